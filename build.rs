@@ -31,6 +31,8 @@ fn main() {
         "command.c",
         "memory.c",
         "sync.c",
+        "alloc.c",
+        "query.c",
         "util/dynarray.c",
     ];
 
@@ -44,9 +46,19 @@ fn main() {
         "command.o",
         "memory.o",
         "sync.o",
+        "alloc.o",
+        "query.o",
         "dynarray.o",
     ];
 
+    // The profile feature defines PROFILE, which enables the C profiling
+    // zones.
+    let zones_define = if env::var("CARGO_FEATURE_PROFILE").is_ok() {
+        "-DPROFILE"
+    } else {
+        "-UPROFILE"
+    };
+
     for (c_file, o_file) in std::iter::zip(c_files, o_files) {
         let status = Command::new("cc")
             .args(&[
@@ -54,6 +66,7 @@ fn main() {
                 "-static",
                 if profile == "RELEASE" { "-O3" } else { "-g" },
                 format!("-D{}", profile).as_str(),
+                zones_define,
                 "-c",
                 format!("lib/{}", c_file).as_str(),
                 "-o",
@@ -85,6 +98,18 @@ fn main() {
         exit(1);
     }
 
+    let status = Command::new("glslc")
+        .args(&[
+            "shaders/trace_aligned.vert",
+            "-o",
+            "shaders/trace_aligned.vert.spv",
+        ])
+        .status()
+        .unwrap();
+    if !status.success() {
+        exit(1);
+    }
+
     let status = Command::new("glslc")
         .args(&["shaders/trace.frag", "-o", "shaders/trace.frag.spv"])
         .status()
@@ -93,11 +118,30 @@ fn main() {
         exit(1);
     }
 
+    // Ray tracing shaders need SPIR-V 1.4.
+    for shader in ["trace.rgen", "trace.rmiss", "trace.rchit", "trace.rint"] {
+        let status = Command::new("glslc")
+            .args(&[
+                "--target-env=vulkan1.2",
+                format!("shaders/{}", shader).as_str(),
+                "-o",
+                format!("shaders/{}.spv", shader).as_str(),
+            ])
+            .status()
+            .unwrap();
+        if !status.success() {
+            exit(1);
+        }
+
+        println!("cargo:rerun-if-changed=shaders/{}", shader);
+    }
+
     println!("cargo:rustc-link-search=native={}", out_dir);
     println!("cargo:rustc-link-lib=static=render");
     println!("cargo:rustc-link-lib=dylib=glfw");
     println!("cargo:rustc-link-lib=dylib=vulkan");
     println!("cargo:rerun-if-changed=lib/common.h");
-    println!("cargo:rerun-if-changed=trace.vert");
-    println!("cargo:rerun-if-changed=trace.frag");
+    println!("cargo:rerun-if-changed=shaders/trace.vert");
+    println!("cargo:rerun-if-changed=shaders/trace_aligned.vert");
+    println!("cargo:rerun-if-changed=shaders/trace.frag");
 }
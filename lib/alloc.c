@@ -0,0 +1,437 @@
+/*
+ * This file is part of vtrace.
+ * vtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ * vtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with vtrace. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <stdio.h>
+
+#include "common.h"
+
+extern renderer glbl;
+
+// Device memory is sub-allocated from large blocks with a buddy allocator.
+// Each block is split into power of two sized nodes, and a node is split in
+// half until it's the smallest node that fits an allocation. Nodes are
+// aligned to their size, so alignments up to an allocation's size come for
+// free. When a node is freed, it's merged with its buddy for as long as the
+// buddy is free too. Allocations larger than a block get dedicated memory.
+
+static VkDeviceSize order_size(uint32_t order) {
+    return (VkDeviceSize) 1 << (order + ALLOCATOR_MIN_ORDER);
+}
+
+// Smallest order whose nodes fit size at the given alignment, or
+// ALLOCATOR_DEDICATED if even a whole block is too small.
+static uint32_t order_for(VkDeviceSize size, VkDeviceSize alignment) {
+    VkDeviceSize needed = size > alignment ? size : alignment;
+    uint32_t order = 0;
+    while (order < ALLOCATOR_NUM_ORDERS && order_size(order) < needed) ++order;
+    return order < ALLOCATOR_NUM_ORDERS ? order : ALLOCATOR_DEDICATED;
+}
+
+static result allocate_device_memory(uint32_t memory_type, VkDeviceSize size, VkMemoryAllocateFlags allocate_flags, VkDeviceMemory* memory, void** mapped) {
+    VkMemoryAllocateFlagsInfo allocate_flags_info = {0};
+    allocate_flags_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
+    allocate_flags_info.flags = allocate_flags;
+
+    VkMemoryAllocateInfo allocate_info = {0};
+    allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocate_info.pNext = &allocate_flags_info;
+    allocate_info.allocationSize = size;
+    allocate_info.memoryTypeIndex = memory_type;
+    PROPAGATE_VK(vkAllocateMemory(glbl.device, &allocate_info, NULL, memory));
+
+    // Host visible memory is mapped once, for as long as it's allocated.
+    *mapped = NULL;
+    VkPhysicalDeviceMemoryProperties physical_mem_properties;
+    vkGetPhysicalDeviceMemoryProperties(glbl.physical, &physical_mem_properties);
+    if (physical_mem_properties.memoryTypes[memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+	PROPAGATE_VK(vkMapMemory(glbl.device, *memory, 0, VK_WHOLE_SIZE, 0, mapped));
+    }
+
+    glbl.allocator_stats.device_memory_bytes += size;
+    ++glbl.allocator_stats.num_device_memories;
+
+    return SUCCESS;
+}
+
+static void free_device_memory(VkDeviceMemory memory, VkDeviceSize size) {
+    vkFreeMemory(glbl.device, memory, NULL);
+    glbl.allocator_stats.device_memory_bytes -= size;
+    --glbl.allocator_stats.num_device_memories;
+}
+
+static result create_allocator_block(allocator_pool* pool, uint32_t* block_index) {
+    allocator_block block = {0};
+    PROPAGATE(allocate_device_memory(pool->memory_type, order_size(ALLOCATOR_NUM_ORDERS - 1), pool->allocate_flags, &block.memory, &block.mapped));
+    for (uint32_t i = 0; i < ALLOCATOR_NUM_ORDERS; ++i) {
+	PROPAGATE(dynarray_create(sizeof(VkDeviceSize), 4, &block.free_lists[i]));
+    }
+    VkDeviceSize offset = 0;
+    PROPAGATE(dynarray_push(&offset, &block.free_lists[ALLOCATOR_NUM_ORDERS - 1]));
+
+    // Slots of freed blocks are reused, so block indices held by live
+    // allocations stay valid.
+    for (uint32_t i = 0; i < dynarray_len(&pool->blocks); ++i) {
+	if (INDEX(i, pool->blocks, allocator_block).memory == VK_NULL_HANDLE) {
+	    INDEX(i, pool->blocks, allocator_block) = block;
+	    *block_index = i;
+	    return SUCCESS;
+	}
+    }
+    PROPAGATE(dynarray_push(&block, &pool->blocks));
+    *block_index = dynarray_len(&pool->blocks) - 1;
+
+    return SUCCESS;
+}
+
+static void destroy_allocator_block(allocator_block* block) {
+    free_device_memory(block->memory, order_size(ALLOCATOR_NUM_ORDERS - 1));
+    for (uint32_t i = 0; i < ALLOCATOR_NUM_ORDERS; ++i) {
+	dynarray_destroy(&block->free_lists[i]);
+    }
+    block->memory = VK_NULL_HANDLE;
+    block->mapped = NULL;
+    block->used = 0;
+}
+
+// Takes a node of the given order from block, splitting a larger free node if
+// needed. Returns 0 if the block has no free node large enough.
+static uint32_t allocate_from_block(allocator_block* block, uint32_t order, VkDeviceSize* offset) {
+    uint32_t found = order;
+    while (found < ALLOCATOR_NUM_ORDERS && dynarray_len(&block->free_lists[found]) == 0) ++found;
+    if (found == ALLOCATOR_NUM_ORDERS) return 0;
+
+    dynarray_pop(offset, &block->free_lists[found]);
+    while (found > order) {
+	--found;
+	VkDeviceSize buddy = *offset + order_size(found);
+	dynarray_push(&buddy, &block->free_lists[found]);
+    }
+    block->used += order_size(order);
+
+    return 1;
+}
+
+static void free_to_block(allocator_block* block, uint32_t order, VkDeviceSize offset) {
+    block->used -= order_size(order);
+    while (order + 1 < ALLOCATOR_NUM_ORDERS) {
+	VkDeviceSize buddy = offset ^ order_size(order);
+	dynarray* free_list = &block->free_lists[order];
+	uint32_t len = dynarray_len(free_list);
+	uint32_t i = 0;
+	while (i < len && INDEX(i, *free_list, VkDeviceSize) != buddy) ++i;
+	if (i == len) break;
+
+	INDEX(i, *free_list, VkDeviceSize) = INDEX(len - 1, *free_list, VkDeviceSize);
+	dynarray_pop(NULL, free_list);
+	offset = offset < buddy ? offset : buddy;
+	++order;
+    }
+    dynarray_push(&offset, &block->free_lists[order]);
+}
+
+result allocate_memory(VkMemoryRequirements requirements, VkMemoryPropertyFlags properties, VkMemoryAllocateFlags allocate_flags, allocation_kind kind, allocation* allocation) {
+    uint32_t memory_type;
+    PROPAGATE(find_memory_type(requirements.memoryTypeBits, properties, &memory_type));
+
+    memset(allocation, 0, sizeof(*allocation));
+    allocation->size = requirements.size;
+    allocation->order = order_for(requirements.size, requirements.alignment);
+
+    if (allocation->order == ALLOCATOR_DEDICATED) {
+	PROPAGATE(allocate_device_memory(memory_type, requirements.size, allocate_flags, &allocation->memory, &allocation->mapped));
+	++glbl.allocator_stats.num_allocations;
+	glbl.allocator_stats.allocated_bytes += requirements.size;
+	return SUCCESS;
+    }
+
+    // Buffers and images are kept in separate pools, so they never share a
+    // page and bufferImageGranularity never needs to be considered. Each
+    // allocate flag combination also needs its own memory.
+    uint32_t pool_index = (memory_type * NUM_ALLOCATION_KINDS + kind) * 2 + (allocate_flags ? 1 : 0);
+    allocator_pool* pool = &glbl.allocator_pools[pool_index];
+    if (!pool->initialized) {
+	pool->memory_type = memory_type;
+	pool->allocate_flags = allocate_flags;
+	pool->excluded_block = ALLOCATOR_DEDICATED;
+	PROPAGATE(dynarray_create(sizeof(allocator_block), 4, &pool->blocks));
+	pool->initialized = 1;
+    }
+
+    uint32_t block_index = 0;
+    VkDeviceSize offset;
+    while (block_index < dynarray_len(&pool->blocks)) {
+	allocator_block* block = &INDEX(block_index, pool->blocks, allocator_block);
+	if (block->memory != VK_NULL_HANDLE && block_index != pool->excluded_block && allocate_from_block(block, allocation->order, &offset)) break;
+	++block_index;
+    }
+    if (block_index == dynarray_len(&pool->blocks)) {
+	PROPAGATE(create_allocator_block(pool, &block_index));
+	allocate_from_block(&INDEX(block_index, pool->blocks, allocator_block), allocation->order, &offset);
+    }
+
+    allocator_block* block = &INDEX(block_index, pool->blocks, allocator_block);
+    allocation->memory = block->memory;
+    allocation->offset = offset;
+    allocation->mapped = block->mapped ? (uint8_t*) block->mapped + offset : NULL;
+    allocation->pool = pool_index;
+    allocation->block = block_index;
+
+    ++glbl.allocator_stats.num_allocations;
+    glbl.allocator_stats.allocated_bytes += requirements.size;
+
+    return SUCCESS;
+}
+
+void free_memory(allocation* allocation) {
+    if (allocation->memory == VK_NULL_HANDLE) return;
+
+    --glbl.allocator_stats.num_allocations;
+    glbl.allocator_stats.allocated_bytes -= allocation->size;
+
+    if (allocation->order == ALLOCATOR_DEDICATED) {
+	free_device_memory(allocation->memory, allocation->size);
+    }
+    else {
+	allocator_pool* pool = &glbl.allocator_pools[allocation->pool];
+	allocator_block* block = &INDEX(allocation->block, pool->blocks, allocator_block);
+	free_to_block(block, allocation->order, allocation->offset);
+
+	// Empty blocks are released, other than the first, so a pool that's
+	// in use doesn't repeatedly allocate and free a block.
+	if (block->used == 0 && allocation->block > 0) {
+	    destroy_allocator_block(block);
+	}
+    }
+
+    memset(allocation, 0, sizeof(*allocation));
+}
+
+result allocate_buffer_memory(VkBuffer buffer, VkMemoryPropertyFlags properties, VkMemoryAllocateFlags allocate_flags, allocation* allocation) {
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(glbl.device, buffer, &requirements);
+    PROPAGATE(allocate_memory(requirements, properties, allocate_flags, ALLOCATION_KIND_BUFFER, allocation));
+    PROPAGATE_VK(vkBindBufferMemory(glbl.device, buffer, allocation->memory, allocation->offset));
+
+    return SUCCESS;
+}
+
+result allocate_image_memory(VkImage image, VkMemoryPropertyFlags properties, allocation* allocation) {
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(glbl.device, image, &requirements);
+    PROPAGATE(allocate_memory(requirements, properties, 0, ALLOCATION_KIND_IMAGE, allocation));
+    PROPAGATE_VK(vkBindImageMemory(glbl.device, image, allocation->memory, allocation->offset));
+
+    return SUCCESS;
+}
+
+void get_allocator_stats(allocator_stats* stats) {
+    *stats = glbl.allocator_stats;
+}
+
+// Finds the least occupied block of the pool holding texture images, if it's
+// worth emptying. Returns ALLOCATOR_DEDICATED if no block is.
+static uint32_t find_sparse_texture_block(uint32_t* pool_index) {
+    uint32_t num_textures = dynarray_len(&glbl.texture_images);
+    if (num_textures == 0) return ALLOCATOR_DEDICATED;
+
+    uint32_t sparse_block = ALLOCATOR_DEDICATED;
+    VkDeviceSize sparse_used = order_size(ALLOCATOR_NUM_ORDERS - 1) / ALLOCATOR_DEFRAGMENT_THRESHOLD;
+    uint32_t num_live_blocks = 0;
+    for (uint32_t i = 0; i < num_textures; ++i) {
+	allocation* allocation = &INDEX(i, glbl.texture_allocations, struct allocation);
+	if (allocation->order == ALLOCATOR_DEDICATED) continue;
+	*pool_index = allocation->pool;
+	break;
+    }
+    if (*pool_index >= ALLOCATOR_MAX_POOLS) return ALLOCATOR_DEDICATED;
+
+    allocator_pool* pool = &glbl.allocator_pools[*pool_index];
+    for (uint32_t i = 0; i < dynarray_len(&pool->blocks); ++i) {
+	allocator_block* block = &INDEX(i, pool->blocks, allocator_block);
+	if (block->memory == VK_NULL_HANDLE) continue;
+	++num_live_blocks;
+	if (block->used > 0 && block->used < sparse_used) {
+	    sparse_block = i;
+	    sparse_used = block->used;
+	}
+    }
+
+    return num_live_blocks > 1 ? sparse_block : ALLOCATOR_DEDICATED;
+}
+
+// Moves every texture out of the least occupied texture block, if it's below
+// the defragmentation threshold, so the block can be released. New images
+// are copied from the old ones on the GPU, and the old images are destroyed
+// once no frame in flight can still sample them. Returns the number of
+// textures moved.
+int32_t defragment_textures(void) {
+    uint32_t pool_index = ALLOCATOR_MAX_POOLS;
+    uint32_t sparse_block = find_sparse_texture_block(&pool_index);
+    if (sparse_block == ALLOCATOR_DEDICATED) return 0;
+
+    // Every failure goes through cleanup, which puts back the textures moved
+    // so far, destroys their new images and frees the commands' arrays. Once
+    // the commands are queued they own their arrays.
+    int32_t ret = -1;
+    allocator_pool* pool = &glbl.allocator_pools[pool_index];
+    pool->excluded_block = sparse_block;
+    descriptor_mark descriptor_mark;
+    mark_pending_descriptors(&descriptor_mark);
+    dynarray moved = {0};
+    VkImage new_image = VK_NULL_HANDLE;
+    VkImageView new_image_view = VK_NULL_HANDLE;
+    allocation new_allocation = {0};
+
+    secondary_command commands[5] = {0};
+    secondary_command* src_transition_command = &commands[0];
+    secondary_command* dst_transition_command = &commands[1];
+    secondary_command* copy_command = &commands[2];
+    secondary_command* read_transition_command = &commands[3];
+    secondary_command* cleanup_command = &commands[4];
+
+    src_transition_command->type = SECONDARY_TYPE_LAYOUT_TRANSITION;
+    src_transition_command->layout_transition.old = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    src_transition_command->layout_transition.new = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+
+    dst_transition_command->type = SECONDARY_TYPE_LAYOUT_TRANSITION;
+    dst_transition_command->layout_transition.old = VK_IMAGE_LAYOUT_UNDEFINED;
+    dst_transition_command->layout_transition.new = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+
+    copy_command->type = SECONDARY_TYPE_COPY_IMAGES_IMAGES;
+
+    // Only the new images need to end up readable, since the old ones are
+    // never sampled again.
+    read_transition_command->type = SECONDARY_TYPE_LAYOUT_TRANSITION;
+    read_transition_command->layout_transition.old = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    read_transition_command->layout_transition.new = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+    // The old images are destroyed once every frame that might have bound
+    // them has finished. The delay counts frames, since the secondary queue
+    // advances every frame.
+    cleanup_command->type = SECONDARY_TYPE_CLEANUP;
+    cleanup_command->delay = FRAMES_IN_FLIGHT + 2;
+
+    PROPAGATE_GOTO(dynarray_create(sizeof(uint32_t), 8, &moved), cleanup);
+    PROPAGATE_GOTO(dynarray_create(sizeof(VkImage), 8, &src_transition_command->layout_transition.images), cleanup);
+    PROPAGATE_GOTO(dynarray_create(sizeof(VkImage), 8, &dst_transition_command->layout_transition.images), cleanup);
+    PROPAGATE_GOTO(dynarray_create(sizeof(VkImage), 8, &read_transition_command->layout_transition.images), cleanup);
+    PROPAGATE_GOTO(dynarray_create(sizeof(VkImage), 8, &copy_command->copy_images_images.src_images), cleanup);
+    PROPAGATE_GOTO(dynarray_create(sizeof(VkImage), 8, &copy_command->copy_images_images.dst_images), cleanup);
+    PROPAGATE_GOTO(dynarray_create(sizeof(VkExtent3D), 8, &copy_command->copy_images_images.extents), cleanup);
+    PROPAGATE_GOTO(dynarray_create(sizeof(VkImage), 8, &cleanup_command->cleanup.images), cleanup);
+    PROPAGATE_GOTO(dynarray_create(sizeof(VkImageView), 8, &cleanup_command->cleanup.image_views), cleanup);
+    PROPAGATE_GOTO(dynarray_create(sizeof(allocation), 8, &cleanup_command->cleanup.allocations), cleanup);
+
+    VkImageSubresourceRange subresource_range;
+    subresource_range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    subresource_range.baseMipLevel = 0;
+    subresource_range.levelCount = 1;
+    subresource_range.baseArrayLayer = 0;
+    subresource_range.layerCount = 1;
+
+    // A texture only counts as moved once its entries are swapped for the new
+    // ones, and the old ones are at the same position in the cleanup arrays.
+    for (uint32_t i = 0; i < dynarray_len(&glbl.texture_images); ++i) {
+	allocation* old_allocation = &INDEX(i, glbl.texture_allocations, allocation);
+	if (old_allocation->order == ALLOCATOR_DEDICATED || old_allocation->pool != pool_index || old_allocation->block != sparse_block) continue;
+
+	VkImage* image = &INDEX(i, glbl.texture_images, VkImage);
+	VkImageView* image_view = &INDEX(i, glbl.texture_image_views, VkImageView);
+	VkExtent3D extent = INDEX(i, glbl.texture_image_extents, VkExtent3D);
+
+	PROPAGATE_GOTO(create_image(0, VK_FORMAT_R8G8B8A8_SRGB, extent, 1, 1, VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_SHARING_MODE_EXCLUSIVE, &new_image), cleanup);
+	PROPAGATE_GOTO(allocate_image_memory(new_image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &new_allocation), cleanup);
+	PROPAGATE_GOTO(create_image_view(new_image, VK_IMAGE_VIEW_TYPE_3D, VK_FORMAT_R8G8B8A8_SRGB, subresource_range, &new_image_view), cleanup);
+
+	PROPAGATE_GOTO(dynarray_push(image, &src_transition_command->layout_transition.images), cleanup);
+	PROPAGATE_GOTO(dynarray_push(&new_image, &dst_transition_command->layout_transition.images), cleanup);
+	PROPAGATE_GOTO(dynarray_push(&new_image, &read_transition_command->layout_transition.images), cleanup);
+	PROPAGATE_GOTO(dynarray_push(image, &copy_command->copy_images_images.src_images), cleanup);
+	PROPAGATE_GOTO(dynarray_push(&new_image, &copy_command->copy_images_images.dst_images), cleanup);
+	PROPAGATE_GOTO(dynarray_push(&extent, &copy_command->copy_images_images.extents), cleanup);
+	PROPAGATE_GOTO(dynarray_push(image, &cleanup_command->cleanup.images), cleanup);
+	PROPAGATE_GOTO(dynarray_push(image_view, &cleanup_command->cleanup.image_views), cleanup);
+	PROPAGATE_GOTO(dynarray_push(old_allocation, &cleanup_command->cleanup.allocations), cleanup);
+	PROPAGATE_GOTO(dynarray_push(&i, &moved), cleanup);
+
+	*image = new_image;
+	*image_view = new_image_view;
+	*old_allocation = new_allocation;
+	new_image = VK_NULL_HANDLE;
+	new_image_view = VK_NULL_HANDLE;
+	new_allocation = (allocation) {0};
+    }
+
+    // The block may only hold atlases, which aren't moved.
+    uint32_t num_moved = dynarray_len(&moved);
+    for (uint32_t i = 0; i < num_moved; ++i) {
+	PROPAGATE_GOTO(update_descriptors(INDEX(i, moved, uint32_t), 1), cleanup);
+    }
+    if (num_moved > 0) {
+	PROPAGATE_GOTO(queue_secondary_commands(sizeof(commands) / sizeof(commands[0]), commands), cleanup);
+    }
+    ret = num_moved;
+
+ cleanup:
+    pool->excluded_block = ALLOCATOR_DEDICATED;
+    if (ret < 0) {
+	discard_pending_descriptors(&descriptor_mark);
+	for (uint32_t i = 0; moved.alloc && i < dynarray_len(&moved); ++i) {
+	    uint32_t texture = INDEX(i, moved, uint32_t);
+	    vkDestroyImageView(glbl.device, INDEX(texture, glbl.texture_image_views, VkImageView), NULL);
+	    vkDestroyImage(glbl.device, INDEX(texture, glbl.texture_images, VkImage), NULL);
+	    free_memory(&INDEX(texture, glbl.texture_allocations, allocation));
+	    INDEX(texture, glbl.texture_images, VkImage) = INDEX(i, cleanup_command->cleanup.images, VkImage);
+	    INDEX(texture, glbl.texture_image_views, VkImageView) = INDEX(i, cleanup_command->cleanup.image_views, VkImageView);
+	    INDEX(texture, glbl.texture_allocations, allocation) = INDEX(i, cleanup_command->cleanup.allocations, allocation);
+	}
+	if (new_image_view != VK_NULL_HANDLE) vkDestroyImageView(glbl.device, new_image_view, NULL);
+	if (new_image != VK_NULL_HANDLE) vkDestroyImage(glbl.device, new_image, NULL);
+	free_memory(&new_allocation);
+    }
+    if (ret <= 0) {
+	for (uint32_t i = 0; i < sizeof(commands) / sizeof(commands[0]); ++i) {
+	    secondary_command* command = &commands[i];
+	    if (command->type == SECONDARY_TYPE_LAYOUT_TRANSITION) {
+		if (command->layout_transition.images.alloc) dynarray_destroy(&command->layout_transition.images);
+	    }
+	    else if (command->type == SECONDARY_TYPE_COPY_IMAGES_IMAGES) {
+		if (command->copy_images_images.src_images.alloc) dynarray_destroy(&command->copy_images_images.src_images);
+		if (command->copy_images_images.dst_images.alloc) dynarray_destroy(&command->copy_images_images.dst_images);
+		if (command->copy_images_images.extents.alloc) dynarray_destroy(&command->copy_images_images.extents);
+	    }
+	    else {
+		if (command->cleanup.images.alloc) dynarray_destroy(&command->cleanup.images);
+		if (command->cleanup.image_views.alloc) dynarray_destroy(&command->cleanup.image_views);
+		if (command->cleanup.allocations.alloc) dynarray_destroy(&command->cleanup.allocations);
+	    }
+	}
+    }
+    if (moved.alloc) dynarray_destroy(&moved);
+    return ret;
+}
+
+void cleanup_allocator(void) {
+    for (uint32_t i = 0; i < ALLOCATOR_MAX_POOLS; ++i) {
+	allocator_pool* pool = &glbl.allocator_pools[i];
+	if (!pool->initialized) continue;
+	for (uint32_t j = 0; j < dynarray_len(&pool->blocks); ++j) {
+	    allocator_block* block = &INDEX(j, pool->blocks, allocator_block);
+	    if (block->memory != VK_NULL_HANDLE) destroy_allocator_block(block);
+	}
+	dynarray_destroy(&pool->blocks);
+	pool->initialized = 0;
+    }
+}
@@ -21,15 +21,15 @@
 static const uint32_t NUM_CUBE_INDICES = 36;
 
 result create_command_pool(void) {
-    uint32_t queue_family;
-    PROPAGATE(physical_check_queue_family(glbl.physical, &queue_family, VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT));
-
     VkCommandPoolCreateInfo create_info = {0};
     create_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
     create_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-    create_info.queueFamilyIndex = queue_family;
+    create_info.queueFamilyIndex = glbl.queue_family;
 
     PROPAGATE_VK(vkCreateCommandPool(glbl.device, &create_info, NULL, &glbl.command_pool));
+
+    create_info.queueFamilyIndex = glbl.transfer_queue_family;
+    PROPAGATE_VK(vkCreateCommandPool(glbl.device, &create_info, NULL, &glbl.transfer_command_pool));
     
     return SUCCESS;
 }
@@ -43,16 +43,14 @@ result create_command_buffers(void) {
 
     PROPAGATE_VK(vkAllocateCommandBuffers(glbl.device, &allocate_info, &glbl.raster_command_buffers[0]));
     PROPAGATE_VK(vkAllocateCommandBuffers(glbl.device, &allocate_info, &glbl.secondary_command_buffers[0]));
+
+    allocate_info.commandPool = glbl.transfer_command_pool;
+    PROPAGATE_VK(vkAllocateCommandBuffers(glbl.device, &allocate_info, &glbl.transfer_command_buffers[0]));
     
     return SUCCESS;
 }
 
-result record_raster_command_buffer(VkCommandBuffer command_buffer, uint32_t image_index, const render_tick_info* render_tick_info) {
-    VkCommandBufferBeginInfo begin_info = {0};
-    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-
-    PROPAGATE_VK(vkBeginCommandBuffer(command_buffer, &begin_info));
-
+static void record_raster_pass(VkCommandBuffer command_buffer, uint32_t image_index, const render_tick_info* render_tick_info) {
     VkClearValue clear_values[2];
     clear_values[0].color.float32[0] = 53.0f / 100.0f;
     clear_values[0].color.float32[1] = 81.0f / 100.0f;
@@ -60,6 +58,8 @@ result record_raster_command_buffer(VkCommandBuffer command_buffer, uint32_t ima
     clear_values[0].color.float32[3] = 1.0f;
     clear_values[1].depthStencil.depth = 1.0f;
     clear_values[1].depthStencil.stencil = 0;
+
+    begin_gpu_pass(command_buffer, GPU_PASS_RASTER);
     
     VkRenderPassBeginInfo render_pass_begin_info = {0};
     render_pass_begin_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
@@ -72,8 +72,6 @@ result record_raster_command_buffer(VkCommandBuffer command_buffer, uint32_t ima
     render_pass_begin_info.pClearValues = clear_values;
 
     vkCmdBeginRenderPass(command_buffer, &render_pass_begin_info, VK_SUBPASS_CONTENTS_INLINE);
-    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, glbl.raster_pipeline);
-
     VkViewport viewport = {0};
     viewport.x = 0.0f;
     viewport.y = 0.0f;
@@ -91,7 +89,6 @@ result record_raster_command_buffer(VkCommandBuffer command_buffer, uint32_t ima
 
     VkDeviceSize offsets[] = {0};
     vkCmdBindVertexBuffers(command_buffer, 0, 1, &glbl.cube_vertex_buffer, offsets);
-    vkCmdBindVertexBuffers(command_buffer, 1, 1, &glbl.instance_buffer, offsets);
     vkCmdBindIndexBuffer(command_buffer, glbl.cube_index_buffer, 0, VK_INDEX_TYPE_UINT16);
 
     vkCmdPushConstants(command_buffer, glbl.raster_pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(float) * 4 * 4, render_tick_info->perspective);
@@ -99,153 +96,705 @@ result record_raster_command_buffer(VkCommandBuffer command_buffer, uint32_t ima
 
     vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, glbl.raster_pipeline_layout, 0, 1, &glbl.raster_descriptor_sets[glbl.current_frame], 0, NULL);
 
-    vkCmdDrawIndexed(command_buffer, NUM_CUBE_INDICES, glbl.instance_count, 0, 0, 0);
+    // Every stream uses the same pipeline layout and descriptor set, so only
+    // the pipeline and draw list change between streams.
+    for (uint32_t stream = 0; stream < NUM_INSTANCE_STREAMS; ++stream) {
+	instance_stream* instances = &glbl.instance_streams[stream];
+	if (instances->draw_count == 0) continue;
+	vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, glbl.raster_pipelines[stream]);
+	vkCmdBindVertexBuffers(command_buffer, 1, 1, &instances->draw_list_buffers[glbl.current_frame], offsets);
+	vkCmdDrawIndexed(command_buffer, NUM_CUBE_INDICES, instances->draw_count, 0, 0, 0);
+    }
 
     vkCmdEndRenderPass(command_buffer);
 
-    PROPAGATE_VK(vkEndCommandBuffer(command_buffer));
-    
-    return SUCCESS;
+    end_gpu_pass(command_buffer, GPU_PASS_RASTER);
 }
 
-result record_secondary_command_buffer(VkCommandBuffer command_buffer, uint32_t num_commands, secondary_command* commands) {
+result record_raster_command_buffer(VkCommandBuffer command_buffer, uint32_t image_index, const render_tick_info* render_tick_info) {
     VkCommandBufferBeginInfo begin_info = {0};
     begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
     PROPAGATE_VK(vkBeginCommandBuffer(command_buffer, &begin_info));
 
-    uint32_t skips = 1;
-    while (skips > 0) {
-	skips = 0;
-	for (uint32_t i = 0; i < num_commands; ++i) {
-	    if (commands[i].ordering > 0) {
-		--commands[i].ordering;
-		commands[skips] = commands[i];
-		++skips;
-		continue;
+    if (glbl.ray_trace) {
+	record_trace_commands(command_buffer, image_index);
+    }
+    else {
+	record_raster_pass(command_buffer, image_index, render_tick_info);
+    }
+
+    // Both paths leave offscreen images ready to be copied from.
+    if (glbl.readback) {
+	VkBufferImageCopy region = {0};
+	region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	region.imageSubresource.layerCount = 1;
+	region.imageExtent.width = glbl.swapchain_extent.width;
+	region.imageExtent.height = glbl.swapchain_extent.height;
+	region.imageExtent.depth = 1;
+	vkCmdCopyImageToBuffer(command_buffer, INDEX(image_index, glbl.swapchain_images, VkImage), VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, glbl.readback_buffers[glbl.current_frame], 1, &region);
+
+	// The timeline signal alone doesn't make the copy visible to the host.
+	VkBufferMemoryBarrier barrier = {0};
+	barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.buffer = glbl.readback_buffers[glbl.current_frame];
+	barrier.offset = 0;
+	barrier.size = VK_WHOLE_SIZE;
+	vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, NULL, 1, &barrier, 0, NULL);
+    }
+
+    PROPAGATE_VK(vkEndCommandBuffer(command_buffer));
+    
+    return SUCCESS;
+}
+
+// Acquires what the last transfer submission released to the graphics queue.
+// The barriers have to match the releases recorded below.
+static result record_transfer_acquires(VkCommandBuffer command_buffer) {
+    uint32_t num_image_barriers = dynarray_len(&glbl.transfer_acquire_images);
+    uint32_t num_buffer_barriers = dynarray_len(&glbl.transfer_acquire_buffers);
+    if (num_image_barriers == 0 && num_buffer_barriers == 0) return SUCCESS;
+
+    VkImageMemoryBarrier* image_barriers = num_image_barriers > 0 ? malloc(num_image_barriers * sizeof(VkImageMemoryBarrier)) : NULL;
+    VkBufferMemoryBarrier* buffer_barriers = num_buffer_barriers > 0 ? malloc(num_buffer_barriers * sizeof(VkBufferMemoryBarrier)) : NULL;
+    if ((num_image_barriers > 0 && !image_barriers) || (num_buffer_barriers > 0 && !buffer_barriers)) {
+	fprintf(stderr, "ERROR: Couldn't allocate transfer acquire barriers\n");
+	free(image_barriers);
+	free(buffer_barriers);
+	return CUSTOM_ERROR;
+    }
+
+    for (uint32_t i = 0; i < num_image_barriers; ++i) {
+	VkImageMemoryBarrier barrier = {0};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	barrier.srcQueueFamilyIndex = glbl.transfer_queue_family;
+	barrier.dstQueueFamilyIndex = glbl.queue_family;
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	barrier.image = INDEX(i, glbl.transfer_acquire_images, VkImage);
+	barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	barrier.subresourceRange.baseMipLevel = 0;
+	barrier.subresourceRange.levelCount = 1;
+	barrier.subresourceRange.baseArrayLayer = 0;
+	barrier.subresourceRange.layerCount = 1;
+	image_barriers[i] = barrier;
+    }
+
+    for (uint32_t i = 0; i < num_buffer_barriers; ++i) {
+	VkBufferMemoryBarrier barrier = {0};
+	barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	barrier.srcQueueFamilyIndex = glbl.transfer_queue_family;
+	barrier.dstQueueFamilyIndex = glbl.queue_family;
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+	barrier.buffer = INDEX(i, glbl.transfer_acquire_buffers, VkBuffer);
+	barrier.offset = 0;
+	barrier.size = VK_WHOLE_SIZE;
+	buffer_barriers[i] = barrier;
+    }
+
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, NULL, num_buffer_barriers, buffer_barriers, num_image_barriers, image_barriers);
+    free(image_barriers);
+    free(buffer_barriers);
+
+    dynarray_clear(&glbl.transfer_acquire_images);
+    dynarray_clear(&glbl.transfer_acquire_buffers);
+
+    return SUCCESS;
+}
+
+// Moves the commands meant for the transfer queue to the front, keeping the
+// order within both groups, and returns how many there are. Without a
+// dedicated transfer queue, everything is recorded for the graphics queue.
+uint32_t partition_transfer_commands(uint32_t num_commands, secondary_command* commands) {
+    if (glbl.transfer_queue_family == glbl.queue_family) return 0;
+
+    uint32_t num_transfer = 0;
+    for (uint32_t i = 0; i < num_commands; ++i) {
+	if (!commands[i].transfer) continue;
+	secondary_command command = commands[i];
+	memmove(&commands[num_transfer + 1], &commands[num_transfer], (i - num_transfer) * sizeof(secondary_command));
+	commands[num_transfer] = command;
+	++num_transfer;
+    }
+
+    return num_transfer;
+}
+
+// A resource a secondary command reads or writes. Images, buffers and
+// acceleration structures are all identified by their handle. Acceleration
+// structure builds read their inputs through device addresses, which aren't
+// tracked, so their inputs have to be written by the host or an earlier
+// submission.
+typedef struct resource_access {
+    uint64_t handle;
+    uint32_t write;
+} resource_access;
+
+static result declare_access(uint64_t handle, uint32_t write, dynarray* accesses) {
+    resource_access access = {.handle = handle, .write = write};
+    return dynarray_push(&access, accesses);
+}
+
+// Pushes every resource command reads or writes onto accesses. Layout
+// transitions count as writes, since they rewrite the image's memory.
+static result declare_resources(secondary_command* command, dynarray* accesses) {
+    switch (command->type) {
+    case SECONDARY_TYPE_COPY_BUFFER_BUFFER:
+	PROPAGATE(declare_access((uint64_t) command->copy_buffer_buffer.src_buffer, 0, accesses));
+	PROPAGATE(declare_access((uint64_t) command->copy_buffer_buffer.dst_buffer, 1, accesses));
+	break;
+    case SECONDARY_TYPE_COPY_BUFFER_IMAGE:
+	PROPAGATE(declare_access((uint64_t) command->copy_buffer_image.src_buffer, 0, accesses));
+	if (command->copy_buffer_image.copy_regions) {
+	    for (uint32_t i = 0; i < command->copy_buffer_image.num_copy_regions; ++i) {
+		PROPAGATE(declare_access((uint64_t) command->copy_buffer_image.dst_images[i], 1, accesses));
 	    }
-	    switch (commands[i].type) {
-	    case SECONDARY_TYPE_COPY_BUFFER_BUFFER:
-		vkCmdCopyBuffer(command_buffer, commands[i].copy_buffer_buffer.src_buffer, commands[i].copy_buffer_buffer.dst_buffer, 1, &commands[i].copy_buffer_buffer.copy_region);
-		break;
-	    case SECONDARY_TYPE_COPY_BUFFER_IMAGE:
-		vkCmdCopyBufferToImage(command_buffer, commands[i].copy_buffer_image.src_buffer, commands[i].copy_buffer_image.dst_image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &commands[i].copy_buffer_image.copy_region);
-		break;
-	    case SECONDARY_TYPE_COPY_IMAGES_IMAGES: {
-		VkImageCopy region = {0};
-		
-		region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		region.srcSubresource.mipLevel = 0;
-		region.srcSubresource.baseArrayLayer = 0;
-		region.srcSubresource.layerCount = 1;
-		region.srcOffset.x = 0;
-		region.srcOffset.y = 0;
-		region.srcOffset.z = 0;
-		
-		region.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		region.dstSubresource.mipLevel = 0;
-		region.dstSubresource.baseArrayLayer = 0;
-		region.dstSubresource.layerCount = 1;
-		region.dstOffset.x = 0;
-		region.dstOffset.y = 0;
-		region.dstOffset.z = 0;
-
-		for (uint32_t j = 0; j < dynarray_len(&commands[i].copy_images_images.src_images); ++j) {
-		    region.extent = INDEX(j, commands[i].copy_images_images.extents, VkExtent3D);
-        	    vkCmdCopyImage(command_buffer, INDEX(j, commands[i].copy_images_images.src_images, VkImage), VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, INDEX(j, commands[i].copy_images_images.dst_images, VkImage), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
-		}
+	}
+	else {
+	    PROPAGATE(declare_access((uint64_t) command->copy_buffer_image.dst_image, 1, accesses));
+	}
+	break;
+    case SECONDARY_TYPE_COPY_IMAGES_IMAGES:
+	for (uint32_t i = 0; i < dynarray_len(&command->copy_images_images.src_images); ++i) {
+	    PROPAGATE(declare_access((uint64_t) INDEX(i, command->copy_images_images.src_images, VkImage), 0, accesses));
+	    PROPAGATE(declare_access((uint64_t) INDEX(i, command->copy_images_images.dst_images, VkImage), 1, accesses));
+	}
+	break;
+    case SECONDARY_TYPE_LAYOUT_TRANSITION:
+	for (uint32_t i = 0; i < dynarray_len(&command->layout_transition.images); ++i) {
+	    PROPAGATE(declare_access((uint64_t) INDEX(i, command->layout_transition.images, VkImage), 1, accesses));
+	}
+	break;
+    case SECONDARY_TYPE_ACCELERATION_STRUCTURE_BUILD: {
+	const VkAccelerationStructureBuildGeometryInfoKHR* geometry_info = &command->acceleration_structure_build.geometry_info;
+	if (geometry_info->mode == VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR && geometry_info->srcAccelerationStructure != geometry_info->dstAccelerationStructure) {
+	    PROPAGATE(declare_access((uint64_t) geometry_info->srcAccelerationStructure, 0, accesses));
+	}
+	PROPAGATE(declare_access((uint64_t) geometry_info->dstAccelerationStructure, 1, accesses));
+	break;
+    }
+    case SECONDARY_TYPE_ACCELERATION_STRUCTURE_COPY:
+	PROPAGATE(declare_access((uint64_t) command->acceleration_structure_copy.src, 0, accesses));
+	PROPAGATE(declare_access((uint64_t) command->acceleration_structure_copy.dst, 1, accesses));
+	break;
+    case SECONDARY_TYPE_CLEANUP:
+	for (uint32_t i = 0; i < dynarray_len(&command->cleanup.images); ++i) {
+	    PROPAGATE(declare_access((uint64_t) INDEX(i, command->cleanup.images, VkImage), 1, accesses));
+	}
+	break;
+    }
+
+    return SUCCESS;
+}
+
+static uint32_t accesses_conflict(const resource_access* a, uint32_t num_a, const resource_access* b, uint32_t num_b) {
+    for (uint32_t i = 0; i < num_a; ++i) {
+	for (uint32_t j = 0; j < num_b; ++j) {
+	    if (!a[i].write && !b[j].write) continue;
+	    if (a[i].handle == b[j].handle) return 1;
+	}
+    }
+    return 0;
+}
+
+// Stages and accesses of a command other than a layout transition.
+static void command_scope(const secondary_command* command, VkPipelineStageFlags* stage, VkAccessFlags* access) {
+    if (command->type == SECONDARY_TYPE_ACCELERATION_STRUCTURE_BUILD || command->type == SECONDARY_TYPE_ACCELERATION_STRUCTURE_COPY) {
+	*stage = VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR;
+	*access = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    }
+    else {
+	*stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+	*access = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    }
+}
+
+// Fills in the barrier template and stages of a layout transition. Returns 0
+// for transitions that aren't supported.
+static uint32_t transition_barrier(const secondary_command* command, uint32_t transfer, VkImageMemoryBarrier* barrier, VkPipelineStageFlags* src_stage, VkPipelineStageFlags* dst_stage) {
+    memset(barrier, 0, sizeof(*barrier));
+    barrier->sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier->oldLayout = command->layout_transition.old;
+    barrier->newLayout = command->layout_transition.new;
+    barrier->srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier->dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier->subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier->subresourceRange.baseMipLevel = 0;
+    barrier->subresourceRange.levelCount = 1;
+    barrier->subresourceRange.baseArrayLayer = 0;
+    barrier->subresourceRange.layerCount = 1;
+
+    if (command->layout_transition.old == VK_IMAGE_LAYOUT_UNDEFINED && command->layout_transition.new == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) {
+	barrier->srcAccessMask = 0;
+	barrier->dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	*src_stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+	*dst_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    }
+    else if (command->layout_transition.old == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL && command->layout_transition.new == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
+	barrier->srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier->dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	*src_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+	*dst_stage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    }
+    else if (command->layout_transition.old == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL && command->layout_transition.new == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) {
+	barrier->srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	barrier->dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	*src_stage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+	*dst_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    }
+    else if (command->layout_transition.old == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL && command->layout_transition.new == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL) {
+	barrier->srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	barrier->dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	*src_stage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+	*dst_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    }
+    else if (command->layout_transition.old == VK_IMAGE_LAYOUT_UNDEFINED && command->layout_transition.new == VK_IMAGE_LAYOUT_GENERAL) {
+	barrier->srcAccessMask = 0;
+	barrier->dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	*src_stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+	*dst_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    }
+    else if (command->layout_transition.old == VK_IMAGE_LAYOUT_GENERAL && command->layout_transition.new == VK_IMAGE_LAYOUT_GENERAL) {
+	barrier->srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier->dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	*src_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+	*dst_stage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    }
+    else {
+	return 0;
+    }
+
+    // The transfer queue can't wait on shader stages, so the semaphore the
+    // graphics queue waits on makes the writes visible instead. Images that
+    // end up read only are exclusive to one queue family, so they're
+    // released here and acquired by the graphics queue.
+    if (transfer && *dst_stage == VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT) {
+	barrier->dstAccessMask = 0;
+	*dst_stage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+	if (command->layout_transition.new == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
+	    barrier->srcQueueFamilyIndex = glbl.transfer_queue_family;
+	    barrier->dstQueueFamilyIndex = glbl.queue_family;
+	}
+    }
+
+    return 1;
+}
 
-		break;
+static result record_command(VkCommandBuffer command_buffer, secondary_command* command, uint32_t transfer) {
+    switch (command->type) {
+    case SECONDARY_TYPE_COPY_BUFFER_BUFFER:
+	if (command->copy_buffer_buffer.copy_regions) {
+	    vkCmdCopyBuffer(command_buffer, command->copy_buffer_buffer.src_buffer, command->copy_buffer_buffer.dst_buffer, command->copy_buffer_buffer.num_copy_regions, command->copy_buffer_buffer.copy_regions);
+	    free(command->copy_buffer_buffer.copy_regions);
+	}
+	else {
+	    vkCmdCopyBuffer(command_buffer, command->copy_buffer_buffer.src_buffer, command->copy_buffer_buffer.dst_buffer, 1, &command->copy_buffer_buffer.copy_region);
+	}
+	if (transfer) {
+	    PROPAGATE(dynarray_push(&command->copy_buffer_buffer.dst_buffer, &glbl.transfer_acquire_buffers));
+	}
+	break;
+    case SECONDARY_TYPE_COPY_BUFFER_IMAGE:
+	if (command->copy_buffer_image.copy_regions) {
+	    for (uint32_t j = 0; j < command->copy_buffer_image.num_copy_regions; ++j) {
+		vkCmdCopyBufferToImage(command_buffer, command->copy_buffer_image.src_buffer, command->copy_buffer_image.dst_images[j], command->copy_buffer_image.dst_layout, 1, &command->copy_buffer_image.copy_regions[j]);
 	    }
-	    case SECONDARY_TYPE_LAYOUT_TRANSITION: {
-		VkImageMemoryBarrier barrier = {0};
+	    free(command->copy_buffer_image.dst_images);
+	    free(command->copy_buffer_image.copy_regions);
+	}
+	else {
+	    vkCmdCopyBufferToImage(command_buffer, command->copy_buffer_image.src_buffer, command->copy_buffer_image.dst_image, command->copy_buffer_image.dst_layout, 1, &command->copy_buffer_image.copy_region);
+	}
+	break;
+    case SECONDARY_TYPE_COPY_IMAGES_IMAGES: {
+	VkImageCopy region = {0};
 		
-		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-		barrier.oldLayout = commands[i].layout_transition.old;
-		barrier.newLayout = commands[i].layout_transition.new;
-		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-		barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		barrier.subresourceRange.baseMipLevel = 0;
-		barrier.subresourceRange.levelCount = 1;
-		barrier.subresourceRange.baseArrayLayer = 0;
-		barrier.subresourceRange.layerCount = 1;
+	region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	region.srcSubresource.mipLevel = 0;
+	region.srcSubresource.baseArrayLayer = 0;
+	region.srcSubresource.layerCount = 1;
+	region.srcOffset.x = 0;
+	region.srcOffset.y = 0;
+	region.srcOffset.z = 0;
 		
+	region.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	region.dstSubresource.mipLevel = 0;
+	region.dstSubresource.baseArrayLayer = 0;
+	region.dstSubresource.layerCount = 1;
+	region.dstOffset.x = 0;
+	region.dstOffset.y = 0;
+	region.dstOffset.z = 0;
+
+	for (uint32_t j = 0; j < dynarray_len(&command->copy_images_images.src_images); ++j) {
+	    region.extent = INDEX(j, command->copy_images_images.extents, VkExtent3D);
+	    vkCmdCopyImage(command_buffer, INDEX(j, command->copy_images_images.src_images, VkImage), VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, INDEX(j, command->copy_images_images.dst_images, VkImage), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+	}
+
+	dynarray_destroy(&command->copy_images_images.src_images);
+	dynarray_destroy(&command->copy_images_images.dst_images);
+	dynarray_destroy(&command->copy_images_images.extents);
+	break;
+    }
+    case SECONDARY_TYPE_LAYOUT_TRANSITION:
+	// The barrier was already recorded at the start of this command's
+	// level.
+	dynarray_destroy(&command->layout_transition.images);
+	break;
+    case SECONDARY_TYPE_ACCELERATION_STRUCTURE_BUILD:
+	// Recorded together by record_acceleration_structure_builds.
+	break;
+    case SECONDARY_TYPE_ACCELERATION_STRUCTURE_COPY: {
+	// The source is usually built by an earlier submission, which the
+	// levels don't order against.
+	VkMemoryBarrier barrier = {0};
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+	barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+	vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &barrier, 0, NULL, 0, NULL);
+
+	VkCopyAccelerationStructureInfoKHR copy_info = {0};
+	copy_info.sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR;
+	copy_info.src = command->acceleration_structure_copy.src;
+	copy_info.dst = command->acceleration_structure_copy.dst;
+	copy_info.mode = command->acceleration_structure_copy.mode;
+	vkCmdCopyAccelerationStructure(command_buffer, &copy_info);
+	break;
+    }
+    case SECONDARY_TYPE_CLEANUP: {
+	for (uint32_t j = 0; j < dynarray_len(&command->cleanup.images); ++j) {
+	    if (command->cleanup.images.size > 0) vkDestroyImage(glbl.device, INDEX(j, command->cleanup.images, VkImage), NULL);
+	    if (command->cleanup.image_views.size > 0) vkDestroyImageView(glbl.device, INDEX(j, command->cleanup.image_views, VkImageView), NULL);
+	}
+
+	for (uint32_t j = 0; j < dynarray_len(&command->cleanup.allocations); ++j) {
+	    free_memory(&INDEX(j, command->cleanup.allocations, allocation));
+	}
+
+	dynarray_destroy(&command->cleanup.images);
+	dynarray_destroy(&command->cleanup.image_views);
+	dynarray_destroy(&command->cleanup.allocations);
+	break;
+    }
+    }
+
+    return SUCCESS;
+}
+
+// Builds in the same level don't conflict, so all of a level's builds are
+// recorded with one vkCmdBuildAccelerationStructures, which lets the device
+// overlap them. Compacted sizes are written once the level's builds finish.
+static result record_acceleration_structure_builds(VkCommandBuffer command_buffer, uint32_t level, const uint32_t* levels, uint32_t num_commands, secondary_command* commands) {
+    uint32_t num_builds = 0;
+    uint32_t num_queries = 0;
+    for (uint32_t i = 0; i < num_commands; ++i) {
+	if (levels[i] != level || commands[i].type != SECONDARY_TYPE_ACCELERATION_STRUCTURE_BUILD) continue;
+	++num_builds;
+	if (commands[i].acceleration_structure_build.compacted_size_query_pool != VK_NULL_HANDLE) ++num_queries;
+    }
+    if (num_builds == 0) return SUCCESS;
+
+    VkAccelerationStructureBuildGeometryInfoKHR* geometry_infos = malloc(num_builds * sizeof(VkAccelerationStructureBuildGeometryInfoKHR));
+    const VkAccelerationStructureBuildRangeInfoKHR** range_infos = malloc(num_builds * sizeof(VkAccelerationStructureBuildRangeInfoKHR*));
+    if (!geometry_infos || !range_infos) {
+	fprintf(stderr, "ERROR: Couldn't allocate acceleration structure builds\n");
+	free(geometry_infos);
+	free(range_infos);
+	return CUSTOM_ERROR;
+    }
+
+    uint32_t build = 0;
+    for (uint32_t i = 0; i < num_commands; ++i) {
+	if (levels[i] != level || commands[i].type != SECONDARY_TYPE_ACCELERATION_STRUCTURE_BUILD) continue;
+	geometry_infos[build] = commands[i].acceleration_structure_build.geometry_info;
+	range_infos[build] = commands[i].acceleration_structure_build.range_info;
+	++build;
+	if (commands[i].acceleration_structure_build.compacted_size_query_pool != VK_NULL_HANDLE) {
+	    vkCmdResetQueryPool(command_buffer, commands[i].acceleration_structure_build.compacted_size_query_pool, commands[i].acceleration_structure_build.compacted_size_query, 1);
+	}
+    }
+    vkCmdBuildAccelerationStructures(command_buffer, num_builds, geometry_infos, range_infos);
+
+    if (num_queries > 0) {
+	VkMemoryBarrier barrier = {0};
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+	barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+	vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &barrier, 0, NULL, 0, NULL);
+    }
+
+    for (uint32_t i = 0; i < num_commands; ++i) {
+	if (levels[i] != level || commands[i].type != SECONDARY_TYPE_ACCELERATION_STRUCTURE_BUILD) continue;
+	if (commands[i].acceleration_structure_build.compacted_size_query_pool != VK_NULL_HANDLE) {
+	    vkCmdWriteAccelerationStructuresProperties(command_buffer, 1, &commands[i].acceleration_structure_build.geometry_info.dstAccelerationStructure, VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR, commands[i].acceleration_structure_build.compacted_size_query_pool, commands[i].acceleration_structure_build.compacted_size_query);
+	}
+	free(commands[i].acceleration_structure_build.range_info);
+	free(commands[i].acceleration_structure_build.geometries);
+    }
+
+    free(geometry_infos);
+    free(range_infos);
+
+    return SUCCESS;
+}
+
+// When transfer is set, the command buffer is for the dedicated transfer
+// queue. Its uploads are released to the graphics queue, and acquired at the
+// start of the next graphics recording.
+//
+// Commands are scheduled into levels from the resources they declare. A
+// command goes one level after the latest earlier command it conflicts with,
+// so commands on independent resources share a level and aren't serialized.
+// Each level starts with a single barrier carrying its layout transitions, and
+// a memory barrier for its other commands that depend on earlier ones.
+//
+// Every failure after recording begins goes through cleanup, which frees the
+// scheduling arrays and resets the command buffer, so it isn't left
+// recording.
+result record_secondary_command_buffer(VkCommandBuffer command_buffer, uint32_t num_commands, secondary_command* commands, uint32_t transfer) {
+    VkCommandBufferBeginInfo begin_info = {0};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+    result res = SUCCESS;
+    dynarray accesses = {0};
+    dynarray image_barriers = {0};
+    uint32_t* first_accesses = NULL;
+    uint32_t* levels = NULL;
+    uint32_t* waits = NULL;
+
+    PROPAGATE_VK(vkBeginCommandBuffer(command_buffer, &begin_info));
+
+    // Only the graphics secondary submission is timed. When there's a
+    // dedicated transfer queue, its uploads finish before this starts.
+    if (!transfer) {
+	begin_gpu_pass(command_buffer, GPU_PASS_SECONDARY);
+	PROPAGATE_SAVE_GOTO(record_transfer_acquires(command_buffer), res, cleanup);
+    }
+    uint32_t first_released_buffer = dynarray_len(&glbl.transfer_acquire_buffers);
+    if (num_commands == 0) {
+	if (!transfer) end_gpu_pass(command_buffer, GPU_PASS_SECONDARY);
+	PROPAGATE_VK(vkEndCommandBuffer(command_buffer));
+	return SUCCESS;
+    }
+
+    first_accesses = malloc((num_commands + 1) * sizeof(uint32_t));
+    levels = malloc(num_commands * sizeof(uint32_t));
+    waits = malloc(num_commands * sizeof(uint32_t));
+    if (!first_accesses || !levels || !waits) {
+	fprintf(stderr, "ERROR: Couldn't allocate secondary command levels\n");
+	res = CUSTOM_ERROR;
+	goto cleanup;
+    }
+    PROPAGATE_SAVE_GOTO(dynarray_create(sizeof(resource_access), 4 * num_commands, &accesses), res, cleanup);
+    PROPAGATE_SAVE_GOTO(dynarray_create(sizeof(VkImageMemoryBarrier), 16, &image_barriers), res, cleanup);
+
+    for (uint32_t i = 0; i < num_commands; ++i) {
+	first_accesses[i] = dynarray_len(&accesses);
+	PROPAGATE_SAVE_GOTO(declare_resources(&commands[i], &accesses), res, cleanup);
+    }
+    first_accesses[num_commands] = dynarray_len(&accesses);
+
+    // waits records whether a command that isn't a transition depends on one
+    // that isn't either, and so needs a memory barrier before it.
+    uint32_t num_levels = 0;
+    resource_access* access_data = accesses.data;
+    for (uint32_t i = 0; i < num_commands; ++i) {
+	levels[i] = 0;
+	waits[i] = 0;
+	for (uint32_t j = 0; j < i; ++j) {
+	    if (!accesses_conflict(&access_data[first_accesses[j]], first_accesses[j + 1] - first_accesses[j], &access_data[first_accesses[i]], first_accesses[i + 1] - first_accesses[i])) continue;
+	    if (levels[j] + 1 > levels[i]) levels[i] = levels[j] + 1;
+	    if (commands[i].type != SECONDARY_TYPE_LAYOUT_TRANSITION && commands[j].type != SECONDARY_TYPE_LAYOUT_TRANSITION) waits[i] = 1;
+	}
+	if (levels[i] + 1 > num_levels) num_levels = levels[i] + 1;
+    }
+
+    for (uint32_t level = 0; level < num_levels; ++level) {
+	VkPipelineStageFlags src_stage = 0;
+	VkPipelineStageFlags dst_stage = 0;
+	VkMemoryBarrier memory_barrier = {0};
+	memory_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	uint32_t num_memory_barriers = 0;
+	dynarray_clear(&image_barriers);
+
+	for (uint32_t i = 0; i < num_commands; ++i) {
+	    if (levels[i] != level) continue;
+
+	    if (commands[i].type == SECONDARY_TYPE_LAYOUT_TRANSITION) {
+		VkImageMemoryBarrier barrier;
+		VkPipelineStageFlags transition_src_stage;
+		VkPipelineStageFlags transition_dst_stage;
+		if (!transition_barrier(&commands[i], transfer, &barrier, &transition_src_stage, &transition_dst_stage)) continue;
+		src_stage |= transition_src_stage;
+		dst_stage |= transition_dst_stage;
 		for (uint32_t j = 0; j < dynarray_len(&commands[i].layout_transition.images); ++j) {
 		    barrier.image = INDEX(j, commands[i].layout_transition.images, VkImage);
-		    
-		    if (commands[i].layout_transition.old == VK_IMAGE_LAYOUT_UNDEFINED && commands[i].layout_transition.new == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) {
-			barrier.srcAccessMask = 0;
-			barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-			vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
-		    }
-		    else if (commands[i].layout_transition.old == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL && commands[i].layout_transition.new == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
-			barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-			barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-			vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
-		    }
-		    else if (commands[i].layout_transition.old == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL && commands[i].layout_transition.new == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL) {
-			barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
-			barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-			vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+		    PROPAGATE_SAVE_GOTO(dynarray_push(&barrier, &image_barriers), res, cleanup);
+		    if (barrier.srcQueueFamilyIndex != barrier.dstQueueFamilyIndex) {
+			PROPAGATE_SAVE_GOTO(dynarray_push(&barrier.image, &glbl.transfer_acquire_images), res, cleanup);
 		    }
 		}
-
-		break;
 	    }
-	    case SECONDARY_TYPE_ACCELERATION_STRUCTURE_BUILD: {
-		vkCmdBuildAccelerationStructures(command_buffer, 1, &commands[i].acceleration_structure_build.geometry_info, (const VkAccelerationStructureBuildRangeInfoKHR *const *) &commands[i].acceleration_structure_build.range_info);
-		free(commands[i].acceleration_structure_build.range_info);
-		free(commands[i].acceleration_structure_build.geometries);
-		break;
+	    else if (waits[i]) {
+		VkPipelineStageFlags stage;
+		VkAccessFlags access;
+		command_scope(&commands[i], &stage, &access);
+		dst_stage |= stage;
+		memory_barrier.dstAccessMask |= access;
+		num_memory_barriers = 1;
 	    }
-	    case SECONDARY_TYPE_CLEANUP: {
-		for (uint32_t j = 0; j < dynarray_len(&commands[i].cleanup.images); ++j) {
-		    if (commands[i].cleanup.images.size > 0) vkDestroyImage(glbl.device, INDEX(j, commands[i].cleanup.images, VkImage), NULL);
-		    if (commands[i].cleanup.image_views.size > 0) vkDestroyImageView(glbl.device, INDEX(j, commands[i].cleanup.image_views, VkImageView), NULL);
-		}
-
-		if (commands[i].cleanup.memory) vkFreeMemory(glbl.device, commands[i].cleanup.memory, NULL);
+	}
 
-		dynarray_destroy(&commands[i].cleanup.images);
-		dynarray_destroy(&commands[i].cleanup.image_views);
-		break;
-	    }
+	// The memory barrier waits on everything the level's commands could
+	// depend on from earlier levels.
+	if (num_memory_barriers > 0) {
+	    for (uint32_t i = 0; i < num_commands; ++i) {
+		if (levels[i] >= level || commands[i].type == SECONDARY_TYPE_LAYOUT_TRANSITION) continue;
+		VkPipelineStageFlags stage;
+		VkAccessFlags access;
+		command_scope(&commands[i], &stage, &access);
+		src_stage |= stage;
+		memory_barrier.srcAccessMask |= access & (VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR);
 	    }
-	    
 	}
-	num_commands = skips;
-	if (skips > 0) {
-	    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL, 0, NULL, 0, NULL);
+
+	if (dynarray_len(&image_barriers) > 0 || num_memory_barriers > 0) {
+	    vkCmdPipelineBarrier(command_buffer, src_stage, dst_stage, 0, num_memory_barriers, &memory_barrier, 0, NULL, dynarray_len(&image_barriers), image_barriers.data);
+	}
+
+	PROPAGATE_SAVE_GOTO(record_acceleration_structure_builds(command_buffer, level, levels, num_commands, commands), res, cleanup);
+	for (uint32_t i = 0; i < num_commands; ++i) {
+	    if (levels[i] == level) PROPAGATE_SAVE_GOTO(record_command(command_buffer, &commands[i], transfer), res, cleanup);
 	}
     }
-    
-    PROPAGATE_VK(vkEndCommandBuffer(command_buffer));
-    
-    return SUCCESS;
+
+    // Buffers copied on the transfer queue are released to the graphics queue
+    // together, once every command has been recorded.
+    uint32_t num_released_buffers = transfer ? dynarray_len(&glbl.transfer_acquire_buffers) - first_released_buffer : 0;
+    if (num_released_buffers > 0) {
+	VkBufferMemoryBarrier* buffer_barriers = malloc(num_released_buffers * sizeof(VkBufferMemoryBarrier));
+	if (!buffer_barriers) {
+	    fprintf(stderr, "ERROR: Couldn't allocate transfer release barriers\n");
+	    res = CUSTOM_ERROR;
+	    goto cleanup;
+	}
+	for (uint32_t i = 0; i < num_released_buffers; ++i) {
+	    VkBufferMemoryBarrier barrier = {0};
+	    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	    barrier.srcQueueFamilyIndex = glbl.transfer_queue_family;
+	    barrier.dstQueueFamilyIndex = glbl.queue_family;
+	    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	    barrier.dstAccessMask = 0;
+	    barrier.buffer = INDEX(first_released_buffer + i, glbl.transfer_acquire_buffers, VkBuffer);
+	    barrier.offset = 0;
+	    barrier.size = VK_WHOLE_SIZE;
+	    buffer_barriers[i] = barrier;
+	}
+	vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL, num_released_buffers, buffer_barriers, 0, NULL);
+	free(buffer_barriers);
+    }
+
+    if (!transfer) end_gpu_pass(command_buffer, GPU_PASS_SECONDARY);
+    res.vk = vkEndCommandBuffer(command_buffer);
+
+ cleanup:
+    if (!IS_SUCCESS(res)) vkResetCommandBuffer(command_buffer, 0);
+    if (image_barriers.alloc) dynarray_destroy(&image_barriers);
+    if (accesses.alloc) dynarray_destroy(&accesses);
+    free(first_accesses);
+    free(levels);
+    free(waits);
+
+    return res;
 }
 
-result queue_secondary_command(secondary_command command) {
-    uint32_t effective_index = (command.delay + glbl.secondary_queue_index) % COMMAND_QUEUE_DEPTH;
-    if (glbl.secondary_queue_size[effective_index] >= COMMAND_QUEUE_SIZE) {
-	fprintf(stderr, "ERROR: Attempted to queue copy operation, but copy queue is full");
+result create_secondary_queue(void) {
+    if (pthread_mutex_init(&glbl.secondary_queue_lock, NULL)) {
+	fprintf(stderr, "ERROR: Couldn't create secondary queue lock\n");
 	return CUSTOM_ERROR;
     }
-    
-    glbl.secondary_queue[effective_index][glbl.secondary_queue_size[effective_index]] = command;
-    ++glbl.secondary_queue_size[effective_index];
+    for (uint32_t i = 0; i < COMMAND_QUEUE_DEPTH; ++i) {
+	PROPAGATE(dynarray_create(sizeof(secondary_command), COMMAND_QUEUE_INITIAL_SIZE, &glbl.secondary_queue[i]));
+    }
+    PROPAGATE(dynarray_create(sizeof(secondary_command), COMMAND_QUEUE_INITIAL_SIZE, &glbl.secondary_recording_queue));
+    PROPAGATE(dynarray_create(sizeof(VkImage), 64, &glbl.transfer_acquire_images));
+    PROPAGATE(dynarray_create(sizeof(VkBuffer), 8, &glbl.transfer_acquire_buffers));
 
     return SUCCESS;
 }
 
-result set_secondary_fence(VkFence fence) {
-    if (glbl.secondary_finished_fence != VK_NULL_HANDLE) {
-	fprintf(stderr, "ERROR: Attempted to set secondary command fence when it's already set");
-	return CUSTOM_ERROR;
+result queue_secondary_command(secondary_command command) {
+    return queue_secondary_commands(1, &command);
+}
+
+// Queues every command or none of them, so a caller that fails to queue a
+// batch still owns all of its commands' arrays.
+result queue_secondary_commands(uint32_t num_commands, const secondary_command* commands) {
+    for (uint32_t i = 0; i < num_commands; ++i) {
+	if (commands[i].delay >= COMMAND_QUEUE_DEPTH) {
+	    fprintf(stderr, "ERROR: Attempted to queue secondary command with a delay of %u, but the queue is only %u deep\n", commands[i].delay, COMMAND_QUEUE_DEPTH);
+	    return CUSTOM_ERROR;
+	}
     }
 
-    glbl.secondary_finished_fence = fence;
-    
-    return SUCCESS;
+    pthread_mutex_lock(&glbl.secondary_queue_lock);
+    result result = SUCCESS;
+    uint32_t num_queued = 0;
+    for (; num_queued < num_commands; ++num_queued) {
+	uint32_t effective_index = (commands[num_queued].delay + glbl.secondary_queue_index) % COMMAND_QUEUE_DEPTH;
+	result = dynarray_push((void*) &commands[num_queued], &glbl.secondary_queue[effective_index]);
+	if (!IS_SUCCESS(result)) break;
+    }
+    if (!IS_SUCCESS(result)) {
+	while (num_queued > 0) {
+	    --num_queued;
+	    uint32_t effective_index = (commands[num_queued].delay + glbl.secondary_queue_index) % COMMAND_QUEUE_DEPTH;
+	    dynarray_pop(NULL, &glbl.secondary_queue[effective_index]);
+	}
+    }
+    pthread_mutex_unlock(&glbl.secondary_queue_lock);
+
+    if (!IS_SUCCESS(result)) {
+	fprintf(stderr, "ERROR: Couldn't grow secondary queue\n");
+    }
+    return result;
+}
+
+// Returns the commands due for this frame, or NULL if there are none. It's
+// called once per frame, and the queue advances even when nothing is due, so
+// a command's delay counts frames. Due commands are swapped out for the empty
+// recording queue, so producers aren't blocked while they're recorded. The
+// returned queue must be cleared once recorded, before the next call.
+dynarray* take_secondary_commands(void) {
+    pthread_mutex_lock(&glbl.secondary_queue_lock);
+    dynarray* due = &glbl.secondary_queue[glbl.secondary_queue_index];
+    glbl.secondary_queue_index = (glbl.secondary_queue_index + 1) % COMMAND_QUEUE_DEPTH;
+    if (dynarray_len(due) == 0) {
+	pthread_mutex_unlock(&glbl.secondary_queue_lock);
+	return NULL;
+    }
+
+    dynarray taken = *due;
+    *due = glbl.secondary_recording_queue;
+    glbl.secondary_recording_queue = taken;
+    pthread_mutex_unlock(&glbl.secondary_queue_lock);
+
+    return &glbl.secondary_recording_queue;
+}
+
+void cleanup_secondary_queue(void) {
+    for (uint32_t i = 0; i < COMMAND_QUEUE_DEPTH; ++i) {
+	dynarray_destroy(&glbl.secondary_queue[i]);
+    }
+    dynarray_destroy(&glbl.secondary_recording_queue);
+    dynarray_destroy(&glbl.transfer_acquire_images);
+    dynarray_destroy(&glbl.transfer_acquire_buffers);
+    pthread_mutex_destroy(&glbl.secondary_queue_lock);
 }
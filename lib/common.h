@@ -16,6 +16,7 @@
 #define COMMON_H
 
 #include <stdint.h>
+#include <pthread.h>
 
 #define GLFW_INCLUDE_VULKAN
 
@@ -30,9 +31,69 @@ typedef struct result {
 
 #define MAX_VK_ENUMERATIONS 16
 #define FRAMES_IN_FLIGHT 2
-#define COMMAND_QUEUE_SIZE 16
+#define TIMELINE_VALUES_PER_FRAME 2
+#define COMMAND_QUEUE_INITIAL_SIZE 16
 #define COMMAND_QUEUE_DEPTH 16
 #define MAX_TEXTURES 65536
+#define STAGING_RING_SIZE (64 * 1024 * 1024)
+
+// Fixed size textures, such as terrain chunks, are packed into slots of large
+// 3D atlas images instead of each getting an image. Textures with
+// ATLAS_TEXTURE_BIT set in their ID are atlas slots, and the rest of the ID is
+// the slot's index across all atlases. Atlas i is bound at texture index
+// ATLAS_TEXTURE_BIT + i, so other textures get IDs below ATLAS_TEXTURE_BIT.
+// Atlases stay in the general layout and are shared by the graphics and
+// transfer queues, so slots can be written while frames in flight sample the
+// others.
+#define ATLAS_TEXTURE_BIT 0x8000
+#define ATLAS_SLOT_SIZE 16
+#define ATLAS_SLOTS_PER_AXIS 16
+#define ATLAS_SLOTS (ATLAS_SLOTS_PER_AXIS * ATLAS_SLOTS_PER_AXIS * ATLAS_SLOTS_PER_AXIS)
+#define MAX_ATLASES 8
+
+// Device memory is sub-allocated from blocks of 2^ALLOCATOR_BLOCK_ORDER bytes,
+// in power of two sized nodes of at least 2^ALLOCATOR_MIN_ORDER bytes. A
+// texture block is defragmented once it's less than 1/ALLOCATOR_DEFRAGMENT_THRESHOLD
+// full.
+#define ALLOCATOR_MIN_ORDER 8
+#define ALLOCATOR_BLOCK_ORDER 26
+#define ALLOCATOR_NUM_ORDERS (ALLOCATOR_BLOCK_ORDER - ALLOCATOR_MIN_ORDER + 1)
+#define ALLOCATOR_DEDICATED 0xFFFFFFFF
+#define ALLOCATOR_DEFRAGMENT_THRESHOLD 4
+
+// Instances are split into streams by encoding. Each stream has its own
+// instance buffer, draw lists and pipeline, and is bound to the descriptor
+// binding matching its index. Stream buffers are indexed by entries of that
+// stream, so each is only as big as its own population. Object IDs of aligned
+// instances have OBJECT_ID_ALIGNED_BIT set, so they don't collide with model
+// instance entries.
+#define INSTANCE_STREAM_MODEL 0
+#define INSTANCE_STREAM_ALIGNED 1
+#define NUM_INSTANCE_STREAMS 2
+#define OBJECT_ID_ALIGNED_BIT 0x80000000
+
+// The per-frame camera uniform comes right after the instance buffers, then
+// the ray tracing TLAS and output image, and the variable count texture array
+// has to be the last binding.
+#define CAMERA_BINDING NUM_INSTANCE_STREAMS
+#define TLAS_BINDING (NUM_INSTANCE_STREAMS + 1)
+#define TRACE_IMAGE_BINDING (NUM_INSTANCE_STREAMS + 2)
+#define TEXTURE_BINDING (NUM_INSTANCE_STREAMS + 3)
+
+// A frame's TLAS is refit rather than rebuilt while its instances are the
+// same, other than their transforms. It's rebuilt once it has been refit
+// TLAS_MAX_UPDATES times, or once more than 1/TLAS_REBUILD_FRACTION of its
+// instances have been replaced since it was last built, since refits don't
+// restructure the BVH and it gets slower to trace.
+#define TLAS_MAX_UPDATES 64
+#define TLAS_REBUILD_FRACTION 8
+
+// Ray traced frames are rendered into this format, then blitted to the
+// swapchain image.
+#define TRACE_IMAGE_FORMAT VK_FORMAT_R16G16B16A16_SFLOAT
+
+// Two inverse view projection matrices and the camera position.
+#define CAMERA_UNIFORM_SIZE (sizeof(float) * 4 * 4 * 2 + sizeof(float) * 4)
 
 #define IS_SUCCESS(res) (res.vk == SUCCESS.vk && res.custom == SUCCESS.custom)
 
@@ -65,6 +126,21 @@ typedef struct result {
 	if (!IS_SUCCESS(eval)) return -1;				\
     }
 
+// For functions that have to release what they've allocated before returning
+// an error, so every failure goes through one cleanup label.
+#define PROPAGATE_GOTO(res, label)					\
+    {									\
+	result eval = res;						\
+	if (!IS_SUCCESS(eval)) goto label;				\
+    }
+
+// Like PROPAGATE_GOTO, but keeps the error in saved for cleanup to return.
+#define PROPAGATE_SAVE_GOTO(res, saved, label)				\
+    {									\
+	saved = res;							\
+	if (!IS_SUCCESS(saved)) goto label;				\
+    }
+
 #define PROPAGATE_CLEAN(res)						\
     {									\
     result PROPAGATE_CLEANUP_RETURN_VALUE_RESERVED = res;		\
@@ -75,6 +151,18 @@ typedef struct result {
     }							\
     }
 
+// CPU profiling zones, recorded by src/profile.rs. Names must be string
+// literals. Zones compile to nothing unless built with the profile feature.
+#ifdef PROFILE
+void profile_zone_begin(const char* name);
+void profile_zone_end(void);
+#define PROFILE_ZONE_BEGIN(name) profile_zone_begin(name)
+#define PROFILE_ZONE_END() profile_zone_end()
+#else
+#define PROFILE_ZONE_BEGIN(name)
+#define PROFILE_ZONE_END()
+#endif
+
 #define PROPAGATE_VK_CLEAN(res)						\
     {									\
     VkResult PROPAGATE_CLEANUP_EVAL_VALUE_RESERVED = res;		\
@@ -89,35 +177,133 @@ typedef struct result {
 typedef struct render_tick_info {
     void* perspective;
     void* camera;
+    void* camera_uniform;
 } render_tick_info;
 
 typedef struct gpu_vertex {
     float pos[3];
 } gpu_vertex;
 
+typedef enum allocation_kind {
+    ALLOCATION_KIND_BUFFER,
+    ALLOCATION_KIND_IMAGE,
+    NUM_ALLOCATION_KINDS,
+} allocation_kind;
+
+// Every memory type has a pool per allocation kind and per whether the memory
+// needs any allocate flags.
+#define ALLOCATOR_MAX_POOLS (VK_MAX_MEMORY_TYPES * NUM_ALLOCATION_KINDS * 2)
+
+// A range of device memory. Allocations too large for a block have order
+// ALLOCATOR_DEDICATED and own their memory. Host visible allocations are
+// always mapped.
+typedef struct allocation {
+    VkDeviceMemory memory;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    void* mapped;
+    uint32_t pool;
+    uint32_t block;
+    uint32_t order;
+} allocation;
+
+typedef struct allocator_block {
+    VkDeviceMemory memory;
+    void* mapped;
+    VkDeviceSize used;
+    dynarray free_lists[ALLOCATOR_NUM_ORDERS];
+} allocator_block;
+
+typedef struct allocator_pool {
+    uint32_t initialized;
+    uint32_t memory_type;
+    VkMemoryAllocateFlags allocate_flags;
+    uint32_t excluded_block;
+    dynarray blocks;
+} allocator_pool;
+
+typedef struct allocator_stats {
+    uint64_t num_device_memories;
+    uint64_t device_memory_bytes;
+    uint64_t num_allocations;
+    uint64_t allocated_bytes;
+} allocator_stats;
+
+// Passes timed with GPU timestamps. Only the raster pass has pipeline
+// statistics.
+typedef enum gpu_pass {
+    GPU_PASS_SECONDARY,
+    GPU_PASS_RASTER,
+    NUM_GPU_PASSES,
+} gpu_pass;
+
+// GPU timings of one frame, read back once it has finished. Matches
+// GpuTimings in src/render.rs.
+typedef struct gpu_timings {
+    uint64_t frame;
+    uint64_t fragment_shader_invocations;
+    float secondary_ms;
+    float raster_ms;
+    uint32_t has_secondary;
+    uint32_t has_timestamps;
+    uint32_t has_statistics;
+} gpu_timings;
+
 typedef enum secondary_type {
     SECONDARY_TYPE_COPY_BUFFER_BUFFER,
     SECONDARY_TYPE_COPY_BUFFER_IMAGE,
     SECONDARY_TYPE_COPY_IMAGES_IMAGES,
     SECONDARY_TYPE_LAYOUT_TRANSITION,
     SECONDARY_TYPE_ACCELERATION_STRUCTURE_BUILD,
+    SECONDARY_TYPE_ACCELERATION_STRUCTURE_COPY,
     SECONDARY_TYPE_CLEANUP,
 } secondary_type;
 
+// What a frame's TLAS needs before it's traced.
+typedef enum tlas_build_mode {
+    TLAS_BUILD,
+    TLAS_UPDATE,
+    TLAS_SKIP,
+} tlas_build_mode;
+
+// BLASes are built with compaction allowed, and their compacted size is
+// queried. Once the frame that built it has finished, the size is read back
+// and the BLAS is copied into a compacted one, and the original retires once
+// the frame that switched over has finished.
+typedef enum blas_compaction {
+    BLAS_COMPACTION_NONE,
+    BLAS_COMPACTION_QUERIED,
+    BLAS_COMPACTION_RETIRING,
+} blas_compaction;
+
+// Commands are recorded in dependency order derived from the images and
+// buffers they touch, so producers queue them in the order they should run.
+// A queued command owns its arrays and dynarrays, which are freed once it's
+// recorded, so each must only be queued with one command.
+// Commands with transfer set are recorded for the dedicated transfer queue,
+// when there is one, and run before the rest of their submission. Images they
+// leave in SHADER_READ_ONLY_OPTIMAL and buffers they copy into are released
+// to the graphics queue. They may only use transfer stages.
 typedef struct secondary_command {
     secondary_type type;
-    uint32_t ordering;
     uint32_t delay;
+    uint32_t transfer;
     union {
 	struct {
 	    VkBuffer src_buffer;
 	    VkBuffer dst_buffer;
 	    VkBufferCopy copy_region;
+	    uint32_t num_copy_regions;
+	    VkBufferCopy* copy_regions;
 	} copy_buffer_buffer;
 	struct {
 	    VkBuffer src_buffer;
 	    VkImage dst_image;
+	    VkImageLayout dst_layout;
 	    VkBufferImageCopy copy_region;
+	    uint32_t num_copy_regions;
+	    VkImage* dst_images;
+	    VkBufferImageCopy* copy_regions;
 	} copy_buffer_image;
 	struct {
 	    dynarray src_images;
@@ -133,15 +319,78 @@ typedef struct secondary_command {
 	    VkAccelerationStructureBuildGeometryInfoKHR geometry_info;
 	    VkAccelerationStructureGeometryKHR* geometries;
 	    VkAccelerationStructureBuildRangeInfoKHR* range_info;
+	    // When set, the built structure's compacted size is written to
+	    // this query.
+	    VkQueryPool compacted_size_query_pool;
+	    uint32_t compacted_size_query;
 	} acceleration_structure_build;
+	struct {
+	    VkAccelerationStructureKHR src;
+	    VkAccelerationStructureKHR dst;
+	    VkCopyAccelerationStructureModeKHR mode;
+	} acceleration_structure_copy;
 	struct {
 	    dynarray images;
 	    dynarray image_views;
-	    VkDeviceMemory memory;
+	    dynarray allocations;
 	} cleanup;
     };
 } secondary_command;
 
+typedef struct instance_stream {
+    uint32_t stride;
+    uint32_t count;
+    uint32_t capacity;
+    uint8_t* data;
+
+    // Every frame in flight has its own persistently mapped copy of the
+    // instances, synced from data. version counts updates, and the dirty
+    // ranges of the last FRAMES_IN_FLIGHT updates are kept, indexed by
+    // version.
+    uint64_t version;
+    dynarray dirty_ranges[FRAMES_IN_FLIGHT];
+    uint64_t buffer_versions[FRAMES_IN_FLIGHT];
+    uint32_t buffer_capacities[FRAMES_IN_FLIGHT];
+    uint32_t upload_all[FRAMES_IN_FLIGHT];
+    VkBuffer buffers[FRAMES_IN_FLIGHT];
+    allocation allocations[FRAMES_IN_FLIGHT];
+
+    // The draw list is written into a CPU copy without waiting on the GPU,
+    // and copied into the current frame's buffer by sync_draw_lists.
+    uint32_t draw_count;
+    uint32_t draw_list_capacity;
+    uint32_t* draw_list;
+    uint32_t draw_list_capacities[FRAMES_IN_FLIGHT];
+    uint32_t* draw_list_data[FRAMES_IN_FLIGHT];
+    VkBuffer draw_list_buffers[FRAMES_IN_FLIGHT];
+    allocation draw_list_allocations[FRAMES_IN_FLIGHT];
+} instance_stream;
+
+// Persistently mapped staging memory for texture uploads. Space is allocated
+// at the head, and retired from the tail once the secondary submission that
+// read it has reached its timeline value. Head and tail only ever grow, and
+// are wrapped into the buffer when used as offsets.
+typedef struct staging_ring_submission {
+    uint64_t head;
+    uint64_t timeline_value;
+} staging_ring_submission;
+
+typedef struct staging_ring {
+    uint64_t head;
+    uint64_t tail;
+    dynarray submissions;
+    uint8_t* data;
+    VkBuffer buffer;
+    allocation allocation;
+} staging_ring;
+
+// An atlas slot that becomes free once the graphics timeline reaches
+// timeline_value.
+typedef struct atlas_retiring_slot {
+    uint32_t slot;
+    uint64_t timeline_value;
+} atlas_retiring_slot;
+
 typedef struct user_input {
     uint8_t keys[6];
     double mouse_x;
@@ -150,17 +399,42 @@ typedef struct user_input {
     double last_mouse_y;
 } user_input;
 
+// Both members are the same size, so a run of image infos can be passed to
+// Vulkan as an array.
 typedef union descriptor_info {
     VkDescriptorImageInfo image_info;
     VkDescriptorBufferInfo buffer_info;
 } descriptor_info;
 
+// The lengths of the pending descriptor writes, so a caller that fails
+// partway can drop the writes it added before they're applied.
+typedef struct descriptor_mark {
+    uint32_t num_writes[FRAMES_IN_FLIGHT];
+    uint32_t num_write_infos[FRAMES_IN_FLIGHT];
+} descriptor_mark;
+
+// How the renderer is started. Headless renderers have no window or
+// swapchain, and render into offscreen images of the given size, which are
+// copied back to the host when readback is set. Ray traced renderers trace
+// every frame through a TLAS of the drawn instances instead of rasterizing
+// them. Matches InitInfo in src/render.rs.
+typedef struct init_info {
+    uint32_t headless;
+    uint32_t width;
+    uint32_t height;
+    uint32_t readback;
+    uint32_t ray_trace;
+} init_info;
+
 typedef struct renderer {
     uint32_t current_frame;
     uint32_t num_frames_elapsed;
     uint32_t window_width;
     uint32_t window_height;
     uint32_t resized;
+    uint32_t headless;
+    uint32_t readback;
+    uint32_t ray_trace;
     GLFWwindow* window;
 
     user_input user_input;
@@ -170,12 +444,21 @@ typedef struct renderer {
     VkPhysicalDevice physical;
     VkDevice device;
     VkQueue queue;
+    uint32_t queue_family;
+    VkQueue transfer_queue;
+    uint32_t transfer_queue_family;
 
     VkSwapchainKHR swapchain;
     dynarray swapchain_images;
     VkFormat swapchain_format;
     VkExtent2D swapchain_extent;
     dynarray swapchain_image_views;
+    // Headless renderers use one offscreen image per frame in flight in place
+    // of swapchain images, and read each back through its frame's buffer.
+    dynarray offscreen_allocations;
+    VkBuffer readback_buffers[FRAMES_IN_FLIGHT];
+    allocation readback_allocations[FRAMES_IN_FLIGHT];
+    uint64_t readback_frames[FRAMES_IN_FLIGHT];
 
     VkDescriptorPool descriptor_pool;
     VkDescriptorSetLayout raster_descriptor_set_layout;
@@ -185,15 +468,69 @@ typedef struct renderer {
 
     VkPipelineLayout raster_pipeline_layout;
     VkRenderPass render_pass;
-    VkPipeline raster_pipeline;
+    VkPipeline raster_pipelines[NUM_INSTANCE_STREAMS];
     dynarray framebuffers;
     VkImage depth_image;
     VkDeviceMemory depth_image_memory;
     VkImageView depth_image_view;
 
+    // Every instance is a TLAS instance of the same unit cube BLAS, whose
+    // AABB the intersection shader marches through. Each frame in flight has
+    // its own TLAS, updated from its draw lists every frame, and grown like
+    // the instance buffers. tlas_keys holds the stream and entry of each TLAS
+    // instance as of the frame's last update.
+    VkAccelerationStructureKHR cube_blas;
+    VkDeviceAddress cube_blas_address;
+    VkBuffer cube_blas_buffer;
+    allocation cube_blas_allocation;
+    VkBuffer cube_aabb_buffer;
+    allocation cube_aabb_allocation;
+    VkBuffer cube_scratch_buffer;
+    allocation cube_scratch_allocation;
+    VkQueryPool blas_query_pool;
+    blas_compaction cube_blas_compaction;
+    VkAccelerationStructureKHR retired_cube_blas;
+    VkBuffer retired_cube_blas_buffer;
+    allocation retired_cube_blas_allocation;
+    uint64_t cube_blas_compaction_value;
+    VkAccelerationStructureKHR tlas[FRAMES_IN_FLIGHT];
+    VkWriteDescriptorSetAccelerationStructureKHR tlas_descriptor_infos[FRAMES_IN_FLIGHT];
+    VkBuffer tlas_buffers[FRAMES_IN_FLIGHT];
+    allocation tlas_allocations[FRAMES_IN_FLIGHT];
+    VkBuffer tlas_scratch_buffers[FRAMES_IN_FLIGHT];
+    allocation tlas_scratch_allocations[FRAMES_IN_FLIGHT];
+    VkDeviceAddress tlas_scratch_addresses[FRAMES_IN_FLIGHT];
+    VkBuffer tlas_instance_buffers[FRAMES_IN_FLIGHT];
+    allocation tlas_instance_allocations[FRAMES_IN_FLIGHT];
+    VkDeviceAddress tlas_instance_addresses[FRAMES_IN_FLIGHT];
+    uint32_t tlas_capacities[FRAMES_IN_FLIGHT];
+    uint32_t tlas_instance_counts[FRAMES_IN_FLIGHT];
+    uint32_t* tlas_keys[FRAMES_IN_FLIGHT];
+    uint64_t tlas_instance_versions[FRAMES_IN_FLIGHT][NUM_INSTANCE_STREAMS];
+    tlas_build_mode tlas_build_modes[FRAMES_IN_FLIGHT];
+    uint32_t tlas_force_build[FRAMES_IN_FLIGHT];
+    uint32_t tlas_updates_since_build[FRAMES_IN_FLIGHT];
+    uint32_t tlas_changes_since_build[FRAMES_IN_FLIGHT];
+    VkDeviceSize scratch_alignment;
+    VkImage trace_images[FRAMES_IN_FLIGHT];
+    VkImageView trace_image_views[FRAMES_IN_FLIGHT];
+    allocation trace_image_allocations[FRAMES_IN_FLIGHT];
+    VkPipelineLayout trace_pipeline_layout;
+    VkPipeline trace_pipeline;
+    VkBuffer shader_binding_table_buffer;
+    allocation shader_binding_table_allocation;
+    VkStridedDeviceAddressRegionKHR raygen_region;
+    VkStridedDeviceAddressRegionKHR miss_region;
+    VkStridedDeviceAddressRegionKHR hit_region;
+    VkStridedDeviceAddressRegionKHR callable_region;
+
     VkCommandPool command_pool;
     VkCommandBuffer raster_command_buffers[FRAMES_IN_FLIGHT];
     VkCommandBuffer secondary_command_buffers[FRAMES_IN_FLIGHT];
+    VkCommandPool transfer_command_pool;
+    VkCommandBuffer transfer_command_buffers[FRAMES_IN_FLIGHT];
+    dynarray transfer_acquire_images;
+    dynarray transfer_acquire_buffers;
 
     VkBuffer staging_cube_vertex_buffer;
     VkBuffer staging_cube_index_buffer;
@@ -202,35 +539,58 @@ typedef struct renderer {
     VkBuffer cube_index_buffer;
     VkDeviceMemory cube_memory;
 
-    uint32_t instance_count;
-    uint32_t instance_capacity;
-    VkBuffer staging_instance_buffer;
-    VkDeviceMemory staging_instance_memory;
-    VkBuffer instance_buffer;
-    VkDeviceMemory instance_memory;
-
-    uint32_t staging_texture_size;
-    VkBuffer staging_texture_buffer;
-    VkDeviceMemory staging_texture_memory;
-    uint32_t last_texture_memory_used;
-    uint32_t last_texture_memory_allocated;
+    instance_stream instance_streams[NUM_INSTANCE_STREAMS];
+
+    void* camera_data[FRAMES_IN_FLIGHT];
+    VkBuffer camera_buffers[FRAMES_IN_FLIGHT];
+    allocation camera_allocations[FRAMES_IN_FLIGHT];
+
+    allocator_pool allocator_pools[ALLOCATOR_MAX_POOLS];
+    allocator_stats allocator_stats;
+
+    uint32_t timestamps_supported;
+    uint32_t pipeline_statistics_supported;
+    float timestamp_period;
+    VkQueryPool timestamp_query_pool;
+    VkQueryPool statistics_query_pool;
+    uint32_t gpu_passes_recorded[FRAMES_IN_FLIGHT];
+    uint64_t gpu_pass_frames[FRAMES_IN_FLIGHT];
+    gpu_timings gpu_timings;
+
+    staging_ring staging_ring;
     dynarray texture_images;
     dynarray texture_image_views;
     dynarray texture_image_extents;
-    dynarray texture_memories;
+    dynarray texture_allocations;
     VkSampler texture_sampler;
-    VkFence texture_upload_finished_fence;
+
+    uint32_t num_atlases;
+    uint32_t atlas_slots_used;
+    dynarray atlas_free_slots;
+    dynarray atlas_retiring_slots;
+    VkImage atlas_images[MAX_ATLASES];
+    VkImageView atlas_image_views[MAX_ATLASES];
+    allocation atlas_allocations[MAX_ATLASES];
 
     VkSemaphore image_available_semaphore[FRAMES_IN_FLIGHT];
     VkSemaphore render_finished_semaphore[FRAMES_IN_FLIGHT];
-    VkFence frame_in_flight_fence[FRAMES_IN_FLIGHT];
 
-    VkSemaphore secondary_finished_semaphore[FRAMES_IN_FLIGHT];
-    VkSemaphore secondary_intercommand_semaphore[FRAMES_IN_FLIGHT];
-    uint32_t secondary_queue_size[COMMAND_QUEUE_DEPTH];
-    secondary_command secondary_queue[COMMAND_QUEUE_DEPTH][COMMAND_QUEUE_SIZE];
+    // Every submission signals the next value of its queue's timeline, so
+    // whether it has finished is a comparison against the semaphore's
+    // counter. Each frame takes TIMELINE_VALUES_PER_FRAME graphics values,
+    // for its secondary and raster submissions, whether or not it has a
+    // secondary submission.
+    VkSemaphore graphics_timeline;
+    VkSemaphore transfer_timeline;
+    uint64_t graphics_timeline_value;
+    uint64_t transfer_timeline_value;
+    uint64_t frame_timeline_values[FRAMES_IN_FLIGHT];
+    // Commands can be queued from any thread. The lock is only held while
+    // pushing, and while taking the commands due for submission.
+    pthread_mutex_t secondary_queue_lock;
+    dynarray secondary_queue[COMMAND_QUEUE_DEPTH];
+    dynarray secondary_recording_queue;
     uint32_t secondary_queue_index;
-    VkFence secondary_finished_fence;
 } renderer;
 
 typedef struct swapchain_support {
@@ -249,10 +609,17 @@ extern PFN_vkGetAccelerationStructureBuildSizesKHR vkGetAccelerationStructureBui
 extern PFN_vkCreateAccelerationStructureKHR vkCreateAccelerationStructure;
 extern PFN_vkBuildAccelerationStructuresKHR vkBuildAccelerationStructures;
 extern PFN_vkCmdBuildAccelerationStructuresKHR vkCmdBuildAccelerationStructures;
+extern PFN_vkGetAccelerationStructureDeviceAddressKHR vkGetAccelerationStructureDeviceAddress;
+extern PFN_vkDestroyAccelerationStructureKHR vkDestroyAccelerationStructure;
+extern PFN_vkCreateRayTracingPipelinesKHR vkCreateRayTracingPipelines;
+extern PFN_vkGetRayTracingShaderGroupHandlesKHR vkGetRayTracingShaderGroupHandles;
+extern PFN_vkCmdTraceRaysKHR vkCmdTraceRays;
+extern PFN_vkCmdWriteAccelerationStructuresPropertiesKHR vkCmdWriteAccelerationStructuresProperties;
+extern PFN_vkCmdCopyAccelerationStructureKHR vkCmdCopyAccelerationStructure;
 
-uint64_t entry(void);
+uint64_t entry(const init_info* init_info);
 
-result init(void);
+result init(const init_info* init_info);
 
 result create_instance(void);
 
@@ -264,6 +631,8 @@ int32_t physical_score(VkPhysicalDevice physical);
 
 result physical_check_queue_family(VkPhysicalDevice physical, uint32_t* queue_family, VkQueueFlagBits bits);
 
+result physical_find_transfer_queue_family(VkPhysicalDevice physical, uint32_t* queue_family);
+
 result physical_check_extensions(VkPhysicalDevice physical);
 
 result physical_check_swapchain_support(VkPhysicalDevice physical, swapchain_support* support);
@@ -292,66 +661,170 @@ result create_depth_resources(void);
 
 result create_ray_tracing_objects(void);
 
+result create_trace_images(void);
+
+result update_tlas(uint32_t frame);
+
+void record_trace_commands(VkCommandBuffer command_buffer, uint32_t image_index);
+
+void cleanup_trace_images(void);
+
+void cleanup_ray_tracing_objects(void);
+
 result create_command_pool(void);
 
 result create_command_buffers(void);
 
 result record_raster_command_buffer(VkCommandBuffer command_buffer, uint32_t image_index, const render_tick_info* render_tick_info);
 
-result record_secondary_command_buffer(VkCommandBuffer command_buffer, uint32_t num_commands, secondary_command* commands);
+result record_secondary_command_buffer(VkCommandBuffer command_buffer, uint32_t num_commands, secondary_command* commands, uint32_t transfer);
+
+uint32_t partition_transfer_commands(uint32_t num_commands, secondary_command* commands);
 
 result create_buffer(VkDeviceSize size, VkBufferUsageFlags usage, VkBuffer* buffer);
 
 result create_buffer_memory(VkMemoryPropertyFlags properties, VkMemoryAllocateFlags allocate_flags, VkDeviceMemory* memory, VkBuffer* buffers, uint32_t num_buffers, uint32_t* offsets, uint32_t minimum_size);
 
-result create_image(VkImageCreateFlags flags, VkFormat format, VkExtent3D extent, uint32_t mipLevels, uint32_t arrayLevels, VkImageUsageFlagBits usage, VkImage* image);
+result create_image(VkImageCreateFlags flags, VkFormat format, VkExtent3D extent, uint32_t mipLevels, uint32_t arrayLevels, VkImageUsageFlagBits usage, VkSharingMode sharing_mode, VkImage* image);
 
 result create_image_view(VkImage image, VkImageViewType type, VkFormat format, VkImageSubresourceRange subresource_range, VkImageView* view);
 
 result create_image_memory(VkMemoryPropertyFlags properties, VkMemoryAllocateFlags allocate_flags, VkDeviceMemory* memory, VkImage* images, uint32_t num_images, uint32_t* offsets, uint32_t* requested_size);
 
+result allocate_memory(VkMemoryRequirements requirements, VkMemoryPropertyFlags properties, VkMemoryAllocateFlags allocate_flags, allocation_kind kind, allocation* allocation);
+
+void free_memory(allocation* allocation);
+
+result allocate_buffer_memory(VkBuffer buffer, VkMemoryPropertyFlags properties, VkMemoryAllocateFlags allocate_flags, allocation* allocation);
+
+result allocate_image_memory(VkImage image, VkMemoryPropertyFlags properties, allocation* allocation);
+
+void get_allocator_stats(allocator_stats* stats);
+
+int32_t defragment_textures(void);
+
+void cleanup_allocator(void);
+
+result create_query_pools(void);
+
+void begin_gpu_pass(VkCommandBuffer command_buffer, gpu_pass pass);
+
+void end_gpu_pass(VkCommandBuffer command_buffer, gpu_pass pass);
+
+result read_gpu_timings(uint32_t frame);
+
+void get_gpu_timings(gpu_timings* timings);
+
+void cleanup_query_pools(void);
+
 result create_cube_buffer(void);
 
-result create_instance_buffer(void);
+result create_instance_buffer(uint32_t stream);
+
+result create_instance_frame_buffer(uint32_t stream, uint32_t frame);
+
+result grow_instance_buffer(uint32_t stream);
+
+void* start_update_instances(uint32_t stream, uint32_t instance_count);
+
+int32_t end_update_instances(uint32_t stream, uint32_t instance_count, const uint32_t* dirty_ranges, uint32_t num_dirty_ranges);
+
+result sync_instance_buffers(uint32_t frame);
+
+result create_draw_list_buffer(uint32_t stream, uint32_t frame, uint32_t draw_capacity);
 
-float* start_update_instances(uint32_t instance_count);
+uint32_t* start_update_draw_list(uint32_t stream, uint32_t draw_count);
 
-int32_t end_update_instances(uint32_t instance_count);
+int32_t end_update_draw_list(uint32_t stream, uint32_t draw_count);
 
-result create_staging_texture_buffer(void);
+result sync_draw_lists(uint32_t frame);
 
-result add_new_texture_memory(void* images, uint32_t num_images);
+result create_camera_buffers(void);
+
+result create_staging_ring(void);
+
+int32_t allocate_staging_ring(uint32_t size, uint32_t alignment);
+
+result submit_staging_ring(uint64_t timeline_value);
+
+void retire_staging_ring(void);
 
 result create_texture_singletons(void);
 
-int32_t add_texture(const uint8_t* data, uint32_t width, uint32_t height, uint32_t depth);
+result create_atlas(void);
+
+result allocate_atlas_slot(int32_t* slot);
+
+int32_t remove_atlas_texture(uint32_t texture_id);
+
+result retire_atlas_slots(void);
+
+int32_t add_textures(uint32_t num_textures, const uint8_t* const* data, const uint32_t* extents, int32_t* texture_ids);
+
+void mark_pending_descriptors(descriptor_mark* mark);
 
-result update_descriptors(uint32_t update_texture);
+void discard_pending_descriptors(const descriptor_mark* mark);
+
+result update_descriptors(uint32_t first_texture, uint32_t num_textures);
+
+result update_atlas_descriptors(uint32_t atlas);
+
+result update_instance_descriptors(uint32_t stream, uint32_t frame);
+
+result update_camera_descriptors(void);
+
+result update_tlas_descriptors(uint32_t frame);
+
+result update_trace_image_descriptors(uint32_t frame);
 
 void get_vertex_input_descriptions(VkVertexInputBindingDescription* vertex_input_binding_description, VkVertexInputAttributeDescription* vertex_input_attribute_description);
 
+result create_secondary_queue(void);
+
 result queue_secondary_command(secondary_command command);
 
-result set_secondary_fence(VkFence fence);
+result queue_secondary_commands(uint32_t num_commands, const secondary_command* commands);
+
+dynarray* take_secondary_commands(void);
 
 result find_memory_type(uint32_t filter, VkMemoryPropertyFlags properties, uint32_t* type);
 
 result create_synchronization(void);
 
+uint64_t get_timeline_value(VkSemaphore timeline);
+
+result wait_timeline(VkSemaphore timeline, uint64_t value);
+
+uint64_t get_upload_timeline_value(void);
+
+int32_t is_upload_finished(uint64_t timeline_value);
+
 void cleanup(void);
 
 result recreate_swapchain(void);
 
+result create_offscreen_targets(void);
+
+int32_t take_readback(uint32_t wait, uint64_t* frame, const uint8_t** pixels);
+
+int32_t take_reused_readback(uint64_t* frame, const uint8_t** pixels);
+
 void cleanup_swapchain(void);
 
-void cleanup_instance_buffer(void);
+void cleanup_instance_buffer(uint32_t stream);
+
+void cleanup_draw_list_buffer(uint32_t stream, uint32_t frame);
 
-void cleanup_staging_texture_buffer(void);
+void cleanup_camera_buffers(void);
+
+void cleanup_staging_ring(void);
 
 void cleanup_texture_images(void);
 
 void cleanup_texture_resources(void);
 
+void cleanup_secondary_queue(void);
+
 user_input* get_input_data_pointer(void);
 
 int32_t render_tick(int32_t* window_width, int32_t* window_height, const render_tick_info* render_tick_info);
@@ -19,15 +19,23 @@
 #include "common.h"
 
 result create_descriptor_pool(void) {
-    VkDescriptorPoolSize pool_size = {0};
-    pool_size.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    pool_size.descriptorCount = FRAMES_IN_FLIGHT * MAX_TEXTURES;
+    VkDescriptorPoolSize pool_sizes[5] = {0};
+    pool_sizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    pool_sizes[0].descriptorCount = FRAMES_IN_FLIGHT * NUM_INSTANCE_STREAMS;
+    pool_sizes[1].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    pool_sizes[1].descriptorCount = FRAMES_IN_FLIGHT;
+    pool_sizes[2].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    pool_sizes[2].descriptorCount = FRAMES_IN_FLIGHT * MAX_TEXTURES;
+    pool_sizes[3].type = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+    pool_sizes[3].descriptorCount = FRAMES_IN_FLIGHT;
+    pool_sizes[4].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    pool_sizes[4].descriptorCount = FRAMES_IN_FLIGHT;
 
     VkDescriptorPoolCreateInfo create_info = {0};
     create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
     create_info.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT;
-    create_info.poolSizeCount = 1;
-    create_info.pPoolSizes = &pool_size;
+    create_info.poolSizeCount = sizeof(pool_sizes) / sizeof(pool_sizes[0]);
+    create_info.pPoolSizes = pool_sizes;
     create_info.maxSets = FRAMES_IN_FLIGHT * MAX_TEXTURES;
 
     PROPAGATE_VK(vkCreateDescriptorPool(glbl.device, &create_info, NULL, &glbl.descriptor_pool));
@@ -36,21 +44,53 @@ result create_descriptor_pool(void) {
 }
 
 result create_descriptor_layouts(void) {
+    VkDescriptorSetLayoutBinding bindings[TEXTURE_BINDING + 1] = {0};
+    VkDescriptorBindingFlags binding_flags[TEXTURE_BINDING + 1] = {0};
+    for (uint32_t stream = 0; stream < NUM_INSTANCE_STREAMS; ++stream) {
+	bindings[stream].binding = stream;
+	bindings[stream].descriptorCount = 1;
+	bindings[stream].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	bindings[stream].pImmutableSamplers = NULL;
+	bindings[stream].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    }
+
+    bindings[CAMERA_BINDING].binding = CAMERA_BINDING;
+    bindings[CAMERA_BINDING].descriptorCount = 1;
+    bindings[CAMERA_BINDING].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    bindings[CAMERA_BINDING].pImmutableSamplers = NULL;
+    bindings[CAMERA_BINDING].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_RAYGEN_BIT_KHR;
+
+    // Only written and used when ray tracing.
+    bindings[TLAS_BINDING].binding = TLAS_BINDING;
+    bindings[TLAS_BINDING].descriptorCount = 1;
+    bindings[TLAS_BINDING].descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+    bindings[TLAS_BINDING].pImmutableSamplers = NULL;
+    bindings[TLAS_BINDING].stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
+    binding_flags[TLAS_BINDING] = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT;
+
+    bindings[TRACE_IMAGE_BINDING].binding = TRACE_IMAGE_BINDING;
+    bindings[TRACE_IMAGE_BINDING].descriptorCount = 1;
+    bindings[TRACE_IMAGE_BINDING].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    bindings[TRACE_IMAGE_BINDING].pImmutableSamplers = NULL;
+    bindings[TRACE_IMAGE_BINDING].stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
+    binding_flags[TRACE_IMAGE_BINDING] = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT;
+
     VkDescriptorSetLayoutBinding sampler_layout_binding = {0};
-    sampler_layout_binding.binding = 0;
+    sampler_layout_binding.binding = TEXTURE_BINDING;
     sampler_layout_binding.descriptorCount = MAX_TEXTURES;
     sampler_layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
     sampler_layout_binding.pImmutableSamplers = NULL;
-    sampler_layout_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+    sampler_layout_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_INTERSECTION_BIT_KHR;
 
-    VkDescriptorSetLayoutBinding bindings[] = {sampler_layout_binding};
+    bindings[TEXTURE_BINDING] = sampler_layout_binding;
 
     VkDescriptorBindingFlags bindless_flags = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT | VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT_EXT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT;
+    binding_flags[TEXTURE_BINDING] = bindless_flags;
 
     VkDescriptorSetLayoutBindingFlagsCreateInfoEXT layout_binding_flags_create_info = {0};
     layout_binding_flags_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
-    layout_binding_flags_create_info.bindingCount = 1;
-    layout_binding_flags_create_info.pBindingFlags = &bindless_flags;
+    layout_binding_flags_create_info.bindingCount = sizeof(binding_flags) / sizeof(binding_flags[0]);
+    layout_binding_flags_create_info.pBindingFlags = binding_flags;
     
     VkDescriptorSetLayoutCreateInfo layout_create_info = {0};
     layout_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
@@ -116,31 +156,80 @@ result create_texture_singletons(void) {
 
     PROPAGATE_VK(vkCreateSampler(glbl.device, &create_info, NULL, &glbl.texture_sampler));
 
-    PROPAGATE(dynarray_create(sizeof(VkDeviceMemory), 1, &glbl.texture_memories));
     dynarray_create(sizeof(VkImage), 8, &glbl.texture_images);
     dynarray_create(sizeof(VkImageView), 8, &glbl.texture_image_views);
     dynarray_create(sizeof(VkExtent3D), 8, &glbl.texture_image_extents);
+    PROPAGATE(dynarray_create(sizeof(allocation), 8, &glbl.texture_allocations));
+
+    PROPAGATE(dynarray_create(sizeof(uint32_t), 64, &glbl.atlas_free_slots));
+    PROPAGATE(dynarray_create(sizeof(atlas_retiring_slot), 64, &glbl.atlas_retiring_slots));
     
     return SUCCESS;
 }
 
-result update_descriptors(uint32_t update_texture) {
+// Textures added together have consecutive IDs, so a batch is updated with a
+// single write covering a range of the texture array. Its image infos are
+// consecutive entries in the pending write infos.
+void mark_pending_descriptors(descriptor_mark* mark) {
+    for (uint32_t i = 0; i < FRAMES_IN_FLIGHT; ++i) {
+	mark->num_writes[i] = dynarray_len(&glbl.raster_pending_descriptor_writes[i]);
+	mark->num_write_infos[i] = dynarray_len(&glbl.raster_pending_descriptor_write_infos[i]);
+    }
+}
+
+void discard_pending_descriptors(const descriptor_mark* mark) {
+    for (uint32_t i = 0; i < FRAMES_IN_FLIGHT; ++i) {
+	glbl.raster_pending_descriptor_writes[i].size = mark->num_writes[i] * sizeof(VkWriteDescriptorSet);
+	glbl.raster_pending_descriptor_write_infos[i].size = mark->num_write_infos[i] * sizeof(descriptor_info);
+    }
+}
+
+result update_descriptors(uint32_t first_texture, uint32_t num_textures) {
+    for (uint32_t i = 0; i < FRAMES_IN_FLIGHT; ++i) {
+	for (uint32_t j = 0; j < num_textures; ++j) {
+	    PROPAGATE(dynarray_push(NULL, &glbl.raster_pending_descriptor_write_infos[i]));
+
+	    descriptor_info* write_info = dynarray_last(&glbl.raster_pending_descriptor_write_infos[i]);
+	    write_info->image_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	    write_info->image_info.imageView = INDEX(first_texture + j, glbl.texture_image_views, VkImageView);
+	    write_info->image_info.sampler = glbl.texture_sampler;
+	}
+	PROPAGATE(dynarray_push(NULL, &glbl.raster_pending_descriptor_writes[i]));
+
+	VkWriteDescriptorSet* write = dynarray_last(&glbl.raster_pending_descriptor_writes[i]);
+
+	write->sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	write->pNext = NULL;
+	write->dstSet = glbl.raster_descriptor_sets[i];
+	write->dstBinding = TEXTURE_BINDING;
+	write->dstArrayElement = first_texture;
+	write->descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	write->descriptorCount = num_textures;
+	write->pImageInfo = NULL;
+	write->pBufferInfo = NULL;
+	write->pTexelBufferView = NULL;
+    }
+
+    return SUCCESS;
+}
+
+result update_atlas_descriptors(uint32_t atlas) {
     for (uint32_t i = 0; i < FRAMES_IN_FLIGHT; ++i) {
 	PROPAGATE(dynarray_push(NULL, &glbl.raster_pending_descriptor_write_infos[i]));
 	PROPAGATE(dynarray_push(NULL, &glbl.raster_pending_descriptor_writes[i]));
 
 	descriptor_info* write_info = dynarray_last(&glbl.raster_pending_descriptor_write_infos[i]);
 	VkWriteDescriptorSet* write = dynarray_last(&glbl.raster_pending_descriptor_writes[i]);
-	
-	write_info->image_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-	write_info->image_info.imageView = INDEX(update_texture, glbl.texture_image_views, VkImageView);
+
+	write_info->image_info.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+	write_info->image_info.imageView = glbl.atlas_image_views[atlas];
 	write_info->image_info.sampler = glbl.texture_sampler;
 
 	write->sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 	write->pNext = NULL;
 	write->dstSet = glbl.raster_descriptor_sets[i];
-	write->dstBinding = 0;
-	write->dstArrayElement = update_texture;
+	write->dstBinding = TEXTURE_BINDING;
+	write->dstArrayElement = ATLAS_TEXTURE_BIT + atlas;
 	write->descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
 	write->descriptorCount = 1;
 	write->pImageInfo = NULL;
@@ -150,3 +239,110 @@ result update_descriptors(uint32_t update_texture) {
 
     return SUCCESS;
 }
+
+// Each frame's descriptor set points at that frame's instance buffer.
+result update_instance_descriptors(uint32_t stream, uint32_t frame) {
+    PROPAGATE(dynarray_push(NULL, &glbl.raster_pending_descriptor_write_infos[frame]));
+    PROPAGATE(dynarray_push(NULL, &glbl.raster_pending_descriptor_writes[frame]));
+
+    descriptor_info* write_info = dynarray_last(&glbl.raster_pending_descriptor_write_infos[frame]);
+    VkWriteDescriptorSet* write = dynarray_last(&glbl.raster_pending_descriptor_writes[frame]);
+
+    write_info->buffer_info.buffer = glbl.instance_streams[stream].buffers[frame];
+    write_info->buffer_info.offset = 0;
+    write_info->buffer_info.range = VK_WHOLE_SIZE;
+
+    write->sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write->pNext = NULL;
+    write->dstSet = glbl.raster_descriptor_sets[frame];
+    write->dstBinding = stream;
+    write->dstArrayElement = 0;
+    write->descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    write->descriptorCount = 1;
+    write->pImageInfo = NULL;
+    write->pBufferInfo = NULL;
+    write->pTexelBufferView = NULL;
+
+    return SUCCESS;
+}
+
+result update_camera_descriptors(void) {
+    for (uint32_t i = 0; i < FRAMES_IN_FLIGHT; ++i) {
+	PROPAGATE(dynarray_push(NULL, &glbl.raster_pending_descriptor_write_infos[i]));
+	PROPAGATE(dynarray_push(NULL, &glbl.raster_pending_descriptor_writes[i]));
+
+	descriptor_info* write_info = dynarray_last(&glbl.raster_pending_descriptor_write_infos[i]);
+	VkWriteDescriptorSet* write = dynarray_last(&glbl.raster_pending_descriptor_writes[i]);
+
+	write_info->buffer_info.buffer = glbl.camera_buffers[i];
+	write_info->buffer_info.offset = 0;
+	write_info->buffer_info.range = CAMERA_UNIFORM_SIZE;
+
+	write->sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	write->pNext = NULL;
+	write->dstSet = glbl.raster_descriptor_sets[i];
+	write->dstBinding = CAMERA_BINDING;
+	write->dstArrayElement = 0;
+	write->descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	write->descriptorCount = 1;
+	write->pImageInfo = NULL;
+	write->pBufferInfo = NULL;
+	write->pTexelBufferView = NULL;
+    }
+
+    return SUCCESS;
+}
+
+// Acceleration structure descriptors are passed in the write's pNext, which
+// points at the frame's persistent info, so the write consumes a write info
+// it doesn't use.
+result update_tlas_descriptors(uint32_t frame) {
+    PROPAGATE(dynarray_push(NULL, &glbl.raster_pending_descriptor_write_infos[frame]));
+    PROPAGATE(dynarray_push(NULL, &glbl.raster_pending_descriptor_writes[frame]));
+
+    VkWriteDescriptorSetAccelerationStructureKHR* acceleration_structure_info = &glbl.tlas_descriptor_infos[frame];
+    VkWriteDescriptorSet* write = dynarray_last(&glbl.raster_pending_descriptor_writes[frame]);
+
+    acceleration_structure_info->sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR;
+    acceleration_structure_info->pNext = NULL;
+    acceleration_structure_info->accelerationStructureCount = 1;
+    acceleration_structure_info->pAccelerationStructures = &glbl.tlas[frame];
+
+    write->sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write->pNext = acceleration_structure_info;
+    write->dstSet = glbl.raster_descriptor_sets[frame];
+    write->dstBinding = TLAS_BINDING;
+    write->dstArrayElement = 0;
+    write->descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+    write->descriptorCount = 1;
+    write->pImageInfo = NULL;
+    write->pBufferInfo = NULL;
+    write->pTexelBufferView = NULL;
+
+    return SUCCESS;
+}
+
+result update_trace_image_descriptors(uint32_t frame) {
+    PROPAGATE(dynarray_push(NULL, &glbl.raster_pending_descriptor_write_infos[frame]));
+    PROPAGATE(dynarray_push(NULL, &glbl.raster_pending_descriptor_writes[frame]));
+
+    descriptor_info* write_info = dynarray_last(&glbl.raster_pending_descriptor_write_infos[frame]);
+    VkWriteDescriptorSet* write = dynarray_last(&glbl.raster_pending_descriptor_writes[frame]);
+
+    write_info->image_info.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    write_info->image_info.imageView = glbl.trace_image_views[frame];
+    write_info->image_info.sampler = VK_NULL_HANDLE;
+
+    write->sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write->pNext = NULL;
+    write->dstSet = glbl.raster_descriptor_sets[frame];
+    write->dstBinding = TRACE_IMAGE_BINDING;
+    write->dstArrayElement = 0;
+    write->descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    write->descriptorCount = 1;
+    write->pImageInfo = NULL;
+    write->pBufferInfo = NULL;
+    write->pTexelBufferView = NULL;
+
+    return SUCCESS;
+}
@@ -22,6 +22,8 @@ static const char* validation_layers[] = {
     "VK_LAYER_KHRONOS_validation"
 };
 
+// Only the swapchain extension is skipped by headless renderers, so it has
+// to stay first.
 static const char* device_extensions[] = {
     "VK_KHR_swapchain",
     "VK_KHR_ray_tracing_pipeline",
@@ -46,11 +48,14 @@ result create_instance(void) {
     create_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
     create_info.pApplicationInfo = &app_info;
     
-    uint32_t glfw_extension_count = 0;
-    const char** glfw_extensions;
-    glfw_extensions = glfwGetRequiredInstanceExtensions(&glfw_extension_count);
-    create_info.enabledExtensionCount = glfw_extension_count;
-    create_info.ppEnabledExtensionNames = glfw_extensions;
+    // Headless renderers don't present, so need no surface extensions.
+    if (!glbl.headless) {
+	uint32_t glfw_extension_count = 0;
+	const char** glfw_extensions;
+	glfw_extensions = glfwGetRequiredInstanceExtensions(&glfw_extension_count);
+	create_info.enabledExtensionCount = glfw_extension_count;
+	create_info.ppEnabledExtensionNames = glfw_extensions;
+    }
     
 #ifndef RELEASE
     create_info.enabledLayerCount = sizeof(validation_layers) / sizeof(validation_layers[0]);
@@ -143,10 +148,12 @@ int32_t physical_score(VkPhysicalDevice physical) {
 	return -1;
     }
 
-    swapchain_support support;
-    result support_check = physical_check_swapchain_support(physical, &support);
-    if (!IS_SUCCESS(support_check) || support.num_formats == 0 || support.num_present_modes == 0) {
-	return -1;
+    if (!glbl.headless) {
+	swapchain_support support;
+	result support_check = physical_check_swapchain_support(physical, &support);
+	if (!IS_SUCCESS(support_check) || support.num_formats == 0 || support.num_present_modes == 0) {
+	    return -1;
+	}
     }
 
     result features_check = physical_check_features_support(physical);
@@ -171,8 +178,10 @@ result physical_check_queue_family(VkPhysicalDevice physical, uint32_t* queue_fa
 
     for (uint32_t queue_family_index = 0; queue_family_index < queue_family_count; ++queue_family_index) {
 	if ((possible[queue_family_index].queueFlags & bits) == bits) {
-	    VkBool32 present_support = VK_FALSE;
-	    vkGetPhysicalDeviceSurfaceSupportKHR(physical, queue_family_index, glbl.surface, &present_support);
+	    VkBool32 present_support = glbl.headless;
+	    if (!glbl.headless) {
+		vkGetPhysicalDeviceSurfaceSupportKHR(physical, queue_family_index, glbl.surface, &present_support);
+	    }
 	    if (present_support == VK_TRUE) {
 		if (queue_family) *queue_family = queue_family_index;
 		return SUCCESS;
@@ -183,6 +192,27 @@ result physical_check_queue_family(VkPhysicalDevice physical, uint32_t* queue_fa
     return CUSTOM_ERROR;
 }
 
+// Finds a queue family that supports transfers, but not graphics or compute.
+// These usually map to dedicated copy engines.
+result physical_find_transfer_queue_family(VkPhysicalDevice physical, uint32_t* queue_family) {
+    uint32_t queue_family_count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physical, &queue_family_count, NULL);
+
+    VkQueueFamilyProperties possible[MAX_VK_ENUMERATIONS];
+    queue_family_count = queue_family_count < MAX_VK_ENUMERATIONS ? queue_family_count : MAX_VK_ENUMERATIONS;
+    vkGetPhysicalDeviceQueueFamilyProperties(physical, &queue_family_count, possible);
+
+    for (uint32_t queue_family_index = 0; queue_family_index < queue_family_count; ++queue_family_index) {
+	VkQueueFlags flags = possible[queue_family_index].queueFlags;
+	if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+	    *queue_family = queue_family_index;
+	    return SUCCESS;
+	}
+    }
+
+    return CUSTOM_ERROR;
+}
+
 result physical_check_extensions(VkPhysicalDevice physical) {
     uint32_t extension_count = 0;
     vkEnumerateDeviceExtensionProperties(physical, NULL, &extension_count, NULL);
@@ -191,7 +221,7 @@ result physical_check_extensions(VkPhysicalDevice physical) {
     vkEnumerateDeviceExtensionProperties(physical, NULL, &extension_count, available_extensions);
 
     uint32_t required_extension_index;
-    for (required_extension_index = 0; required_extension_index < sizeof(device_extensions) / sizeof(device_extensions[0]); ++required_extension_index) {
+    for (required_extension_index = glbl.headless ? 1 : 0; required_extension_index < sizeof(device_extensions) / sizeof(device_extensions[0]); ++required_extension_index) {
 	uint32_t available_extension_index;
 	for (available_extension_index = 0; available_extension_index < extension_count; ++available_extension_index) {
 	    if (!strcmp(available_extensions[available_extension_index].extensionName, device_extensions[required_extension_index])) {
@@ -228,8 +258,12 @@ result physical_check_swapchain_support(VkPhysicalDevice physical, swapchain_sup
 }
 
 result physical_check_features_support(VkPhysicalDevice physical) {
+    VkPhysicalDeviceTimelineSemaphoreFeatures timeline_semaphore_features = {0};
+    timeline_semaphore_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+
     VkPhysicalDeviceBufferDeviceAddressFeatures buffer_device_address_features = {0};
     buffer_device_address_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES;
+    buffer_device_address_features.pNext = &timeline_semaphore_features;
 
     VkPhysicalDeviceAccelerationStructureFeaturesKHR acceleration_features = {0};
     acceleration_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR;
@@ -249,9 +283,11 @@ result physical_check_features_support(VkPhysicalDevice physical) {
     
     vkGetPhysicalDeviceFeatures2(physical, &device_features);
     
-    if (buffer_device_address_features.bufferDeviceAddress &&
+    if (timeline_semaphore_features.timelineSemaphore &&
+	buffer_device_address_features.bufferDeviceAddress &&
 	indexing_features.descriptorBindingPartiallyBound &&
 	indexing_features.runtimeDescriptorArray &&
+	indexing_features.shaderSampledImageArrayNonUniformIndexing &&
 	ray_tracing_features.rayTracingPipeline &&
 	acceleration_features.accelerationStructure &&
 	acceleration_features.descriptorBindingAccelerationStructureUpdateAfterBind
@@ -262,20 +298,36 @@ result physical_check_features_support(VkPhysicalDevice physical) {
 }
 
 result create_device(void) {
-    uint32_t queue_family;
-    PROPAGATE(physical_check_queue_family(glbl.physical, &queue_family, VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT));
+    PROPAGATE(physical_check_queue_family(glbl.physical, &glbl.queue_family, VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT));
+
+    // Uploads go through a transfer only queue family when the device has one,
+    // and through the graphics queue otherwise.
+    uint32_t num_queue_families = 1;
+    if (IS_SUCCESS(physical_find_transfer_queue_family(glbl.physical, &glbl.transfer_queue_family))) {
+	num_queue_families = 2;
+    }
+    else {
+	glbl.transfer_queue_family = glbl.queue_family;
+    }
 
     float queue_priority = 1.0f;
 
-    VkDeviceQueueCreateInfo queue_create_info = {0};
-    queue_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    queue_create_info.queueFamilyIndex = queue_family;
-    queue_create_info.queueCount = 1;
-    queue_create_info.pQueuePriorities = &queue_priority;
+    VkDeviceQueueCreateInfo queue_create_infos[2] = {0};
+    queue_create_infos[0].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queue_create_infos[0].queueFamilyIndex = glbl.queue_family;
+    queue_create_infos[0].queueCount = 1;
+    queue_create_infos[0].pQueuePriorities = &queue_priority;
+    queue_create_infos[1] = queue_create_infos[0];
+    queue_create_infos[1].queueFamilyIndex = glbl.transfer_queue_family;
+
+    VkPhysicalDeviceTimelineSemaphoreFeatures timeline_semaphore_features = {0};
+    timeline_semaphore_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+    timeline_semaphore_features.timelineSemaphore = VK_TRUE;
 
     VkPhysicalDeviceBufferDeviceAddressFeatures buffer_device_address_features = {0};
     buffer_device_address_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES;
     buffer_device_address_features.bufferDeviceAddress = VK_TRUE; 
+    buffer_device_address_features.pNext = &timeline_semaphore_features;
 
     VkPhysicalDeviceAccelerationStructureFeaturesKHR acceleration_features = {0};
     acceleration_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR;
@@ -292,6 +344,7 @@ result create_device(void) {
     indexing_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES;
     indexing_features.descriptorBindingPartiallyBound = VK_TRUE;
     indexing_features.runtimeDescriptorArray = VK_TRUE;
+    indexing_features.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
     indexing_features.pNext = &ray_tracing_features;
 
     VkPhysicalDeviceFeatures2 device_features = {0};
@@ -299,17 +352,21 @@ result create_device(void) {
     device_features.pNext = &indexing_features;
 
     vkGetPhysicalDeviceFeatures2(glbl.physical, &device_features);
+    // Every supported feature is enabled, but pipeline statistics are
+    // optional, so profiling checks whether they are.
+    glbl.pipeline_statistics_supported = device_features.features.pipelineStatisticsQuery;
 
     VkDeviceCreateInfo device_create_info = {0};
     device_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-    device_create_info.queueCreateInfoCount = 1;
-    device_create_info.pQueueCreateInfos = &queue_create_info;
+    device_create_info.queueCreateInfoCount = num_queue_families;
+    device_create_info.pQueueCreateInfos = queue_create_infos;
     device_create_info.pNext = &device_features;
-    device_create_info.enabledExtensionCount = sizeof(device_extensions) / sizeof(device_extensions[0]);
-    device_create_info.ppEnabledExtensionNames = device_extensions;
+    device_create_info.enabledExtensionCount = sizeof(device_extensions) / sizeof(device_extensions[0]) - (glbl.headless ? 1 : 0);
+    device_create_info.ppEnabledExtensionNames = device_extensions + (glbl.headless ? 1 : 0);
 
     PROPAGATE_VK(vkCreateDevice(glbl.physical, &device_create_info, NULL, &glbl.device));
-    vkGetDeviceQueue(glbl.device, queue_family, 0, &glbl.queue);
+    vkGetDeviceQueue(glbl.device, glbl.queue_family, 0, &glbl.queue);
+    vkGetDeviceQueue(glbl.device, glbl.transfer_queue_family, 0, &glbl.transfer_queue);
     
     return SUCCESS;
 }
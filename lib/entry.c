@@ -23,6 +23,13 @@ PFN_vkGetAccelerationStructureBuildSizesKHR vkGetAccelerationStructureBuildSizes
 PFN_vkCreateAccelerationStructureKHR vkCreateAccelerationStructure;
 PFN_vkBuildAccelerationStructuresKHR vkBuildAccelerationStructures;
 PFN_vkCmdBuildAccelerationStructuresKHR vkCmdBuildAccelerationStructures;
+PFN_vkGetAccelerationStructureDeviceAddressKHR vkGetAccelerationStructureDeviceAddress;
+PFN_vkDestroyAccelerationStructureKHR vkDestroyAccelerationStructure;
+PFN_vkCreateRayTracingPipelinesKHR vkCreateRayTracingPipelines;
+PFN_vkGetRayTracingShaderGroupHandlesKHR vkGetRayTracingShaderGroupHandles;
+PFN_vkCmdTraceRaysKHR vkCmdTraceRays;
+PFN_vkCmdWriteAccelerationStructuresPropertiesKHR vkCmdWriteAccelerationStructuresProperties;
+PFN_vkCmdCopyAccelerationStructureKHR vkCmdCopyAccelerationStructure;
 
 static void glfw_framebuffer_resize_callback(__attribute__((unused)) GLFWwindow* window, __attribute__((unused)) int width, __attribute__((unused)) int height) {
     glbl.resized = 1;
@@ -51,25 +58,37 @@ static void glfw_key_callback(__attribute__((unused)) GLFWwindow* window, int ke
     }
 }
 
-uint64_t entry(void) {
-    result res = init();
+uint64_t entry(const init_info* init_info) {
+    result res = init(init_info);
     return ((uint64_t) res.vk << 32) | (uint64_t) res.custom;
 }
 
-result init(void) {
-    glfwInit();
-    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-    glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+result init(const init_info* init_info) {
+    glbl.headless = init_info->headless;
+    glbl.readback = init_info->headless && init_info->readback;
+    glbl.ray_trace = init_info->ray_trace;
 
-    glbl.window_width = 1000;
-    glbl.window_height = 1000;
-    glbl.window = glfwCreateWindow(glbl.window_width, glbl.window_height, "vtrace", NULL, NULL);
-    glfwSetFramebufferSizeCallback(glbl.window, glfw_framebuffer_resize_callback);
-    glfwSetKeyCallback(glbl.window, glfw_key_callback);
-    glfwSetInputMode(glbl.window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    if (glbl.headless) {
+	glbl.window_width = init_info->width;
+	glbl.window_height = init_info->height;
+    }
+    else {
+	glfwInit();
+	glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+	glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+
+	glbl.window_width = 1000;
+	glbl.window_height = 1000;
+	glbl.window = glfwCreateWindow(glbl.window_width, glbl.window_height, "vtrace", NULL, NULL);
+	glfwSetFramebufferSizeCallback(glbl.window, glfw_framebuffer_resize_callback);
+	glfwSetKeyCallback(glbl.window, glfw_key_callback);
+	glfwSetInputMode(glbl.window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    }
 
     PROPAGATE(create_instance());
-    PROPAGATE(create_surface());
+    if (!glbl.headless) {
+	PROPAGATE(create_surface());
+    }
     PROPAGATE(create_physical());
     PROPAGATE(create_device());
 
@@ -77,8 +96,20 @@ result init(void) {
     vkCreateAccelerationStructure = (PFN_vkCreateAccelerationStructureKHR) vkGetDeviceProcAddr(glbl.device, "vkCreateAccelerationStructureKHR");
     vkBuildAccelerationStructures = (PFN_vkBuildAccelerationStructuresKHR) vkGetDeviceProcAddr(glbl.device, "vkBuildAccelerationStructuresKHR");
     vkCmdBuildAccelerationStructures = (PFN_vkCmdBuildAccelerationStructuresKHR) vkGetDeviceProcAddr(glbl.device, "vkCmdBuildAccelerationStructuresKHR");
-
-    PROPAGATE(create_swapchain());
+    vkGetAccelerationStructureDeviceAddress = (PFN_vkGetAccelerationStructureDeviceAddressKHR) vkGetDeviceProcAddr(glbl.device, "vkGetAccelerationStructureDeviceAddressKHR");
+    vkDestroyAccelerationStructure = (PFN_vkDestroyAccelerationStructureKHR) vkGetDeviceProcAddr(glbl.device, "vkDestroyAccelerationStructureKHR");
+    vkCreateRayTracingPipelines = (PFN_vkCreateRayTracingPipelinesKHR) vkGetDeviceProcAddr(glbl.device, "vkCreateRayTracingPipelinesKHR");
+    vkGetRayTracingShaderGroupHandles = (PFN_vkGetRayTracingShaderGroupHandlesKHR) vkGetDeviceProcAddr(glbl.device, "vkGetRayTracingShaderGroupHandlesKHR");
+    vkCmdTraceRays = (PFN_vkCmdTraceRaysKHR) vkGetDeviceProcAddr(glbl.device, "vkCmdTraceRaysKHR");
+    vkCmdWriteAccelerationStructuresProperties = (PFN_vkCmdWriteAccelerationStructuresPropertiesKHR) vkGetDeviceProcAddr(glbl.device, "vkCmdWriteAccelerationStructuresPropertiesKHR");
+    vkCmdCopyAccelerationStructure = (PFN_vkCmdCopyAccelerationStructureKHR) vkGetDeviceProcAddr(glbl.device, "vkCmdCopyAccelerationStructureKHR");
+
+    if (glbl.headless) {
+	PROPAGATE(create_offscreen_targets());
+    }
+    else {
+	PROPAGATE(create_swapchain());
+    }
     PROPAGATE(create_descriptor_pool());
     PROPAGATE(create_descriptor_layouts());
     PROPAGATE(create_descriptor_sets());
@@ -87,12 +118,22 @@ result init(void) {
     PROPAGATE(create_framebuffers());
     PROPAGATE(create_command_pool());
     PROPAGATE(create_command_buffers());
+    PROPAGATE(create_secondary_queue());
     PROPAGATE(create_cube_buffer());
-    PROPAGATE(create_instance_buffer());
+    glbl.instance_streams[INSTANCE_STREAM_MODEL].stride = sizeof(float) * 4 * 4;
+    glbl.instance_streams[INSTANCE_STREAM_ALIGNED].stride = sizeof(uint32_t) * 4;
+    for (uint32_t stream = 0; stream < NUM_INSTANCE_STREAMS; ++stream) {
+	PROPAGATE(create_instance_buffer(stream));
+	for (uint32_t i = 0; i < FRAMES_IN_FLIGHT; ++i) {
+	    PROPAGATE(create_draw_list_buffer(stream, i, 1));
+	}
+    }
+    PROPAGATE(create_camera_buffers());
     PROPAGATE(create_ray_tracing_objects());
-    PROPAGATE(create_staging_texture_buffer());
+    PROPAGATE(create_staging_ring());
     PROPAGATE(create_texture_singletons());
     PROPAGATE(create_synchronization());
+    PROPAGATE(create_query_pools());
 
     return SUCCESS;
 }
@@ -101,23 +142,28 @@ void cleanup(void) {
     vkDeviceWaitIdle(glbl.device);
 
     cleanup_swapchain();
-    cleanup_instance_buffer();
-    cleanup_staging_texture_buffer();
+    for (uint32_t stream = 0; stream < NUM_INSTANCE_STREAMS; ++stream) {
+	cleanup_instance_buffer(stream);
+	for (uint32_t i = 0; i < FRAMES_IN_FLIGHT; ++i) {
+	    cleanup_draw_list_buffer(stream, i);
+	}
+    }
+    cleanup_camera_buffers();
+    cleanup_ray_tracing_objects();
+    cleanup_staging_ring();
     cleanup_texture_images();
 
-    for (uint32_t i = 0; i < dynarray_len(&glbl.texture_memories); ++i) {
-	vkFreeMemory(glbl.device, INDEX(i, glbl.texture_memories, VkDeviceMemory), NULL);
-    }
+    cleanup_allocator();
+    cleanup_query_pools();
 
     vkDestroySampler(glbl.device, glbl.texture_sampler, NULL);
 
     for (uint32_t i = 0; i < FRAMES_IN_FLIGHT; ++i) {
 	vkDestroySemaphore(glbl.device, glbl.image_available_semaphore[i], NULL);
 	vkDestroySemaphore(glbl.device, glbl.render_finished_semaphore[i], NULL);
-	vkDestroyFence(glbl.device, glbl.frame_in_flight_fence[i], NULL);
-	vkDestroySemaphore(glbl.device, glbl.secondary_finished_semaphore[i], NULL);
     }
-    vkDestroyFence(glbl.device, glbl.texture_upload_finished_fence, NULL);
+    vkDestroySemaphore(glbl.device, glbl.graphics_timeline, NULL);
+    vkDestroySemaphore(glbl.device, glbl.transfer_timeline, NULL);
 
     vkDestroyBuffer(glbl.device, glbl.cube_vertex_buffer, NULL);
     vkDestroyBuffer(glbl.device, glbl.cube_index_buffer, NULL);
@@ -127,8 +173,12 @@ void cleanup(void) {
     vkFreeMemory(glbl.device, glbl.staging_cube_memory, NULL);
  
     vkDestroyCommandPool(glbl.device, glbl.command_pool, NULL);
+    vkDestroyCommandPool(glbl.device, glbl.transfer_command_pool, NULL);
+    cleanup_secondary_queue();
      
-    vkDestroyPipeline(glbl.device, glbl.raster_pipeline, NULL);
+    for (uint32_t stream = 0; stream < NUM_INSTANCE_STREAMS; ++stream) {
+	vkDestroyPipeline(glbl.device, glbl.raster_pipelines[stream], NULL);
+    }
     vkDestroyPipelineLayout(glbl.device, glbl.raster_pipeline_layout, NULL);
     vkDestroyDescriptorPool(glbl.device, glbl.descriptor_pool, NULL);
     vkDestroyDescriptorSetLayout(glbl.device, glbl.raster_descriptor_set_layout, NULL);
@@ -136,11 +186,15 @@ void cleanup(void) {
     vkDestroyRenderPass(glbl.device, glbl.render_pass, NULL);
 
     vkDestroyDevice(glbl.device, NULL);
-    vkDestroySurfaceKHR(glbl.instance, glbl.surface, NULL);
+    if (!glbl.headless) {
+	vkDestroySurfaceKHR(glbl.instance, glbl.surface, NULL);
+    }
     vkDestroyInstance(glbl.instance, NULL);
     
-    glfwDestroyWindow(glbl.window);
-    glfwTerminate();
+    if (!glbl.headless) {
+	glfwDestroyWindow(glbl.window);
+	glfwTerminate();
+    }
 }
 
 user_input* get_input_data_pointer(void) {
@@ -148,79 +202,208 @@ user_input* get_input_data_pointer(void) {
 }
 
 int32_t render_tick(int32_t* window_width, int32_t* window_height, const render_tick_info* render_tick_info) {
-    if (glfwWindowShouldClose(glbl.window)) {
-	return -1;
-    }
+    // Headless renderers have no window, so their input stays zeroed.
+    if (!glbl.headless) {
+	if (glfwWindowShouldClose(glbl.window)) {
+	    return -1;
+	}
 
-    glfwPollEvents();
+	glfwPollEvents();
 
-    glbl.user_input.last_mouse_x = glbl.user_input.mouse_x;
-    glbl.user_input.last_mouse_y = glbl.user_input.mouse_y;
-    glfwGetCursorPos(glbl.window, &glbl.user_input.mouse_x, &glbl.user_input.mouse_y);
-    if (glbl.num_frames_elapsed == 0) {
 	glbl.user_input.last_mouse_x = glbl.user_input.mouse_x;
 	glbl.user_input.last_mouse_y = glbl.user_input.mouse_y;
+	glfwGetCursorPos(glbl.window, &glbl.user_input.mouse_x, &glbl.user_input.mouse_y);
+	if (glbl.num_frames_elapsed == 0) {
+	    glbl.user_input.last_mouse_x = glbl.user_input.mouse_x;
+	    glbl.user_input.last_mouse_y = glbl.user_input.mouse_y;
+	}
     }
-    
-    vkWaitForFences(glbl.device, 1, &glbl.frame_in_flight_fence[glbl.current_frame], VK_TRUE, UINT64_MAX);
 
-    uint32_t image_index;
-    VkResult acquire_image_result = vkAcquireNextImageKHR(glbl.device, glbl.swapchain, UINT64_MAX, glbl.image_available_semaphore[glbl.current_frame], VK_NULL_HANDLE, &image_index);
-    if (acquire_image_result == VK_ERROR_OUT_OF_DATE_KHR) {
-	PROPAGATE_C(recreate_swapchain());
-	return 0;
-    } else if (acquire_image_result != VK_SUCCESS && acquire_image_result != VK_SUBOPTIMAL_KHR) {
+    // The frame's readback buffer and frame number are overwritten below, so
+    // whatever is still in them would be silently lost.
+    if (glbl.readback && glbl.readback_frames[glbl.current_frame]) {
+	fprintf(stderr, "ERROR: Tried rendering over frame %llu, which hasn't been read back\n", (unsigned long long) glbl.readback_frames[glbl.current_frame]);
 	return -1;
     }
+    
+    PROFILE_ZONE_BEGIN("wait_frame");
+    PROPAGATE_C(wait_timeline(glbl.graphics_timeline, glbl.frame_timeline_values[glbl.current_frame]));
+    PROFILE_ZONE_END();
+    retire_staging_ring();
+    PROPAGATE_C(retire_atlas_slots());
+    PROPAGATE_C(read_gpu_timings(glbl.current_frame));
+    PROPAGATE_C(sync_instance_buffers(glbl.current_frame));
+    PROPAGATE_C(sync_draw_lists(glbl.current_frame));
+    PROPAGATE_C(update_tlas(glbl.current_frame));
+
+    // Each frame in flight owns one offscreen image, and the wait above means
+    // the previous frame that used it has finished.
+    uint32_t image_index = glbl.current_frame;
+    if (!glbl.headless) {
+	VkResult acquire_image_result = vkAcquireNextImageKHR(glbl.device, glbl.swapchain, UINT64_MAX, glbl.image_available_semaphore[glbl.current_frame], VK_NULL_HANDLE, &image_index);
+	if (acquire_image_result == VK_ERROR_OUT_OF_DATE_KHR) {
+	    PROPAGATE_C(recreate_swapchain());
+	    return 0;
+	} else if (acquire_image_result != VK_SUCCESS && acquire_image_result != VK_SUBOPTIMAL_KHR) {
+	    return -1;
+	}
+    }
 
     if (dynarray_len(&glbl.raster_pending_descriptor_writes[glbl.current_frame]) > 0) {
+	// Each write consumes descriptorCount consecutive write infos.
+	uint32_t info_index = 0;
 	for (uint32_t i = 0; i < dynarray_len(&glbl.raster_pending_descriptor_writes[glbl.current_frame]); ++i) {
-	    INDEX(i, glbl.raster_pending_descriptor_writes[glbl.current_frame], VkWriteDescriptorSet).pImageInfo = &INDEX(i, glbl.raster_pending_descriptor_write_infos[glbl.current_frame], descriptor_info).image_info;
+	    VkWriteDescriptorSet* write = &INDEX(i, glbl.raster_pending_descriptor_writes[glbl.current_frame], VkWriteDescriptorSet);
+	    descriptor_info* write_info = &INDEX(info_index, glbl.raster_pending_descriptor_write_infos[glbl.current_frame], descriptor_info);
+	    info_index += write->descriptorCount;
+	    if (write->descriptorType == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER || write->descriptorType == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
+		write->pBufferInfo = &write_info->buffer_info;
+	    }
+	    else if (write->descriptorType != VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR) {
+		write->pImageInfo = &write_info->image_info;
+	    }
 	}
 	vkUpdateDescriptorSets(glbl.device, dynarray_len(&glbl.raster_pending_descriptor_writes[glbl.current_frame]), glbl.raster_pending_descriptor_writes[glbl.current_frame].data, 0, NULL);
 	dynarray_clear(&glbl.raster_pending_descriptor_writes[glbl.current_frame]);
 	dynarray_clear(&glbl.raster_pending_descriptor_write_infos[glbl.current_frame]);
     }
 
-    vkResetFences(glbl.device, 1, &glbl.frame_in_flight_fence[glbl.current_frame]);
+    // The last frame to read this frame's camera buffer has finished, since its
+    // timeline value was waited on above.
+    memcpy(glbl.camera_data[glbl.current_frame], render_tick_info->camera_uniform, CAMERA_UNIFORM_SIZE);
+
     vkResetCommandBuffer(glbl.raster_command_buffers[glbl.current_frame], 0);
     vkResetCommandBuffer(glbl.secondary_command_buffers[glbl.current_frame], 0);
+    PROFILE_ZONE_BEGIN("record_raster_command_buffer");
     PROPAGATE_C(record_raster_command_buffer(glbl.raster_command_buffers[glbl.current_frame], image_index, render_tick_info));
+    PROFILE_ZONE_END();
+
+    // The secondary submission signals the first of this frame's graphics
+    // timeline values and the raster submission the second, so the values
+    // are known before anything is submitted.
+    uint64_t secondary_value = glbl.graphics_timeline_value + 1;
+    uint64_t raster_value = glbl.graphics_timeline_value + TIMELINE_VALUES_PER_FRAME;
 
-    VkPipelineStageFlags wait_stages[2] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT};
-    VkSemaphore wait_semaphores[2] = {glbl.image_available_semaphore[glbl.current_frame], glbl.secondary_finished_semaphore[glbl.current_frame]};
+    // Ray traced frames first write the swapchain image with a blit.
+    VkPipelineStageFlags wait_stages[2] = {glbl.ray_trace ? VK_PIPELINE_STAGE_TRANSFER_BIT : VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT};
+    VkSemaphore wait_semaphores[2] = {glbl.image_available_semaphore[glbl.current_frame], glbl.graphics_timeline};
+    uint64_t wait_values[2] = {0, secondary_value};
 
     uint32_t did_secondary = 0;
-    if (glbl.secondary_queue_size[glbl.secondary_queue_index] > 0) {
+    dynarray* secondary_commands = take_secondary_commands();
+    if (secondary_commands) {
+	// Uploads go to the transfer queue, so they can overlap with the frame
+	// the graphics queue is still rendering. The rest of the secondary
+	// commands wait for them, and acquire what they released.
+	secondary_command* commands = secondary_commands->data;
+	uint32_t num_commands = dynarray_len(secondary_commands);
+	uint32_t num_transfer_commands = partition_transfer_commands(num_commands, commands);
+	VkPipelineStageFlags transfer_wait_stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+	if (num_transfer_commands > 0) {
+	    vkResetCommandBuffer(glbl.transfer_command_buffers[glbl.current_frame], 0);
+	    PROFILE_ZONE_BEGIN("record_secondary_command_buffer");
+	    PROPAGATE_C(record_secondary_command_buffer(glbl.transfer_command_buffers[glbl.current_frame], num_transfer_commands, commands, 1));
+	    PROFILE_ZONE_END();
+
+	    ++glbl.transfer_timeline_value;
+	    VkTimelineSemaphoreSubmitInfo transfer_timeline_info = {0};
+	    transfer_timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+	    transfer_timeline_info.signalSemaphoreValueCount = 1;
+	    transfer_timeline_info.pSignalSemaphoreValues = &glbl.transfer_timeline_value;
+
+	    VkSubmitInfo transfer_submit_info = {0};
+	    transfer_submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	    transfer_submit_info.pNext = &transfer_timeline_info;
+	    transfer_submit_info.commandBufferCount = 1;
+	    transfer_submit_info.pCommandBuffers = &glbl.transfer_command_buffers[glbl.current_frame];
+	    transfer_submit_info.signalSemaphoreCount = 1;
+	    transfer_submit_info.pSignalSemaphores = &glbl.transfer_timeline;
+
+	    PROFILE_ZONE_BEGIN("vkQueueSubmit");
+	    PROPAGATE_VK_C(vkQueueSubmit(glbl.transfer_queue, 1, &transfer_submit_info, VK_NULL_HANDLE));
+	    PROFILE_ZONE_END();
+	}
+
         vkResetCommandBuffer(glbl.secondary_command_buffers[glbl.current_frame], 0);
-	PROPAGATE_C(record_secondary_command_buffer(glbl.secondary_command_buffers[glbl.current_frame], glbl.secondary_queue_size[glbl.secondary_queue_index], glbl.secondary_queue[glbl.secondary_queue_index]));
+	PROFILE_ZONE_BEGIN("record_secondary_command_buffer");
+	PROPAGATE_C(record_secondary_command_buffer(glbl.secondary_command_buffers[glbl.current_frame], num_commands - num_transfer_commands, commands + num_transfer_commands, 0));
+	PROFILE_ZONE_END();
+	dynarray_clear(secondary_commands);
+
+	VkTimelineSemaphoreSubmitInfo timeline_info = {0};
+	timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+	timeline_info.signalSemaphoreValueCount = 1;
+	timeline_info.pSignalSemaphoreValues = &secondary_value;
 
 	VkSubmitInfo submit_info = {0};
 	submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submit_info.pNext = &timeline_info;
+	if (num_transfer_commands > 0) {
+	    timeline_info.waitSemaphoreValueCount = 1;
+	    timeline_info.pWaitSemaphoreValues = &glbl.transfer_timeline_value;
+	    submit_info.waitSemaphoreCount = 1;
+	    submit_info.pWaitSemaphores = &glbl.transfer_timeline;
+	    submit_info.pWaitDstStageMask = &transfer_wait_stage;
+	}
 	submit_info.commandBufferCount = 1;
 	submit_info.pCommandBuffers = &glbl.secondary_command_buffers[glbl.current_frame];
 	submit_info.signalSemaphoreCount = 1;
-	submit_info.pSignalSemaphores = &glbl.secondary_finished_semaphore[glbl.current_frame];
+	submit_info.pSignalSemaphores = &glbl.graphics_timeline;
 
-	PROPAGATE_VK_C(vkQueueSubmit(glbl.queue, 1, &submit_info, glbl.secondary_finished_fence));
+	PROFILE_ZONE_BEGIN("vkQueueSubmit");
+	PROPAGATE_VK_C(vkQueueSubmit(glbl.queue, 1, &submit_info, VK_NULL_HANDLE));
+	PROFILE_ZONE_END();
 
-	glbl.secondary_queue_size[glbl.secondary_queue_index] = 0;
-	glbl.secondary_finished_fence = VK_NULL_HANDLE;
-	glbl.secondary_queue_index = (glbl.secondary_queue_index + 1) % COMMAND_QUEUE_DEPTH;
+	PROPAGATE_C(submit_staging_ring(secondary_value));
 	did_secondary = 1;
     }
 
+    // The raster submission waits on the whole secondary submission rather
+    // than just the stages that read its uploads, so reaching raster_value
+    // means everything this frame submitted has finished.
+    // The render finished semaphore is binary, so its value is ignored.
+    // Headless frames have no image to acquire or present, so only the
+    // timeline is waited on and signaled.
+    uint32_t first_wait = glbl.headless ? 1 : 0;
+    uint32_t num_waits = (glbl.headless ? 0 : 1) + did_secondary;
+    uint32_t num_signals = glbl.headless ? 1 : 2;
+    VkSemaphore signal_semaphores[2] = {glbl.graphics_timeline, glbl.render_finished_semaphore[glbl.current_frame]};
+    uint64_t signal_values[2] = {raster_value, 0};
+    VkTimelineSemaphoreSubmitInfo timeline_info = {0};
+    timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timeline_info.waitSemaphoreValueCount = num_waits;
+    timeline_info.pWaitSemaphoreValues = wait_values + first_wait;
+    timeline_info.signalSemaphoreValueCount = num_signals;
+    timeline_info.pSignalSemaphoreValues = signal_values;
+
     VkSubmitInfo submit_info = {0};
     submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submit_info.waitSemaphoreCount = did_secondary ? 2 : 1;
-    submit_info.pWaitSemaphores = wait_semaphores;
-    submit_info.pWaitDstStageMask = wait_stages;
-    submit_info.signalSemaphoreCount = 1;
-    submit_info.pSignalSemaphores = &glbl.render_finished_semaphore[glbl.current_frame];
+    submit_info.pNext = &timeline_info;
+    submit_info.waitSemaphoreCount = num_waits;
+    submit_info.pWaitSemaphores = wait_semaphores + first_wait;
+    submit_info.pWaitDstStageMask = wait_stages + first_wait;
+    submit_info.signalSemaphoreCount = num_signals;
+    submit_info.pSignalSemaphores = signal_semaphores;
     submit_info.commandBufferCount = 1;
     submit_info.pCommandBuffers = &glbl.raster_command_buffers[glbl.current_frame];
 
-    PROPAGATE_VK_C(vkQueueSubmit(glbl.queue, 1, &submit_info, glbl.frame_in_flight_fence[glbl.current_frame]));
+    PROFILE_ZONE_BEGIN("vkQueueSubmit");
+    PROPAGATE_VK_C(vkQueueSubmit(glbl.queue, 1, &submit_info, VK_NULL_HANDLE));
+    PROFILE_ZONE_END();
+    glbl.frame_timeline_values[glbl.current_frame] = raster_value;
+    glbl.graphics_timeline_value = raster_value;
+
+    if (glbl.headless) {
+	if (glbl.readback) {
+	    glbl.readback_frames[glbl.current_frame] = glbl.num_frames_elapsed + 1;
+	}
+	glbl.current_frame = (glbl.current_frame + 1) % FRAMES_IN_FLIGHT;
+	++glbl.num_frames_elapsed;
+	*window_width = glbl.window_width;
+	*window_height = glbl.window_height;
+
+	return 0;
+    }
 
     VkPresentInfoKHR present_info = {0};
     present_info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -230,7 +413,9 @@ int32_t render_tick(int32_t* window_width, int32_t* window_height, const render_
     present_info.pSwapchains = &glbl.swapchain;
     present_info.pImageIndices = &image_index;
 
+    PROFILE_ZONE_BEGIN("vkQueuePresentKHR");
     VkResult queue_present_result = vkQueuePresentKHR(glbl.queue, &present_info);
+    PROFILE_ZONE_END();
 
     if (queue_present_result == VK_ERROR_OUT_OF_DATE_KHR || queue_present_result == VK_SUBOPTIMAL_KHR || glbl.resized) {
 	glbl.resized = 0;
@@ -100,7 +100,11 @@ result create_buffer_memory(VkMemoryPropertyFlags properties, VkMemoryAllocateFl
     return SUCCESS;
 }
 
-result create_image(VkImageCreateFlags flags, VkFormat format, VkExtent3D extent, uint32_t mipLevels, uint32_t arrayLevels, VkImageUsageFlagBits usage, VkImage* image) {
+// Concurrent images are shared by the graphics and transfer queues. They're
+// exclusive when both are the same queue family.
+result create_image(VkImageCreateFlags flags, VkFormat format, VkExtent3D extent, uint32_t mipLevels, uint32_t arrayLevels, VkImageUsageFlagBits usage, VkSharingMode sharing_mode, VkImage* image) {
+    uint32_t queue_families[2] = {glbl.queue_family, glbl.transfer_queue_family};
+
     VkImageCreateInfo create_info = {0};
     create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
     create_info.flags = flags;
@@ -113,6 +117,11 @@ result create_image(VkImageCreateFlags flags, VkFormat format, VkExtent3D extent
     create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
     create_info.usage = usage;
     create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    if (sharing_mode == VK_SHARING_MODE_CONCURRENT && glbl.queue_family != glbl.transfer_queue_family) {
+	create_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+	create_info.queueFamilyIndexCount = 2;
+	create_info.pQueueFamilyIndices = queue_families;
+    }
     create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
 
     PROPAGATE_VK(vkCreateImage(glbl.device, &create_info, NULL, image));
@@ -202,7 +211,7 @@ result create_cube_buffer(void) {
 
     secondary_command copy_command = {0};
     copy_command.type = SECONDARY_TYPE_COPY_BUFFER_BUFFER;
-    copy_command.ordering = 0;
+    copy_command.transfer = 1;
     copy_command.copy_buffer_buffer.src_buffer = glbl.staging_cube_vertex_buffer;
     copy_command.copy_buffer_buffer.dst_buffer = glbl.cube_vertex_buffer;
     copy_command.copy_buffer_buffer.copy_region.size = vertex_buffer_size;
@@ -218,106 +227,279 @@ result create_cube_buffer(void) {
     return SUCCESS;
 }
 
-result create_instance_buffer(void) {
-    uint32_t instance_capacity = round_up_p2(glbl.instance_count + 1);
-    
-    PROPAGATE(create_buffer(instance_capacity * sizeof(float) * 4 * 4, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, &glbl.instance_buffer));
-    PROPAGATE(create_buffer_memory(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, &glbl.instance_memory, &glbl.instance_buffer, 1, NULL, 0));
+result create_instance_buffer(uint32_t stream) {
+    instance_stream* instances = &glbl.instance_streams[stream];
+    instances->capacity = round_up_p2(instances->count + 1);
 
-    PROPAGATE(create_buffer(instance_capacity * sizeof(float) * 4 * 4, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, &glbl.staging_instance_buffer));
-    PROPAGATE(create_buffer_memory(VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, 0, &glbl.staging_instance_memory, &glbl.staging_instance_buffer, 1, NULL, 0));
+    // Entries persist between updates, and only dirty entries get written, so
+    // the CPU copy needs to start out in a known state.
+    instances->data = calloc(instances->capacity, instances->stride);
+    if (!instances->data) {
+	fprintf(stderr, "ERROR: Couldn't allocate instance data\n");
+	return CUSTOM_ERROR;
+    }
 
-    glbl.instance_capacity = instance_capacity;
+    for (uint32_t frame = 0; frame < FRAMES_IN_FLIGHT; ++frame) {
+	PROPAGATE(dynarray_create(sizeof(uint32_t), 64, &instances->dirty_ranges[frame]));
+	PROPAGATE(create_instance_frame_buffer(stream, frame));
+    }
 
     return SUCCESS;
 }
 
-float* start_update_instances(uint32_t instance_count) {
+// Instance buffers are read directly by the vertex shader, so they're put in
+// device local memory the host can write to when the device has it. Otherwise
+// they're read from host memory over the bus.
+static VkMemoryPropertyFlags instance_memory_properties(VkBuffer buffer) {
+    VkMemoryPropertyFlags device_local = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(glbl.device, buffer, &requirements);
+    VkPhysicalDeviceMemoryProperties physical_mem_properties;
+    vkGetPhysicalDeviceMemoryProperties(glbl.physical, &physical_mem_properties);
+    for (uint32_t i = 0; i < physical_mem_properties.memoryTypeCount; i++) {
+	if ((requirements.memoryTypeBits & (1 << i)) && (physical_mem_properties.memoryTypes[i].propertyFlags & device_local) == device_local) {
+	    return device_local;
+	}
+    }
+
+    return VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+}
+
+result create_instance_frame_buffer(uint32_t stream, uint32_t frame) {
+    instance_stream* instances = &glbl.instance_streams[stream];
+
+    PROPAGATE(create_buffer(instances->capacity * instances->stride, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, &instances->buffers[frame]));
+    PROPAGATE(allocate_buffer_memory(instances->buffers[frame], instance_memory_properties(instances->buffers[frame]), 0, &instances->allocations[frame]));
+
+    instances->buffer_capacities[frame] = instances->capacity;
+    instances->upload_all[frame] = 1;
+
+    PROPAGATE(update_instance_descriptors(stream, frame));
+
+    return SUCCESS;
+}
+
+// Only the CPU copy grows here. Each frame's buffer is replaced once that
+// frame's timeline value has been waited on, so nothing waits on the GPU.
+result grow_instance_buffer(uint32_t stream) {
+    instance_stream* instances = &glbl.instance_streams[stream];
+    uint32_t old_capacity = instances->capacity;
+    uint32_t capacity = round_up_p2(instances->count + 1);
+
+    uint8_t* data = realloc(instances->data, capacity * instances->stride);
+    if (!data) {
+	fprintf(stderr, "ERROR: Couldn't grow instance data\n");
+	return CUSTOM_ERROR;
+    }
+    memset(data + old_capacity * instances->stride, 0, (capacity - old_capacity) * instances->stride);
+
+    instances->data = data;
+    instances->capacity = capacity;
+
+    return SUCCESS;
+}
+
+void* start_update_instances(uint32_t stream, uint32_t instance_count) {
+    instance_stream* instances = &glbl.instance_streams[stream];
     if (instance_count == 0) instance_count = 1;
     
-    glbl.instance_count = instance_count;
-    if (instance_count > glbl.instance_capacity) {
-	cleanup_instance_buffer();
-	result result = create_instance_buffer();
+    instances->count = instance_count;
+    if (instance_count > instances->capacity) {
+	result result = grow_instance_buffer(stream);
 	if (!IS_SUCCESS(result)) return NULL;
     }
 
-    void* instance_data;
-    vkMapMemory(glbl.device, glbl.staging_instance_memory, 0, instance_count * sizeof(float) * 4 * 4, 0, &instance_data);
-    return instance_data;
+    return instances->data;
 }
 
-int32_t end_update_instances(uint32_t instance_count) {
+// Dirty ranges come in (first instance, number of instances) pairs. They're
+// kept for FRAMES_IN_FLIGHT updates, since every frame's buffer needs them.
+int32_t end_update_instances(uint32_t stream, uint32_t instance_count, const uint32_t* dirty_ranges, uint32_t num_dirty_ranges) {
+    instance_stream* instances = &glbl.instance_streams[stream];
     if (instance_count == 0) instance_count = 1;
 
-    vkUnmapMemory(glbl.device, glbl.staging_instance_memory);
+    instances->count = instance_count;
 
-    glbl.instance_count = instance_count;
+    dynarray* version_ranges = &instances->dirty_ranges[(instances->version + 1) % FRAMES_IN_FLIGHT];
+    dynarray_clear(version_ranges);
+    for (uint32_t i = 0; i < num_dirty_ranges; ++i) {
+	assert(dirty_ranges[2 * i] + dirty_ranges[2 * i + 1] <= instance_count);
+	PROPAGATE_C(dynarray_push((void*) &dirty_ranges[2 * i], version_ranges));
+	PROPAGATE_C(dynarray_push((void*) &dirty_ranges[2 * i + 1], version_ranges));
+    }
+    ++instances->version;
 
-    secondary_command copy_command = {0};
-    copy_command.type = SECONDARY_TYPE_COPY_BUFFER_BUFFER;
-    copy_command.ordering = 0;
-    copy_command.copy_buffer_buffer.src_buffer = glbl.staging_instance_buffer;
-    copy_command.copy_buffer_buffer.dst_buffer = glbl.instance_buffer;
-    copy_command.copy_buffer_buffer.copy_region.size = instance_count * sizeof(float) * 4 * 4;
+    return 0;
+}
+
+// Brings frame's instance buffers up to date with the CPU copies. Called once
+// frame's timeline value has been waited on, so the buffers aren't in use.
+result sync_instance_buffers(uint32_t frame) {
+    for (uint32_t stream = 0; stream < NUM_INSTANCE_STREAMS; ++stream) {
+	instance_stream* instances = &glbl.instance_streams[stream];
+
+	if (instances->buffer_capacities[frame] < instances->capacity) {
+	    vkDestroyBuffer(glbl.device, instances->buffers[frame], NULL);
+	    free_memory(&instances->allocations[frame]);
+	    PROPAGATE(create_instance_frame_buffer(stream, frame));
+	}
 
-    PROPAGATE_C(queue_secondary_command(copy_command));
+	uint8_t* mapped = instances->allocations[frame].mapped;
+	if (instances->upload_all[frame] || instances->version - instances->buffer_versions[frame] > FRAMES_IN_FLIGHT) {
+	    memcpy(mapped, instances->data, instances->capacity * instances->stride);
+	    instances->upload_all[frame] = 0;
+	}
+	else {
+	    for (uint64_t version = instances->buffer_versions[frame] + 1; version <= instances->version; ++version) {
+		dynarray* version_ranges = &instances->dirty_ranges[version % FRAMES_IN_FLIGHT];
+		for (uint32_t i = 0; i < dynarray_len(version_ranges); i += 2) {
+		    uint32_t offset = INDEX(i, *version_ranges, uint32_t) * instances->stride;
+		    uint32_t size = INDEX(i + 1, *version_ranges, uint32_t) * instances->stride;
+		    memcpy(mapped + offset, instances->data + offset, size);
+		}
+	    }
+	}
+	instances->buffer_versions[frame] = instances->version;
+    }
+
+    return SUCCESS;
+}
+
+result create_draw_list_buffer(uint32_t stream, uint32_t frame, uint32_t draw_capacity) {
+    instance_stream* instances = &glbl.instance_streams[stream];
+    PROPAGATE(create_buffer(draw_capacity * sizeof(uint32_t), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, &instances->draw_list_buffers[frame]));
+    PROPAGATE(allocate_buffer_memory(instances->draw_list_buffers[frame], VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 0, &instances->draw_list_allocations[frame]));
+    instances->draw_list_data[frame] = instances->draw_list_allocations[frame].mapped;
+
+    instances->draw_list_capacities[frame] = draw_capacity;
+
+    return SUCCESS;
+}
+
+// Only the CPU copy is written here, so culling and sorting the draw list
+// never waits on the GPU.
+uint32_t* start_update_draw_list(uint32_t stream, uint32_t draw_count) {
+    instance_stream* instances = &glbl.instance_streams[stream];
+
+    if (!instances->draw_list || draw_count > instances->draw_list_capacity) {
+	uint32_t capacity = round_up_p2(draw_count > 0 ? draw_count : 1);
+	uint32_t* draw_list = realloc(instances->draw_list, capacity * sizeof(uint32_t));
+	if (!draw_list) {
+	    fprintf(stderr, "ERROR: Couldn't grow draw list\n");
+	    return NULL;
+	}
+	instances->draw_list = draw_list;
+	instances->draw_list_capacity = capacity;
+    }
+
+    return instances->draw_list;
+}
+
+int32_t end_update_draw_list(uint32_t stream, uint32_t draw_count) {
+    glbl.instance_streams[stream].draw_count = draw_count;
 
     return 0;
 }
 
-result create_staging_texture_buffer(void) {
-    if (glbl.staging_texture_size == 0) glbl.staging_texture_size = 1;
+// Copies the draw lists into frame's draw list buffers. Called once frame's
+// timeline value has been waited on, so the buffers aren't in use.
+result sync_draw_lists(uint32_t frame) {
+    for (uint32_t stream = 0; stream < NUM_INSTANCE_STREAMS; ++stream) {
+	instance_stream* instances = &glbl.instance_streams[stream];
+	if (instances->draw_count == 0) continue;
 
-    PROPAGATE(create_buffer(glbl.staging_texture_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, &glbl.staging_texture_buffer));
-    PROPAGATE(create_buffer_memory(VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, 0, &glbl.staging_texture_memory, &glbl.staging_texture_buffer, 1, NULL, 0));
+	if (instances->draw_count > instances->draw_list_capacities[frame]) {
+	    cleanup_draw_list_buffer(stream, frame);
+	    PROPAGATE(create_draw_list_buffer(stream, frame, round_up_p2(instances->draw_count)));
+	}
+	memcpy(instances->draw_list_data[frame], instances->draw_list, instances->draw_count * sizeof(uint32_t));
+    }
 
     return SUCCESS;
 }
 
-result add_new_texture_memory(void* images, uint32_t num_images) {
-    glbl.last_texture_memory_allocated *= 2;
-    PROPAGATE(dynarray_push(NULL, &glbl.texture_memories));
-    PROPAGATE(create_image_memory(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, dynarray_last(&glbl.texture_memories), images, num_images, NULL, &glbl.last_texture_memory_allocated));
+result create_camera_buffers(void) {
+    for (uint32_t i = 0; i < FRAMES_IN_FLIGHT; ++i) {
+	PROPAGATE(create_buffer(CAMERA_UNIFORM_SIZE, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, &glbl.camera_buffers[i]));
+	PROPAGATE(allocate_buffer_memory(glbl.camera_buffers[i], VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 0, &glbl.camera_allocations[i]));
+	glbl.camera_data[i] = glbl.camera_allocations[i].mapped;
+    }
+
+    PROPAGATE(update_camera_descriptors());
 
     return SUCCESS;
 }
 
-int32_t add_texture(const uint8_t* data, uint32_t width, uint32_t height, uint32_t depth) {
-    if (dynarray_len(&glbl.texture_images) >= MAX_TEXTURES) {
-	fprintf(stderr, "ERROR: Tried allocating too many textures\n");
+result create_staging_ring(void) {
+    PROPAGATE(create_buffer(STAGING_RING_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, &glbl.staging_ring.buffer));
+    PROPAGATE(allocate_buffer_memory(glbl.staging_ring.buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 0, &glbl.staging_ring.allocation));
+    glbl.staging_ring.data = glbl.staging_ring.allocation.mapped;
+    PROPAGATE(dynarray_create(sizeof(staging_ring_submission), 2 * FRAMES_IN_FLIGHT, &glbl.staging_ring.submissions));
+
+    return SUCCESS;
+}
+
+// Returns the offset of size contiguous bytes in the staging ring, or -1 if
+// the ring doesn't currently have room. Allocations never straddle the end of
+// the ring, so the space left at the end is skipped when one doesn't fit.
+int32_t allocate_staging_ring(uint32_t size, uint32_t alignment) {
+    staging_ring* ring = &glbl.staging_ring;
+    uint64_t start = (ring->head + alignment - 1) / alignment * alignment;
+    uint64_t position = start % STAGING_RING_SIZE;
+    if (position + size > STAGING_RING_SIZE) {
+	start += STAGING_RING_SIZE - position;
+    }
+    if (start + size - ring->tail > STAGING_RING_SIZE) {
 	return -1;
     }
 
-    uint32_t prior_len = dynarray_len(&glbl.texture_images);
-    
-    vkWaitForFences(glbl.device, 1, &glbl.texture_upload_finished_fence, VK_TRUE, UINT64_MAX);
-    vkResetFences(glbl.device, 1, &glbl.texture_upload_finished_fence);
-    
-    uint32_t upload_size = 4 * width * height * depth;
-    if (upload_size > glbl.staging_texture_size) {
-	glbl.staging_texture_size = round_up_p2(upload_size);
-	cleanup_staging_texture_buffer();
-	PROPAGATE_C(create_staging_texture_buffer());
+    ring->head = start + size;
+    return start % STAGING_RING_SIZE;
+}
+
+// Everything allocated so far is read by the secondary submission that
+// signals timeline_value.
+result submit_staging_ring(uint64_t timeline_value) {
+    staging_ring_submission submission = {.head = glbl.staging_ring.head, .timeline_value = timeline_value};
+    PROPAGATE(dynarray_push(&submission, &glbl.staging_ring.submissions));
+
+    return SUCCESS;
+}
+
+// Moves the tail past every submission the graphics timeline has reached.
+// Submissions are in timeline order, so this stops at the first unfinished one.
+void retire_staging_ring(void) {
+    staging_ring* ring = &glbl.staging_ring;
+    uint64_t completed = get_timeline_value(glbl.graphics_timeline);
+    uint32_t num_retired = 0;
+    while (num_retired < dynarray_len(&ring->submissions) && INDEX(num_retired, ring->submissions, staging_ring_submission).timeline_value <= completed) {
+	ring->tail = INDEX(num_retired, ring->submissions, staging_ring_submission).head;
+	++num_retired;
     }
+    if (num_retired == 0) return;
 
-    void* texture_data;
-    vkMapMemory(glbl.device, glbl.staging_texture_memory, 0, upload_size, 0, &texture_data);
-    memcpy(texture_data, data, upload_size);
-    vkUnmapMemory(glbl.device, glbl.staging_texture_memory);
+    uint32_t num_left = dynarray_len(&ring->submissions) - num_retired;
+    staging_ring_submission* submissions = ring->submissions.data;
+    memmove(submissions, submissions + num_retired, num_left * sizeof(staging_ring_submission));
+    ring->submissions.size = num_left;
+}
 
-    VkImage image;
-    VkImageView image_view;
+static void destroy_atlas(uint32_t atlas) {
+    vkDestroyImageView(glbl.device, glbl.atlas_image_views[atlas], NULL);
+    vkDestroyImage(glbl.device, glbl.atlas_images[atlas], NULL);
+    free_memory(&glbl.atlas_allocations[atlas]);
+    glbl.atlas_image_views[atlas] = VK_NULL_HANDLE;
+    glbl.atlas_images[atlas] = VK_NULL_HANDLE;
+}
 
-    VkExtent3D extent;
-    extent.width = width;
-    extent.height = height;
-    extent.depth = depth;
-    
-    PROPAGATE_C(create_image(0, VK_FORMAT_R8G8B8A8_SRGB, extent, 1, 1, VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, &image));
+result create_atlas(void) {
+    uint32_t atlas = glbl.num_atlases;
 
-    PROPAGATE_C(dynarray_push(&image, &glbl.texture_images));
-    PROPAGATE_C(dynarray_push(&extent, &glbl.texture_image_extents));
+    VkExtent3D extent;
+    extent.width = ATLAS_SLOT_SIZE * ATLAS_SLOTS_PER_AXIS;
+    extent.height = ATLAS_SLOT_SIZE * ATLAS_SLOTS_PER_AXIS;
+    extent.depth = ATLAS_SLOT_SIZE * ATLAS_SLOTS_PER_AXIS;
 
     VkImageSubresourceRange subresource_range; 
     subresource_range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -326,62 +508,353 @@ int32_t add_texture(const uint8_t* data, uint32_t width, uint32_t height, uint32
     subresource_range.baseArrayLayer = 0;
     subresource_range.layerCount = 1;
 
-    VkMemoryRequirements requirements;
-    vkGetImageMemoryRequirements(glbl.device, image, &requirements);
-    uint32_t desired_offset = round_up(glbl.last_texture_memory_used, requirements.alignment);
-    uint32_t needed_size = desired_offset + requirements.size;
-    if (needed_size > glbl.last_texture_memory_allocated) {
-	PROPAGATE_C(add_new_texture_memory(&image, 1));
+    result res = create_image(0, VK_FORMAT_R8G8B8A8_SRGB, extent, 1, 1, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_SHARING_MODE_CONCURRENT, &glbl.atlas_images[atlas]);
+    if (IS_SUCCESS(res)) res = allocate_image_memory(glbl.atlas_images[atlas], VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &glbl.atlas_allocations[atlas]);
+    if (IS_SUCCESS(res)) res = create_image_view(glbl.atlas_images[atlas], VK_IMAGE_VIEW_TYPE_3D, VK_FORMAT_R8G8B8A8_SRGB, subresource_range, &glbl.atlas_image_views[atlas]);
+    if (IS_SUCCESS(res)) res = update_atlas_descriptors(atlas);
+    if (!IS_SUCCESS(res)) {
+	destroy_atlas(atlas);
+	return res;
+    }
+
+    ++glbl.num_atlases;
+
+    return SUCCESS;
+}
+
+// Sets slot to a free atlas slot, creating a new atlas if every existing one
+// is full. slot is set to -1 if no more atlases can be created.
+result allocate_atlas_slot(int32_t* slot) {
+    if (dynarray_len(&glbl.atlas_free_slots) > 0) {
+	uint32_t free_slot;
+	PROPAGATE(dynarray_pop(&free_slot, &glbl.atlas_free_slots));
+	*slot = free_slot;
+	return SUCCESS;
     }
-    else {
-	PROPAGATE_VK_C(vkBindImageMemory(glbl.device, image, *((VkDeviceMemory*) dynarray_last(&glbl.texture_memories)), desired_offset));
+
+    if (glbl.atlas_slots_used == glbl.num_atlases * ATLAS_SLOTS) {
+	if (glbl.num_atlases == MAX_ATLASES) {
+	    *slot = -1;
+	    return SUCCESS;
+	}
+	PROPAGATE(create_atlas());
     }
-    glbl.last_texture_memory_used = needed_size;
 
-    PROPAGATE_C(create_image_view(image, VK_IMAGE_VIEW_TYPE_3D, VK_FORMAT_R8G8B8A8_SRGB, subresource_range, &image_view));
-    
-    PROPAGATE_C(dynarray_push(&image_view, &glbl.texture_image_views));
-
-    secondary_command transition_command = {0};
-    transition_command.type = SECONDARY_TYPE_LAYOUT_TRANSITION;
-    transition_command.ordering = 0;
-    transition_command.layout_transition.images = dynarray_create_singleton(dynarray_last(&glbl.texture_images), sizeof(VkImage));
-    transition_command.layout_transition.old = VK_IMAGE_LAYOUT_UNDEFINED;
-    transition_command.layout_transition.new = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-    queue_secondary_command(transition_command);
-
-    VkBufferImageCopy region = {0};
-    region.bufferOffset = 0;
-    region.bufferRowLength = 0;
-    region.bufferImageHeight = 0;
+    *slot = glbl.atlas_slots_used++;
+
+    return SUCCESS;
+}
+
+// Frees the slot of an atlas texture. Frames already submitted may still
+// sample it, so it's only reused once the graphics timeline reaches the value
+// of the most recent submission.
+int32_t remove_atlas_texture(uint32_t texture_id) {
+    if (!(texture_id & ATLAS_TEXTURE_BIT)) {
+	fprintf(stderr, "ERROR: Tried removing a texture that isn't in an atlas\n");
+	return -1;
+    }
+
+    atlas_retiring_slot retiring = {.slot = texture_id & ~ATLAS_TEXTURE_BIT, .timeline_value = glbl.graphics_timeline_value};
+    PROPAGATE_C(dynarray_push(&retiring, &glbl.atlas_retiring_slots));
+
+    return 0;
+}
+
+// Frees every retiring slot the graphics timeline has reached. Slots are
+// retired in timeline order.
+result retire_atlas_slots(void) {
+    uint64_t completed = get_timeline_value(glbl.graphics_timeline);
+    uint32_t num_retired = 0;
+    while (num_retired < dynarray_len(&glbl.atlas_retiring_slots) && INDEX(num_retired, glbl.atlas_retiring_slots, atlas_retiring_slot).timeline_value <= completed) {
+	PROPAGATE(dynarray_push(&INDEX(num_retired, glbl.atlas_retiring_slots, atlas_retiring_slot).slot, &glbl.atlas_free_slots));
+	++num_retired;
+    }
+    if (num_retired == 0) return SUCCESS;
+
+    uint32_t num_left = dynarray_len(&glbl.atlas_retiring_slots) - num_retired;
+    atlas_retiring_slot* slots = glbl.atlas_retiring_slots.data;
+    memmove(slots, slots + num_retired, num_left * sizeof(atlas_retiring_slot));
+    glbl.atlas_retiring_slots.size = num_left;
+
+    return SUCCESS;
+}
+
+// Textures are added in order until the staging ring runs out of room, and the
+// number added is returned. The rest should be retried on a later frame, once
+// earlier uploads have retired. Textures the size of an atlas slot are copied
+// into a slot rather than getting their own image. The ID of each added
+// texture is written to texture_ids once the whole batch is queued.
+static int32_t add_texture_batch(uint32_t num_textures, const uint8_t* const* data, const uint32_t* extents, int32_t* texture_ids) {
+    if (num_textures == 0) {
+	fprintf(stderr, "ERROR: Tried adding an empty batch of textures\n");
+	return -1;
+    }
+
+    // Every failure goes through cleanup, which puts everything the batch
+    // touched back how it was. The staging space and atlas slots taken are
+    // given back, the images and atlases created are destroyed, and their
+    // descriptor writes are dropped. Queueing the commands is the last thing
+    // that can fail, and they're queued all at once, so a failed batch still
+    // owns its commands' arrays.
+    int32_t ret = -1;
+    uint64_t prior_staging_head = glbl.staging_ring.head;
+    uint32_t num_commands = 0;
+    uint32_t num_queued = 0;
+    secondary_command commands[6];
+    uint32_t num_reserved = 0;
+    uint32_t prior_num_atlases = glbl.num_atlases;
+    uint32_t prior_atlas_slots_used = glbl.atlas_slots_used;
+    uint32_t prior_len = dynarray_len(&glbl.texture_images);
+    descriptor_mark descriptor_mark;
+    mark_pending_descriptors(&descriptor_mark);
+    VkImage image = VK_NULL_HANDLE;
+    VkImageView image_view = VK_NULL_HANDLE;
+    allocation image_allocation = {0};
+    int32_t* offsets = malloc(num_textures * sizeof(int32_t));
+    int32_t* slots = malloc(num_textures * sizeof(int32_t));
+    if (!offsets || !slots) {
+	fprintf(stderr, "ERROR: Couldn't allocate texture staging offsets\n");
+	goto cleanup;
+    }
+
+    // Staging space and atlas slots are reserved for the whole batch first, so
+    // the number of textures needing their own image is known before any are
+    // created. Copy offsets only need to be a multiple of the texel size, but
+    // are rounded up further to keep each texture's rows aligned.
+    uint32_t num_own_images = 0;
+    for (uint32_t i = 0; i < num_textures; ++i) {
+	uint32_t texture_size = 4 * extents[3 * i] * extents[3 * i + 1] * extents[3 * i + 2];
+	if (texture_size > STAGING_RING_SIZE) {
+	    fprintf(stderr, "ERROR: Tried adding a texture larger than the staging ring\n");
+	    goto cleanup;
+	}
+	offsets[i] = allocate_staging_ring(texture_size, 16);
+	if (offsets[i] < 0) break;
+
+	slots[i] = -1;
+	++num_reserved;
+	if (extents[3 * i] == ATLAS_SLOT_SIZE && extents[3 * i + 1] == ATLAS_SLOT_SIZE && extents[3 * i + 2] == ATLAS_SLOT_SIZE) {
+	    PROPAGATE_GOTO(allocate_atlas_slot(&slots[i]), cleanup);
+	}
+	if (slots[i] < 0) ++num_own_images;
+    }
+    if (num_reserved == 0) {
+	ret = 0;
+	goto cleanup;
+    }
+    num_textures = num_reserved;
+
+    if (prior_len + num_own_images > ATLAS_TEXTURE_BIT) {
+	fprintf(stderr, "ERROR: Tried allocating too many textures\n");
+	goto cleanup;
+    }
+
+    // The whole batch is transitioned with one barrier before and after the
+    // copies, rather than a pair of barriers per texture. Atlases in use are
+    // only written in slots no frame in flight samples, so they only need
+    // their writes made visible afterwards. Atlases are written in the general
+    // layout, and textures with their own image in TRANSFER_DST_OPTIMAL, so
+    // each get their own copy command. Everything here runs on the transfer
+    // queue when there's a dedicated one.
+    num_commands = sizeof(commands) / sizeof(commands[0]);
+    for (uint32_t i = 0; i < num_commands; ++i) {
+	commands[i] = (secondary_command) {0};
+	commands[i].transfer = 1;
+    }
+    secondary_command* undefined_atlases = &commands[0];
+    secondary_command* atlas_copy = &commands[1];
+    secondary_command* written_atlases = &commands[2];
+    secondary_command* undefined_images = &commands[3];
+    secondary_command* image_copy = &commands[4];
+    secondary_command* written_images = &commands[5];
+
+    undefined_atlases->type = SECONDARY_TYPE_LAYOUT_TRANSITION;
+    undefined_atlases->layout_transition.old = VK_IMAGE_LAYOUT_UNDEFINED;
+    undefined_atlases->layout_transition.new = VK_IMAGE_LAYOUT_GENERAL;
+    written_atlases->type = SECONDARY_TYPE_LAYOUT_TRANSITION;
+    written_atlases->layout_transition.old = VK_IMAGE_LAYOUT_GENERAL;
+    written_atlases->layout_transition.new = VK_IMAGE_LAYOUT_GENERAL;
+    undefined_images->type = SECONDARY_TYPE_LAYOUT_TRANSITION;
+    undefined_images->layout_transition.old = VK_IMAGE_LAYOUT_UNDEFINED;
+    undefined_images->layout_transition.new = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    written_images->type = SECONDARY_TYPE_LAYOUT_TRANSITION;
+    written_images->layout_transition.old = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    written_images->layout_transition.new = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    atlas_copy->type = SECONDARY_TYPE_COPY_BUFFER_IMAGE;
+    atlas_copy->copy_buffer_image.src_buffer = glbl.staging_ring.buffer;
+    atlas_copy->copy_buffer_image.dst_layout = VK_IMAGE_LAYOUT_GENERAL;
+    image_copy->type = SECONDARY_TYPE_COPY_BUFFER_IMAGE;
+    image_copy->copy_buffer_image.src_buffer = glbl.staging_ring.buffer;
+    image_copy->copy_buffer_image.dst_layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+
+    atlas_copy->copy_buffer_image.dst_images = malloc(num_textures * sizeof(VkImage));
+    atlas_copy->copy_buffer_image.copy_regions = malloc(num_textures * sizeof(VkBufferImageCopy));
+    image_copy->copy_buffer_image.dst_images = malloc(num_textures * sizeof(VkImage));
+    image_copy->copy_buffer_image.copy_regions = malloc(num_textures * sizeof(VkBufferImageCopy));
+    if (!atlas_copy->copy_buffer_image.dst_images || !atlas_copy->copy_buffer_image.copy_regions || !image_copy->copy_buffer_image.dst_images || !image_copy->copy_buffer_image.copy_regions) {
+	fprintf(stderr, "ERROR: Couldn't allocate texture copy regions\n");
+	goto cleanup;
+    }
+    PROPAGATE_GOTO(dynarray_create(sizeof(VkImage), MAX_ATLASES, &undefined_atlases->layout_transition.images), cleanup);
+    PROPAGATE_GOTO(dynarray_create(sizeof(VkImage), MAX_ATLASES, &written_atlases->layout_transition.images), cleanup);
+    PROPAGATE_GOTO(dynarray_create(sizeof(VkImage), num_textures, &undefined_images->layout_transition.images), cleanup);
+    PROPAGATE_GOTO(dynarray_create(sizeof(VkImage), num_textures, &written_images->layout_transition.images), cleanup);
+
+    uint32_t touched_atlases = 0;
+
+    VkImageSubresourceRange subresource_range; 
+    subresource_range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    subresource_range.baseMipLevel = 0;
+    subresource_range.levelCount = 1;
+    subresource_range.baseArrayLayer = 0;
+    subresource_range.layerCount = 1;
+
+    for (uint32_t i = 0; i < num_textures; ++i) {
+	VkExtent3D extent;
+	extent.width = extents[3 * i];
+	extent.height = extents[3 * i + 1];
+	extent.depth = extents[3 * i + 2];
+	uint32_t texture_size = 4 * extent.width * extent.height * extent.depth;
+
+	memcpy(glbl.staging_ring.data + offsets[i], data[i], texture_size);
+
+	VkBufferImageCopy region = {0};
+	region.bufferOffset = offsets[i];
+	region.bufferRowLength = 0;
+	region.bufferImageHeight = 0;
     
-    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    region.imageSubresource.mipLevel = 0;
-    region.imageSubresource.baseArrayLayer = 0;
-    region.imageSubresource.layerCount = 1;
+	region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	region.imageSubresource.mipLevel = 0;
+	region.imageSubresource.baseArrayLayer = 0;
+	region.imageSubresource.layerCount = 1;
     
-    region.imageOffset.x = 0;
-    region.imageOffset.y = 0;
-    region.imageOffset.z = 0;
-    region.imageExtent = extent;
+	region.imageOffset.x = 0;
+	region.imageOffset.y = 0;
+	region.imageOffset.z = 0;
+	region.imageExtent = extent;
+
+	// Atlases fill up slots in x, then y, then z order.
+	if (slots[i] >= 0) {
+	    uint32_t atlas = slots[i] / ATLAS_SLOTS;
+	    uint32_t atlas_slot = slots[i] % ATLAS_SLOTS;
+	    region.imageOffset.x = ATLAS_SLOT_SIZE * (atlas_slot % ATLAS_SLOTS_PER_AXIS);
+	    region.imageOffset.y = ATLAS_SLOT_SIZE * (atlas_slot / ATLAS_SLOTS_PER_AXIS % ATLAS_SLOTS_PER_AXIS);
+	    region.imageOffset.z = ATLAS_SLOT_SIZE * (atlas_slot / (ATLAS_SLOTS_PER_AXIS * ATLAS_SLOTS_PER_AXIS));
+
+	    if (!(touched_atlases & (1 << atlas))) {
+		touched_atlases |= 1 << atlas;
+		if (atlas >= prior_num_atlases) {
+		    PROPAGATE_GOTO(dynarray_push(&glbl.atlas_images[atlas], &undefined_atlases->layout_transition.images), cleanup);
+		}
+		PROPAGATE_GOTO(dynarray_push(&glbl.atlas_images[atlas], &written_atlases->layout_transition.images), cleanup);
+	    }
+
+	    uint32_t copy = atlas_copy->copy_buffer_image.num_copy_regions++;
+	    atlas_copy->copy_buffer_image.dst_images[copy] = glbl.atlas_images[atlas];
+	    atlas_copy->copy_buffer_image.copy_regions[copy] = region;
+	    continue;
+	}
 
-    secondary_command copy_command = {0};
-    copy_command.type = SECONDARY_TYPE_COPY_BUFFER_IMAGE;
-    copy_command.ordering = 1;
-    copy_command.copy_buffer_image.src_buffer = glbl.staging_texture_buffer;
-    copy_command.copy_buffer_image.dst_image = image;
-    copy_command.copy_buffer_image.copy_region = region;
-    queue_secondary_command(copy_command);
+	// The new image is only owned by the texture arrays once it's in all
+	// of them, and until then it's destroyed at cleanup from the locals.
+	PROPAGATE_GOTO(create_image(0, VK_FORMAT_R8G8B8A8_SRGB, extent, 1, 1, VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_SHARING_MODE_EXCLUSIVE, &image), cleanup);
+	PROPAGATE_GOTO(allocate_image_memory(image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &image_allocation), cleanup);
+	PROPAGATE_GOTO(create_image_view(image, VK_IMAGE_VIEW_TYPE_3D, VK_FORMAT_R8G8B8A8_SRGB, subresource_range, &image_view), cleanup);
+
+	PROPAGATE_GOTO(dynarray_push(&image, &undefined_images->layout_transition.images), cleanup);
+	PROPAGATE_GOTO(dynarray_push(&image, &written_images->layout_transition.images), cleanup);
+
+	uint32_t copy = image_copy->copy_buffer_image.num_copy_regions++;
+	image_copy->copy_buffer_image.dst_images[copy] = image;
+	image_copy->copy_buffer_image.copy_regions[copy] = region;
+
+	PROPAGATE_GOTO(dynarray_push(&image, &glbl.texture_images), cleanup);
+	PROPAGATE_GOTO(dynarray_push(&extent, &glbl.texture_image_extents), cleanup);
+	PROPAGATE_GOTO(dynarray_push(&image_allocation, &glbl.texture_allocations), cleanup);
+	PROPAGATE_GOTO(dynarray_push(&image_view, &glbl.texture_image_views), cleanup);
+	image = VK_NULL_HANDLE;
+	image_view = VK_NULL_HANDLE;
+	image_allocation = (allocation) {0};
+    }
+
+    // Commands with nothing to do are moved to the end, keeping the others in
+    // order, and freed at cleanup.
+    uint32_t num_used = 0;
+    for (uint32_t i = 0; i < num_commands; ++i) {
+	uint32_t used = commands[i].type == SECONDARY_TYPE_LAYOUT_TRANSITION ? dynarray_len(&commands[i].layout_transition.images) > 0 : commands[i].copy_buffer_image.num_copy_regions > 0;
+	if (used) {
+	    secondary_command command = commands[num_used];
+	    commands[num_used++] = commands[i];
+	    commands[i] = command;
+	}
+    }
+
+    uint32_t num_new_textures = dynarray_len(&glbl.texture_images) - prior_len;
+    if (num_new_textures > 0) {
+	PROPAGATE_GOTO(update_descriptors(prior_len, num_new_textures), cleanup);
+    }
+
+    PROPAGATE_GOTO(queue_secondary_commands(num_used, commands), cleanup);
+    num_queued = num_used;
 
-    transition_command.ordering = 2;
-    transition_command.layout_transition.old = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-    transition_command.layout_transition.new = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-    queue_secondary_command(transition_command);
+    uint32_t next_image = prior_len;
+    for (uint32_t i = 0; i < num_textures; ++i) {
+	texture_ids[i] = slots[i] >= 0 ? (int32_t) (ATLAS_TEXTURE_BIT | slots[i]) : (int32_t) next_image++;
+    }
+    ret = num_textures;
+
+ cleanup:
+    if (ret < 0) {
+	glbl.staging_ring.head = prior_staging_head;
+	discard_pending_descriptors(&descriptor_mark);
+
+	// Slots past the ones used before the batch are given back by resetting
+	// the count, and the rest came from the free list.
+	for (uint32_t i = 0; i < num_reserved; ++i) {
+	    uint32_t slot = slots[i];
+	    if (slots[i] >= 0 && slot < prior_atlas_slots_used && !IS_SUCCESS(dynarray_push(&slot, &glbl.atlas_free_slots))) break;
+	}
+	glbl.atlas_slots_used = prior_atlas_slots_used;
+	while (glbl.num_atlases > prior_num_atlases) {
+	    destroy_atlas(--glbl.num_atlases);
+	}
+
+	// Textures that made it into all four texture arrays are destroyed from
+	// them, and the arrays are truncated back to their lengths before the
+	// batch.
+	for (uint32_t i = prior_len; i < dynarray_len(&glbl.texture_image_views); ++i) {
+	    vkDestroyImageView(glbl.device, INDEX(i, glbl.texture_image_views, VkImageView), NULL);
+	    vkDestroyImage(glbl.device, INDEX(i, glbl.texture_images, VkImage), NULL);
+	    free_memory(&INDEX(i, glbl.texture_allocations, allocation));
+	}
+	glbl.texture_images.size = prior_len * sizeof(VkImage);
+	glbl.texture_image_extents.size = prior_len * sizeof(VkExtent3D);
+	glbl.texture_allocations.size = prior_len * sizeof(allocation);
+	glbl.texture_image_views.size = prior_len * sizeof(VkImageView);
+	if (image_view != VK_NULL_HANDLE) vkDestroyImageView(glbl.device, image_view, NULL);
+	if (image != VK_NULL_HANDLE) vkDestroyImage(glbl.device, image, NULL);
+	free_memory(&image_allocation);
+    }
+    for (uint32_t i = num_queued; i < num_commands; ++i) {
+	if (commands[i].type == SECONDARY_TYPE_LAYOUT_TRANSITION) {
+	    if (commands[i].layout_transition.images.alloc) dynarray_destroy(&commands[i].layout_transition.images);
+	}
+	else {
+	    free(commands[i].copy_buffer_image.dst_images);
+	    free(commands[i].copy_buffer_image.copy_regions);
+	}
+    }
+    free(offsets);
+    free(slots);
+    return ret;
+}
 
-    PROPAGATE_C(update_descriptors(prior_len));
-    PROPAGATE_C(set_secondary_fence(glbl.texture_upload_finished_fence));
+int32_t add_textures(uint32_t num_textures, const uint8_t* const* data, const uint32_t* extents, int32_t* texture_ids) {
+    PROFILE_ZONE_BEGIN("add_textures");
+    int32_t num_added = add_texture_batch(num_textures, data, extents, texture_ids);
+    PROFILE_ZONE_END();
 
-    return prior_len;
+    return num_added;
 }
 
 void get_vertex_input_descriptions(VkVertexInputBindingDescription* vertex_input_binding_descriptions, VkVertexInputAttributeDescription* vertex_input_attribute_descriptions) {
@@ -389,8 +862,10 @@ void get_vertex_input_descriptions(VkVertexInputBindingDescription* vertex_input
     vertex_input_binding_descriptions[0].stride = sizeof(gpu_vertex);
     vertex_input_binding_descriptions[0].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
 
+    // Per-instance input is just the stream entry of the instance to draw.
+    // Instance data itself is fetched from the instance storage buffer.
     vertex_input_binding_descriptions[1].binding = 1;
-    vertex_input_binding_descriptions[1].stride = sizeof(float) * 4 * 4;
+    vertex_input_binding_descriptions[1].stride = sizeof(uint32_t);
     vertex_input_binding_descriptions[1].inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
 
     vertex_input_attribute_descriptions[0].binding = 0;
@@ -398,12 +873,10 @@ void get_vertex_input_descriptions(VkVertexInputBindingDescription* vertex_input
     vertex_input_attribute_descriptions[0].format = VK_FORMAT_R32G32B32_SFLOAT;
     vertex_input_attribute_descriptions[0].offset = 0;
 
-    for (uint32_t i = 0; i < 4; ++i) {
-	vertex_input_attribute_descriptions[1 + i].binding = 1;
-	vertex_input_attribute_descriptions[1 + i].location = 1 + i;
-	vertex_input_attribute_descriptions[1 + i].format = VK_FORMAT_R32G32B32A32_SFLOAT;
-	vertex_input_attribute_descriptions[1 + i].offset = sizeof(float) * 4 * i;
-    }
+    vertex_input_attribute_descriptions[1].binding = 1;
+    vertex_input_attribute_descriptions[1].location = 1;
+    vertex_input_attribute_descriptions[1].format = VK_FORMAT_R32_UINT;
+    vertex_input_attribute_descriptions[1].offset = 0;
 }
 
 result find_memory_type(uint32_t filter, VkMemoryPropertyFlags properties, uint32_t* type) {
@@ -421,18 +894,37 @@ result find_memory_type(uint32_t filter, VkMemoryPropertyFlags properties, uint3
     return CUSTOM_ERROR;
 }
 
-void cleanup_instance_buffer(void) {
+void cleanup_instance_buffer(uint32_t stream) {
+    instance_stream* instances = &glbl.instance_streams[stream];
     vkQueueWaitIdle(glbl.queue);
-    vkDestroyBuffer(glbl.device, glbl.staging_instance_buffer, NULL);
-    vkFreeMemory(glbl.device, glbl.staging_instance_memory, NULL);
-    vkDestroyBuffer(glbl.device, glbl.instance_buffer, NULL);
-    vkFreeMemory(glbl.device, glbl.instance_memory, NULL);
+    for (uint32_t frame = 0; frame < FRAMES_IN_FLIGHT; ++frame) {
+	vkDestroyBuffer(glbl.device, instances->buffers[frame], NULL);
+	free_memory(&instances->allocations[frame]);
+	dynarray_destroy(&instances->dirty_ranges[frame]);
+    }
+    free(instances->data);
+    free(instances->draw_list);
 }
 
-void cleanup_staging_texture_buffer(void) {
-    vkQueueWaitIdle(glbl.queue);
-    vkDestroyBuffer(glbl.device, glbl.staging_texture_buffer, NULL);
-    vkFreeMemory(glbl.device, glbl.staging_texture_memory, NULL);
+void cleanup_draw_list_buffer(uint32_t stream, uint32_t frame) {
+    instance_stream* instances = &glbl.instance_streams[stream];
+    if (instances->draw_list_buffers[frame] == VK_NULL_HANDLE) return;
+    vkDestroyBuffer(glbl.device, instances->draw_list_buffers[frame], NULL);
+    free_memory(&instances->draw_list_allocations[frame]);
+    instances->draw_list_buffers[frame] = VK_NULL_HANDLE;
+}
+
+void cleanup_camera_buffers(void) {
+    for (uint32_t i = 0; i < FRAMES_IN_FLIGHT; ++i) {
+	vkDestroyBuffer(glbl.device, glbl.camera_buffers[i], NULL);
+	free_memory(&glbl.camera_allocations[i]);
+    }
+}
+
+void cleanup_staging_ring(void) {
+    vkDestroyBuffer(glbl.device, glbl.staging_ring.buffer, NULL);
+    free_memory(&glbl.staging_ring.allocation);
+    dynarray_destroy(&glbl.staging_ring.submissions);
 }
 
 void cleanup_texture_images(void) {
@@ -440,7 +932,15 @@ void cleanup_texture_images(void) {
     for (uint32_t i = 0; i < dynarray_len(&glbl.texture_images); ++i) {
 	vkDestroyImage(glbl.device, INDEX(i, glbl.texture_images, VkImage), NULL);
 	vkDestroyImageView(glbl.device, INDEX(i, glbl.texture_image_views, VkImageView), NULL);
+	free_memory(&INDEX(i, glbl.texture_allocations, allocation));
     }
     dynarray_destroy(&glbl.texture_images);
     dynarray_destroy(&glbl.texture_image_views);
+    dynarray_destroy(&glbl.texture_allocations);
+
+    for (uint32_t i = 0; i < glbl.num_atlases; ++i) {
+	destroy_atlas(i);
+    }
+    dynarray_destroy(&glbl.atlas_free_slots);
+    dynarray_destroy(&glbl.atlas_retiring_slots);
 }
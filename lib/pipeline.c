@@ -67,14 +67,17 @@ result create_shader_module(VkShaderModule* module, const char* shader_path) {
 }
 
 result create_raster_pipeline(void) {
-    VkShaderModule vertex_shader, fragment_shader;
-    PROPAGATE(create_shader_module(&vertex_shader, "shaders/trace.vert.spv"));
+    // Instance streams only differ in how the vertex shader decodes instances.
+    const char* vertex_shader_paths[NUM_INSTANCE_STREAMS] = {"shaders/trace.vert.spv", "shaders/trace_aligned.vert.spv"};
+    VkShaderModule vertex_shaders[NUM_INSTANCE_STREAMS], fragment_shader;
+    for (uint32_t stream = 0; stream < NUM_INSTANCE_STREAMS; ++stream) {
+	PROPAGATE(create_shader_module(&vertex_shaders[stream], vertex_shader_paths[stream]));
+    }
     PROPAGATE(create_shader_module(&fragment_shader, "shaders/trace.frag.spv"));
 
     VkPipelineShaderStageCreateInfo vertex_shader_stage_create_info = {0};
     vertex_shader_stage_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
     vertex_shader_stage_create_info.stage = VK_SHADER_STAGE_VERTEX_BIT;
-    vertex_shader_stage_create_info.module = vertex_shader;
     vertex_shader_stage_create_info.pName = "main";
 
     VkPipelineShaderStageCreateInfo fragment_shader_stage_create_info = {0};
@@ -92,7 +95,7 @@ result create_raster_pipeline(void) {
     pipeline_dynamic_state_create_info.pDynamicStates = pipeline_dynamic_states;
 
     VkVertexInputBindingDescription vertex_input_binding_description[2] = {0};
-    VkVertexInputAttributeDescription vertex_input_attribute_description[5] = {0};
+    VkVertexInputAttributeDescription vertex_input_attribute_description[2] = {0};
     VkPipelineVertexInputStateCreateInfo vertex_input_create_info = {0};
     get_vertex_input_descriptions(vertex_input_binding_description, vertex_input_attribute_description);
     vertex_input_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
@@ -173,7 +176,7 @@ result create_raster_pipeline(void) {
     color_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     color_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
     color_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    color_attachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    color_attachment.finalLayout = glbl.headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
 
     VkAttachmentReference color_attachment_reference = {0};
     color_attachment_reference.attachment = 0;
@@ -199,13 +202,21 @@ result create_raster_pipeline(void) {
     subpass.pColorAttachments = &color_attachment_reference;
     subpass.pDepthStencilAttachment = &depth_attachment_reference;
 
-    VkSubpassDependency subpass_dependency = {0};
-    subpass_dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-    subpass_dependency.dstSubpass = 0;
-    subpass_dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-    subpass_dependency.srcAccessMask = 0;
-    subpass_dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-    subpass_dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    VkSubpassDependency subpass_dependencies[2] = {0};
+    subpass_dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+    subpass_dependencies[0].dstSubpass = 0;
+    subpass_dependencies[0].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+    subpass_dependencies[0].srcAccessMask = 0;
+    subpass_dependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+    subpass_dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+    // Offscreen images are copied to the host after the pass.
+    subpass_dependencies[1].srcSubpass = 0;
+    subpass_dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+    subpass_dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    subpass_dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    subpass_dependencies[1].dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    subpass_dependencies[1].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
 
     VkAttachmentDescription attachments[] = {color_attachment, depth_attachment};
     
@@ -215,8 +226,8 @@ result create_raster_pipeline(void) {
     render_pass_create_info.pAttachments = attachments;
     render_pass_create_info.subpassCount = 1;
     render_pass_create_info.pSubpasses = &subpass;
-    render_pass_create_info.dependencyCount = 1;
-    render_pass_create_info.pDependencies = &subpass_dependency;
+    render_pass_create_info.dependencyCount = glbl.headless ? 2 : 1;
+    render_pass_create_info.pDependencies = subpass_dependencies;
 
     PROPAGATE_VK(vkCreateRenderPass(glbl.device, &render_pass_create_info, NULL, &glbl.render_pass));
 
@@ -236,9 +247,14 @@ result create_raster_pipeline(void) {
     raster_pipeline_create_info.renderPass = glbl.render_pass;
     raster_pipeline_create_info.subpass = 0;
 
-    PROPAGATE_VK(vkCreateGraphicsPipelines(glbl.device, VK_NULL_HANDLE, 1, &raster_pipeline_create_info, NULL, &glbl.raster_pipeline));
+    for (uint32_t stream = 0; stream < NUM_INSTANCE_STREAMS; ++stream) {
+	shader_stage_create_infos[0].module = vertex_shaders[stream];
+	PROPAGATE_VK(vkCreateGraphicsPipelines(glbl.device, VK_NULL_HANDLE, 1, &raster_pipeline_create_info, NULL, &glbl.raster_pipelines[stream]));
+    }
  
-    vkDestroyShaderModule(glbl.device, vertex_shader, NULL);
+    for (uint32_t stream = 0; stream < NUM_INSTANCE_STREAMS; ++stream) {
+	vkDestroyShaderModule(glbl.device, vertex_shaders[stream], NULL);
+    }
     vkDestroyShaderModule(glbl.device, fragment_shader, NULL);
     
     return SUCCESS;
@@ -271,7 +287,7 @@ result create_depth_resources(void) {
     extent.height = glbl.swapchain_extent.height;
     extent.depth = 1;
 
-    PROPAGATE(create_image(0, VK_FORMAT_D32_SFLOAT, extent, 1, 1, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, &glbl.depth_image));
+    PROPAGATE(create_image(0, VK_FORMAT_D32_SFLOAT, extent, 1, 1, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, VK_SHARING_MODE_EXCLUSIVE, &glbl.depth_image));
 
     PROPAGATE(create_image_memory(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, &glbl.depth_image_memory, &glbl.depth_image, 1, NULL, 0));
 
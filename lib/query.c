@@ -0,0 +1,136 @@
+/*
+ * This file is part of vtrace.
+ * vtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ * vtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with vtrace. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "common.h"
+
+// Each frame has a begin and end timestamp per pass, and one pipeline
+// statistics query around the raster pass. Queries are only read back once
+// the frame's timeline value has been waited on, so reading never stalls.
+result create_query_pools(void) {
+    VkPhysicalDeviceProperties device_properties;
+    vkGetPhysicalDeviceProperties(glbl.physical, &device_properties);
+    glbl.timestamp_period = device_properties.limits.timestampPeriod;
+
+    uint32_t queue_family_count = 0;
+    VkQueueFamilyProperties queue_families[MAX_VK_ENUMERATIONS];
+    vkGetPhysicalDeviceQueueFamilyProperties(glbl.physical, &queue_family_count, NULL);
+    queue_family_count = queue_family_count < MAX_VK_ENUMERATIONS ? queue_family_count : MAX_VK_ENUMERATIONS;
+    vkGetPhysicalDeviceQueueFamilyProperties(glbl.physical, &queue_family_count, queue_families);
+    glbl.timestamps_supported = glbl.queue_family < queue_family_count && queue_families[glbl.queue_family].timestampValidBits > 0;
+
+    if (glbl.timestamps_supported) {
+	VkQueryPoolCreateInfo timestamp_info = {0};
+	timestamp_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	timestamp_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+	timestamp_info.queryCount = FRAMES_IN_FLIGHT * NUM_GPU_PASSES * 2;
+
+	PROPAGATE_VK(vkCreateQueryPool(glbl.device, &timestamp_info, NULL, &glbl.timestamp_query_pool));
+    }
+
+    if (glbl.pipeline_statistics_supported) {
+	VkQueryPoolCreateInfo statistics_info = {0};
+	statistics_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	statistics_info.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+	statistics_info.queryCount = FRAMES_IN_FLIGHT;
+	statistics_info.pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+
+	PROPAGATE_VK(vkCreateQueryPool(glbl.device, &statistics_info, NULL, &glbl.statistics_query_pool));
+    }
+
+    return SUCCESS;
+}
+
+// Queries are reset in the command buffer that writes them, right before
+// they're written, since the pass may not be recorded every frame.
+void begin_gpu_pass(VkCommandBuffer command_buffer, gpu_pass pass) {
+    uint32_t frame = glbl.current_frame;
+    if (glbl.timestamps_supported) {
+	uint32_t query = (frame * NUM_GPU_PASSES + pass) * 2;
+	vkCmdResetQueryPool(command_buffer, glbl.timestamp_query_pool, query, 2);
+	vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, glbl.timestamp_query_pool, query);
+    }
+    if (glbl.pipeline_statistics_supported && pass == GPU_PASS_RASTER) {
+	vkCmdResetQueryPool(command_buffer, glbl.statistics_query_pool, frame, 1);
+	vkCmdBeginQuery(command_buffer, glbl.statistics_query_pool, frame, 0);
+    }
+}
+
+void end_gpu_pass(VkCommandBuffer command_buffer, gpu_pass pass) {
+    uint32_t frame = glbl.current_frame;
+    if (glbl.pipeline_statistics_supported && pass == GPU_PASS_RASTER) {
+	vkCmdEndQuery(command_buffer, glbl.statistics_query_pool, frame);
+    }
+    if (glbl.timestamps_supported) {
+	uint32_t query = (frame * NUM_GPU_PASSES + pass) * 2 + 1;
+	vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, glbl.timestamp_query_pool, query);
+    }
+    glbl.gpu_passes_recorded[frame] |= 1 << pass;
+    glbl.gpu_pass_frames[frame] = glbl.num_frames_elapsed + 1;
+}
+
+// Called once frame's timeline value has been waited on, before the frame is
+// recorded again. The results are kept until the next frame that has them.
+result read_gpu_timings(uint32_t frame) {
+    uint32_t recorded = glbl.gpu_passes_recorded[frame];
+    glbl.gpu_passes_recorded[frame] = 0;
+    if (!(recorded & (1 << GPU_PASS_RASTER))) return SUCCESS;
+
+    gpu_timings timings = {0};
+    timings.frame = glbl.gpu_pass_frames[frame];
+
+    // Passes that weren't recorded this frame have queries that were never
+    // reset, so they're skipped rather than read.
+    if (glbl.timestamps_supported) {
+	float pass_ms[NUM_GPU_PASSES] = {0};
+	for (uint32_t pass = 0; pass < NUM_GPU_PASSES; ++pass) {
+	    if (!(recorded & (1 << pass))) continue;
+	    uint64_t timestamps[2];
+	    PROPAGATE_VK(vkGetQueryPoolResults(glbl.device, glbl.timestamp_query_pool, (frame * NUM_GPU_PASSES + pass) * 2, 2, sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT));
+	    pass_ms[pass] = (float) (timestamps[1] - timestamps[0]) * glbl.timestamp_period / 1000000.0f;
+	}
+	timings.secondary_ms = pass_ms[GPU_PASS_SECONDARY];
+	timings.raster_ms = pass_ms[GPU_PASS_RASTER];
+	timings.has_secondary = (recorded & (1 << GPU_PASS_SECONDARY)) != 0;
+	timings.has_timestamps = 1;
+    }
+
+    if (glbl.pipeline_statistics_supported) {
+	PROPAGATE_VK(vkGetQueryPoolResults(glbl.device, glbl.statistics_query_pool, frame, 1, sizeof(uint64_t), &timings.fragment_shader_invocations, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT));
+	timings.has_statistics = 1;
+    }
+
+    glbl.gpu_timings = timings;
+
+    return SUCCESS;
+}
+
+// Copies the latest timings read back. Frames are counted from 1, so frame is
+// 0 until the first frame has been read back, and only changes when newer
+// timings are available.
+void get_gpu_timings(gpu_timings* timings) {
+    *timings = glbl.gpu_timings;
+}
+
+void cleanup_query_pools(void) {
+    if (glbl.timestamps_supported) {
+	vkDestroyQueryPool(glbl.device, glbl.timestamp_query_pool, NULL);
+    }
+    if (glbl.pipeline_statistics_supported) {
+	vkDestroyQueryPool(glbl.device, glbl.statistics_query_pool, NULL);
+    }
+}
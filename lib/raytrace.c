@@ -12,85 +12,642 @@
  * along with vtrace. If not, see <https://www.gnu.org/licenses/>.
  */
 
+
 #include <stdlib.h>
+#include <string.h>
 #include <stdio.h>
 
 #include "common.h"
 
-result create_ray_tracing_objects(void) {
-    VkAabbPositionsKHR aabb = {0};
-    aabb.minX = -0.5f;
-    aabb.minY = -0.5f;
-    aabb.minZ = -0.5f;
-    aabb.maxX = 0.5f;
-    aabb.maxY = 0.5f;
-    aabb.maxZ = 0.5f;
-    
-    VkAccelerationStructureGeometryDataKHR cube_geometry_data = {0};
-    cube_geometry_data.aabbs.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_AABBS_DATA_KHR;
-    cube_geometry_data.aabbs.stride = sizeof(VkAabbPositionsKHR);
-    
+static VkDeviceSize align_up(VkDeviceSize size, VkDeviceSize alignment) {
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+// Acceleration structure inputs, scratch memory and shader binding tables are
+// all referenced by device address, some with stricter alignment than the
+// buffer itself needs. Allocations are aligned to their own size, so raising
+// the required alignment is enough.
+static result create_address_buffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkDeviceSize alignment, VkBuffer* buffer, allocation* allocation, VkDeviceAddress* address) {
+    PROPAGATE(create_buffer(size, usage | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, buffer));
+
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(glbl.device, *buffer, &requirements);
+    if (requirements.alignment < alignment) requirements.alignment = alignment;
+    PROPAGATE(allocate_memory(requirements, properties, VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT, ALLOCATION_KIND_BUFFER, allocation));
+    PROPAGATE_VK(vkBindBufferMemory(glbl.device, *buffer, allocation->memory, allocation->offset));
+
+    if (address) {
+	VkBufferDeviceAddressInfo address_info = {0};
+	address_info.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
+	address_info.buffer = *buffer;
+	*address = vkGetBufferDeviceAddress(glbl.device, &address_info);
+    }
+
+    return SUCCESS;
+}
+
+static VkDeviceAddress acceleration_structure_address(VkAccelerationStructureKHR acceleration_structure) {
+    VkAccelerationStructureDeviceAddressInfoKHR address_info = {0};
+    address_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
+    address_info.accelerationStructure = acceleration_structure;
+    return vkGetAccelerationStructureDeviceAddress(glbl.device, &address_info);
+}
+
+// Every instance shares a BLAS of a single unit cube AABB, the same cube the
+// raster path draws, and the intersection shader marches the instance's
+// texture inside it. The build is queued as a secondary command, so it's
+// finished before the first frame traces against it, and its compacted size
+// is queried so compact_cube_blas can shrink it.
+static result create_cube_blas(void) {
     VkAccelerationStructureGeometryKHR* cube_geometry = calloc(1, sizeof(VkAccelerationStructureGeometryKHR));
+    if (!cube_geometry) {
+	fprintf(stderr, "ERROR: Couldn't allocate cube geometry\n");
+	return CUSTOM_ERROR;
+    }
     cube_geometry->sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
     cube_geometry->geometryType = VK_GEOMETRY_TYPE_AABBS_KHR;
-    cube_geometry->geometry = cube_geometry_data;
+    cube_geometry->flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+    cube_geometry->geometry.aabbs.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_AABBS_DATA_KHR;
+    cube_geometry->geometry.aabbs.stride = sizeof(VkAabbPositionsKHR);
 
     VkAccelerationStructureBuildGeometryInfoKHR geometry_info = {0};
     geometry_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
     geometry_info.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-    geometry_info.flags = VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+    geometry_info.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR;
     geometry_info.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
     geometry_info.geometryCount = 1;
     geometry_info.pGeometries = cube_geometry;
 
-    uint32_t aabb_num_primitives = 1;
-    VkAccelerationStructureBuildSizesInfoKHR build_size;
+    uint32_t num_primitives = 1;
+    VkAccelerationStructureBuildSizesInfoKHR build_size = {0};
     build_size.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
-    vkGetAccelerationStructureBuildSizes(glbl.device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &geometry_info, &aabb_num_primitives, &build_size);
-    printf("%lu %lu %lu\n", build_size.accelerationStructureSize, build_size.updateScratchSize, build_size.buildScratchSize);
+    vkGetAccelerationStructureBuildSizes(glbl.device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &geometry_info, &num_primitives, &build_size);
 
-    VkBuffer acceleration_structure_buffer, build_scratch_buffer, aabb_buffer;
-    PROPAGATE(create_buffer(build_size.accelerationStructureSize, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR, &acceleration_structure_buffer));
-    PROPAGATE(create_buffer(build_size.buildScratchSize, VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, &build_scratch_buffer));
-    PROPAGATE(create_buffer(sizeof(VkAabbPositionsKHR), VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, &aabb_buffer));
+    VkDeviceAddress aabb_address, scratch_address;
+    PROPAGATE(create_address_buffer(build_size.accelerationStructureSize, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 256, &glbl.cube_blas_buffer, &glbl.cube_blas_allocation, NULL));
+    PROPAGATE(create_address_buffer(build_size.buildScratchSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, glbl.scratch_alignment, &glbl.cube_scratch_buffer, &glbl.cube_scratch_allocation, &scratch_address));
+    PROPAGATE(create_address_buffer(sizeof(VkAabbPositionsKHR), VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 8, &glbl.cube_aabb_buffer, &glbl.cube_aabb_allocation, &aabb_address));
 
-    VkDeviceMemory buffer_memory;
-    VkBuffer buffers[] = {acceleration_structure_buffer, build_scratch_buffer, aabb_buffer};
-    PROPAGATE(create_buffer_memory(VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT, &buffer_memory, buffers, sizeof(buffers)/sizeof(buffers[0]), NULL, build_size.accelerationStructureSize));
+    VkAabbPositionsKHR aabb = {0};
+    aabb.minX = -0.5f;
+    aabb.minY = -0.5f;
+    aabb.minZ = -0.5f;
+    aabb.maxX = 0.5f;
+    aabb.maxY = 0.5f;
+    aabb.maxZ = 0.5f;
+    memcpy(glbl.cube_aabb_allocation.mapped, &aabb, sizeof(aabb));
 
     VkAccelerationStructureCreateInfoKHR create_info = {0};
     create_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
-    create_info.buffer = acceleration_structure_buffer;
+    create_info.buffer = glbl.cube_blas_buffer;
     create_info.offset = 0;
     create_info.size = build_size.accelerationStructureSize;
     create_info.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-    
-    VkAccelerationStructureKHR blas;
-    PROPAGATE_VK(vkCreateAccelerationStructure(glbl.device, &create_info, NULL, &blas));
 
-    VkBufferDeviceAddressInfo address_info = {0};
-    address_info.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
-    address_info.buffer = aabb_buffer;
+    PROPAGATE_VK(vkCreateAccelerationStructure(glbl.device, &create_info, NULL, &glbl.cube_blas));
+    glbl.cube_blas_address = acceleration_structure_address(glbl.cube_blas);
 
-    cube_geometry_data.aabbs.data.deviceAddress = vkGetBufferDeviceAddress(glbl.device, &address_info);
-    cube_geometry->geometry = cube_geometry_data;
-    
-    address_info.buffer = build_scratch_buffer;
-    geometry_info.dstAccelerationStructure = blas;
-    geometry_info.scratchData.deviceAddress = vkGetBufferDeviceAddress(glbl.device, &address_info);
-
-    VkAccelerationStructureBuildRangeInfoKHR range_info = {0};
-    range_info.primitiveCount = 1;
-    range_info.primitiveOffset = 0;
-    range_info.firstVertex = 0;
+    cube_geometry->geometry.aabbs.data.deviceAddress = aabb_address;
+    geometry_info.dstAccelerationStructure = glbl.cube_blas;
+    geometry_info.scratchData.deviceAddress = scratch_address;
 
     secondary_command build_command = {0};
     build_command.type = SECONDARY_TYPE_ACCELERATION_STRUCTURE_BUILD;
     build_command.acceleration_structure_build.geometry_info = geometry_info;
-    build_command.acceleration_structure_build.range_info = malloc(sizeof(VkAccelerationStructureBuildRangeInfoKHR ));
-    build_command.acceleration_structure_build.range_info[0] = range_info;
+    build_command.acceleration_structure_build.geometries = cube_geometry;
+    build_command.acceleration_structure_build.range_info = calloc(1, sizeof(VkAccelerationStructureBuildRangeInfoKHR));
+    if (!build_command.acceleration_structure_build.range_info) {
+	fprintf(stderr, "ERROR: Couldn't allocate cube build range\n");
+	return CUSTOM_ERROR;
+    }
+    build_command.acceleration_structure_build.range_info[0].primitiveCount = 1;
+
+    VkQueryPoolCreateInfo query_pool_create_info = {0};
+    query_pool_create_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    query_pool_create_info.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR;
+    query_pool_create_info.queryCount = 1;
+
+    PROPAGATE_VK(vkCreateQueryPool(glbl.device, &query_pool_create_info, NULL, &glbl.blas_query_pool));
+    build_command.acceleration_structure_build.compacted_size_query_pool = glbl.blas_query_pool;
+    build_command.acceleration_structure_build.compacted_size_query = 0;
 
     PROPAGATE(queue_secondary_command(build_command));
+    glbl.cube_blas_compaction = BLAS_COMPACTION_QUERIED;
+    glbl.cube_blas_compaction_value = glbl.graphics_timeline_value + TIMELINE_VALUES_PER_FRAME;
 
     return SUCCESS;
 }
+
+// Called every frame once the current frame's timeline value has been waited
+// on. Once the cube BLAS's compacted size is available, it's copied into a
+// compacted BLAS, which every TLAS switches to. The copy is queued without a
+// delay, so it's in this frame's secondary submission, which this frame's
+// TLAS build waits on. Earlier frames may still trace against the original,
+// so it's only destroyed once this frame has finished.
+static result compact_cube_blas(void) {
+    if (glbl.cube_blas_compaction == BLAS_COMPACTION_QUERIED && get_timeline_value(glbl.graphics_timeline) >= glbl.cube_blas_compaction_value) {
+	VkDeviceSize compacted_size;
+	VkResult query_result = vkGetQueryPoolResults(glbl.device, glbl.blas_query_pool, 0, 1, sizeof(compacted_size), &compacted_size, sizeof(compacted_size), VK_QUERY_RESULT_64_BIT);
+	if (query_result == VK_NOT_READY) return SUCCESS;
+	PROPAGATE_VK(query_result);
+
+	glbl.retired_cube_blas = glbl.cube_blas;
+	glbl.retired_cube_blas_buffer = glbl.cube_blas_buffer;
+	glbl.retired_cube_blas_allocation = glbl.cube_blas_allocation;
+
+	PROPAGATE(create_address_buffer(compacted_size, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 256, &glbl.cube_blas_buffer, &glbl.cube_blas_allocation, NULL));
+
+	VkAccelerationStructureCreateInfoKHR create_info = {0};
+	create_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+	create_info.buffer = glbl.cube_blas_buffer;
+	create_info.offset = 0;
+	create_info.size = compacted_size;
+	create_info.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+
+	PROPAGATE_VK(vkCreateAccelerationStructure(glbl.device, &create_info, NULL, &glbl.cube_blas));
+	glbl.cube_blas_address = acceleration_structure_address(glbl.cube_blas);
+
+	secondary_command copy_command = {0};
+	copy_command.type = SECONDARY_TYPE_ACCELERATION_STRUCTURE_COPY;
+	copy_command.acceleration_structure_copy.src = glbl.retired_cube_blas;
+	copy_command.acceleration_structure_copy.dst = glbl.cube_blas;
+	copy_command.acceleration_structure_copy.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR;
+	PROPAGATE(queue_secondary_command(copy_command));
+
+	// Refits can't be trusted to pick up a new BLAS reference.
+	for (uint32_t i = 0; i < FRAMES_IN_FLIGHT; ++i) {
+	    glbl.tlas_force_build[i] = 1;
+	}
+	glbl.cube_blas_compaction_value = glbl.graphics_timeline_value + TIMELINE_VALUES_PER_FRAME;
+	glbl.cube_blas_compaction = BLAS_COMPACTION_RETIRING;
+    }
+    else if (glbl.cube_blas_compaction == BLAS_COMPACTION_RETIRING && get_timeline_value(glbl.graphics_timeline) >= glbl.cube_blas_compaction_value) {
+	// The original build's inputs aren't needed by the copy either.
+	vkDestroyAccelerationStructure(glbl.device, glbl.retired_cube_blas, NULL);
+	vkDestroyBuffer(glbl.device, glbl.retired_cube_blas_buffer, NULL);
+	free_memory(&glbl.retired_cube_blas_allocation);
+	vkDestroyBuffer(glbl.device, glbl.cube_scratch_buffer, NULL);
+	free_memory(&glbl.cube_scratch_allocation);
+	vkDestroyBuffer(glbl.device, glbl.cube_aabb_buffer, NULL);
+	free_memory(&glbl.cube_aabb_allocation);
+	glbl.cube_scratch_buffer = VK_NULL_HANDLE;
+	glbl.cube_aabb_buffer = VK_NULL_HANDLE;
+	glbl.cube_blas_compaction = BLAS_COMPACTION_NONE;
+    }
+
+    return SUCCESS;
+}
+
+// Ray generation and miss shaders are general groups, and the intersection
+// and closest hit shaders form the one procedural hit group.
+static result create_trace_pipeline(void) {
+    VkPhysicalDeviceRayTracingPipelinePropertiesKHR ray_tracing_properties = {0};
+    ray_tracing_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_PROPERTIES_KHR;
+    VkPhysicalDeviceProperties2 properties = {0};
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties.pNext = &ray_tracing_properties;
+    vkGetPhysicalDeviceProperties2(glbl.physical, &properties);
+
+    VkPipelineLayoutCreateInfo layout_create_info = {0};
+    layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    layout_create_info.setLayoutCount = 1;
+    layout_create_info.pSetLayouts = &glbl.raster_descriptor_set_layout;
+
+    PROPAGATE_VK(vkCreatePipelineLayout(glbl.device, &layout_create_info, NULL, &glbl.trace_pipeline_layout));
+
+    const char* shader_paths[4] = {"shaders/trace.rgen.spv", "shaders/trace.rmiss.spv", "shaders/trace.rchit.spv", "shaders/trace.rint.spv"};
+    VkShaderStageFlagBits shader_stages[4] = {VK_SHADER_STAGE_RAYGEN_BIT_KHR, VK_SHADER_STAGE_MISS_BIT_KHR, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, VK_SHADER_STAGE_INTERSECTION_BIT_KHR};
+    VkShaderModule shaders[4];
+    VkPipelineShaderStageCreateInfo stage_create_infos[4] = {0};
+    for (uint32_t i = 0; i < 4; ++i) {
+	PROPAGATE(create_shader_module(&shaders[i], shader_paths[i]));
+	stage_create_infos[i].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	stage_create_infos[i].stage = shader_stages[i];
+	stage_create_infos[i].module = shaders[i];
+	stage_create_infos[i].pName = "main";
+    }
+
+    VkRayTracingShaderGroupCreateInfoKHR groups[3] = {0};
+    for (uint32_t i = 0; i < 3; ++i) {
+	groups[i].sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR;
+	groups[i].type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR;
+	groups[i].generalShader = i;
+	groups[i].closestHitShader = VK_SHADER_UNUSED_KHR;
+	groups[i].anyHitShader = VK_SHADER_UNUSED_KHR;
+	groups[i].intersectionShader = VK_SHADER_UNUSED_KHR;
+    }
+    groups[2].type = VK_RAY_TRACING_SHADER_GROUP_TYPE_PROCEDURAL_HIT_GROUP_KHR;
+    groups[2].generalShader = VK_SHADER_UNUSED_KHR;
+    groups[2].closestHitShader = 2;
+    groups[2].intersectionShader = 3;
+
+    VkRayTracingPipelineCreateInfoKHR pipeline_create_info = {0};
+    pipeline_create_info.sType = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR;
+    pipeline_create_info.stageCount = 4;
+    pipeline_create_info.pStages = stage_create_infos;
+    pipeline_create_info.groupCount = 3;
+    pipeline_create_info.pGroups = groups;
+    pipeline_create_info.maxPipelineRayRecursionDepth = 1;
+    pipeline_create_info.layout = glbl.trace_pipeline_layout;
+
+    PROPAGATE_VK(vkCreateRayTracingPipelines(glbl.device, VK_NULL_HANDLE, VK_NULL_HANDLE, 1, &pipeline_create_info, NULL, &glbl.trace_pipeline));
+
+    for (uint32_t i = 0; i < 4; ++i) {
+	vkDestroyShaderModule(glbl.device, shaders[i], NULL);
+    }
+
+    // Each group gets its own region of the shader binding table, starting
+    // at a multiple of the base alignment.
+    uint32_t handle_size = ray_tracing_properties.shaderGroupHandleSize;
+    VkDeviceSize handle_stride = align_up(handle_size, ray_tracing_properties.shaderGroupHandleAlignment);
+    VkDeviceSize region_size = align_up(handle_stride, ray_tracing_properties.shaderGroupBaseAlignment);
+
+    uint8_t handles[3 * 64];
+    if (handle_size > 64) {
+	fprintf(stderr, "ERROR: Shader group handles are too large\n");
+	return CUSTOM_ERROR;
+    }
+    PROPAGATE_VK(vkGetRayTracingShaderGroupHandles(glbl.device, glbl.trace_pipeline, 0, 3, 3 * handle_size, handles));
+
+    VkDeviceAddress table_address;
+    PROPAGATE(create_address_buffer(3 * region_size, VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, ray_tracing_properties.shaderGroupBaseAlignment, &glbl.shader_binding_table_buffer, &glbl.shader_binding_table_allocation, &table_address));
+    for (uint32_t i = 0; i < 3; ++i) {
+	memcpy((uint8_t*) glbl.shader_binding_table_allocation.mapped + i * region_size, handles + i * handle_size, handle_size);
+    }
+
+    VkStridedDeviceAddressRegionKHR* regions[3] = {&glbl.raygen_region, &glbl.miss_region, &glbl.hit_region};
+    for (uint32_t i = 0; i < 3; ++i) {
+	regions[i]->deviceAddress = table_address + i * region_size;
+	regions[i]->stride = handle_stride;
+	regions[i]->size = handle_stride;
+    }
+    // The ray generation region's stride has to equal its size.
+    glbl.raygen_region.stride = region_size;
+    glbl.raygen_region.size = region_size;
+    memset(&glbl.callable_region, 0, sizeof(glbl.callable_region));
+
+    return SUCCESS;
+}
+
+result create_ray_tracing_objects(void) {
+    if (!glbl.ray_trace) return SUCCESS;
+
+    VkPhysicalDeviceAccelerationStructurePropertiesKHR acceleration_properties = {0};
+    acceleration_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR;
+    VkPhysicalDeviceProperties2 properties = {0};
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties.pNext = &acceleration_properties;
+    vkGetPhysicalDeviceProperties2(glbl.physical, &properties);
+    glbl.scratch_alignment = acceleration_properties.minAccelerationStructureScratchOffsetAlignment;
+    if (glbl.scratch_alignment == 0) glbl.scratch_alignment = 1;
+
+    PROPAGATE(create_cube_blas());
+    PROPAGATE(create_trace_pipeline());
+    PROPAGATE(create_trace_images());
+
+    return SUCCESS;
+}
+
+// Frames are traced into a float image, which is then blitted to the
+// swapchain image, since swapchain formats generally can't be storage images.
+result create_trace_images(void) {
+    if (!glbl.ray_trace) return SUCCESS;
+
+    VkExtent3D extent;
+    extent.width = glbl.swapchain_extent.width;
+    extent.height = glbl.swapchain_extent.height;
+    extent.depth = 1;
+
+    VkImageSubresourceRange subresource_range = {0};
+    subresource_range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    subresource_range.baseMipLevel = 0;
+    subresource_range.levelCount = 1;
+    subresource_range.baseArrayLayer = 0;
+    subresource_range.layerCount = 1;
+
+    for (uint32_t i = 0; i < FRAMES_IN_FLIGHT; ++i) {
+	PROPAGATE(create_image(0, TRACE_IMAGE_FORMAT, extent, 1, 1, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_SHARING_MODE_EXCLUSIVE, &glbl.trace_images[i]));
+	PROPAGATE(allocate_image_memory(glbl.trace_images[i], VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &glbl.trace_image_allocations[i]));
+	PROPAGATE(create_image_view(glbl.trace_images[i], VK_IMAGE_VIEW_TYPE_2D, TRACE_IMAGE_FORMAT, subresource_range, &glbl.trace_image_views[i]));
+	PROPAGATE(update_trace_image_descriptors(i));
+    }
+
+    return SUCCESS;
+}
+
+static result create_tlas(uint32_t frame, uint32_t capacity) {
+    PROPAGATE(create_address_buffer(capacity * sizeof(VkAccelerationStructureInstanceKHR), VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 16, &glbl.tlas_instance_buffers[frame], &glbl.tlas_instance_allocations[frame], &glbl.tlas_instance_addresses[frame]));
+
+    VkAccelerationStructureGeometryKHR geometry = {0};
+    geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+    geometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+    geometry.geometry.instances.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
+
+    VkAccelerationStructureBuildGeometryInfoKHR geometry_info = {0};
+    geometry_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+    geometry_info.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+    geometry_info.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+    geometry_info.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+    geometry_info.geometryCount = 1;
+    geometry_info.pGeometries = &geometry;
+
+    VkAccelerationStructureBuildSizesInfoKHR build_size = {0};
+    build_size.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+    vkGetAccelerationStructureBuildSizes(glbl.device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &geometry_info, &capacity, &build_size);
+
+    PROPAGATE(create_address_buffer(build_size.accelerationStructureSize, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 256, &glbl.tlas_buffers[frame], &glbl.tlas_allocations[frame], NULL));
+    // The same scratch buffer is used for builds and refits.
+    VkDeviceSize scratch_size = build_size.buildScratchSize > build_size.updateScratchSize ? build_size.buildScratchSize : build_size.updateScratchSize;
+    PROPAGATE(create_address_buffer(scratch_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, glbl.scratch_alignment, &glbl.tlas_scratch_buffers[frame], &glbl.tlas_scratch_allocations[frame], &glbl.tlas_scratch_addresses[frame]));
+
+    VkAccelerationStructureCreateInfoKHR create_info = {0};
+    create_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+    create_info.buffer = glbl.tlas_buffers[frame];
+    create_info.offset = 0;
+    create_info.size = build_size.accelerationStructureSize;
+    create_info.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+
+    PROPAGATE_VK(vkCreateAccelerationStructure(glbl.device, &create_info, NULL, &glbl.tlas[frame]));
+    glbl.tlas_capacities[frame] = capacity;
+    glbl.tlas_instance_counts[frame] = 0;
+    glbl.tlas_force_build[frame] = 1;
+
+    glbl.tlas_keys[frame] = malloc(capacity * sizeof(uint32_t));
+    if (!glbl.tlas_keys[frame]) {
+	fprintf(stderr, "ERROR: Couldn't allocate TLAS keys\n");
+	return CUSTOM_ERROR;
+    }
+
+    PROPAGATE(update_tlas_descriptors(frame));
+
+    return SUCCESS;
+}
+
+static void cleanup_tlas(uint32_t frame) {
+    if (glbl.tlas_capacities[frame] == 0) return;
+
+    vkDestroyAccelerationStructure(glbl.device, glbl.tlas[frame], NULL);
+    vkDestroyBuffer(glbl.device, glbl.tlas_buffers[frame], NULL);
+    free_memory(&glbl.tlas_allocations[frame]);
+    vkDestroyBuffer(glbl.device, glbl.tlas_scratch_buffers[frame], NULL);
+    free_memory(&glbl.tlas_scratch_allocations[frame]);
+    vkDestroyBuffer(glbl.device, glbl.tlas_instance_buffers[frame], NULL);
+    free_memory(&glbl.tlas_instance_allocations[frame]);
+    free(glbl.tlas_keys[frame]);
+    glbl.tlas_keys[frame] = NULL;
+    glbl.tlas_capacities[frame] = 0;
+}
+
+// Writes a TLAS instance for every instance in frame's draw lists, so the
+// TLAS holds exactly what the raster path would draw. The custom index is
+// the texture ID. Called once frame's timeline value has been waited on, so
+// frame's TLAS can be replaced when it's too small. Decides whether the TLAS
+// is rebuilt, refit, or left alone this frame, by comparing the drawn
+// instances and their versions against the ones it was last written with.
+result update_tlas(uint32_t frame) {
+    if (!glbl.ray_trace) return SUCCESS;
+
+    PROPAGATE(compact_cube_blas());
+
+    uint32_t num_instances = 0;
+    for (uint32_t stream = 0; stream < NUM_INSTANCE_STREAMS; ++stream) {
+	num_instances += glbl.instance_streams[stream].draw_count;
+    }
+
+    if (num_instances > glbl.tlas_capacities[frame] || glbl.tlas_capacities[frame] == 0) {
+	cleanup_tlas(frame);
+	PROPAGATE(create_tlas(frame, round_up_p2(num_instances > 0 ? num_instances : 1)));
+    }
+
+    // Refits need the same instances in the same order, so each TLAS
+    // instance's stream and entry is compared against the last write.
+    uint32_t same_count = num_instances == glbl.tlas_instance_counts[frame];
+    uint32_t num_changed = 0;
+    uint32_t key_index = 0;
+    for (uint32_t stream = 0; stream < NUM_INSTANCE_STREAMS; ++stream) {
+	instance_stream* instances = &glbl.instance_streams[stream];
+	for (uint32_t i = 0; i < instances->draw_count; ++i) {
+	    uint32_t key = (stream << 31) | instances->draw_list_data[frame][i];
+	    if (same_count && glbl.tlas_keys[frame][key_index] != key) ++num_changed;
+	    glbl.tlas_keys[frame][key_index++] = key;
+	}
+    }
+
+    // Any update to a drawn stream since the last write may have moved its
+    // instances. Dirty ranges are only kept for the last FRAMES_IN_FLIGHT
+    // updates, so older TLASes are assumed dirty.
+    uint32_t dirty = 0;
+    for (uint32_t stream = 0; stream < NUM_INSTANCE_STREAMS; ++stream) {
+	instance_stream* instances = &glbl.instance_streams[stream];
+	uint64_t last_version = glbl.tlas_instance_versions[frame][stream];
+	if (instances->version - last_version > FRAMES_IN_FLIGHT) {
+	    dirty = 1;
+	}
+	else {
+	    for (uint64_t version = last_version + 1; version <= instances->version; ++version) {
+		if (dynarray_len(&instances->dirty_ranges[version % FRAMES_IN_FLIGHT]) > 0) dirty = 1;
+	    }
+	}
+	glbl.tlas_instance_versions[frame][stream] = instances->version;
+    }
+
+    tlas_build_mode mode;
+    if (glbl.tlas_force_build[frame] || !same_count || glbl.tlas_updates_since_build[frame] >= TLAS_MAX_UPDATES || (uint64_t) (glbl.tlas_changes_since_build[frame] + num_changed) * TLAS_REBUILD_FRACTION > num_instances) {
+	mode = TLAS_BUILD;
+	glbl.tlas_force_build[frame] = 0;
+	glbl.tlas_updates_since_build[frame] = 0;
+	glbl.tlas_changes_since_build[frame] = 0;
+    }
+    else if (num_changed == 0 && !dirty) {
+	mode = TLAS_SKIP;
+    }
+    else {
+	mode = TLAS_UPDATE;
+	++glbl.tlas_updates_since_build[frame];
+	glbl.tlas_changes_since_build[frame] += num_changed;
+    }
+    glbl.tlas_build_modes[frame] = mode;
+    glbl.tlas_instance_counts[frame] = num_instances;
+    if (mode == TLAS_SKIP) return SUCCESS;
+
+    VkAccelerationStructureInstanceKHR* tlas_instances = glbl.tlas_instance_allocations[frame].mapped;
+    uint32_t tlas_index = 0;
+    for (uint32_t stream = 0; stream < NUM_INSTANCE_STREAMS; ++stream) {
+	instance_stream* instances = &glbl.instance_streams[stream];
+	for (uint32_t i = 0; i < instances->draw_count; ++i) {
+	    uint8_t* instance = instances->data + instances->draw_list_data[frame][i] * instances->stride;
+	    VkAccelerationStructureInstanceKHR* tlas_instance = &tlas_instances[tlas_index++];
+	    memset(tlas_instance, 0, sizeof(*tlas_instance));
+
+	    // Transforms are row major 3x4 matrices, where the model matrices
+	    // are column major 4x4.
+	    uint32_t texture_id;
+	    if (stream == INSTANCE_STREAM_MODEL) {
+		const float* model = (const float*) instance;
+		for (uint32_t row = 0; row < 3; ++row) {
+		    for (uint32_t column = 0; column < 4; ++column) {
+			tlas_instance->transform.matrix[row][column] = model[column * 4 + row];
+		    }
+		}
+		memcpy(&texture_id, &model[15], sizeof(texture_id));
+	    }
+	    else {
+		const uint32_t* aligned = (const uint32_t*) instance;
+		float scale = (float) (aligned[3] >> 16) / 256.0f;
+		for (uint32_t axis = 0; axis < 3; ++axis) {
+		    tlas_instance->transform.matrix[axis][axis] = scale;
+		    tlas_instance->transform.matrix[axis][3] = (float) (int32_t) aligned[axis] * scale;
+		}
+		texture_id = aligned[3] & 0xFFFF;
+	    }
+
+	    tlas_instance->instanceCustomIndex = texture_id;
+	    tlas_instance->mask = 0xFF;
+	    tlas_instance->instanceShaderBindingTableRecordOffset = 0;
+	    tlas_instance->flags = VK_GEOMETRY_INSTANCE_FORCE_OPAQUE_BIT_KHR;
+	    tlas_instance->accelerationStructureReference = glbl.cube_blas_address;
+	}
+    }
+
+    return SUCCESS;
+}
+
+// Rebuilds or refits the current frame's TLAS, as decided by update_tlas,
+// traces the frame into its trace image, and blits that to the swapchain
+// image, leaving it ready to present, or to be read back when headless.
+void record_trace_commands(VkCommandBuffer command_buffer, uint32_t image_index) {
+    uint32_t frame = glbl.current_frame;
+    tlas_build_mode mode = glbl.tlas_build_modes[frame];
+
+    VkAccelerationStructureGeometryKHR geometry = {0};
+    geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+    geometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+    geometry.geometry.instances.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
+    geometry.geometry.instances.data.deviceAddress = glbl.tlas_instance_addresses[frame];
+
+    VkAccelerationStructureBuildGeometryInfoKHR geometry_info = {0};
+    geometry_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+    geometry_info.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+    geometry_info.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+    geometry_info.mode = mode == TLAS_UPDATE ? VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR : VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+    geometry_info.srcAccelerationStructure = mode == TLAS_UPDATE ? glbl.tlas[frame] : VK_NULL_HANDLE;
+    geometry_info.dstAccelerationStructure = glbl.tlas[frame];
+    geometry_info.geometryCount = 1;
+    geometry_info.pGeometries = &geometry;
+    geometry_info.scratchData.deviceAddress = glbl.tlas_scratch_addresses[frame];
+
+    VkAccelerationStructureBuildRangeInfoKHR range_info = {0};
+    range_info.primitiveCount = glbl.tlas_instance_counts[frame];
+    const VkAccelerationStructureBuildRangeInfoKHR* range_infos[] = {&range_info};
+
+    if (mode != TLAS_SKIP) {
+	vkCmdBuildAccelerationStructures(command_buffer, 1, &geometry_info, range_infos);
+    }
+
+    VkImageSubresourceRange subresource_range = {0};
+    subresource_range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    subresource_range.baseMipLevel = 0;
+    subresource_range.levelCount = 1;
+    subresource_range.baseArrayLayer = 0;
+    subresource_range.layerCount = 1;
+
+    VkMemoryBarrier build_barrier = {0};
+    build_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    build_barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    build_barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+
+    VkImageMemoryBarrier image_barriers[2] = {0};
+    image_barriers[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    image_barriers[0].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    image_barriers[0].newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    image_barriers[0].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    image_barriers[0].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    image_barriers[0].image = glbl.trace_images[frame];
+    image_barriers[0].subresourceRange = subresource_range;
+    image_barriers[0].srcAccessMask = 0;
+    image_barriers[0].dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, 0, 1, &build_barrier, 0, NULL, 1, image_barriers);
+
+    begin_gpu_pass(command_buffer, GPU_PASS_RASTER);
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, glbl.trace_pipeline);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, glbl.trace_pipeline_layout, 0, 1, &glbl.raster_descriptor_sets[frame], 0, NULL);
+    vkCmdTraceRays(command_buffer, &glbl.raygen_region, &glbl.miss_region, &glbl.hit_region, &glbl.callable_region, glbl.swapchain_extent.width, glbl.swapchain_extent.height, 1);
+    end_gpu_pass(command_buffer, GPU_PASS_RASTER);
+
+    // The swapchain image's first use is this blit, which waits on the image
+    // available semaphore at the transfer stage.
+    image_barriers[0].oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+    image_barriers[0].newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    image_barriers[0].srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    image_barriers[0].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+    VkImage swapchain_image = INDEX(image_index, glbl.swapchain_images, VkImage);
+    image_barriers[1] = image_barriers[0];
+    image_barriers[1].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    image_barriers[1].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    image_barriers[1].image = swapchain_image;
+    image_barriers[1].srcAccessMask = 0;
+    image_barriers[1].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 2, image_barriers);
+
+    VkImageBlit blit = {0};
+    blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    blit.srcSubresource.layerCount = 1;
+    blit.srcOffsets[1].x = glbl.swapchain_extent.width;
+    blit.srcOffsets[1].y = glbl.swapchain_extent.height;
+    blit.srcOffsets[1].z = 1;
+    blit.dstSubresource = blit.srcSubresource;
+    blit.dstOffsets[1] = blit.srcOffsets[1];
+    vkCmdBlitImage(command_buffer, glbl.trace_images[frame], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, swapchain_image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit, VK_FILTER_NEAREST);
+
+    image_barriers[1].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    image_barriers[1].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    if (glbl.headless) {
+	image_barriers[1].newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+	image_barriers[1].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1, &image_barriers[1]);
+    }
+    else {
+	image_barriers[1].newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+	image_barriers[1].dstAccessMask = 0;
+	vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL, 0, NULL, 1, &image_barriers[1]);
+    }
+}
+
+void cleanup_trace_images(void) {
+    if (!glbl.ray_trace) return;
+
+    for (uint32_t i = 0; i < FRAMES_IN_FLIGHT; ++i) {
+	vkDestroyImageView(glbl.device, glbl.trace_image_views[i], NULL);
+	vkDestroyImage(glbl.device, glbl.trace_images[i], NULL);
+	free_memory(&glbl.trace_image_allocations[i]);
+    }
+}
+
+void cleanup_ray_tracing_objects(void) {
+    if (!glbl.ray_trace) return;
+
+    for (uint32_t i = 0; i < FRAMES_IN_FLIGHT; ++i) {
+	cleanup_tlas(i);
+    }
+    if (glbl.cube_blas_compaction == BLAS_COMPACTION_RETIRING) {
+	vkDestroyAccelerationStructure(glbl.device, glbl.retired_cube_blas, NULL);
+	vkDestroyBuffer(glbl.device, glbl.retired_cube_blas_buffer, NULL);
+	free_memory(&glbl.retired_cube_blas_allocation);
+    }
+    vkDestroyQueryPool(glbl.device, glbl.blas_query_pool, NULL);
+    vkDestroyAccelerationStructure(glbl.device, glbl.cube_blas, NULL);
+    vkDestroyBuffer(glbl.device, glbl.cube_blas_buffer, NULL);
+    free_memory(&glbl.cube_blas_allocation);
+    vkDestroyBuffer(glbl.device, glbl.cube_scratch_buffer, NULL);
+    free_memory(&glbl.cube_scratch_allocation);
+    vkDestroyBuffer(glbl.device, glbl.cube_aabb_buffer, NULL);
+    free_memory(&glbl.cube_aabb_allocation);
+
+    vkDestroyBuffer(glbl.device, glbl.shader_binding_table_buffer, NULL);
+    free_memory(&glbl.shader_binding_table_allocation);
+    vkDestroyPipeline(glbl.device, glbl.trace_pipeline, NULL);
+    vkDestroyPipelineLayout(glbl.device, glbl.trace_pipeline_layout, NULL);
+}
@@ -40,7 +40,8 @@ result create_swapchain(void) {
     create_info.imageColorSpace = surface_format.colorSpace;
     create_info.imageExtent = swap_extent;
     create_info.imageArrayLayers = 1;
-    create_info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+    // Ray traced frames are blitted to the swapchain image.
+    create_info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | (glbl.ray_trace ? VK_IMAGE_USAGE_TRANSFER_DST_BIT : 0);
     create_info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
     create_info.preTransform = support.capabilities.currentTransform;
     create_info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
@@ -82,6 +83,119 @@ result create_swapchain(void) {
     return SUCCESS;
 }
 
+// Readback buffers are read by the host after every frame, so cached memory
+// is preferred when the device has it.
+static VkMemoryPropertyFlags readback_memory_properties(VkBuffer buffer) {
+    VkMemoryPropertyFlags cached = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(glbl.device, buffer, &requirements);
+    VkPhysicalDeviceMemoryProperties physical_mem_properties;
+    vkGetPhysicalDeviceMemoryProperties(glbl.physical, &physical_mem_properties);
+    for (uint32_t i = 0; i < physical_mem_properties.memoryTypeCount; i++) {
+	if ((requirements.memoryTypeBits & (1 << i)) && (physical_mem_properties.memoryTypes[i].propertyFlags & cached) == cached) {
+	    return cached;
+	}
+    }
+
+    return VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+}
+
+// Headless renderers draw into one offscreen image per frame in flight, which
+// stand in for the swapchain images everywhere else.
+result create_offscreen_targets(void) {
+    if (glbl.window_width == 0 || glbl.window_height == 0) {
+	fprintf(stderr, "ERROR: Headless render size must be non-zero\n");
+	return CUSTOM_ERROR;
+    }
+
+    glbl.swapchain_format = VK_FORMAT_B8G8R8A8_SRGB;
+    glbl.swapchain_extent.width = glbl.window_width;
+    glbl.swapchain_extent.height = glbl.window_height;
+
+    VkExtent3D extent;
+    extent.width = glbl.swapchain_extent.width;
+    extent.height = glbl.swapchain_extent.height;
+    extent.depth = 1;
+
+    VkImageSubresourceRange subresource_range = {0};
+    subresource_range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    subresource_range.baseMipLevel = 0;
+    subresource_range.levelCount = 1;
+    subresource_range.baseArrayLayer = 0;
+    subresource_range.layerCount = 1;
+
+    PROPAGATE(dynarray_create(sizeof(VkImage), FRAMES_IN_FLIGHT, &glbl.swapchain_images));
+    PROPAGATE(dynarray_create(sizeof(VkImageView), FRAMES_IN_FLIGHT, &glbl.swapchain_image_views));
+    PROPAGATE(dynarray_create(sizeof(allocation), FRAMES_IN_FLIGHT, &glbl.offscreen_allocations));
+    for (uint32_t i = 0; i < FRAMES_IN_FLIGHT; ++i) {
+	VkImage image;
+	VkImageView view;
+	allocation image_allocation;
+	PROPAGATE(create_image(0, glbl.swapchain_format, extent, 1, 1, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | (glbl.ray_trace ? VK_IMAGE_USAGE_TRANSFER_DST_BIT : 0), VK_SHARING_MODE_EXCLUSIVE, &image));
+	PROPAGATE(allocate_image_memory(image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &image_allocation));
+	PROPAGATE(create_image_view(image, VK_IMAGE_VIEW_TYPE_2D, glbl.swapchain_format, subresource_range, &view));
+	PROPAGATE(dynarray_push(&image, &glbl.swapchain_images));
+	PROPAGATE(dynarray_push(&view, &glbl.swapchain_image_views));
+	PROPAGATE(dynarray_push(&image_allocation, &glbl.offscreen_allocations));
+    }
+
+    if (glbl.readback) {
+	VkDeviceSize readback_size = (VkDeviceSize) glbl.swapchain_extent.width * glbl.swapchain_extent.height * 4;
+	for (uint32_t i = 0; i < FRAMES_IN_FLIGHT; ++i) {
+	    PROPAGATE(create_buffer(readback_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT, &glbl.readback_buffers[i]));
+	    PROPAGATE(allocate_buffer_memory(glbl.readback_buffers[i], readback_memory_properties(glbl.readback_buffers[i]), 0, &glbl.readback_allocations[i]));
+	    glbl.readback_frames[i] = 0;
+	}
+    }
+
+    return SUCCESS;
+}
+
+static int32_t take_readback_slot(uint32_t slot, uint32_t wait, uint64_t* frame, const uint8_t** pixels) {
+    if (wait) {
+	PROPAGATE_C(wait_timeline(glbl.graphics_timeline, glbl.frame_timeline_values[slot]));
+    }
+    else if (get_timeline_value(glbl.graphics_timeline) < glbl.frame_timeline_values[slot]) {
+	return 0;
+    }
+
+    *frame = glbl.readback_frames[slot];
+    *pixels = glbl.readback_allocations[slot].mapped;
+    glbl.readback_frames[slot] = 0;
+
+    return 1;
+}
+
+// Returns 1 and the oldest rendered frame not yet taken, with its pixels in
+// B8G8R8A8 rows of width * 4 bytes, or 0 if there is none. Without wait, only
+// frames that have already finished on the device are returned. The pixels
+// stay valid until render_tick is next called.
+int32_t take_readback(uint32_t wait, uint64_t* frame, const uint8_t** pixels) {
+    if (!glbl.readback) return 0;
+
+    uint32_t oldest = FRAMES_IN_FLIGHT;
+    for (uint32_t i = 0; i < FRAMES_IN_FLIGHT; ++i) {
+	if (glbl.readback_frames[i] && (oldest == FRAMES_IN_FLIGHT || glbl.readback_frames[i] < glbl.readback_frames[oldest])) {
+	    oldest = i;
+	}
+    }
+    if (oldest == FRAMES_IN_FLIGHT) return 0;
+
+    return take_readback_slot(oldest, wait, frame, pixels);
+}
+
+// Like take_readback, but takes the frame whose readback the next render_tick
+// overwrites, waiting for it if needed. render_tick waits for the same frame
+// before reusing its slot, so this doesn't stall any longer than it would.
+// That frame is always the oldest one not yet taken, so frames are still
+// taken in order.
+int32_t take_reused_readback(uint64_t* frame, const uint8_t** pixels) {
+    if (!glbl.readback || !glbl.readback_frames[glbl.current_frame]) return 0;
+
+    return take_readback_slot(glbl.current_frame, 1, frame, pixels);
+}
+
 result choose_swapchain_options(swapchain_support* support, VkSurfaceFormatKHR* surface_format, VkPresentModeKHR* present_mode, VkExtent2D* swap_extent) {
     uint32_t format_index;
     for (format_index = 0; format_index < support->num_formats; ++format_index) {
@@ -142,11 +256,14 @@ result recreate_swapchain(void) {
     PROPAGATE(create_swapchain());
     PROPAGATE(create_depth_resources());
     PROPAGATE(create_framebuffers());
+    PROPAGATE(create_trace_images());
 
     return SUCCESS;
 }
 
 void cleanup_swapchain(void) {
+    cleanup_trace_images();
+
     for (uint32_t framebuffer_index = 0; framebuffer_index < dynarray_len(&glbl.framebuffers); ++framebuffer_index) {
 	vkDestroyFramebuffer(glbl.device, INDEX(framebuffer_index, glbl.framebuffers, VkFramebuffer), NULL);
     }
@@ -160,6 +277,21 @@ void cleanup_swapchain(void) {
     vkFreeMemory(glbl.device, glbl.depth_image_memory, NULL);
 
     dynarray_destroy(&glbl.swapchain_image_views);
+    if (glbl.headless) {
+	for (uint32_t image_index = 0; image_index < dynarray_len(&glbl.swapchain_images); ++image_index) {
+	    vkDestroyImage(glbl.device, INDEX(image_index, glbl.swapchain_images, VkImage), NULL);
+	    free_memory(&INDEX(image_index, glbl.offscreen_allocations, allocation));
+	}
+	dynarray_destroy(&glbl.offscreen_allocations);
+	if (glbl.readback) {
+	    for (uint32_t i = 0; i < FRAMES_IN_FLIGHT; ++i) {
+		vkDestroyBuffer(glbl.device, glbl.readback_buffers[i], NULL);
+		free_memory(&glbl.readback_allocations[i]);
+	    }
+	}
+    }
+    else {
+	vkDestroySwapchainKHR(glbl.device, glbl.swapchain, NULL);
+    }
     dynarray_destroy(&glbl.swapchain_images);
-    vkDestroySwapchainKHR(glbl.device, glbl.swapchain, NULL);
 }
@@ -22,18 +22,56 @@ result create_synchronization(void) {
     VkSemaphoreCreateInfo semaphore_info = {0};
     semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-    VkFenceCreateInfo fence_info = {0};
-    fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-
+    // The swapchain only takes binary semaphores, so acquiring and presenting
+    // still use them.
     for (uint32_t i = 0; i < FRAMES_IN_FLIGHT; ++i) {
 	PROPAGATE_VK(vkCreateSemaphore(glbl.device, &semaphore_info, NULL, &glbl.image_available_semaphore[i]));
 	PROPAGATE_VK(vkCreateSemaphore(glbl.device, &semaphore_info, NULL, &glbl.render_finished_semaphore[i]));
-	PROPAGATE_VK(vkCreateFence(glbl.device, &fence_info, NULL, &glbl.frame_in_flight_fence[i]));
-	PROPAGATE_VK(vkCreateSemaphore(glbl.device, &semaphore_info, NULL, &glbl.secondary_finished_semaphore[i]));
     }
 
-    PROPAGATE_VK(vkCreateFence(glbl.device, &fence_info, NULL, &glbl.texture_upload_finished_fence));
+    VkSemaphoreTypeCreateInfo timeline_info = {0};
+    timeline_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    timeline_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    timeline_info.initialValue = 0;
+    semaphore_info.pNext = &timeline_info;
+
+    PROPAGATE_VK(vkCreateSemaphore(glbl.device, &semaphore_info, NULL, &glbl.graphics_timeline));
+    PROPAGATE_VK(vkCreateSemaphore(glbl.device, &semaphore_info, NULL, &glbl.transfer_timeline));
+    glbl.graphics_timeline_value = 0;
+    glbl.transfer_timeline_value = 0;
+    for (uint32_t i = 0; i < FRAMES_IN_FLIGHT; ++i) {
+	glbl.frame_timeline_values[i] = 0;
+    }
 
     return SUCCESS;
 }
+
+// Returns the value timeline has reached. Doesn't block.
+uint64_t get_timeline_value(VkSemaphore timeline) {
+    uint64_t value = 0;
+    vkGetSemaphoreCounterValue(glbl.device, timeline, &value);
+    return value;
+}
+
+result wait_timeline(VkSemaphore timeline, uint64_t value) {
+    VkSemaphoreWaitInfo wait_info = {0};
+    wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    wait_info.semaphoreCount = 1;
+    wait_info.pSemaphores = &timeline;
+    wait_info.pValues = &value;
+
+    PROPAGATE_VK(vkWaitSemaphores(glbl.device, &wait_info, UINT64_MAX));
+
+    return SUCCESS;
+}
+
+// Returns the graphics timeline value that the uploads queued so far will
+// have finished by. They're submitted by the next frame, whose secondary
+// submission signals the first of its values.
+uint64_t get_upload_timeline_value(void) {
+    return glbl.graphics_timeline_value + 1;
+}
+
+int32_t is_upload_finished(uint64_t timeline_value) {
+    return get_timeline_value(glbl.graphics_timeline) >= timeline_value;
+}
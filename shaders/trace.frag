@@ -21,14 +21,21 @@ layout (location = 1) in vec4 world_position;
 layout (location = 2) in vec4 model_position;
 layout (location = 3) in flat uint object_id;
 layout (location = 4) in flat uint texture_id;
-layout (location = 5) in flat mat4 model_matrix;
+layout (location = 5) in flat mat4 model_inverse;
 
 layout (push_constant) uniform PushConstants {
     mat4 projection;
     mat4 camera;
 } push;
 
-layout(set = 0, binding = 0) uniform sampler3D tex[];
+// Inverses of the camera transforms, computed once per frame on the CPU.
+layout(set = 0, binding = 2) uniform Camera {
+    mat4 inverse_view_projection;
+    mat4 inverse_centered_view_projection;
+    vec4 position;
+} cam;
+
+layout(set = 0, binding = 5) uniform sampler3D tex[];
 
 layout (location = 0) out vec4 color;
 layout (location = 1) out vec4 history_write;
@@ -38,6 +45,12 @@ layout (depth_greater) out float gl_FragDepth;
 #define LOD_SCALE 0.0
 #define LOD_MAX 4
 
+// Must match lib/common.h.
+#define ATLAS_TEXTURE_BIT 0x8000
+#define ATLAS_SLOT_SIZE 16
+#define ATLAS_SLOTS_PER_AXIS 16
+#define ATLAS_SLOTS (ATLAS_SLOTS_PER_AXIS * ATLAS_SLOTS_PER_AXIS * ATLAS_SLOTS_PER_AXIS)
+
 void main() {
     // Since we write to the depth buffer with custom logic, we "statically"
     // write to it. According to the GLSL specification, this means that we
@@ -45,24 +58,30 @@ void main() {
     // value at the beginning.
     gl_FragDepth = screen_position.z / screen_position.w;
 
-    mat4 inverse_projection = inverse(push.projection);
-    mat4 inverse_camera = inverse(push.camera);
-    
-    vec3 cam_pos = (inverse_camera * vec4(0.0, 0.0, 0.0, 1.0)).xyz;
-    vec3 ray_pos = (inverse_camera * inverse_projection * screen_position).xyz;
-
-    mat4 centered_camera = push.camera;
-    centered_camera[3][0] = 0.0;
-    centered_camera[3][1] = 0.0;
-    centered_camera[3][2] = 0.0;
-    
-    vec3 ray_dir = normalize((inverse(centered_camera) * inverse_projection * screen_position).xyz);
+    vec3 cam_pos = cam.position.xyz;
+    vec3 ray_pos = (cam.inverse_view_projection * screen_position).xyz;
+    vec3 ray_dir = normalize((cam.inverse_centered_view_projection * screen_position).xyz);
 
     int lod = min(int(LOD_SCALE * length(cam_pos - ray_pos)), LOD_MAX);
 
-    ivec3 i_model_size = textureSize(tex[texture_id], lod);
+    // Atlas textures are a slot of a larger image, so voxels are offset by
+    // the slot's origin. Voxels are fetched by integer coordinate, so
+    // neighbouring slots are never sampled.
+    uint image = texture_id;
+    ivec3 image_origin = ivec3(0);
+    ivec3 i_model_size;
+    if ((texture_id & ATLAS_TEXTURE_BIT) != 0) {
+	uint slot = texture_id & ~ATLAS_TEXTURE_BIT;
+	uint atlas_slot = slot % ATLAS_SLOTS;
+	image = ATLAS_TEXTURE_BIT + slot / ATLAS_SLOTS;
+	image_origin = ATLAS_SLOT_SIZE * ivec3(atlas_slot % ATLAS_SLOTS_PER_AXIS, atlas_slot / ATLAS_SLOTS_PER_AXIS % ATLAS_SLOTS_PER_AXIS, atlas_slot / (ATLAS_SLOTS_PER_AXIS * ATLAS_SLOTS_PER_AXIS));
+	i_model_size = ivec3(ATLAS_SLOT_SIZE);
+    }
+    else {
+	i_model_size = textureSize(tex[image], lod);
+    }
     vec3 model_size = vec3(i_model_size);
-    vec3 model_ray_dir = (inverse(model_matrix) * vec4(ray_dir, 0.0)).xyz;
+    vec3 model_ray_dir = (model_inverse * vec4(ray_dir, 0.0)).xyz;
     vec3 model_ray_pos = (model_position.xyz + 0.5) * model_size;
 
     ivec3 model_ray_voxel = ivec3(floor(min(model_ray_pos, model_size - 1.0)));
@@ -73,7 +92,7 @@ void main() {
     uint steps = 0;
     uint max_steps = i_model_size.x + i_model_size.y + i_model_size.z;
     while (steps < max_steps && all(greaterThanEqual(model_ray_voxel, ivec3(0))) && all(lessThan(model_ray_voxel, i_model_size))) {
-	vec4 texSample = texture(tex[texture_id], model_ray_voxel / model_size);
+	vec4 texSample = texelFetch(tex[image], image_origin + model_ray_voxel, lod);
 
 	if (texSample.w > 0.0) {
 	    color = texSample;
@@ -15,7 +15,15 @@
 #version 460
 
 layout (location = 0) in vec3 position;
-layout (location = 1) in mat4 model;
+layout (location = 1) in uint instance_entry;
+
+struct Instance {
+    mat4 model;
+};
+
+layout (set = 0, binding = 0) readonly buffer Instances {
+    Instance instances[];
+} instances;
 
 layout (push_constant) uniform PushConstants {
     mat4 projection;
@@ -27,19 +35,25 @@ layout (location = 1) out vec4 world_position;
 layout (location = 2) out vec4 model_position;
 layout (location = 3) out flat uint object_id;
 layout (location = 4) out flat uint texture_id;
-layout (location = 5) out flat mat4 model_matrix;
+layout (location = 5) out flat mat4 model_inverse;
 
 void main() {
     // To decrease the model instance size from 17 to 16 bytes, store
     // the model id in the bottom right entry in the model matrix.
     // For an arbitrary scale/rotation/translate transformation matrix,
     // this entry will always be 1.
-    object_id = gl_InstanceIndex;
+    mat4 model = instances.instances[instance_entry].model;
+    object_id = instance_entry;
     texture_id = floatBitsToInt(model[3][3]);
     mat4 recovered_model = model;
     recovered_model[3][3] = 1.0;
 
-    model_matrix = recovered_model;
+    // Models are affine, so the inverse is the inverse of the upper 3x3 and
+    // the translation taken back through it. Instances are only 64 bytes this
+    // way, and the fragment shader gets the inverse flat.
+    mat3 linear_inverse = inverse(mat3(recovered_model));
+    model_inverse = mat4(linear_inverse);
+    model_inverse[3] = vec4(-(linear_inverse * recovered_model[3].xyz), 1.0);
     model_position = vec4(position, 1.0);
     world_position = recovered_model * model_position;
     screen_position = push.projection * push.camera * world_position;
@@ -0,0 +1,60 @@
+/*
+ * This file is part of vtrace.
+ * vtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ * vtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with vtrace. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#version 460
+
+// Must match lib/common.h.
+#define OBJECT_ID_ALIGNED_BIT 0x80000000u
+
+layout (location = 0) in vec3 position;
+layout (location = 1) in uint instance_entry;
+
+// Axis aligned instances are only translated and uniformly scaled. xyz is the
+// integer coordinate of the instance in units of its scale, and w holds the
+// scale as 8.8 fixed point in the top 16 bits, and the texture ID in the
+// bottom 16 bits.
+layout (set = 0, binding = 1) readonly buffer AlignedInstances {
+    uvec4 instances[];
+} aligned;
+
+layout (push_constant) uniform PushConstants {
+    mat4 projection;
+    mat4 camera;
+} push;
+
+layout (location = 0) out vec4 screen_position;
+layout (location = 1) out vec4 world_position;
+layout (location = 2) out vec4 model_position;
+layout (location = 3) out flat uint object_id;
+layout (location = 4) out flat uint texture_id;
+layout (location = 5) out flat mat4 model_inverse;
+
+void main() {
+    uvec4 instance = aligned.instances[instance_entry];
+    float scale = float(instance.w >> 16) / 256.0;
+    vec3 translate = vec3(ivec3(instance.xyz)) * scale;
+    object_id = instance_entry | OBJECT_ID_ALIGNED_BIT;
+    texture_id = instance.w & 0xFFFF;
+
+    // The inverse of a translate and uniform scale is just the reciprocal
+    // scale and the negated, scaled down translation.
+    float inverse_scale = 1.0 / scale;
+    model_inverse = mat4(inverse_scale);
+    model_inverse[3] = vec4(-translate * inverse_scale, 1.0);
+
+    model_position = vec4(position, 1.0);
+    world_position = vec4(position * scale + translate, 1.0);
+    screen_position = push.projection * push.camera * world_position;
+    gl_Position = screen_position;
+}
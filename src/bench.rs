@@ -0,0 +1,348 @@
+/*
+ * This file is part of vtrace.
+ * vtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ * vtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with vtrace. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+use std::io::{BufRead, Write};
+use std::path::Path;
+use std::sync::*;
+use std::time::Instant;
+
+use crate::profile::*;
+use crate::render::*;
+use crate::world::*;
+
+// Camera paths are stored as text, one frame of UserInput per line:
+// w a s d space lshift mouse_x mouse_y last_mouse_x last_mouse_y
+// so short scripted paths can also be written by hand.
+pub struct InputRecorder {
+    out: std::io::BufWriter<std::fs::File>,
+}
+
+impl InputRecorder {
+    pub fn new(path: &Path) -> std::io::Result<Self> {
+        Ok(InputRecorder {
+            out: std::io::BufWriter::new(std::fs::File::create(path)?),
+        })
+    }
+
+    pub fn record(&mut self, input: &UserInput) -> std::io::Result<()> {
+        writeln!(
+            self.out,
+            "{} {} {} {} {} {} {} {} {} {}",
+            input.key_w,
+            input.key_a,
+            input.key_s,
+            input.key_d,
+            input.key_space,
+            input.key_lshift,
+            input.mouse_x,
+            input.mouse_y,
+            input.last_mouse_x,
+            input.last_mouse_y
+        )
+    }
+
+    pub fn finish(mut self) -> std::io::Result<()> {
+        self.out.flush()
+    }
+}
+
+fn parse_input(line: &str) -> Option<UserInput> {
+    let fields: Vec<&str> = line.split_whitespace().collect();
+    if fields.len() != 10 {
+        return None;
+    }
+    let key = |i: usize| fields[i].parse::<u8>().ok();
+    let mouse = |i: usize| fields[i].parse::<f64>().ok();
+    Some(UserInput {
+        key_w: key(0)?,
+        key_a: key(1)?,
+        key_s: key(2)?,
+        key_d: key(3)?,
+        key_space: key(4)?,
+        key_lshift: key(5)?,
+        mouse_x: mouse(6)?,
+        mouse_y: mouse(7)?,
+        last_mouse_x: mouse(8)?,
+        last_mouse_y: mouse(9)?,
+    })
+}
+
+pub fn load_camera_path(path: &Path) -> std::io::Result<Vec<UserInput>> {
+    let file = std::io::BufReader::new(std::fs::File::open(path)?);
+    let mut inputs = vec![];
+    for (line_num, line) in file.lines().enumerate() {
+        let line = line?;
+        if line.trim().is_empty() {
+            continue;
+        }
+        inputs.push(parse_input(&line).ok_or_else(|| {
+            std::io::Error::new(
+                std::io::ErrorKind::InvalidData,
+                format!("malformed input on line {}", line_num + 1),
+            )
+        })?);
+    }
+    Ok(inputs)
+}
+
+// Used when no recorded path is given. Walks forward while slowly turning,
+// so new chunks keep paging in for the whole run.
+pub fn scripted_camera_path(num_frames: usize) -> Vec<UserInput> {
+    (0..num_frames)
+        .map(|frame| UserInput {
+            key_w: 1,
+            mouse_x: frame as f64 + 1.0,
+            last_mouse_x: frame as f64,
+            ..Default::default()
+        })
+        .collect()
+}
+
+// Most frames rendered before timing starts, while waiting on the initial
+// world's textures.
+const MAX_WARMUP_FRAMES: u64 = 1000;
+
+#[derive(Debug, Default, Copy, Clone)]
+struct FrameSample {
+    frame_ms: f32,
+    update_instances_ms: f32,
+    render_tick_ms: f32,
+    world_update_ms: f32,
+    chunks_generated: usize,
+    textures_uploaded: usize,
+    bytes_uploaded: usize,
+    gpu_secondary_ms: Option<f32>,
+    gpu_raster_ms: Option<f32>,
+}
+
+fn write_optional<W: Write>(out: &mut W, value: Option<f32>) -> std::io::Result<()> {
+    match value {
+        Some(value) => write!(out, "{:.4}", value),
+        None => write!(out, "null"),
+    }
+}
+
+fn write_percentiles<W: Write>(
+    out: &mut W,
+    name: &str,
+    samples: impl Iterator<Item = f32>,
+) -> std::io::Result<()> {
+    let samples: Vec<f32> = samples.collect();
+    let mut histogram = RollingHistogram::new(samples.len().max(1));
+    for sample in samples.iter() {
+        histogram.push(*sample);
+    }
+    let percentiles = histogram.percentiles();
+    write!(
+        out,
+        "\"{}\":{{\"count\":{},\"p50\":{:.4},\"p95\":{:.4},\"p99\":{:.4}}}",
+        name,
+        samples.len(),
+        percentiles.p50,
+        percentiles.p95,
+        percentiles.p99
+    )
+}
+
+// Replays a camera path with a fixed dt, one frame per input, and writes
+// per-frame CPU and GPU times, chunk and upload counts, and percentiles of
+// each as JSON. The world update runs after render_tick rather than alongside
+// it, so which textures are uploaded on which frame doesn't depend on thread
+// timing. on_frame is called with true at the start of every timed frame, and
+// with false at its end, e.g. to capture frames before their readback is
+// reused and once they're done. Timing starts once the initial
+// world's textures have reached the GPU, so the first frames measure the
+// scene rather than the startup upload burst. Warmup frames aren't captured.
+pub fn run_benchmark(
+    renderer: &mut Renderer,
+    world: &mut WorldState,
+    texture_upload_queue: Arc<Mutex<TextureUploadQueue>>,
+    inputs: &[UserInput],
+    dt: f32,
+    seed: u32,
+    output: &Path,
+    mut on_frame: impl FnMut(&mut Renderer, bool),
+) -> std::io::Result<()> {
+    let mut samples: Vec<FrameSample> = Vec::with_capacity(inputs.len());
+    let ms = |start: Instant| start.elapsed().as_secs_f32() * 1000.0;
+
+    let mut warmup_frames = 0;
+    while warmup_frames < MAX_WARMUP_FRAMES
+        && !(texture_upload_queue.lock().unwrap().is_empty() && renderer.uploads_finished())
+    {
+        renderer.update_instances(&mut world.scene);
+        renderer.take_reused_readback();
+        let (code, _) = renderer.render_tick(
+            &world.camera_position,
+            &world.get_camera_direction(),
+            texture_upload_queue.clone(),
+        );
+        warmup_frames += 1;
+        if !code {
+            break;
+        }
+    }
+    while renderer.take_readback(true).is_some() {}
+
+    for input in inputs {
+        on_frame(renderer, true);
+        let mut sample = FrameSample::default();
+        let chunks_before = world.num_chunks_generated();
+        let uploads_before = renderer.get_upload_stats();
+        let frame_start = Instant::now();
+
+        let start = Instant::now();
+        renderer.update_instances(&mut world.scene);
+        sample.update_instances_ms = ms(start);
+
+        let start = Instant::now();
+        let (code, _) = renderer.render_tick(
+            &world.camera_position,
+            &world.get_camera_direction(),
+            texture_upload_queue.clone(),
+        );
+        sample.render_tick_ms = ms(start);
+
+        let start = Instant::now();
+        world.update(dt, *input, texture_upload_queue.clone());
+        sample.world_update_ms = ms(start);
+
+        sample.frame_ms = ms(frame_start);
+        let uploads = renderer.get_upload_stats();
+        sample.chunks_generated = world.num_chunks_generated() - chunks_before;
+        sample.textures_uploaded = uploads.num_textures - uploads_before.num_textures;
+        sample.bytes_uploaded = uploads.num_bytes - uploads_before.num_bytes;
+        samples.push(sample);
+
+        // GPU times arrive a few frames late, and are matched up by frame.
+        if let Some(timing) = renderer.get_latest_gpu_timing() {
+            let index = timing.frame.checked_sub(warmup_frames + 1);
+            if let Some(sample) = index.and_then(|index| samples.get_mut(index as usize)) {
+                sample.gpu_secondary_ms = timing.secondary_ms;
+                sample.gpu_raster_ms = timing.raster_ms;
+            }
+        }
+
+        on_frame(renderer, false);
+        if !code {
+            break;
+        }
+    }
+
+    let mut out = std::io::BufWriter::new(std::fs::File::create(output)?);
+    write!(
+        out,
+        "{{\"seed\":{},\"dt\":{},\"warmup_frames\":{},\"num_frames\":{},\"frames\":[",
+        seed,
+        dt,
+        warmup_frames,
+        samples.len()
+    )?;
+    for (i, sample) in samples.iter().enumerate() {
+        if i > 0 {
+            write!(out, ",")?;
+        }
+        write!(
+            out,
+            "\n{{\"frame\":{},\"frame_ms\":{:.4},\"update_instances_ms\":{:.4},\"render_tick_ms\":{:.4},\"world_update_ms\":{:.4},\"chunks_generated\":{},\"textures_uploaded\":{},\"bytes_uploaded\":{},\"gpu_secondary_ms\":",
+            i + 1,
+            sample.frame_ms,
+            sample.update_instances_ms,
+            sample.render_tick_ms,
+            sample.world_update_ms,
+            sample.chunks_generated,
+            sample.textures_uploaded,
+            sample.bytes_uploaded
+        )?;
+        write_optional(&mut out, sample.gpu_secondary_ms)?;
+        write!(out, ",\"gpu_raster_ms\":")?;
+        write_optional(&mut out, sample.gpu_raster_ms)?;
+        write!(out, "}}")?;
+    }
+
+    // Frames whose GPU times hadn't been read back by the end are left out
+    // of the GPU percentiles.
+    write!(
+        out,
+        "\n],\"total_chunks_generated\":{},\"total_textures_uploaded\":{},\"total_bytes_uploaded\":{},\"percentiles\":{{",
+        samples.iter().map(|s| s.chunks_generated).sum::<usize>(),
+        samples.iter().map(|s| s.textures_uploaded).sum::<usize>(),
+        samples.iter().map(|s| s.bytes_uploaded).sum::<usize>()
+    )?;
+    write_percentiles(&mut out, "frame_ms", samples.iter().map(|s| s.frame_ms))?;
+    write!(out, ",")?;
+    write_percentiles(
+        &mut out,
+        "update_instances_ms",
+        samples.iter().map(|s| s.update_instances_ms),
+    )?;
+    write!(out, ",")?;
+    write_percentiles(
+        &mut out,
+        "render_tick_ms",
+        samples.iter().map(|s| s.render_tick_ms),
+    )?;
+    write!(out, ",")?;
+    write_percentiles(
+        &mut out,
+        "world_update_ms",
+        samples.iter().map(|s| s.world_update_ms),
+    )?;
+    write!(out, ",")?;
+    write_percentiles(
+        &mut out,
+        "gpu_secondary_ms",
+        samples.iter().filter_map(|s| s.gpu_secondary_ms),
+    )?;
+    write!(out, ",")?;
+    write_percentiles(
+        &mut out,
+        "gpu_raster_ms",
+        samples.iter().filter_map(|s| s.gpu_raster_ms),
+    )?;
+    writeln!(out, "}}}}")?;
+    out.flush()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn input_round_trip() {
+        let input = UserInput {
+            key_w: 1,
+            key_lshift: 1,
+            mouse_x: 12.5,
+            mouse_y: -3.0,
+            last_mouse_x: 10.0,
+            last_mouse_y: -3.25,
+            ..Default::default()
+        };
+        let path = std::env::temp_dir().join("vtrace_input_round_trip.txt");
+        let mut recorder = InputRecorder::new(&path).unwrap();
+        recorder.record(&input).unwrap();
+        recorder.record(&UserInput::default()).unwrap();
+        recorder.finish().unwrap();
+
+        let inputs = load_camera_path(&path).unwrap();
+        std::fs::remove_file(&path).unwrap();
+        assert_eq!(inputs.len(), 2);
+        assert_eq!(inputs[0].key_w, 1);
+        assert_eq!(inputs[0].key_lshift, 1);
+        assert_eq!(inputs[0].mouse_x, 12.5);
+        assert_eq!(inputs[0].last_mouse_y, -3.25);
+        assert_eq!(inputs[1].mouse_x, 0.0);
+    }
+}
@@ -0,0 +1,170 @@
+/*
+ * This file is part of vtrace.
+ * vtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ * vtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with vtrace. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+use std::io::Write;
+use std::path::{Path, PathBuf};
+
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub enum CaptureFormat {
+    Png,
+    // Tightly packed RGBA8 rows, with the size in the file name.
+    Raw,
+}
+
+impl CaptureFormat {
+    pub fn parse(name: &str) -> Option<Self> {
+        match name {
+            "png" => Some(CaptureFormat::Png),
+            "raw" => Some(CaptureFormat::Raw),
+            _ => None,
+        }
+    }
+}
+
+// Writes headless frames read back from the renderer into a directory, one
+// file per frame.
+pub struct FrameCapture {
+    directory: PathBuf,
+    format: CaptureFormat,
+    width: u32,
+    height: u32,
+    rgba: Vec<u8>,
+}
+
+impl FrameCapture {
+    pub fn new(directory: &Path, format: CaptureFormat, width: u32, height: u32) -> Self {
+        if let Err(error) = std::fs::create_dir_all(directory) {
+            panic!("ERROR: Couldn't create {}: {}", directory.display(), error);
+        }
+        FrameCapture {
+            directory: directory.to_path_buf(),
+            format,
+            width,
+            height,
+            rgba: vec![],
+        }
+    }
+
+    // Takes B8G8R8A8 pixels, as read back from the renderer.
+    pub fn write_frame(&mut self, frame: u64, bgra: &[u8]) -> std::io::Result<()> {
+        self.rgba.clear();
+        self.rgba.extend(
+            bgra.chunks_exact(4)
+                .flat_map(|pixel| [pixel[2], pixel[1], pixel[0], pixel[3]]),
+        );
+
+        let path = match self.format {
+            CaptureFormat::Png => self.directory.join(format!("frame_{:06}.png", frame)),
+            CaptureFormat::Raw => self.directory.join(format!(
+                "frame_{:06}_{}x{}.rgba",
+                frame, self.width, self.height
+            )),
+        };
+        let mut out = std::io::BufWriter::new(std::fs::File::create(path)?);
+        match self.format {
+            CaptureFormat::Png => write_png(&mut out, self.width, self.height, &self.rgba)?,
+            CaptureFormat::Raw => out.write_all(&self.rgba)?,
+        }
+        out.flush()
+    }
+}
+
+// Deflate stored blocks hold at most this many bytes.
+const MAX_STORED_BLOCK: usize = 65535;
+
+fn crc32(crc: u32, bytes: &[u8]) -> u32 {
+    let mut crc = !crc;
+    for &byte in bytes {
+        crc ^= byte as u32;
+        for _ in 0..8 {
+            crc = (crc >> 1) ^ (0xEDB88320 & (crc & 1).wrapping_neg());
+        }
+    }
+    !crc
+}
+
+fn adler32(bytes: &[u8]) -> u32 {
+    let (mut a, mut b) = (1u32, 0u32);
+    for chunk in bytes.chunks(4096) {
+        for &byte in chunk {
+            a += byte as u32;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    (b << 16) | a
+}
+
+fn write_chunk<W: Write>(out: &mut W, kind: &[u8; 4], data: &[u8]) -> std::io::Result<()> {
+    out.write_all(&(data.len() as u32).to_be_bytes())?;
+    out.write_all(kind)?;
+    out.write_all(data)?;
+    out.write_all(&crc32(crc32(0, kind), data).to_be_bytes())
+}
+
+// Uncompressed RGBA8 PNG. Captures are for diffing and tooling rather than
+// storage, so deflate's stored blocks avoid needing a compressor.
+pub fn write_png<W: Write>(
+    out: &mut W,
+    width: u32,
+    height: u32,
+    rgba: &[u8],
+) -> std::io::Result<()> {
+    out.write_all(b"\x89PNG\r\n\x1a\n")?;
+
+    let mut header = vec![];
+    header.extend(width.to_be_bytes());
+    header.extend(height.to_be_bytes());
+    header.extend([8, 6, 0, 0, 0]);
+    write_chunk(out, b"IHDR", &header)?;
+
+    // Every row starts with filter type 0.
+    let row_size = width as usize * 4;
+    let mut scanlines = Vec::with_capacity((row_size + 1) * height as usize);
+    for row in rgba.chunks_exact(row_size) {
+        scanlines.push(0);
+        scanlines.extend(row);
+    }
+
+    let mut zlib =
+        Vec::with_capacity(scanlines.len() + scanlines.len() / MAX_STORED_BLOCK * 5 + 11);
+    zlib.extend([0x78, 0x01]);
+    let num_blocks = scanlines.len().div_ceil(MAX_STORED_BLOCK).max(1);
+    for block in 0..num_blocks {
+        let start = block * MAX_STORED_BLOCK;
+        let end = (start + MAX_STORED_BLOCK).min(scanlines.len());
+        let len = (end - start) as u16;
+        zlib.push((block + 1 == num_blocks) as u8);
+        zlib.extend(len.to_le_bytes());
+        zlib.extend((!len).to_le_bytes());
+        zlib.extend(&scanlines[start..end]);
+    }
+    zlib.extend(adler32(&scanlines).to_be_bytes());
+    write_chunk(out, b"IDAT", &zlib)?;
+
+    write_chunk(out, b"IEND", &[])
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn checksums() {
+        assert_eq!(crc32(0, b"123456789"), 0xCBF43926);
+        assert_eq!(crc32(crc32(0, b"1234"), b"56789"), 0xCBF43926);
+        assert_eq!(adler32(b"Wikipedia"), 0x11E60398);
+    }
+}
@@ -0,0 +1,382 @@
+/*
+ * This file is part of vtrace.
+ * vtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ * vtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with vtrace. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+use glm::*;
+
+use crate::simd::*;
+
+// Number of boxes tested together. The inner loops over lanes have no
+// branches, so they get vectorized.
+const CULL_LANES: usize = 8;
+
+// Half extent of an empty box. Large and negative rather than infinite, so
+// multiplying it by a zero plane component can't produce a NaN.
+const EMPTY_EXTENT: f32 = -1.0e30;
+
+// The six planes of a view frustum, as (a, b, c, d) where a point p is inside
+// a plane when a * p.x + b * p.y + c * p.z + d >= 0. Planes aren't normalized,
+// since only the sign of the distance matters.
+#[derive(Clone, Copy)]
+pub struct Frustum {
+    planes: [[f32; 4]; 6],
+}
+
+impl Frustum {
+    pub fn from_view_projection(view_projection: &Matrix4<f32>) -> Self {
+        let m = view_projection;
+        let row = |r: usize| [m[0][r], m[1][r], m[2][r], m[3][r]];
+        let (r0, r1, r2, r3) = (row(0), row(1), row(2), row(3));
+        let add = |a: [f32; 4], b: [f32; 4]| [a[0] + b[0], a[1] + b[1], a[2] + b[2], a[3] + b[3]];
+        let sub = |a: [f32; 4], b: [f32; 4]| [a[0] - b[0], a[1] - b[1], a[2] - b[2], a[3] - b[3]];
+        Frustum {
+            planes: [
+                add(r3, r0),
+                sub(r3, r0),
+                add(r3, r1),
+                sub(r3, r1),
+                add(r3, r2),
+                sub(r3, r2),
+            ],
+        }
+    }
+
+    // Signed distance of the box's most positive corner from each plane. The
+    // box is at least partially inside the frustum when none are negative.
+    fn min_distance(&self, center: [f32; 3], extent: [f32; 3]) -> f32 {
+        let mut min = f32::MAX;
+        for plane in self.planes.iter() {
+            let distance = plane[0] * center[0]
+                + plane[1] * center[1]
+                + plane[2] * center[2]
+                + plane[3]
+                + plane[0].abs() * extent[0]
+                + plane[1].abs() * extent[1]
+                + plane[2].abs() * extent[2];
+            min = min.min(distance);
+        }
+        min
+    }
+
+    pub fn intersects(&self, center: [f32; 3], extent: [f32; 3]) -> bool {
+        self.min_distance(center, extent) >= 0.0
+    }
+
+    // min_distance of CULL_LANES boxes at once. The loops over lanes have no
+    // branches, so they get vectorized.
+    fn lane_min_distances(
+        &self,
+        center_x: &[f32; CULL_LANES],
+        center_y: &[f32; CULL_LANES],
+        center_z: &[f32; CULL_LANES],
+        extent_x: &[f32; CULL_LANES],
+        extent_y: &[f32; CULL_LANES],
+        extent_z: &[f32; CULL_LANES],
+    ) -> [f32; CULL_LANES] {
+        let mut min = [f32::MAX; CULL_LANES];
+        for plane in self.planes.iter() {
+            let abs = [plane[0].abs(), plane[1].abs(), plane[2].abs()];
+            for lane in 0..CULL_LANES {
+                let distance = plane[0] * center_x[lane]
+                    + plane[1] * center_y[lane]
+                    + plane[2] * center_z[lane]
+                    + plane[3]
+                    + abs[0] * extent_x[lane]
+                    + abs[1] * extent_y[lane]
+                    + abs[2] * extent_z[lane];
+                min[lane] = min[lane].min(distance);
+            }
+        }
+        min
+    }
+}
+
+// Structure-of-arrays axis aligned bounding boxes, stored as centers and half
+// extents.
+pub struct BoundsArrays {
+    center_x: Vec<f32>,
+    center_y: Vec<f32>,
+    center_z: Vec<f32>,
+    extent_x: Vec<f32>,
+    extent_y: Vec<f32>,
+    extent_z: Vec<f32>,
+}
+
+impl BoundsArrays {
+    pub fn new() -> Self {
+        BoundsArrays {
+            center_x: vec![],
+            center_y: vec![],
+            center_z: vec![],
+            extent_x: vec![],
+            extent_y: vec![],
+            extent_z: vec![],
+        }
+    }
+
+    pub fn len(&self) -> usize {
+        self.center_x.len()
+    }
+
+    pub fn clear(&mut self) {
+        self.center_x.clear();
+        self.center_y.clear();
+        self.center_z.clear();
+        self.extent_x.clear();
+        self.extent_y.clear();
+        self.extent_z.clear();
+    }
+
+    // Grows the arrays to hold at least len boxes. New boxes are empty.
+    pub fn resize(&mut self, len: usize) {
+        if len > self.len() {
+            self.center_x.resize(len, 0.0);
+            self.center_y.resize(len, 0.0);
+            self.center_z.resize(len, 0.0);
+            self.extent_x.resize(len, EMPTY_EXTENT);
+            self.extent_y.resize(len, EMPTY_EXTENT);
+            self.extent_z.resize(len, EMPTY_EXTENT);
+        }
+    }
+
+    pub fn set(&mut self, i: usize, center: [f32; 3], extent: [f32; 3]) {
+        self.center_x[i] = center[0];
+        self.center_y[i] = center[1];
+        self.center_z[i] = center[2];
+        self.extent_x[i] = extent[0];
+        self.extent_y[i] = extent[1];
+        self.extent_z[i] = extent[2];
+    }
+
+    // Empty boxes never intersect a frustum.
+    pub fn set_empty(&mut self, i: usize) {
+        self.set(
+            i,
+            [0.0, 0.0, 0.0],
+            [EMPTY_EXTENT, EMPTY_EXTENT, EMPTY_EXTENT],
+        );
+    }
+
+    pub fn get(&self, i: usize) -> ([f32; 3], [f32; 3]) {
+        (
+            [self.center_x[i], self.center_y[i], self.center_z[i]],
+            [self.extent_x[i], self.extent_y[i], self.extent_z[i]],
+        )
+    }
+
+    // Appends the index of every box that intersects the frustum to visible.
+    pub fn cull(&self, frustum: &Frustum, visible: &mut Vec<u32>) {
+        let len = self.len();
+        let batched_len = len / CULL_LANES * CULL_LANES;
+        for base in (0..batched_len).step_by(CULL_LANES) {
+            let lanes = base..base + CULL_LANES;
+            let min = frustum.lane_min_distances(
+                self.center_x[lanes.clone()].try_into().unwrap(),
+                self.center_y[lanes.clone()].try_into().unwrap(),
+                self.center_z[lanes.clone()].try_into().unwrap(),
+                self.extent_x[lanes.clone()].try_into().unwrap(),
+                self.extent_y[lanes.clone()].try_into().unwrap(),
+                self.extent_z[lanes].try_into().unwrap(),
+            );
+            for lane in 0..CULL_LANES {
+                if min[lane] >= 0.0 {
+                    visible.push((base + lane) as u32);
+                }
+            }
+        }
+
+        for i in batched_len..len {
+            let (center, extent) = self.get(i);
+            if frustum.intersects(center, extent) {
+                visible.push(i as u32);
+            }
+        }
+    }
+
+    // Same as cull, but only tests the boxes in indices. Boxes are gathered
+    // into lanes, so the tests are still batched.
+    pub fn cull_indices(&self, frustum: &Frustum, indices: &[u32], visible: &mut Vec<u32>) {
+        let mut chunks = indices.chunks_exact(CULL_LANES);
+        for chunk in &mut chunks {
+            let gather = |values: &[f32]| -> [f32; CULL_LANES] {
+                std::array::from_fn(|lane| values[chunk[lane] as usize])
+            };
+            let min = frustum.lane_min_distances(
+                &gather(&self.center_x),
+                &gather(&self.center_y),
+                &gather(&self.center_z),
+                &gather(&self.extent_x),
+                &gather(&self.extent_y),
+                &gather(&self.extent_z),
+            );
+            for lane in 0..CULL_LANES {
+                if min[lane] >= 0.0 {
+                    visible.push(chunk[lane]);
+                }
+            }
+        }
+
+        for i in chunks.remainder() {
+            let (center, extent) = self.get(*i as usize);
+            if frustum.intersects(center, extent) {
+                visible.push(*i);
+            }
+        }
+    }
+}
+
+// Depth keys are quantized to this many bits, and sorted by RADIX_BITS per
+// pass. Coarse keys are enough, since the order only needs to be roughly front
+// to back for early depth testing to reject most occluded fragments.
+const DEPTH_KEY_BITS: u32 = 16;
+const RADIX_BITS: u32 = 8;
+
+// Sorts draw lists front to back by the view depth of each box's center, using
+// an LSD radix sort over quantized depths. The buffers are kept between frames
+// so sorting doesn't allocate.
+pub struct DepthSorter {
+    depths: Vec<f32>,
+    keys: Vec<u16>,
+    scratch_keys: Vec<u16>,
+    scratch_indices: Vec<u32>,
+}
+
+impl DepthSorter {
+    pub fn new() -> Self {
+        DepthSorter {
+            depths: vec![],
+            keys: vec![],
+            scratch_keys: vec![],
+            scratch_indices: vec![],
+        }
+    }
+
+    // Sorts indices into bounds by increasing distance along the camera's view
+    // direction. camera is the world to view transform, looking down -z.
+    pub fn sort(&mut self, camera: &Matrix4<f32>, bounds: &BoundsArrays, indices: &mut [u32]) {
+        let len = indices.len();
+        if len < 2 {
+            return;
+        }
+
+        let row = [camera[0][2], camera[1][2], camera[2][2], camera[3][2]];
+        self.depths.clear();
+        let (mut min, mut max) = (f32::MAX, f32::MIN);
+        for i in indices.iter() {
+            let i = *i as usize;
+            let depth = -(row[0] * bounds.center_x[i]
+                + row[1] * bounds.center_y[i]
+                + row[2] * bounds.center_z[i]
+                + row[3]);
+            min = min.min(depth);
+            max = max.max(depth);
+            self.depths.push(depth);
+        }
+
+        let max_key = ((1 << DEPTH_KEY_BITS) - 1) as f32;
+        let scale = if max > min {
+            max_key / (max - min)
+        } else {
+            0.0
+        };
+        self.keys.clear();
+        self.keys.extend(
+            self.depths
+                .iter()
+                .map(|depth| ((depth - min) * scale) as u16),
+        );
+        self.scratch_keys.resize(len, 0);
+        self.scratch_indices.resize(len, 0);
+
+        for pass in 0..DEPTH_KEY_BITS / RADIX_BITS {
+            let shift = pass * RADIX_BITS;
+            let digit = |key: u16| ((key >> shift) & ((1 << RADIX_BITS) - 1)) as usize;
+
+            let mut offsets = [0; 1 << RADIX_BITS];
+            for key in self.keys.iter() {
+                offsets[digit(*key)] += 1;
+            }
+            let mut sum = 0;
+            for offset in offsets.iter_mut() {
+                let count = *offset;
+                *offset = sum;
+                sum += count;
+            }
+
+            for i in 0..len {
+                let key = self.keys[i];
+                let dst = &mut offsets[digit(key)];
+                self.scratch_keys[*dst] = key;
+                self.scratch_indices[*dst] = indices[i];
+                *dst += 1;
+            }
+            std::mem::swap(&mut self.keys, &mut self.scratch_keys);
+            indices.copy_from_slice(&self.scratch_indices);
+        }
+    }
+}
+
+pub fn empty_bounds() -> ([f32; 3], [f32; 3]) {
+    ([0.0, 0.0, 0.0], [EMPTY_EXTENT, EMPTY_EXTENT, EMPTY_EXTENT])
+}
+
+fn is_empty(extent: [f32; 3]) -> bool {
+    extent[0] < 0.0 || extent[1] < 0.0 || extent[2] < 0.0
+}
+
+// Smallest box containing both boxes. Empty boxes don't contribute.
+pub fn union_bounds(a: ([f32; 3], [f32; 3]), b: ([f32; 3], [f32; 3])) -> ([f32; 3], [f32; 3]) {
+    if is_empty(a.1) {
+        return b;
+    }
+    if is_empty(b.1) {
+        return a;
+    }
+    let mut center = [0.0; 3];
+    let mut extent = [0.0; 3];
+    for i in 0..3 {
+        let min = (a.0[i] - a.1[i]).min(b.0[i] - b.1[i]);
+        let max = (a.0[i] + a.1[i]).max(b.0[i] + b.1[i]);
+        center[i] = 0.5 * (min + max);
+        extent[i] = 0.5 * (max - min);
+    }
+    (center, extent)
+}
+
+// Axis aligned bounds of a box after being transformed by model. Empty boxes
+// stay empty.
+pub fn transform_bounds(
+    model: &SimdMat4,
+    center: [f32; 3],
+    extent: [f32; 3],
+) -> ([f32; 3], [f32; 3]) {
+    if is_empty(extent) {
+        return empty_bounds();
+    }
+    let mut new_center = [0.0; 3];
+    let mut new_extent = [0.0; 3];
+    for i in 0..3 {
+        new_center[i] = model[3][i];
+        for j in 0..3 {
+            new_center[i] += model[j][i] * center[j];
+            new_extent[i] += model[j][i].abs() * extent[j];
+        }
+    }
+    (new_center, new_extent)
+}
+
+// World space bounds of the unit cube centered at the origin, transformed by
+// model.
+pub fn unit_cube_bounds(model: &SimdMat4) -> ([f32; 3], [f32; 3]) {
+    transform_bounds(model, [0.0, 0.0, 0.0], [0.5, 0.5, 0.5])
+}
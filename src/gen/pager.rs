@@ -18,6 +18,7 @@ use std::collections::HashMap;
 use std::sync::*;
 
 use crate::gen::terrain::*;
+use crate::profile::profile_zone;
 use crate::render::*;
 use crate::voxel::*;
 
@@ -37,18 +38,25 @@ pub type Chunk =
     rawchunk::RawStaticChunk<Color, CHUNK_VOXEL_SIZE, CHUNK_VOXEL_SIZE, CHUNK_VOXEL_SIZE>;
 
 pub struct WorldPager {
-    chunks: HashMap<(i32, i32, i32), Option<(Box<Chunk>, TextureHandle)>>,
+    chunks: HashMap<(i32, i32, i32), Option<(Arc<Chunk>, TextureHandle)>>,
     terrain_generator: TerrainGenerator,
+    num_chunks_generated: usize,
 }
 
 impl WorldPager {
-    pub fn new() -> Self {
+    pub fn new(seed: u32) -> Self {
         WorldPager {
             chunks: HashMap::new(),
-            terrain_generator: TerrainGenerator::new(0),
+            terrain_generator: TerrainGenerator::new(seed),
+            num_chunks_generated: 0,
         }
     }
 
+    // Number of chunks generated so far, including empty ones.
+    pub fn num_chunks_generated(&self) -> usize {
+        self.num_chunks_generated
+    }
+
     pub fn page(
         &mut self,
         chunk_x: i32,
@@ -60,7 +68,11 @@ impl WorldPager {
             Some(Some((_, handle))) => Some(*handle),
             Some(None) => None,
             None => {
+                // Only paging in a new chunk is timed, since cached lookups
+                // happen for every chunk in range each frame.
+                profile_zone!("WorldPager::page");
                 let chunk = self.terrain_generator.gen_chunk(chunk_x, chunk_y, chunk_z);
+                self.num_chunks_generated += 1;
                 if let Some(concrete_chunk) = chunk {
                     let handle = texture_upload_queue
                         .lock()
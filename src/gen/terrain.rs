@@ -14,7 +14,10 @@
 
 use noise::*;
 
+use std::sync::*;
+
 use crate::gen::pager::*;
+use crate::profile::profile_zone;
 use crate::voxel::*;
 
 pub struct TerrainGenerator {
@@ -64,7 +67,8 @@ impl TerrainGenerator {
         }
     }
 
-    pub fn gen_chunk(&self, chunk_x: i32, chunk_y: i32, chunk_z: i32) -> Option<Box<Chunk>> {
+    pub fn gen_chunk(&self, chunk_x: i32, chunk_y: i32, chunk_z: i32) -> Option<Arc<Chunk>> {
+        profile_zone!("gen_chunk");
         let mut chunk = rawchunk::RawStaticChunk::new(Default::default());
 
         let mut any_filled = false;
@@ -87,7 +91,7 @@ impl TerrainGenerator {
         }
 
         if any_filled {
-            Some(Box::new(chunk))
+            Some(Arc::new(chunk))
         } else {
             None
         }
@@ -17,27 +17,242 @@
 
 use std::sync::*;
 
+mod bench;
+mod capture;
+mod cull;
 mod gen;
+mod profile;
 mod render;
 mod scene;
+mod simd;
 mod voxel;
 mod world;
 
+// Length of the scripted camera path, when benchmarking without a recorded
+// path or a frame count.
+const DEFAULT_BENCH_FRAMES: usize = 600;
+
+// Command line options. Headless runs render without a window, and can
+// capture every frame into a directory. Benchmarks replay a camera path with
+// a fixed dt rather than reading live input. Ray traced runs trace every frame
+// with the hardware ray tracing pipeline instead of rasterizing.
+struct Options {
+    headless: bool,
+    ray_trace: bool,
+    width: u32,
+    height: u32,
+    frames: Option<usize>,
+    capture: Option<std::path::PathBuf>,
+    capture_format: capture::CaptureFormat,
+    seed: u32,
+    bench: Option<std::path::PathBuf>,
+    replay: Option<std::path::PathBuf>,
+    record: Option<std::path::PathBuf>,
+    dt: f32,
+}
+
+fn usage() -> ! {
+    eprintln!(
+        "Usage: vtrace [--headless] [--ray-trace] [--width N] [--height N] [--frames N] [--capture DIR] [--capture-format png|raw] [--seed N] [--bench OUT.json [--replay PATH] [--dt SECONDS]] [--record PATH]"
+    );
+    std::process::exit(1);
+}
+
+fn parse_options() -> Options {
+    let mut options = Options {
+        headless: false,
+        ray_trace: false,
+        width: 1000,
+        height: 1000,
+        frames: None,
+        capture: None,
+        capture_format: capture::CaptureFormat::Png,
+        seed: 0,
+        bench: None,
+        replay: None,
+        record: None,
+        dt: 1.0 / 60.0,
+    };
+
+    let mut args = std::env::args().skip(1);
+    while let Some(arg) = args.next() {
+        let mut value = || args.next().unwrap_or_else(|| usage());
+        match arg.as_str() {
+            "--headless" => options.headless = true,
+            "--ray-trace" => options.ray_trace = true,
+            "--width" => options.width = value().parse().unwrap_or_else(|_| usage()),
+            "--height" => options.height = value().parse().unwrap_or_else(|_| usage()),
+            "--frames" => options.frames = Some(value().parse().unwrap_or_else(|_| usage())),
+            "--capture" => options.capture = Some(value().into()),
+            "--capture-format" => {
+                options.capture_format =
+                    capture::CaptureFormat::parse(&value()).unwrap_or_else(|| usage())
+            }
+            "--seed" => options.seed = value().parse().unwrap_or_else(|_| usage()),
+            "--bench" => options.bench = Some(value().into()),
+            "--replay" => options.replay = Some(value().into()),
+            "--record" => options.record = Some(value().into()),
+            "--dt" => options.dt = value().parse().unwrap_or_else(|_| usage()),
+            _ => usage(),
+        }
+    }
+
+    if options.capture.is_some() && !options.headless {
+        eprintln!("ERROR: --capture requires --headless");
+        std::process::exit(1);
+    }
+    if options.replay.is_some() && options.bench.is_none() {
+        eprintln!("ERROR: --replay requires --bench");
+        std::process::exit(1);
+    }
+    if options.record.is_some() && options.bench.is_some() {
+        eprintln!("ERROR: --record can't be used with --bench");
+        std::process::exit(1);
+    }
+    if !(options.dt > 0.0) {
+        eprintln!("ERROR: --dt must be positive");
+        std::process::exit(1);
+    }
+    if options.headless && (options.width == 0 || options.height == 0) {
+        eprintln!("ERROR: Headless width and height must be non-zero");
+        std::process::exit(1);
+    }
+
+    options
+}
+
+// Writes every frame the renderer has read back. Only waits for frames still
+// on the GPU when wait is set.
+fn capture_frames(
+    renderer: &mut render::Renderer,
+    frame_capture: &mut Option<capture::FrameCapture>,
+    wait: bool,
+) {
+    let Some(frame_capture) = frame_capture else {
+        return;
+    };
+    while let Some((frame, pixels)) = renderer.take_readback(wait) {
+        if let Err(error) = frame_capture.write_frame(frame, pixels) {
+            eprintln!("ERROR: Couldn't write frame {}: {}", frame, error);
+        }
+    }
+}
+
+// Writes the frame the next render_tick would overwrite, if it hasn't been
+// written yet. Waits for it if it's still on the GPU, which render_tick would
+// do anyway.
+fn capture_reused_frame(
+    renderer: &mut render::Renderer,
+    frame_capture: &mut Option<capture::FrameCapture>,
+) {
+    let Some(frame_capture) = frame_capture else {
+        return;
+    };
+    if let Some((frame, pixels)) = renderer.take_reused_readback() {
+        if let Err(error) = frame_capture.write_frame(frame, pixels) {
+            eprintln!("ERROR: Couldn't write frame {}: {}", frame, error);
+        }
+    }
+}
+
+// Set VTRACE_TRACE to a path to write a Chrome trace of the run, when built
+// with the profile feature. Called at the end of benchmarks and of interactive
+// runs.
+fn write_trace() {
+    if let Ok(path) = std::env::var("VTRACE_TRACE") {
+        if let Err(error) = profile::write_chrome_trace(&path) {
+            eprintln!("ERROR: Couldn't write trace to {}: {}", path, error);
+        }
+    }
+}
+
 fn main() {
-    let renderer = Arc::new(Mutex::new(render::Renderer::new()));
+    let options = parse_options();
+    let renderer = Arc::new(Mutex::new(if options.headless {
+        render::Renderer::new_headless(
+            options.width,
+            options.height,
+            options.capture.is_some(),
+            options.ray_trace,
+        )
+    } else {
+        render::Renderer::new(options.ray_trace)
+    }));
+    let mut frame_capture = options.capture.as_ref().map(|directory| {
+        capture::FrameCapture::new(
+            directory,
+            options.capture_format,
+            options.width,
+            options.height,
+        )
+    });
     let texture_upload_queue = Arc::new(Mutex::new(render::TextureUploadQueue::new()));
-    let mut world = world::WorldState::new(texture_upload_queue.clone());
+    let mut world = world::WorldState::new(texture_upload_queue.clone(), options.seed);
+
+    if let Some(output) = &options.bench {
+        let mut inputs = match &options.replay {
+            Some(path) => bench::load_camera_path(path).unwrap_or_else(|error| {
+                eprintln!("ERROR: Couldn't read {}: {}", path.display(), error);
+                std::process::exit(1);
+            }),
+            None => bench::scripted_camera_path(options.frames.unwrap_or(DEFAULT_BENCH_FRAMES)),
+        };
+        if let Some(frames) = options.frames {
+            inputs.truncate(frames);
+        }
+
+        let mut renderer = renderer.lock().unwrap();
+        world.update(
+            0.0,
+            render::UserInput::default(),
+            texture_upload_queue.clone(),
+        );
+        let result = bench::run_benchmark(
+            &mut renderer,
+            &mut world,
+            texture_upload_queue.clone(),
+            &inputs,
+            options.dt,
+            options.seed,
+            output,
+            |renderer, before_render_tick| {
+                if before_render_tick {
+                    capture_reused_frame(renderer, &mut frame_capture);
+                } else {
+                    capture_frames(renderer, &mut frame_capture, false);
+                }
+            },
+        );
+        if let Err(error) = result {
+            eprintln!("ERROR: Couldn't write {}: {}", output.display(), error);
+        }
+        capture_frames(&mut renderer, &mut frame_capture, true);
+        write_trace();
+        return;
+    }
+
+    let mut recorder = options.record.as_ref().map(|path| {
+        bench::InputRecorder::new(path).unwrap_or_else(|error| {
+            eprintln!("ERROR: Couldn't create {}: {}", path.display(), error);
+            std::process::exit(1);
+        })
+    });
 
     let input_ptr = renderer.lock().unwrap().get_input_data_pointer();
 
-    let mut scene = world.update(0.0, unsafe { *input_ptr }, texture_upload_queue.clone());
+    world.update(0.0, unsafe { *input_ptr }, texture_upload_queue.clone());
 
     let (mut code, mut dt) = (true, 0.0);
-    while code {
+    let mut num_frames = 0;
+    while code && options.frames.map_or(true, |frames| num_frames < frames) {
         let render_camera_pos = world.camera_position;
         let render_camera_dir = world.get_camera_direction();
 
-        renderer.lock().unwrap().update_instances(scene);
+        {
+            let mut renderer = renderer.lock().unwrap();
+            renderer.update_instances(&mut world.scene);
+            capture_reused_frame(&mut renderer, &mut frame_capture);
+        }
         let renderer_clone = renderer.clone();
         let texture_upload_queue_clone = texture_upload_queue.clone();
 
@@ -49,8 +264,25 @@ fn main() {
             )
         });
 
-        scene = world.update(dt, unsafe { *input_ptr }, texture_upload_queue.clone());
+        let input = unsafe { *input_ptr };
+        if let Some(recorder) = &mut recorder {
+            if let Err(error) = recorder.record(&input) {
+                eprintln!("ERROR: Couldn't record input: {}", error);
+            }
+        }
+        world.update(dt, input, texture_upload_queue.clone());
 
         (code, dt) = thread_handle.join().unwrap();
+        num_frames += 1;
+
+        capture_frames(&mut renderer.lock().unwrap(), &mut frame_capture, false);
     }
+    capture_frames(&mut renderer.lock().unwrap(), &mut frame_capture, true);
+    if let Some(recorder) = recorder {
+        if let Err(error) = recorder.finish() {
+            eprintln!("ERROR: Couldn't record input: {}", error);
+        }
+    }
+
+    write_trace();
 }
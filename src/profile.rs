@@ -0,0 +1,297 @@
+/*
+ * This file is part of vtrace.
+ * vtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ * vtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with vtrace. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+use std::collections::VecDeque;
+use std::io::Write;
+
+// Scoped CPU zones, recorded into a ring buffer per thread and exported as
+// Chrome trace events. Everything here compiles to nothing unless the
+// profile feature is enabled, which also defines PROFILE for the C renderer.
+// Usage: profile_zone!("name"); at the top of the scope to time.
+macro_rules! profile_zone {
+    ($name:expr) => {
+        #[cfg(feature = "profile")]
+        let _profile_zone = crate::profile::Zone::new($name);
+    };
+}
+pub(crate) use profile_zone;
+
+#[cfg(feature = "profile")]
+mod zones {
+    use std::ffi::{c_char, CStr};
+    use std::io::Write;
+    use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+    use std::sync::{Arc, Mutex, OnceLock};
+    use std::time::Instant;
+
+    // Events kept per thread. Older events are overwritten, so a trace covers
+    // roughly the last ZONE_RING_CAPACITY / 2 zones of each thread.
+    const ZONE_RING_CAPACITY: usize = 1 << 16;
+
+    // Flags packed into the top bits of an event's name length.
+    const ZONE_END: u64 = 1 << 63;
+    const ZONE_NAME_C: u64 = 1 << 62;
+    const ZONE_LENGTH_MASK: u64 = ZONE_NAME_C - 1;
+
+    // Fields are atomic so the ring can be exported while its thread is still
+    // writing, without a lock. An event being overwritten during export may
+    // come out torn, which only costs that one event.
+    #[derive(Default)]
+    struct ZoneEvent {
+        name: AtomicU64,
+        length: AtomicU64,
+        time: AtomicU64,
+    }
+
+    struct ZoneRing {
+        lane: usize,
+        head: AtomicUsize,
+        events: Box<[ZoneEvent]>,
+    }
+
+    // Rings are never freed. A thread that exits hands its ring back, and the
+    // next new thread reuses it, so threads spawned per frame share a lane.
+    static RINGS: Mutex<Vec<Arc<ZoneRing>>> = Mutex::new(vec![]);
+    static FREE_RINGS: Mutex<Vec<Arc<ZoneRing>>> = Mutex::new(vec![]);
+    static EPOCH: OnceLock<Instant> = OnceLock::new();
+
+    struct RingHandle(Arc<ZoneRing>);
+
+    impl RingHandle {
+        fn acquire() -> Self {
+            if let Some(ring) = FREE_RINGS.lock().unwrap().pop() {
+                return RingHandle(ring);
+            }
+            let mut rings = RINGS.lock().unwrap();
+            let ring = Arc::new(ZoneRing {
+                lane: rings.len(),
+                head: AtomicUsize::new(0),
+                events: (0..ZONE_RING_CAPACITY)
+                    .map(|_| ZoneEvent::default())
+                    .collect(),
+            });
+            rings.push(ring.clone());
+            RingHandle(ring)
+        }
+    }
+
+    impl Drop for RingHandle {
+        fn drop(&mut self) {
+            FREE_RINGS.lock().unwrap().push(self.0.clone());
+        }
+    }
+
+    thread_local! {
+        static RING: RingHandle = RingHandle::acquire();
+    }
+
+    fn now() -> u64 {
+        EPOCH.get_or_init(Instant::now).elapsed().as_nanos() as u64
+    }
+
+    // Only the owning thread pushes, so the head is read and written without
+    // read-modify-write. Zones during thread teardown are dropped.
+    fn push(name: u64, length: u64) {
+        let time = now();
+        let _ = RING.try_with(|ring| {
+            let ring = &ring.0;
+            let head = ring.head.load(Ordering::Relaxed);
+            let event = &ring.events[head % ZONE_RING_CAPACITY];
+            event.name.store(name, Ordering::Relaxed);
+            event.length.store(length, Ordering::Relaxed);
+            event.time.store(time, Ordering::Relaxed);
+            ring.head.store(head + 1, Ordering::Release);
+        });
+    }
+
+    pub struct Zone;
+
+    impl Zone {
+        #[inline]
+        pub fn new(name: &'static str) -> Self {
+            push(name.as_ptr() as u64, name.len() as u64);
+            Zone
+        }
+    }
+
+    impl Drop for Zone {
+        #[inline]
+        fn drop(&mut self) {
+            push(0, ZONE_END);
+        }
+    }
+
+    // Zones from the C renderer. name must be a string literal, since it's
+    // only read when the trace is written.
+    #[no_mangle]
+    pub extern "C" fn profile_zone_begin(name: *const c_char) {
+        push(name as u64, ZONE_NAME_C);
+    }
+
+    #[no_mangle]
+    pub extern "C" fn profile_zone_end() {
+        push(0, ZONE_END);
+    }
+
+    fn write_name<W: Write>(out: &mut W, name: u64, length: u64) -> std::io::Result<()> {
+        let bytes = if length & ZONE_NAME_C != 0 {
+            unsafe { CStr::from_ptr(name as *const c_char) }.to_bytes()
+        } else {
+            unsafe {
+                std::slice::from_raw_parts(name as *const u8, (length & ZONE_LENGTH_MASK) as usize)
+            }
+        };
+        for &byte in bytes {
+            if byte == b'"' || byte == b'\\' {
+                out.write_all(b"\\")?;
+            }
+            out.write_all(&[byte])?;
+        }
+        Ok(())
+    }
+
+    pub fn write_events<W: Write>(out: &mut W) -> std::io::Result<()> {
+        let rings = RINGS.lock().unwrap().clone();
+        let mut first = true;
+        for ring in rings.iter() {
+            let head = ring.head.load(Ordering::Acquire);
+            let start = head.saturating_sub(ZONE_RING_CAPACITY);
+            for index in start..head {
+                let event = &ring.events[index % ZONE_RING_CAPACITY];
+                let name = event.name.load(Ordering::Relaxed);
+                let length = event.length.load(Ordering::Relaxed);
+                let time = event.time.load(Ordering::Relaxed);
+                if !first {
+                    out.write_all(b",\n")?;
+                }
+                first = false;
+                if length & ZONE_END != 0 {
+                    write!(
+                        out,
+                        "{{\"ph\":\"E\",\"pid\":0,\"tid\":{},\"ts\":{:.3}}}",
+                        ring.lane,
+                        time as f64 / 1000.0
+                    )?;
+                } else {
+                    out.write_all(b"{\"name\":\"")?;
+                    write_name(out, name, length)?;
+                    write!(
+                        out,
+                        "\",\"ph\":\"B\",\"pid\":0,\"tid\":{},\"ts\":{:.3}}}",
+                        ring.lane,
+                        time as f64 / 1000.0
+                    )?;
+                }
+            }
+        }
+        Ok(())
+    }
+}
+
+#[cfg(feature = "profile")]
+pub use zones::Zone;
+
+// Writes every recorded zone as Chrome trace event JSON, which can be opened
+// in chrome://tracing or Perfetto. Each lane is a thread, or a run of threads
+// that didn't overlap. Without the profile feature the trace is empty.
+pub fn write_chrome_trace(path: &str) -> std::io::Result<()> {
+    let mut out = std::io::BufWriter::new(std::fs::File::create(path)?);
+    out.write_all(b"{\"traceEvents\":[\n")?;
+    #[cfg(feature = "profile")]
+    zones::write_events(&mut out)?;
+    out.write_all(b"\n]}\n")?;
+    out.flush()
+}
+
+#[derive(Debug, Default, Copy, Clone, PartialEq)]
+pub struct Percentiles {
+    pub p50: f32,
+    pub p95: f32,
+    pub p99: f32,
+}
+
+// Keeps the last capacity samples, so percentiles follow recent behaviour
+// rather than the whole run.
+pub struct RollingHistogram {
+    samples: VecDeque<f32>,
+    capacity: usize,
+    sorted: Vec<f32>,
+}
+
+impl RollingHistogram {
+    pub fn new(capacity: usize) -> Self {
+        RollingHistogram {
+            samples: VecDeque::with_capacity(capacity),
+            capacity,
+            sorted: Vec::with_capacity(capacity),
+        }
+    }
+
+    pub fn push(&mut self, sample: f32) {
+        if self.samples.len() == self.capacity {
+            self.samples.pop_front();
+        }
+        self.samples.push_back(sample);
+    }
+
+    pub fn len(&self) -> usize {
+        self.samples.len()
+    }
+
+    // Nearest rank percentiles. All zero when there are no samples.
+    pub fn percentiles(&mut self) -> Percentiles {
+        if self.samples.is_empty() {
+            return Percentiles::default();
+        }
+
+        self.sorted.clear();
+        self.sorted.extend(self.samples.iter());
+        self.sorted.sort_unstable_by(|a, b| a.total_cmp(b));
+        let rank = |p: f32| {
+            let index = (p * self.sorted.len() as f32).ceil() as usize;
+            self.sorted[index.clamp(1, self.sorted.len()) - 1]
+        };
+
+        Percentiles {
+            p50: rank(0.5),
+            p95: rank(0.95),
+            p99: rank(0.99),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn percentiles_of_window() {
+        let mut histogram = RollingHistogram::new(100);
+        assert_eq!(histogram.percentiles(), Percentiles::default());
+
+        // Only the last 100 samples, 1 through 100, are kept.
+        for sample in (0..=100).rev() {
+            histogram.push(100.0 - sample as f32);
+        }
+        assert_eq!(histogram.len(), 100);
+        assert_eq!(
+            histogram.percentiles(),
+            Percentiles {
+                p50: 50.0,
+                p95: 95.0,
+                p99: 99.0,
+            }
+        );
+    }
+}
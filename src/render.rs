@@ -14,12 +14,16 @@
 
 use glm::*;
 
-use std::collections::HashMap;
 use std::collections::VecDeque;
+use std::ffi::c_void;
 use std::sync::*;
+use std::thread;
 use std::time::*;
 
+use crate::cull::*;
+use crate::profile::*;
 use crate::scene::*;
+use crate::simd::*;
 use crate::voxel::*;
 
 #[repr(C)]
@@ -28,10 +32,13 @@ struct GPUVertex {
     position: [f32; 3],
 }
 
+// Only the model is stored, keeping instances at 64 bytes. The vertex shader
+// derives the affine inverse, so the fragment shader doesn't have to invert
+// the model for every fragment.
 #[repr(C)]
 #[derive(Debug, Copy, Clone)]
 pub struct GPUInstance {
-    model: Matrix4<f32>,
+    model: SimdMat4,
 }
 
 #[repr(C)]
@@ -66,17 +73,29 @@ impl GPUInstance {
         );
         let rotate = glm::ext::rotate(&identity, rotate_angle, *rotate_axis);
         let scale = glm::ext::scale(&rotate, *scale);
-        let mut translate = glm::ext::translate(&rotate, *translate);
-        translate[3][3] = unsafe { std::mem::transmute(texture_id) };
-        GPUInstance { model: translate }
+        let translate = glm::ext::translate(&rotate, *translate);
+        Self::from_model(&SimdMat4::from_glm(&translate), texture_id)
     }
 
-    pub fn from_model(model: Matrix4<f32>, texture_id: u32) -> Self {
-        let mut merged = model;
-        merged[3][3] = unsafe { std::mem::transmute(texture_id) };
+    pub fn from_model(model: &SimdMat4, texture_id: u32) -> Self {
+        let mut merged = *model;
+        merged[3][3] = f32::from_bits(texture_id);
         GPUInstance { model: merged }
     }
 
+    // Batched from_model, for writing runs of instances straight into the
+    // instance data shared with the renderer.
+    pub fn from_models(models: &[SimdMat4], texture_ids: &[u32], instances: &mut [GPUInstance]) {
+        assert!(models.len() == texture_ids.len() && models.len() == instances.len());
+        for ((model, texture_id), instance) in models
+            .iter()
+            .zip(texture_ids.iter())
+            .zip(instances.iter_mut())
+        {
+            *instance = Self::from_model(model, *texture_id);
+        }
+    }
+
     pub fn translate(&mut self, translate: &Vec3) {
         self.model[3][0] += translate.x;
         self.model[3][1] += translate.y;
@@ -90,25 +109,70 @@ impl GPUInstance {
     }
 
     pub fn rotate(&mut self, angle: f32, axis: &Vec3) {
-        self.model = glm::ext::rotate(&self.model, angle, normalize(*axis));
+        let rotated = glm::ext::rotate(&self.model.to_glm(), angle, normalize(*axis));
+        self.model = SimdMat4::from_glm(&rotated);
+    }
+}
+
+// Compact instance for instances that are only translated and uniformly
+// scaled, such as terrain chunks. coord is the translation in units of the
+// scale. scale_texture holds the scale as fixed point in the top 16 bits, and
+// the texture ID in the bottom 16 bits.
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct GPUAlignedInstance {
+    coord: [i32; 3],
+    scale_texture: u32,
+}
+
+// Number of fractional bits in the fixed point scale of aligned instances.
+const ALIGNED_SCALE_FRACTION_BITS: u32 = 8;
+
+impl GPUAlignedInstance {
+    // Encodes model if it's a uniform scale followed by a translation by a
+    // whole multiple of the scale, and both fit in the compact encoding.
+    pub fn from_model(model: &SimdMat4, texture_id: u32) -> Option<Self> {
+        let scale = model[0][0];
+        if model[0] != [scale, 0.0, 0.0, 0.0]
+            || model[1] != [0.0, scale, 0.0, 0.0]
+            || model[2] != [0.0, 0.0, scale, 0.0]
+            || model[3][3] != 1.0
+            || texture_id > 0xFFFF
+        {
+            return None;
+        }
+
+        let fixed_scale = scale * (1 << ALIGNED_SCALE_FRACTION_BITS) as f32;
+        if !(fixed_scale >= 1.0 && fixed_scale <= 65535.0 && fixed_scale.fract() == 0.0) {
+            return None;
+        }
+
+        let mut coord = [0; 3];
+        for i in 0..3 {
+            let c = model[3][i] / scale;
+            if c.fract() != 0.0 || c.abs() >= i32::MAX as f32 {
+                return None;
+            }
+            coord[i] = c as i32;
+        }
+
+        Some(GPUAlignedInstance {
+            coord,
+            scale_texture: ((fixed_scale as u32) << 16) | texture_id,
+        })
     }
 }
 
 impl Default for GPUInstance {
     fn default() -> Self {
         GPUInstance {
-            model: Matrix4::new(
-                Vec4::new(1.0, 0.0, 0.0, 0.0),
-                Vec4::new(0.0, 1.0, 0.0, 0.0),
-                Vec4::new(0.0, 0.0, 1.0, 0.0),
-                Vec4::new(0.0, 0.0, 0.0, 1.0),
-            ),
+            model: SimdMat4::IDENTITY,
         }
     }
 }
 
 extern "C" {
-    fn entry() -> u64;
+    fn entry(init_info: *const InitInfo) -> u64;
 
     fn render_tick(
         window_width: *mut i32,
@@ -118,20 +182,162 @@ extern "C" {
 
     fn get_input_data_pointer() -> *const UserInput;
 
-    fn add_texture(data: *const Color, width: u32, height: u32, depth: u32) -> i32;
+    fn add_textures(
+        num_textures: u32,
+        data: *const *const Color,
+        extents: *const [u32; 3],
+        texture_ids: *mut i32,
+    ) -> i32;
+
+    fn start_update_instances(stream: u32, instance_count: u32) -> *mut c_void;
+
+    fn end_update_instances(
+        stream: u32,
+        instance_count: u32,
+        dirty_ranges: *const u32,
+        num_dirty_ranges: u32,
+    ) -> i32;
 
-    fn start_update_instances(instance_count: u32) -> *mut GPUInstance;
+    fn start_update_draw_list(stream: u32, draw_count: u32) -> *mut u32;
 
-    fn end_update_instances(instance_count: u32) -> i32;
+    fn end_update_draw_list(stream: u32, draw_count: u32) -> i32;
+
+    fn get_allocator_stats(stats: *mut AllocatorStats);
+
+    fn defragment_textures() -> i32;
+
+    fn get_upload_timeline_value() -> u64;
+
+    fn is_upload_finished(timeline_value: u64) -> i32;
+
+    fn get_gpu_timings(timings: *mut GpuTimings);
+
+    fn take_readback(wait: u32, frame: *mut u64, pixels: *mut *const u8) -> i32;
+    fn take_reused_readback(frame: *mut u64, pixels: *mut *const u8) -> i32;
 
     fn cleanup();
 }
 
-#[derive(PartialEq, Eq, Hash, Clone, Copy)]
+#[derive(Default, PartialEq, Eq, Hash, Clone, Copy)]
 pub struct TextureHandle {
     id: u32,
 }
 
+// Marks a texture handle whose texture hasn't been uploaded yet.
+const TEXTURE_NOT_UPLOADED: u32 = u32::MAX;
+
+// Default number of voxel bytes uploaded to textures per frame. At least one
+// texture is uploaded per frame, even if it's larger than the budget.
+const DEFAULT_TEXTURE_UPLOAD_BUDGET: usize = 16 * 1024 * 1024;
+
+// Scenes smaller than this are written on the calling thread, since spawning
+// workers would cost more than it saves.
+const PARALLEL_INSTANCE_THRESHOLD: u32 = 16384;
+
+// Instance streams, matching lib/common.h. Each instance slot is written to
+// exactly one stream, and only drawn from that stream.
+const INSTANCE_STREAM_MODEL: u32 = 0;
+const INSTANCE_STREAM_ALIGNED: u32 = 1;
+const NUM_INSTANCE_STREAMS: usize = 2;
+
+// Dirty instance slots at most this far apart are uploaded as one copy region,
+// since re-uploading a few clean slots is cheaper than another region.
+const INSTANCE_RANGE_MERGE_GAP: u32 = 16;
+
+// Stream of an instance slot that isn't written to any stream, because it's
+// free or its texture hasn't been uploaded yet. Also the slot of a free stream
+// entry.
+const NO_STREAM: u32 = u32::MAX;
+
+// Each instance stream's buffers are indexed by entries of that stream rather
+// than by slot, so a stream only holds as many instances as are written to it.
+// Entries freed when a slot moves to another stream or is removed are reused
+// by later instances of the same stream.
+struct StreamEntries {
+    slot_streams: Vec<u32>,
+    slot_entries: Vec<u32>,
+    entry_slots: [Vec<u32>; NUM_INSTANCE_STREAMS],
+    free_entries: [Vec<u32>; NUM_INSTANCE_STREAMS],
+}
+
+impl StreamEntries {
+    fn new() -> Self {
+        StreamEntries {
+            slot_streams: vec![],
+            slot_entries: vec![],
+            entry_slots: [vec![], vec![]],
+            free_entries: [vec![], vec![]],
+        }
+    }
+
+    fn clear(&mut self) {
+        self.slot_streams.clear();
+        self.slot_entries.clear();
+        for stream in 0..NUM_INSTANCE_STREAMS {
+            self.entry_slots[stream].clear();
+            self.free_entries[stream].clear();
+        }
+    }
+
+    fn resize(&mut self, slot_count: u32) {
+        self.slot_streams.resize(slot_count as usize, NO_STREAM);
+        self.slot_entries.resize(slot_count as usize, 0);
+    }
+
+    // Number of entries in stream, including free ones. Entries are always
+    // less than this.
+    fn num_entries(&self, stream: u32) -> u32 {
+        self.entry_slots[stream as usize].len() as u32
+    }
+
+    // Stream and entry slot is written to, if any.
+    fn get(&self, slot: u32) -> Option<(u32, u32)> {
+        match self.slot_streams.get(slot as usize) {
+            Some(&stream) if stream != NO_STREAM => {
+                Some((stream, self.slot_entries[slot as usize]))
+            }
+            _ => None,
+        }
+    }
+
+    // Takes slot out of the stream it's written to, if any.
+    fn release(&mut self, slot: u32) {
+        if let Some((stream, entry)) = self.get(slot) {
+            self.entry_slots[stream as usize][entry as usize] = NO_STREAM;
+            self.free_entries[stream as usize].push(entry);
+            self.slot_streams[slot as usize] = NO_STREAM;
+        }
+    }
+
+    // Returns slot's entry in stream, moving it there from the stream it was
+    // written to before.
+    fn assign(&mut self, slot: u32, stream: u32) -> u32 {
+        match self.get(slot) {
+            Some((old_stream, entry)) if old_stream == stream => return entry,
+            _ => self.release(slot),
+        }
+        let entry_slots = &mut self.entry_slots[stream as usize];
+        let entry = if let Some(entry) = self.free_entries[stream as usize].pop() {
+            entry_slots[entry as usize] = slot;
+            entry
+        } else {
+            entry_slots.push(slot);
+            entry_slots.len() as u32 - 1
+        };
+        self.slot_streams[slot as usize] = stream;
+        self.slot_entries[slot as usize] = entry;
+        entry
+    }
+}
+
+// An instance slot to be written to an entry of its stream.
+#[derive(Debug, Copy, Clone)]
+struct StreamWrite {
+    entry: u32,
+    slot: u32,
+    texture_id: u32,
+}
+
 pub struct Renderer {
     window_width: i32,
     window_height: i32,
@@ -144,12 +350,40 @@ pub struct Renderer {
     prev_time: Instant,
     prev_frame_time: Instant,
     prev_frame_num: usize,
-    texture_handle_lookup: HashMap<TextureHandle, u32>,
+    texture_handle_lookup: Vec<u32>,
+    num_instance_workers: usize,
+    texture_pending_instances: Vec<u32>,
+    stream_entries: StreamEntries,
+    draw_list: Vec<u32>,
+    stream_draw_lists: [Vec<u32>; NUM_INSTANCE_STREAMS],
+    num_visible_instances: u32,
+    num_culled_instances: u32,
+    sort_front_to_back: bool,
+    depth_sorter: DepthSorter,
+    texture_upload_budget: usize,
+    texture_upload_batch: Vec<(SharedVoxelData, TextureHandle)>,
+    texture_upload_extents: Vec<[u32; 3]>,
+    texture_upload_ids: Vec<i32>,
+    last_upload_timeline_value: u64,
+    defragment_requested: bool,
+    defragment_scheduler: DefragmentScheduler,
+    last_gpu_timing_frame: u64,
+    gpu_secondary_ms: RollingHistogram,
+    gpu_raster_ms: RollingHistogram,
+    gpu_fragment_shader_invocations: RollingHistogram,
+    latest_gpu_timing: Option<GpuFrameTiming>,
+    upload_stats: UploadStats,
+    readback_size: usize,
 }
 
+// Voxel data is shared between its owner (e.g. the world pager) and the upload
+// queue, rather than cloned. The upload queue only holds its reference until
+// the data is copied into the staging buffer.
+pub type SharedVoxelData = Arc<dyn RawVoxelData<Color> + Send + Sync>;
+
 pub struct TextureUploadQueue {
     num_textures_created: u32,
-    texture_upload_queue: VecDeque<(Box<dyn RawVoxelData<Color> + Send>, TextureHandle)>,
+    texture_upload_queue: VecDeque<(SharedVoxelData, TextureHandle)>,
 }
 
 impl TextureUploadQueue {
@@ -160,7 +394,7 @@ impl TextureUploadQueue {
         }
     }
 
-    pub fn add_texture(&mut self, texture: Box<dyn RawVoxelData<Color> + Send>) -> TextureHandle {
+    pub fn add_texture(&mut self, texture: SharedVoxelData) -> TextureHandle {
         let handle = TextureHandle {
             id: self.num_textures_created,
         };
@@ -169,20 +403,222 @@ impl TextureUploadQueue {
         handle
     }
 
-    pub fn pop(&mut self) -> Option<(Box<dyn RawVoxelData<Color> + Send>, TextureHandle)> {
+    pub fn pop(&mut self) -> Option<(SharedVoxelData, TextureHandle)> {
         self.texture_upload_queue.pop_front()
     }
+
+    // Pops textures into batch until their total size would exceed
+    // byte_budget. The first texture is always popped, so large textures
+    // still make progress.
+    pub fn pop_batch(
+        &mut self,
+        byte_budget: usize,
+        batch: &mut Vec<(SharedVoxelData, TextureHandle)>,
+    ) {
+        let mut bytes = 0;
+        while let Some((texture, _)) = self.texture_upload_queue.front() {
+            let size = texture_size(texture);
+            if !batch.is_empty() && bytes + size > byte_budget {
+                break;
+            }
+            bytes += size;
+            batch.push(self.texture_upload_queue.pop_front().unwrap());
+        }
+    }
+
+    // Puts textures that couldn't be uploaded back at the front of the queue,
+    // in their original order.
+    pub fn requeue(&mut self, batch: &mut Vec<(SharedVoxelData, TextureHandle)>) {
+        while let Some(texture) = batch.pop() {
+            self.texture_upload_queue.push_front(texture);
+        }
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.texture_upload_queue.is_empty()
+    }
+}
+
+fn texture_extent(texture: &SharedVoxelData) -> [u32; 3] {
+    let dim_x = texture.dim_x();
+    let dim_y = texture.dim_y();
+    let dim_z = texture.dim_z();
+    assert!(dim_x.1 > dim_x.0);
+    assert!(dim_y.1 > dim_y.0);
+    assert!(dim_z.1 > dim_z.0);
+    [
+        (dim_x.1 - dim_x.0) as u32,
+        (dim_y.1 - dim_y.0) as u32,
+        (dim_z.1 - dim_z.0) as u32,
+    ]
+}
+
+fn texture_size(texture: &SharedVoxelData) -> usize {
+    let extent = texture_extent(texture);
+    extent[0] as usize * extent[1] as usize * extent[2] as usize * std::mem::size_of::<Color>()
+}
+
+// GPU memory usage, as tracked by the device memory sub-allocator.
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone)]
+pub struct AllocatorStats {
+    pub num_device_memories: u64,
+    pub device_memory_bytes: u64,
+    pub num_allocations: u64,
+    pub allocated_bytes: u64,
+}
+
+// Frames between attempts to defragment texture memory.
+const DEFRAGMENT_INTERVAL: u32 = 120;
+
+// Decides when to move textures out of sparse memory blocks. Defragmenting
+// skips that frame's texture uploads, so it's only attempted on frames with
+// no uploads waiting, and not again until allocations have changed. Whether a
+// block is sparse enough is up to defragment_textures, against
+// ALLOCATOR_DEFRAGMENT_THRESHOLD in lib/common.h.
+struct DefragmentScheduler {
+    frames_until_check: u32,
+    checked_stats: AllocatorStats,
+}
+
+impl DefragmentScheduler {
+    fn new() -> Self {
+        DefragmentScheduler {
+            frames_until_check: DEFRAGMENT_INTERVAL,
+            checked_stats: AllocatorStats::default(),
+        }
+    }
+
+    // Called once per frame. Returns whether to defragment this frame.
+    fn update(&mut self, uploads_idle: bool, stats: &AllocatorStats) -> bool {
+        self.frames_until_check = self.frames_until_check.saturating_sub(1);
+        if !uploads_idle || self.frames_until_check > 0 {
+            return false;
+        }
+        self.frames_until_check = DEFRAGMENT_INTERVAL;
+
+        // The last attempt would have found the same blocks.
+        if stats.device_memory_bytes == self.checked_stats.device_memory_bytes
+            && stats.allocated_bytes == self.checked_stats.allocated_bytes
+        {
+            return false;
+        }
+        self.checked_stats = *stats;
+        stats.num_device_memories > 1
+    }
+}
+
+// GPU timings of one frame, matching gpu_timings in lib/common.h. Frames are
+// counted from 1, so frame is 0 until a frame has been read back.
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone)]
+struct GpuTimings {
+    frame: u64,
+    fragment_shader_invocations: u64,
+    secondary_ms: f32,
+    raster_ms: f32,
+    has_secondary: u32,
+    has_timestamps: u32,
+    has_statistics: u32,
+}
+
+// GPU times of one frame, counted from 1. Passes that weren't timed are None.
+#[derive(Debug, Default, Copy, Clone)]
+pub struct GpuFrameTiming {
+    pub frame: u64,
+    pub secondary_ms: Option<f32>,
+    pub raster_ms: Option<f32>,
+}
+
+// Totals of textures uploaded so far.
+#[derive(Debug, Default, Copy, Clone)]
+pub struct UploadStats {
+    pub num_textures: usize,
+    pub num_bytes: usize,
+}
+
+// Number of frames the GPU timing percentiles are taken over.
+const GPU_PROFILE_WINDOW: usize = 512;
+
+// Percentiles of recent per-pass GPU times, and of fragment shader invocations
+// in the raster pass. Passes the device can't time are left at zero.
+#[derive(Debug, Default, Copy, Clone)]
+pub struct GpuProfile {
+    pub secondary_ms: Percentiles,
+    pub raster_ms: Percentiles,
+    pub fragment_shader_invocations: Percentiles,
+}
+
+// How the renderer is started, matching init_info in lib/common.h. Headless
+// renderers have no window and render into offscreen images of the given
+// size, which are copied back to the host when readback is set. Ray traced
+// renderers trace frames through a TLAS of the drawn instances instead of
+// rasterizing them.
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone)]
+struct InitInfo {
+    headless: u32,
+    width: u32,
+    height: u32,
+    readback: u32,
+    ray_trace: u32,
 }
 
 #[repr(C)]
 struct RenderTickInfo {
     perspective: *mut Matrix4<f32>,
     camera: *mut Matrix4<f32>,
+    camera_uniform: *const CameraUniform,
+}
+
+// Per-frame camera data used by the fragment shader to generate rays. These are
+// inverted once per frame here, rather than per fragment.
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+struct CameraUniform {
+    // Unprojects screen positions into world space.
+    inverse_view_projection: SimdMat4,
+    // Same, but without the camera's translation, for ray directions.
+    inverse_centered_view_projection: SimdMat4,
+    position: [f32; 4],
+}
+
+impl CameraUniform {
+    fn new(perspective: &Matrix4<f32>, camera: &Matrix4<f32>) -> Self {
+        let inverse_perspective = SimdMat4::from_glm(perspective).inverse();
+        let inverse_camera = SimdMat4::from_glm(camera).affine_inverse();
+        let mut inverse_centered_camera = inverse_camera;
+        inverse_centered_camera[3] = [0.0, 0.0, 0.0, 1.0];
+        CameraUniform {
+            inverse_view_projection: inverse_camera.mul(&inverse_perspective),
+            inverse_centered_view_projection: inverse_centered_camera.mul(&inverse_perspective),
+            position: inverse_camera[3],
+        }
+    }
 }
 
 impl Renderer {
-    pub fn new() -> Self {
-        let code = unsafe { entry() };
+    pub fn new(ray_trace: bool) -> Self {
+        Self::with_init_info(&InitInfo {
+            ray_trace: ray_trace as u32,
+            ..Default::default()
+        })
+    }
+
+    // Renders width by height frames without a window. With readback, every
+    // frame is copied back and can be taken with take_readback.
+    pub fn new_headless(width: u32, height: u32, readback: bool, ray_trace: bool) -> Self {
+        Self::with_init_info(&InitInfo {
+            headless: 1,
+            width,
+            height,
+            readback: readback as u32,
+            ray_trace: ray_trace as u32,
+        })
+    }
+
+    fn with_init_info(init_info: &InitInfo) -> Self {
+        let code = unsafe { entry(init_info) };
         if code != 0 {
             panic!("ERROR: Vulkan initialization failed",);
         }
@@ -201,7 +637,36 @@ impl Renderer {
             prev_time: Instant::now(),
             prev_frame_time: Instant::now(),
             prev_frame_num: 0,
-            texture_handle_lookup: HashMap::new(),
+            texture_handle_lookup: vec![],
+            num_instance_workers: thread::available_parallelism()
+                .map(|n| n.get())
+                .unwrap_or(1),
+            texture_pending_instances: vec![],
+            stream_entries: StreamEntries::new(),
+            draw_list: vec![],
+            stream_draw_lists: [vec![], vec![]],
+            num_visible_instances: 0,
+            num_culled_instances: 0,
+            sort_front_to_back: true,
+            depth_sorter: DepthSorter::new(),
+            texture_upload_budget: DEFAULT_TEXTURE_UPLOAD_BUDGET,
+            texture_upload_batch: vec![],
+            texture_upload_extents: vec![],
+            texture_upload_ids: vec![],
+            last_upload_timeline_value: 0,
+            defragment_requested: false,
+            defragment_scheduler: DefragmentScheduler::new(),
+            last_gpu_timing_frame: 0,
+            gpu_secondary_ms: RollingHistogram::new(GPU_PROFILE_WINDOW),
+            gpu_raster_ms: RollingHistogram::new(GPU_PROFILE_WINDOW),
+            gpu_fragment_shader_invocations: RollingHistogram::new(GPU_PROFILE_WINDOW),
+            latest_gpu_timing: None,
+            upload_stats: UploadStats::default(),
+            readback_size: if init_info.readback != 0 {
+                init_info.width as usize * init_info.height as usize * 4
+            } else {
+                0
+            },
         }
     }
 
@@ -217,24 +682,464 @@ impl Renderer {
         unsafe { get_input_data_pointer() }
     }
 
-    pub fn update_instances(&mut self, scene: SceneGraph) {
+    fn lookup_texture_id(texture_handle_lookup: &[u32], handle: TextureHandle) -> Option<u32> {
+        match texture_handle_lookup.get(handle.id as usize) {
+            Some(&id) if id != TEXTURE_NOT_UPLOADED => Some(id),
+            _ => None,
+        }
+    }
+
+    // Writes every entry in writes with encode. writes are sorted by entry, so
+    // when they're split into one chunk per worker, each chunk covers a
+    // disjoint range of the mapped buffer.
+    fn write_stream_entries<T: Send>(
+        num_instance_workers: usize,
+        writes: &[StreamWrite],
+        entries: &mut [T],
+        encode: impl Fn(&StreamWrite) -> T + Sync,
+    ) {
+        if num_instance_workers <= 1 || writes.len() < PARALLEL_INSTANCE_THRESHOLD as usize {
+            for write in writes {
+                entries[write.entry as usize] = encode(write);
+            }
+            return;
+        }
+
+        let per_worker = writes.len().div_ceil(num_instance_workers);
+        let encode = &encode;
+        thread::scope(|s| {
+            let mut remaining = entries;
+            let mut base = 0;
+            for chunk in writes.chunks(per_worker) {
+                let end = chunk[chunk.len() - 1].entry + 1;
+                let (chunk_entries, rest) =
+                    std::mem::take(&mut remaining).split_at_mut((end - base) as usize);
+                remaining = rest;
+                let chunk_base = base;
+                base = end;
+                s.spawn(move || {
+                    for write in chunk {
+                        chunk_entries[(write.entry - chunk_base) as usize] = encode(write);
+                    }
+                });
+            }
+        });
+    }
+
+    // Coalesces sorted entries into (first entry, number of entries) pairs.
+    fn coalesce_instance_ranges(writes: &[StreamWrite]) -> Vec<u32> {
+        let mut ranges: Vec<u32> = vec![];
+        for write in writes {
+            let entry = write.entry;
+            let len = ranges.len();
+            if len > 0 && ranges[len - 2] + ranges[len - 1] + INSTANCE_RANGE_MERGE_GAP > entry {
+                ranges[len - 1] = entry + 1 - ranges[len - 2];
+            } else {
+                ranges.push(entry);
+                ranges.push(1);
+            }
+        }
+        ranges
+    }
+
+    // Uploads the instance slots modified since the last update, along with
+    // slots that were waiting on their texture to be uploaded. Slots that
+    // haven't changed are left alone in the persistent instance buffers.
+    // Instances that fit the aligned encoding go into the aligned stream, and
+    // the rest into the model stream. Live instances whose texture isn't
+    // uploaded yet aren't written to either, and are written once it is.
+    pub fn update_instances(&mut self, scene: &mut FlatScene) {
+        profile_zone!("update_instances");
+        let slot_count = scene.num_instance_slots();
+        self.stream_entries.resize(slot_count);
+
+        let lookup = &self.texture_handle_lookup;
+        let mut slots: Vec<u32> = scene.dirty_instances().to_vec();
+        self.texture_pending_instances.retain(|slot| {
+            if *slot >= slot_count
+                || !scene.is_instance_live(*slot)
+                || scene.is_instance_dirty(*slot)
+            {
+                return false;
+            }
+            let texture_handle = scene.get_instance_texture_handle(*slot);
+            if Self::lookup_texture_id(lookup, texture_handle).is_some() {
+                slots.push(*slot);
+                false
+            } else {
+                true
+            }
+        });
+        slots.sort_unstable();
+
+        // Entries are assigned on the calling thread, in slot order, so they
+        // don't depend on how the writes are split between workers.
+        let mut writes: [Vec<StreamWrite>; NUM_INSTANCE_STREAMS] = [vec![], vec![]];
+        for slot in slots {
+            if !scene.is_instance_live(slot) {
+                self.stream_entries.release(slot);
+                continue;
+            }
+            let texture_handle = scene.get_instance_texture_handle(slot);
+            let Some(texture_id) = Self::lookup_texture_id(lookup, texture_handle) else {
+                self.stream_entries.release(slot);
+                self.texture_pending_instances.push(slot);
+                continue;
+            };
+            let model = scene.get_instance_world_model(slot);
+            let stream = if GPUAlignedInstance::from_model(model, texture_id).is_some() {
+                INSTANCE_STREAM_ALIGNED
+            } else {
+                INSTANCE_STREAM_MODEL
+            };
+            let entry = self.stream_entries.assign(slot, stream);
+            writes[stream as usize].push(StreamWrite {
+                entry,
+                slot,
+                texture_id,
+            });
+        }
+        scene.clear_dirty();
+
+        for stream in 0..NUM_INSTANCE_STREAMS as u32 {
+            let writes = &mut writes[stream as usize];
+            writes.sort_unstable_by_key(|write| write.entry);
+            let entry_count = self.stream_entries.num_entries(stream);
+            let ptr = unsafe { start_update_instances(stream, entry_count) };
+            if ptr.is_null() {
+                panic!("ERROR: Updating instances failed",);
+            }
+            let world_model = |write: &StreamWrite| scene.get_instance_world_model(write.slot);
+            if stream == INSTANCE_STREAM_MODEL {
+                let entries = unsafe {
+                    std::slice::from_raw_parts_mut(ptr as *mut GPUInstance, entry_count as usize)
+                };
+                Self::write_stream_entries(self.num_instance_workers, writes, entries, |write| {
+                    GPUInstance::from_model(world_model(write), write.texture_id)
+                });
+            } else {
+                let entries = unsafe {
+                    std::slice::from_raw_parts_mut(
+                        ptr as *mut GPUAlignedInstance,
+                        entry_count as usize,
+                    )
+                };
+                Self::write_stream_entries(self.num_instance_workers, writes, entries, |write| {
+                    GPUAlignedInstance::from_model(world_model(write), write.texture_id).unwrap()
+                });
+            }
+
+            let ranges = Self::coalesce_instance_ranges(writes);
+            let code = unsafe {
+                end_update_instances(
+                    stream,
+                    entry_count,
+                    ranges.as_ptr(),
+                    (ranges.len() / 2) as u32,
+                )
+            };
+            if code != 0 {
+                panic!("ERROR: Updating instances failed",);
+            }
+        }
+
+        self.update_draw_list(scene);
+    }
+
+    // Culls the scene's instances against the view frustum of the next frame,
+    // and uploads the stream entries of the visible ones as that frame's draw
+    // lists. Instances still waiting on their texture aren't written to any
+    // stream, so they're left out. The fragment shader only ever pushes depth
+    // further away, so drawing near instances first lets early depth testing
+    // reject the occluded ones.
+    fn update_draw_list(&mut self, scene: &FlatScene) {
+        self.draw_list.clear();
+        scene.cull(&self.get_frustum(), &mut self.draw_list);
+        let num_in_frustum = self.draw_list.len() as u32;
+        let stream_entries = &self.stream_entries;
+        self.draw_list
+            .retain(|slot| stream_entries.get(*slot).is_some());
+        if self.sort_front_to_back {
+            self.depth_sorter.sort(
+                &self.camera,
+                scene.get_instance_bounds(),
+                &mut self.draw_list,
+            );
+        }
+        for draw_list in self.stream_draw_lists.iter_mut() {
+            draw_list.clear();
+        }
+        for slot in self.draw_list.iter() {
+            let (stream, entry) = self.stream_entries.get(*slot).unwrap();
+            self.stream_draw_lists[stream as usize].push(entry);
+        }
+        self.num_visible_instances = self.draw_list.len() as u32;
+        self.num_culled_instances = scene.num_instances() - num_in_frustum;
+        self.upload_draw_list();
+    }
+
+    fn upload_draw_list(&self) {
+        for stream in 0..NUM_INSTANCE_STREAMS {
+            let draw_list = &self.stream_draw_lists[stream];
+            let draw_count = draw_list.len() as u32;
+            let ptr = unsafe { start_update_draw_list(stream as u32, draw_count) };
+            if ptr == 0 as *mut u32 {
+                panic!("ERROR: Updating draw list failed",);
+            }
+            unsafe { std::ptr::copy_nonoverlapping(draw_list.as_ptr(), ptr, draw_list.len()) };
+            let code = unsafe { end_update_draw_list(stream as u32, draw_count) };
+            if code != 0 {
+                panic!("ERROR: Updating draw list failed",);
+            }
+        }
+    }
+
+    // Frustum of the camera that the next frame will be rendered with.
+    fn get_frustum(&self) -> Frustum {
+        Frustum::from_view_projection(&(self.perspective * self.camera))
+    }
+
+    // Draw lists are sorted front to back by default.
+    pub fn set_sort_front_to_back(&mut self, sort_front_to_back: bool) {
+        self.sort_front_to_back = sort_front_to_back;
+    }
+
+    // Maximum number of voxel bytes uploaded to textures per frame.
+    pub fn set_texture_upload_budget(&mut self, texture_upload_budget: usize) {
+        self.texture_upload_budget = texture_upload_budget;
+    }
+
+    // Uploads as many queued textures as fit in the per-frame budget, as a
+    // single batch. The queue is only locked while popping.
+    fn upload_textures(&mut self, texture_upload_queue: &Mutex<TextureUploadQueue>) {
+        profile_zone!("upload_textures");
+        texture_upload_queue
+            .lock()
+            .unwrap()
+            .pop_batch(self.texture_upload_budget, &mut self.texture_upload_batch);
+        if self.texture_upload_batch.is_empty() {
+            return;
+        }
+
+        // Raw pointers aren't Send, so unlike the extents they aren't kept
+        // on the renderer between frames.
+        let texture_upload_data: Vec<*const Color> = self
+            .texture_upload_batch
+            .iter()
+            .map(|(texture, _)| texture.get_raw())
+            .collect();
+        self.texture_upload_extents.clear();
+        self.texture_upload_extents.extend(
+            self.texture_upload_batch
+                .iter()
+                .map(|(texture, _)| texture_extent(texture)),
+        );
+
+        self.texture_upload_ids
+            .resize(self.texture_upload_batch.len(), -1);
+        let num_added = unsafe {
+            add_textures(
+                self.texture_upload_batch.len() as u32,
+                texture_upload_data.as_ptr(),
+                self.texture_upload_extents.as_ptr(),
+                self.texture_upload_ids.as_mut_ptr(),
+            )
+        };
+
+        if num_added < 0 {
+            panic!("ERROR: Adding textures failed",);
+        }
+        if num_added > 0 {
+            self.last_upload_timeline_value = unsafe { get_upload_timeline_value() };
+        }
+
+        self.upload_stats.num_textures += num_added as usize;
+        self.upload_stats.num_bytes += self.texture_upload_batch[..num_added as usize]
+            .iter()
+            .map(|(texture, _)| texture_size(texture))
+            .sum::<usize>();
+
+        // add_textures has copied the voxels into the staging ring by the
+        // time it returns, so the upload queue's references can be released.
+        // Fixed size textures land in atlas slots, so IDs in a batch aren't
+        // necessarily consecutive.
+        for ((_, handle), texture_id) in self
+            .texture_upload_batch
+            .drain(..num_added as usize)
+            .zip(self.texture_upload_ids.iter())
+        {
+            if self.texture_handle_lookup.len() <= handle.id as usize {
+                self.texture_handle_lookup
+                    .resize(handle.id as usize + 1, TEXTURE_NOT_UPLOADED);
+            }
+            self.texture_handle_lookup[handle.id as usize] = *texture_id as u32;
+        }
+
+        // Whatever didn't fit in the staging ring is retried next frame.
+        if !self.texture_upload_batch.is_empty() {
+            texture_upload_queue
+                .lock()
+                .unwrap()
+                .requeue(&mut self.texture_upload_batch);
+        }
+    }
+
+    // Whether every texture uploaded so far has reached the GPU. Doesn't
+    // block. Benchmarks wait on this before timing starts.
+    pub fn uploads_finished(&self) -> bool {
+        unsafe { is_upload_finished(self.last_upload_timeline_value) != 0 }
+    }
+
+    // Timings are read back FRAMES_IN_FLIGHT frames after they're recorded,
+    // so this is called every frame, and only records timings it hasn't seen.
+    fn record_gpu_timings(&mut self) {
+        let mut timings = GpuTimings::default();
+        unsafe { get_gpu_timings(&mut timings) };
+        if timings.frame == self.last_gpu_timing_frame {
+            return;
+        }
+        self.last_gpu_timing_frame = timings.frame;
+        self.latest_gpu_timing = Some(GpuFrameTiming {
+            frame: timings.frame,
+            secondary_ms: (timings.has_timestamps != 0 && timings.has_secondary != 0)
+                .then_some(timings.secondary_ms),
+            raster_ms: (timings.has_timestamps != 0).then_some(timings.raster_ms),
+        });
+
+        if timings.has_timestamps != 0 {
+            self.gpu_raster_ms.push(timings.raster_ms);
+            if timings.has_secondary != 0 {
+                self.gpu_secondary_ms.push(timings.secondary_ms);
+            }
+        }
+        if timings.has_statistics != 0 {
+            self.gpu_fragment_shader_invocations
+                .push(timings.fragment_shader_invocations as f32);
+        }
+    }
+
+    // The secondary pass only counts frames that uploaded something.
+    pub fn get_gpu_profile(&mut self) -> GpuProfile {
+        GpuProfile {
+            secondary_ms: self.gpu_secondary_ms.percentiles(),
+            raster_ms: self.gpu_raster_ms.percentiles(),
+            fragment_shader_invocations: self.gpu_fragment_shader_invocations.percentiles(),
+        }
+    }
+
+    // Takes the oldest headless frame not yet taken, as its frame number
+    // (counted from 1) and B8G8R8A8 pixels, row by row. Without wait, only
+    // frames already finished on the GPU are returned, so this never blocks.
+    pub fn take_readback(&mut self, wait: bool) -> Option<(u64, &[u8])> {
+        let mut frame = 0;
+        let mut pixels = std::ptr::null();
+        let code = unsafe { take_readback(wait as u32, &mut frame, &mut pixels) };
+        self.readback_result(code, frame, pixels)
+    }
+
+    // Takes the frame whose readback the next render_tick would overwrite,
+    // waiting for it if it's still on the GPU. render_tick refuses to render
+    // over a frame that hasn't been taken, so this must be called before it
+    // whenever every frame in flight holds one. render_tick would wait for the
+    // same frame anyway.
+    pub fn take_reused_readback(&mut self) -> Option<(u64, &[u8])> {
+        let mut frame = 0;
+        let mut pixels = std::ptr::null();
+        let code = unsafe { take_reused_readback(&mut frame, &mut pixels) };
+        self.readback_result(code, frame, pixels)
+    }
+
+    fn readback_result(&self, code: i32, frame: u64, pixels: *const u8) -> Option<(u64, &[u8])> {
+        if code < 0 {
+            panic!("ERROR: Reading back frame failed",);
+        }
+        if code == 0 {
+            return None;
+        }
+        Some((frame, unsafe {
+            std::slice::from_raw_parts(pixels, self.readback_size)
+        }))
+    }
+
+    // The most recent frame whose GPU times have been read back. This lags
+    // the frame being rendered by the number of frames in flight.
+    pub fn get_latest_gpu_timing(&self) -> Option<GpuFrameTiming> {
+        self.latest_gpu_timing
+    }
+
+    pub fn get_upload_stats(&self) -> UploadStats {
+        self.upload_stats
+    }
+
+    pub fn get_allocator_stats(&self) -> AllocatorStats {
+        let mut stats = AllocatorStats::default();
+        unsafe { get_allocator_stats(&mut stats) };
+        stats
+    }
+
+    // Moves textures out of the emptiest texture memory block on the next
+    // frame, so it can be released. Textures aren't uploaded on that frame,
+    // since a texture can't be both uploaded and moved in one submission.
+    // render_tick also requests this itself once memory is sparse enough.
+    pub fn request_defragment(&mut self) {
+        self.defragment_requested = true;
+    }
+
+    // Number of visible and culled instances in the last draw list. Instances
+    // waiting on their texture are neither.
+    pub fn get_cull_stats(&self) -> (u32, u32) {
+        (self.num_visible_instances, self.num_culled_instances)
+    }
+
+    // Rewrites the whole instance buffer from a scene graph. Only instances
+    // inside the view frustum are written, and all of them are drawn.
+    pub fn update_instances_from_graph(&mut self, scene: SceneGraph) {
         let instance_count = scene.num_total_children();
-        let mut ptr = unsafe { start_update_instances(instance_count) };
-        if ptr == 0 as *mut GPUInstance {
+        let ptr = unsafe { start_update_instances(INSTANCE_STREAM_MODEL, instance_count) };
+        if ptr.is_null() {
             panic!("ERROR: Updating instances failed",);
         }
-        let mut true_instance_count = 0;
-        for (model, texture_handle) in scene {
-            if let Some(texture_id) = self.texture_handle_lookup.get(&texture_handle) {
-                unsafe { *ptr = GPUInstance::from_model(model, *texture_id) };
-                ptr = unsafe { ptr.offset(1) };
-                true_instance_count += 1;
+        let mut models = vec![];
+        let mut texture_ids = vec![];
+        let mut iter = scene.into_iter_culled(self.get_frustum());
+        for (model, texture_handle) in &mut iter {
+            if let Some(texture_id) =
+                Self::lookup_texture_id(&self.texture_handle_lookup, texture_handle)
+            {
+                models.push(model);
+                texture_ids.push(texture_id);
             }
         }
-        let code = unsafe { end_update_instances(true_instance_count) };
+        let num_culled_instances = iter.num_culled();
+        let true_instance_count = models.len() as u32;
+        let instances =
+            unsafe { std::slice::from_raw_parts_mut(ptr as *mut GPUInstance, models.len()) };
+        GPUInstance::from_models(&models, &texture_ids, instances);
+        let full_range = [0, true_instance_count];
+        let code = unsafe {
+            end_update_instances(
+                INSTANCE_STREAM_MODEL,
+                true_instance_count,
+                full_range.as_ptr(),
+                1,
+            )
+        };
         if code != 0 {
             panic!("ERROR: Updating instances failed",);
         }
+
+        // Scene graph instances are written straight to the start of the
+        // model stream, so the flat scene's stream entries no longer apply.
+        self.stream_entries.clear();
+        self.draw_list.clear();
+        self.draw_list.extend(0..true_instance_count);
+        for draw_list in self.stream_draw_lists.iter_mut() {
+            draw_list.clear();
+        }
+        self.stream_draw_lists[INSTANCE_STREAM_MODEL as usize].extend(0..true_instance_count);
+        self.num_visible_instances = true_instance_count;
+        self.num_culled_instances = num_culled_instances;
+        self.upload_draw_list();
     }
 
     pub fn render_tick(
@@ -243,33 +1148,28 @@ impl Renderer {
         dir: &Vec3,
         texture_upload_queue: Arc<Mutex<TextureUploadQueue>>,
     ) -> (bool, f32) {
-        if let Some((texture, handle)) = texture_upload_queue.lock().unwrap().pop() {
-            let dim_x = texture.dim_x();
-            let dim_y = texture.dim_y();
-            let dim_z = texture.dim_z();
-            assert!(dim_x.1 > dim_x.0);
-            assert!(dim_y.1 > dim_y.0);
-            assert!(dim_z.1 > dim_z.0);
-
-            let texture_id = unsafe {
-                add_texture(
-                    texture.get_raw(),
-                    (dim_x.1 - dim_x.0) as u32,
-                    (dim_y.1 - dim_y.0) as u32,
-                    (dim_z.1 - dim_z.0) as u32,
-                )
-            };
-
-            if texture_id < 0 {
-                panic!("ERROR: Adding texture failed",);
+        profile_zone!("Renderer::render_tick");
+        let uploads_idle = texture_upload_queue.lock().unwrap().is_empty();
+        if self
+            .defragment_scheduler
+            .update(uploads_idle, &self.get_allocator_stats())
+        {
+            self.request_defragment();
+        }
+        if self.defragment_requested {
+            self.defragment_requested = false;
+            if unsafe { defragment_textures() } < 0 {
+                panic!("ERROR: Defragmenting textures failed",);
             }
-
-            self.texture_handle_lookup.insert(handle, texture_id as u32);
+        } else {
+            self.upload_textures(&texture_upload_queue);
         }
 
+        let camera_uniform = CameraUniform::new(&self.perspective, &self.camera);
         let render_tick_info = RenderTickInfo {
             perspective: &mut self.perspective,
             camera: &mut self.camera,
+            camera_uniform: &camera_uniform,
         };
         let code = unsafe {
             render_tick(
@@ -278,6 +1178,7 @@ impl Renderer {
                 &render_tick_info,
             ) == 0
         };
+        self.record_gpu_timings();
 
         if self.window_width != self.prev_window_width
             || self.window_height != self.prev_window_height
@@ -297,10 +1198,16 @@ impl Renderer {
             self.prev_time = Instant::now();
             let num_frames = self.frame_num - self.prev_frame_num;
             self.prev_frame_num = self.frame_num;
+            let gpu_profile = self.get_gpu_profile();
             println!(
-                "FPS: {}   MS: {}",
+                "FPS: {}   MS: {}   VISIBLE: {}   CULLED: {}   GPU MS (P50/P95/P99): {:.3}/{:.3}/{:.3}",
                 1000000.0 * num_frames as f32 / dt as f32,
-                dt as f32 / 1000.0 / num_frames as f32
+                dt as f32 / 1000.0 / num_frames as f32,
+                self.num_visible_instances,
+                self.num_culled_instances,
+                gpu_profile.raster_ms.p50,
+                gpu_profile.raster_ms.p95,
+                gpu_profile.raster_ms.p99
             );
         }
 
@@ -318,3 +1225,52 @@ impl Drop for Renderer {
         unsafe { cleanup() };
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn stats(
+        num_device_memories: u64,
+        device_memory_bytes: u64,
+        allocated_bytes: u64,
+    ) -> AllocatorStats {
+        AllocatorStats {
+            num_device_memories,
+            device_memory_bytes,
+            num_allocations: 1,
+            allocated_bytes,
+        }
+    }
+
+    // Runs the scheduler until its next check, returning whether it asked to
+    // defragment.
+    fn next_check(scheduler: &mut DefragmentScheduler, stats: &AllocatorStats) -> bool {
+        for _ in 1..DEFRAGMENT_INTERVAL {
+            assert!(!scheduler.update(true, stats));
+        }
+        scheduler.update(true, stats)
+    }
+
+    #[test]
+    fn defragments_sparse_memory_when_idle() {
+        let mut scheduler = DefragmentScheduler::new();
+        let sparse = stats(3, 3 << 26, 1 << 20);
+
+        // Pending uploads hold the check off, without using it up.
+        for _ in 0..2 * DEFRAGMENT_INTERVAL {
+            assert!(!scheduler.update(false, &sparse));
+        }
+        assert!(scheduler.update(true, &sparse));
+
+        // Nothing changed since the last attempt.
+        assert!(!next_check(&mut scheduler, &sparse));
+
+        // A block was released, so the rest are worth checking again.
+        let compacted = stats(2, 2 << 26, 1 << 20);
+        assert!(next_check(&mut scheduler, &compacted));
+
+        // A single block can't be compacted into another.
+        assert!(!next_check(&mut scheduler, &stats(1, 1 << 26, 1 << 20)));
+    }
+}
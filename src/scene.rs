@@ -14,13 +14,20 @@
 
 use glm::*;
 
+use crate::cull::*;
 use crate::render::*;
+use crate::simd::*;
 
 pub enum SceneGraph {
+    // bounds caches the bounding box of the children in the parent's local
+    // space. It's cleared whenever the children change, and recomputed by
+    // update_bounds. Children should only be modified through get_child_mut,
+    // so that the cache is invalidated.
     Parent {
         model: Matrix4<f32>,
         total_children: u32,
         children: Vec<SceneGraph>,
+        bounds: Option<([f32; 3], [f32; 3])>,
     },
     Child {
         model: Matrix4<f32>,
@@ -39,6 +46,7 @@ impl SceneGraph {
             ),
             total_children: 0,
             children: vec![],
+            bounds: None,
         }
     }
 
@@ -55,6 +63,7 @@ impl SceneGraph {
                 model,
                 total_children,
                 children,
+                bounds,
             } => model,
             SceneGraph::Child {
                 model,
@@ -69,6 +78,7 @@ impl SceneGraph {
                 model,
                 total_children,
                 children,
+                bounds,
             } => model,
             SceneGraph::Child {
                 model,
@@ -77,14 +87,34 @@ impl SceneGraph {
         }
     }
 
+    pub fn get_child_mut(&mut self, index: usize) -> Option<&mut SceneGraph> {
+        match self {
+            SceneGraph::Parent {
+                model,
+                total_children,
+                children,
+                bounds,
+            } => {
+                *bounds = None;
+                children.get_mut(index)
+            }
+            SceneGraph::Child {
+                model,
+                texture_handle,
+            } => None,
+        }
+    }
+
     pub fn add_child(&mut self, child: SceneGraph) {
         match self {
             SceneGraph::Parent {
                 model,
                 total_children,
                 children,
+                bounds,
             } => {
                 *total_children += child.num_total_children();
+                *bounds = None;
                 children.push(child);
             }
             SceneGraph::Child {
@@ -106,6 +136,7 @@ impl SceneGraph {
                         },
                         child,
                     ],
+                    bounds: None,
                 };
             }
         };
@@ -117,6 +148,7 @@ impl SceneGraph {
                 model,
                 total_children,
                 children,
+                bounds,
             } => *total_children,
             SceneGraph::Child {
                 model,
@@ -124,58 +156,607 @@ impl SceneGraph {
             } => 1,
         }
     }
+
+    // Recomputes the cached bounds of every parent whose children changed,
+    // and returns the bounds of this node in its parent's space. Subtrees
+    // whose cache is still valid aren't visited.
+    pub fn update_bounds(&mut self) -> ([f32; 3], [f32; 3]) {
+        match self {
+            SceneGraph::Parent {
+                model,
+                total_children,
+                children,
+                bounds,
+            } => {
+                let (center, extent) = *bounds.get_or_insert_with(|| {
+                    let mut union = empty_bounds();
+                    for child in children.iter_mut() {
+                        let (center, extent) = child.update_bounds();
+                        union = union_bounds(union, (center, extent));
+                    }
+                    union
+                });
+                transform_bounds(&SimdMat4::from_glm(model), center, extent)
+            }
+            SceneGraph::Child {
+                model,
+                texture_handle,
+            } => unit_cube_bounds(&SimdMat4::from_glm(model)),
+        }
+    }
+
+    // Iterates over the children that may be visible in the frustum. Parents
+    // whose bounds are outside of the frustum are skipped along with their
+    // whole subtree.
+    pub fn into_iter_culled(mut self, frustum: Frustum) -> SceneGraphIter {
+        self.update_bounds();
+        let world_model = SimdMat4::from_glm(self.get_model());
+        SceneGraphIter {
+            scene: vec![(self, world_model)],
+            frustum: Some(frustum),
+            num_culled: 0,
+            models: vec![],
+            world_models: vec![],
+        }
+    }
 }
 
 impl IntoIterator for SceneGraph {
-    type Item = (Matrix4<f32>, TextureHandle);
+    type Item = (SimdMat4, TextureHandle);
     type IntoIter = SceneGraphIter;
 
     fn into_iter(self) -> Self::IntoIter {
+        let world_model = SimdMat4::from_glm(self.get_model());
         SceneGraphIter {
-            scene: vec![self],
-            model_stack: vec![],
+            scene: vec![(self, world_model)],
+            frustum: None,
+            num_culled: 0,
+            models: vec![],
+            world_models: vec![],
         }
     }
 }
 
+// Each pending node is paired with its world transform. The world transforms
+// of a parent's children are composed together in one batch when the parent is
+// expanded, using the models and world_models scratch buffers.
 pub struct SceneGraphIter {
-    scene: Vec<SceneGraph>,
-    model_stack: Vec<Matrix4<f32>>,
+    scene: Vec<(SceneGraph, SimdMat4)>,
+    frustum: Option<Frustum>,
+    num_culled: u32,
+    models: Vec<SimdMat4>,
+    world_models: Vec<SimdMat4>,
+}
+
+impl SceneGraphIter {
+    // Number of children skipped by culling so far.
+    pub fn num_culled(&self) -> u32 {
+        self.num_culled
+    }
 }
 
 impl Iterator for SceneGraphIter {
-    type Item = (Matrix4<f32>, TextureHandle);
+    type Item = (SimdMat4, TextureHandle);
 
     fn next(&mut self) -> Option<Self::Item> {
-        let scene = self.scene.pop()?;
-        match scene {
-            SceneGraph::Parent {
-                model,
-                total_children,
-                children,
-            } => {
-                for child in children.into_iter().rev() {
-                    self.scene.push(child);
+        loop {
+            let (scene, world_model) = self.scene.pop()?;
+            match scene {
+                SceneGraph::Parent {
+                    model,
+                    total_children,
+                    children,
+                    bounds,
+                } => {
+                    if let (Some(frustum), Some((center, extent))) = (&self.frustum, bounds) {
+                        let (center, extent) = transform_bounds(&world_model, center, extent);
+                        if !frustum.intersects(center, extent) {
+                            self.num_culled += total_children;
+                            continue;
+                        }
+                    }
+                    self.models.clear();
+                    self.models.extend(
+                        children
+                            .iter()
+                            .map(|child| SimdMat4::from_glm(child.get_model())),
+                    );
+                    self.world_models.resize(self.models.len(), SimdMat4::ZERO);
+                    mul_batch(&world_model, &self.models, &mut self.world_models);
+                    for (child, child_world_model) in
+                        children.into_iter().zip(self.world_models.iter()).rev()
+                    {
+                        self.scene.push((child, *child_world_model));
+                    }
+                }
+                SceneGraph::Child {
+                    model,
+                    texture_handle,
+                } => {
+                    if let Some(frustum) = &self.frustum {
+                        let (center, extent) = unit_cube_bounds(&world_model);
+                        if !frustum.intersects(center, extent) {
+                            self.num_culled += 1;
+                            continue;
+                        }
+                    }
+                    return Some((world_model, texture_handle));
                 }
-                self.model_stack
-                    .push(if let Some(prev) = self.model_stack.last() {
-                        *prev * model
-                    } else {
-                        model
-                    });
-                self.next()
             }
-            SceneGraph::Child {
-                model,
-                texture_handle,
-            } => Some((
-                if let Some(prev) = self.model_stack.last() {
-                    *prev * model
-                } else {
-                    model
-                },
-                texture_handle,
-            )),
         }
     }
 }
+
+// Parent index of groups that hang directly off of the scene root.
+pub const SCENE_ROOT: u32 = u32::MAX;
+
+// Flat, structure-of-arrays alternative to SceneGraph. Groups only carry a
+// transform and are stored in topological order (a group's parent always has a
+// smaller index), so world transforms are computed in a single linear pass.
+// Removed group slots are reused by later groups whose parent comes before
+// them.
+// Instances are leaves that reference a group. Instances live in persistent
+// slots, so an instance's ID is stable for as long as it's in the scene, and
+// removed slots are reused by later additions. Every modification marks the
+// touched slots dirty, so the renderer only has to upload what changed. World
+// transforms and bounds of instances are cached, and only recomputed for
+// dirty slots. Each group also caches the world space bounds of its whole
+// subtree, so culling can reject a group without testing its instances.
+pub struct FlatScene {
+    group_models: Vec<SimdMat4>,
+    group_parents: Vec<u32>,
+    group_world_models: Vec<SimdMat4>,
+    group_dirty: Vec<bool>,
+    group_bounds: Vec<([f32; 3], [f32; 3])>,
+    group_bounds_dirty: Vec<bool>,
+    group_instances: Vec<Vec<u32>>,
+    group_live: Vec<bool>,
+    free_groups: Vec<u32>,
+    instance_group_positions: Vec<u32>,
+    instance_models: Vec<SimdMat4>,
+    instance_groups: Vec<u32>,
+    instance_texture_handles: Vec<TextureHandle>,
+    instance_world_models: Vec<SimdMat4>,
+    instance_bounds: BoundsArrays,
+    instance_live: Vec<bool>,
+    instance_dirty: Vec<bool>,
+    dirty_instances: Vec<u32>,
+    free_instances: Vec<u32>,
+    batch_instances: Vec<u32>,
+    batch_models: Vec<SimdMat4>,
+    batch_world_models: Vec<SimdMat4>,
+}
+
+impl FlatScene {
+    pub fn new() -> Self {
+        FlatScene {
+            group_models: vec![],
+            group_parents: vec![],
+            group_world_models: vec![],
+            group_dirty: vec![],
+            group_bounds: vec![],
+            group_bounds_dirty: vec![],
+            group_instances: vec![],
+            group_live: vec![],
+            free_groups: vec![],
+            instance_group_positions: vec![],
+            instance_models: vec![],
+            instance_groups: vec![],
+            instance_texture_handles: vec![],
+            instance_world_models: vec![],
+            instance_bounds: BoundsArrays::new(),
+            instance_live: vec![],
+            instance_dirty: vec![],
+            dirty_instances: vec![],
+            free_instances: vec![],
+            batch_instances: vec![],
+            batch_models: vec![],
+            batch_world_models: vec![],
+        }
+    }
+
+    pub fn clear(&mut self) {
+        self.group_models.clear();
+        self.group_parents.clear();
+        self.group_world_models.clear();
+        self.group_dirty.clear();
+        self.group_bounds.clear();
+        self.group_bounds_dirty.clear();
+        self.group_instances.clear();
+        self.group_live.clear();
+        self.free_groups.clear();
+        self.instance_group_positions.clear();
+        self.instance_models.clear();
+        self.instance_groups.clear();
+        self.instance_texture_handles.clear();
+        self.instance_world_models.clear();
+        self.instance_bounds.clear();
+        self.instance_live.clear();
+        self.instance_dirty.clear();
+        self.dirty_instances.clear();
+        self.free_instances.clear();
+    }
+
+    pub fn add_group(&mut self, parent: u32, model: SimdMat4) -> u32 {
+        assert!(parent == SCENE_ROOT || self.group_live[parent as usize]);
+        let free = self
+            .free_groups
+            .iter()
+            .position(|group| parent == SCENE_ROOT || *group > parent);
+        if let Some(position) = free {
+            let group = self.free_groups.swap_remove(position);
+            self.group_models[group as usize] = model;
+            self.group_parents[group as usize] = parent;
+            self.group_dirty[group as usize] = true;
+            self.group_bounds_dirty[group as usize] = true;
+            self.group_live[group as usize] = true;
+            return group;
+        }
+
+        let group = self.group_models.len() as u32;
+        self.group_models.push(model);
+        self.group_parents.push(parent);
+        self.group_dirty.push(true);
+        self.group_bounds.push(empty_bounds());
+        self.group_bounds_dirty.push(true);
+        self.group_instances.push(vec![]);
+        self.group_live.push(true);
+        group
+    }
+
+    // Only groups with no instances or child groups can be removed. The slot
+    // is left with no parent and empty bounds, so passes over every group
+    // skip it until it's reused.
+    pub fn remove_group(&mut self, group: u32) {
+        assert!(self.group_live[group as usize]);
+        assert!(self.group_instances[group as usize].is_empty());
+        assert!(!self
+            .group_parents
+            .iter()
+            .zip(self.group_live.iter())
+            .any(|(parent, live)| *live && *parent == group));
+        let parent = self.group_parents[group as usize];
+        if parent != SCENE_ROOT {
+            self.group_bounds_dirty[parent as usize] = true;
+        }
+        self.group_parents[group as usize] = SCENE_ROOT;
+        self.group_dirty[group as usize] = false;
+        self.group_bounds[group as usize] = empty_bounds();
+        self.group_bounds_dirty[group as usize] = false;
+        self.group_live[group as usize] = false;
+        self.free_groups.push(group);
+    }
+
+    pub fn set_group_model(&mut self, group: u32, model: SimdMat4) {
+        self.group_models[group as usize] = model;
+        self.group_dirty[group as usize] = true;
+    }
+
+    // Instances are swap removed from their group's list, so each instance's
+    // position in the list is kept to find it.
+    fn add_to_group(&mut self, group: u32, instance: u32) {
+        let instances = &mut self.group_instances[group as usize];
+        self.instance_group_positions[instance as usize] = instances.len() as u32;
+        instances.push(instance);
+        self.group_bounds_dirty[group as usize] = true;
+    }
+
+    fn remove_from_group(&mut self, group: u32, instance: u32) {
+        let position = self.instance_group_positions[instance as usize] as usize;
+        let instances = &mut self.group_instances[group as usize];
+        instances.swap_remove(position);
+        if let Some(moved) = instances.get(position) {
+            self.instance_group_positions[*moved as usize] = position as u32;
+        }
+        self.group_bounds_dirty[group as usize] = true;
+    }
+
+    fn mark_instance_dirty(&mut self, instance: u32) {
+        if !self.instance_dirty[instance as usize] {
+            self.instance_dirty[instance as usize] = true;
+            self.dirty_instances.push(instance);
+        }
+    }
+
+    pub fn add_instance(
+        &mut self,
+        group: u32,
+        model: SimdMat4,
+        texture_handle: TextureHandle,
+    ) -> u32 {
+        assert!(self.group_live[group as usize]);
+        let instance = if let Some(instance) = self.free_instances.pop() {
+            self.instance_models[instance as usize] = model;
+            self.instance_groups[instance as usize] = group;
+            self.instance_texture_handles[instance as usize] = texture_handle;
+            self.instance_live[instance as usize] = true;
+            instance
+        } else {
+            self.instance_models.push(model);
+            self.instance_groups.push(group);
+            self.instance_texture_handles.push(texture_handle);
+            self.instance_world_models.push(model);
+            self.instance_bounds.resize(self.instance_models.len());
+            self.instance_live.push(true);
+            self.instance_dirty.push(false);
+            self.instance_group_positions.push(0);
+            self.instance_models.len() as u32 - 1
+        };
+        self.add_to_group(group, instance);
+        self.mark_instance_dirty(instance);
+        instance
+    }
+
+    pub fn remove_instance(&mut self, instance: u32) {
+        assert!(self.instance_live[instance as usize]);
+        self.remove_from_group(self.instance_groups[instance as usize], instance);
+        self.instance_live[instance as usize] = false;
+        self.instance_bounds.set_empty(instance as usize);
+        self.free_instances.push(instance);
+        self.mark_instance_dirty(instance);
+    }
+
+    pub fn set_instance_model(&mut self, instance: u32, model: SimdMat4) {
+        assert!(self.instance_live[instance as usize]);
+        self.instance_models[instance as usize] = model;
+        self.group_bounds_dirty[self.instance_groups[instance as usize] as usize] = true;
+        self.mark_instance_dirty(instance);
+    }
+
+    pub fn num_groups(&self) -> u32 {
+        (self.group_models.len() - self.free_groups.len()) as u32
+    }
+
+    pub fn num_group_instances(&self, group: u32) -> u32 {
+        self.group_instances[group as usize].len() as u32
+    }
+
+    // Number of instance slots, including free ones. Instance IDs are always
+    // less than this.
+    pub fn num_instance_slots(&self) -> u32 {
+        self.instance_models.len() as u32
+    }
+
+    pub fn num_instances(&self) -> u32 {
+        (self.instance_models.len() - self.free_instances.len()) as u32
+    }
+
+    pub fn is_instance_live(&self, instance: u32) -> bool {
+        self.instance_live[instance as usize]
+    }
+
+    pub fn is_instance_dirty(&self, instance: u32) -> bool {
+        self.instance_dirty[instance as usize]
+    }
+
+    // Slots modified since the last call to clear_dirty, in modification order.
+    pub fn dirty_instances(&self) -> &[u32] {
+        &self.dirty_instances
+    }
+
+    pub fn clear_dirty(&mut self) {
+        for instance in self.dirty_instances.iter() {
+            self.instance_dirty[*instance as usize] = false;
+        }
+        self.dirty_instances.clear();
+    }
+
+    // Computes the world transform of every modified group, marks the
+    // instances under them dirty, and then updates the world transforms and
+    // bounds of dirty instances, and the bounds of the groups above them.
+    // Must be called after the scene is modified and before instance world
+    // transforms or bounds are queried, or the scene is culled.
+    pub fn propagate(&mut self) {
+        let mut any_group_dirty = false;
+        for group in 0..self.group_models.len() {
+            let parent = self.group_parents[group];
+            if parent != SCENE_ROOT && self.group_dirty[parent as usize] {
+                self.group_dirty[group] = true;
+            }
+            if !self.group_dirty[group] {
+                continue;
+            }
+            any_group_dirty = true;
+            self.group_bounds_dirty[group] = true;
+
+            let world = if parent == SCENE_ROOT {
+                self.group_models[group]
+            } else {
+                self.group_world_models[parent as usize].mul(&self.group_models[group])
+            };
+            if group < self.group_world_models.len() {
+                self.group_world_models[group] = world;
+            } else {
+                self.group_world_models.push(world);
+            }
+        }
+
+        if any_group_dirty {
+            for instance in 0..self.instance_models.len() {
+                let group = self.instance_groups[instance] as usize;
+                if self.instance_live[instance] && self.group_dirty[group] {
+                    self.mark_instance_dirty(instance as u32);
+                }
+            }
+            self.group_dirty.iter_mut().for_each(|dirty| *dirty = false);
+        }
+
+        // Live dirty instances are sorted by group, so each group's instances
+        // are composed with its world transform in one batch.
+        self.batch_instances.clear();
+        for instance in self.dirty_instances.iter() {
+            if self.instance_live[*instance as usize] {
+                self.batch_instances.push(*instance);
+            } else {
+                self.instance_bounds.set_empty(*instance as usize);
+            }
+        }
+        let groups = &self.instance_groups;
+        self.batch_instances
+            .sort_unstable_by_key(|instance| groups[*instance as usize]);
+        for run in self
+            .batch_instances
+            .chunk_by(|a, b| groups[*a as usize] == groups[*b as usize])
+        {
+            let group = groups[run[0] as usize] as usize;
+            self.batch_models.clear();
+            self.batch_models.extend(
+                run.iter()
+                    .map(|instance| self.instance_models[*instance as usize]),
+            );
+            self.batch_world_models.resize(run.len(), SimdMat4::ZERO);
+            mul_batch(
+                &self.group_world_models[group],
+                &self.batch_models,
+                &mut self.batch_world_models,
+            );
+            for (instance, world) in run.iter().zip(self.batch_world_models.iter()) {
+                let (center, extent) = unit_cube_bounds(world);
+                self.instance_world_models[*instance as usize] = *world;
+                self.instance_bounds.set(*instance as usize, center, extent);
+            }
+        }
+
+        self.update_group_bounds();
+    }
+
+    // Recomputes the subtree bounds of every group whose instances or
+    // transform changed, along with their ancestors. Parents always come
+    // before their children, so walking the groups backwards visits every
+    // child before its parent.
+    fn update_group_bounds(&mut self) {
+        for group in (0..self.group_models.len()).rev() {
+            let parent = self.group_parents[group];
+            if self.group_bounds_dirty[group] && parent != SCENE_ROOT {
+                self.group_bounds_dirty[parent as usize] = true;
+            }
+        }
+
+        for group in 0..self.group_models.len() {
+            if self.group_bounds_dirty[group] {
+                let mut bounds = empty_bounds();
+                for instance in self.group_instances[group].iter() {
+                    bounds = union_bounds(bounds, self.instance_bounds.get(*instance as usize));
+                }
+                self.group_bounds[group] = bounds;
+            }
+        }
+
+        for group in (0..self.group_models.len()).rev() {
+            let parent = self.group_parents[group];
+            if parent != SCENE_ROOT && self.group_bounds_dirty[parent as usize] {
+                self.group_bounds[parent as usize] =
+                    union_bounds(self.group_bounds[parent as usize], self.group_bounds[group]);
+            }
+        }
+        self.group_bounds_dirty
+            .iter_mut()
+            .for_each(|dirty| *dirty = false);
+    }
+
+    pub fn get_instance_world_model(&self, instance: u32) -> &SimdMat4 {
+        &self.instance_world_models[instance as usize]
+    }
+
+    // Appends every live instance whose bounds intersect the frustum to
+    // visible. Groups whose subtree bounds miss the frustum are skipped along
+    // with all of their descendants, without testing their instances.
+    pub fn cull(&self, frustum: &Frustum, visible: &mut Vec<u32>) {
+        let mut group_visible = vec![false; self.group_models.len()];
+        for group in 0..self.group_models.len() {
+            let parent = self.group_parents[group];
+            if parent != SCENE_ROOT && !group_visible[parent as usize] {
+                continue;
+            }
+            let (center, extent) = self.group_bounds[group];
+            if !frustum.intersects(center, extent) {
+                continue;
+            }
+            group_visible[group] = true;
+            self.instance_bounds
+                .cull_indices(frustum, &self.group_instances[group], visible);
+        }
+    }
+
+    // Bounds of every instance slot. Free slots have empty bounds.
+    pub fn get_instance_bounds(&self) -> &BoundsArrays {
+        &self.instance_bounds
+    }
+
+    pub fn get_instance_texture_handle(&self, instance: u32) -> TextureHandle {
+        self.instance_texture_handles[instance as usize]
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    // The identity view projection's frustum is the cube from -1 to 1.
+    fn unit_frustum() -> Frustum {
+        Frustum::from_view_projection(&SimdMat4::IDENTITY.to_glm())
+    }
+
+    fn culled(scene: &FlatScene) -> Vec<u32> {
+        let mut visible = vec![];
+        scene.cull(&unit_frustum(), &mut visible);
+        visible.sort_unstable();
+        visible
+    }
+
+    #[test]
+    fn cull_skips_groups_outside_frustum() {
+        let mut scene = FlatScene::new();
+        let near = scene.add_group(SCENE_ROOT, SimdMat4::IDENTITY);
+        let far = scene.add_group(SCENE_ROOT, SimdMat4::translation([10.0, 0.0, 0.0]));
+        let far_child = scene.add_group(far, SimdMat4::IDENTITY);
+        let texture_handle = TextureHandle::default();
+        let a = scene.add_instance(near, SimdMat4::IDENTITY, texture_handle);
+        let b = scene.add_instance(far, SimdMat4::IDENTITY, texture_handle);
+        let c = scene.add_instance(far_child, SimdMat4::IDENTITY, texture_handle);
+        scene.propagate();
+        assert_eq!(
+            *scene.get_instance_world_model(c),
+            SimdMat4::translation([10.0, 0.0, 0.0])
+        );
+        assert_eq!(culled(&scene), vec![a]);
+
+        scene.set_group_model(far, SimdMat4::IDENTITY);
+        scene.propagate();
+        assert_eq!(culled(&scene), vec![a, b, c]);
+
+        scene.remove_instance(b);
+        scene.set_instance_model(c, SimdMat4::translation([0.0, -10.0, 0.0]));
+        scene.propagate();
+        assert_eq!(culled(&scene), vec![a]);
+    }
+
+    #[test]
+    fn removed_groups_are_reused_after_their_parent() {
+        let mut scene = FlatScene::new();
+        let root = scene.add_group(SCENE_ROOT, SimdMat4::IDENTITY);
+        let first = scene.add_group(root, SimdMat4::translation([10.0, 0.0, 0.0]));
+        let second = scene.add_group(root, SimdMat4::IDENTITY);
+        let texture_handle = TextureHandle::default();
+        let a = scene.add_instance(first, SimdMat4::IDENTITY, texture_handle);
+        scene.propagate();
+
+        scene.remove_instance(a);
+        scene.remove_group(first);
+        scene.propagate();
+        assert_eq!(scene.num_groups(), 2);
+
+        // The freed slot comes before second, so second's child can't take it.
+        let child = scene.add_group(second, SimdMat4::IDENTITY);
+        assert!(child > second);
+        let reused = scene.add_group(root, SimdMat4::IDENTITY);
+        assert_eq!(reused, first);
+
+        // The reused group doesn't keep the removed group's transform.
+        let b = scene.add_instance(reused, SimdMat4::IDENTITY, texture_handle);
+        let c = scene.add_instance(child, SimdMat4::IDENTITY, texture_handle);
+        scene.propagate();
+        assert_eq!(*scene.get_instance_world_model(b), SimdMat4::IDENTITY);
+        assert_eq!(culled(&scene), vec![b, c]);
+    }
+}
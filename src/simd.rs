@@ -0,0 +1,414 @@
+/*
+ * This file is part of vtrace.
+ * vtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ * vtrace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with vtrace. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+use glm::*;
+
+#[cfg(target_arch = "x86_64")]
+use std::arch::x86_64::*;
+
+// Column major 4x4 matrix with the same layout as glm's Matrix4, aligned so
+// that each column can be loaded into a single SSE register. Used on the hot
+// paths of scene composition and instance writing, where glm's generic
+// matrices are scalar.
+#[repr(C, align(16))]
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub struct SimdMat4 {
+    pub cols: [[f32; 4]; 4],
+}
+
+impl SimdMat4 {
+    pub const IDENTITY: SimdMat4 = SimdMat4 {
+        cols: [
+            [1.0, 0.0, 0.0, 0.0],
+            [0.0, 1.0, 0.0, 0.0],
+            [0.0, 0.0, 1.0, 0.0],
+            [0.0, 0.0, 0.0, 1.0],
+        ],
+    };
+
+    pub const ZERO: SimdMat4 = SimdMat4 {
+        cols: [[0.0; 4]; 4],
+    };
+
+    pub fn from_glm(model: &Matrix4<f32>) -> Self {
+        let col = |c: usize| [model[c][0], model[c][1], model[c][2], model[c][3]];
+        SimdMat4 {
+            cols: [col(0), col(1), col(2), col(3)],
+        }
+    }
+
+    pub fn to_glm(&self) -> Matrix4<f32> {
+        let col = |c: usize| {
+            Vec4::new(
+                self.cols[c][0],
+                self.cols[c][1],
+                self.cols[c][2],
+                self.cols[c][3],
+            )
+        };
+        Matrix4::new(col(0), col(1), col(2), col(3))
+    }
+
+    // Same as scaling and then translating the identity with glm::ext, without
+    // the two intermediate matrix multiplies.
+    pub fn translate_scale(translate: [f32; 3], scale: [f32; 3]) -> Self {
+        SimdMat4 {
+            cols: [
+                [scale[0], 0.0, 0.0, 0.0],
+                [0.0, scale[1], 0.0, 0.0],
+                [0.0, 0.0, scale[2], 0.0],
+                [translate[0], translate[1], translate[2], 1.0],
+            ],
+        }
+    }
+
+    pub fn translation(translate: [f32; 3]) -> Self {
+        Self::translate_scale(translate, [1.0, 1.0, 1.0])
+    }
+
+    // Inverse of an affine transform (bottom row 0, 0, 0, 1), from the inverse
+    // of the upper 3x3 and the translation. Singular matrices, such as the
+    // all zero hidden transform, invert to all zeros.
+    pub fn affine_inverse(&self) -> SimdMat4 {
+        let m = &self.cols;
+        let cofactor =
+            |a: usize, b: usize, c: usize, d: usize| m[a][b] * m[c][d] - m[a][d] * m[c][b];
+        // Rows of the inverse 3x3 are the cross products of pairs of columns.
+        let c00 = cofactor(1, 1, 2, 2);
+        let c01 = -cofactor(0, 1, 2, 2);
+        let c02 = cofactor(0, 1, 1, 2);
+        let det = m[0][0] * c00 + m[1][0] * c01 + m[2][0] * c02;
+        if det == 0.0 {
+            return SimdMat4::ZERO;
+        }
+        let inv_det = 1.0 / det;
+        let mut out = SimdMat4::ZERO;
+        out.cols[0][0] = c00 * inv_det;
+        out.cols[1][0] = -cofactor(1, 0, 2, 2) * inv_det;
+        out.cols[2][0] = cofactor(1, 0, 2, 1) * inv_det;
+        out.cols[0][1] = c01 * inv_det;
+        out.cols[1][1] = cofactor(0, 0, 2, 2) * inv_det;
+        out.cols[2][1] = -cofactor(0, 0, 2, 1) * inv_det;
+        out.cols[0][2] = c02 * inv_det;
+        out.cols[1][2] = -cofactor(0, 0, 1, 2) * inv_det;
+        out.cols[2][2] = cofactor(0, 0, 1, 1) * inv_det;
+        for r in 0..3 {
+            out.cols[3][r] =
+                -(out.cols[0][r] * m[3][0] + out.cols[1][r] * m[3][1] + out.cols[2][r] * m[3][2]);
+        }
+        out.cols[3][3] = 1.0;
+        out
+    }
+
+    // General inverse by cofactor expansion. Only used for per-frame matrices
+    // like the projection, so it isn't vectorized. Singular matrices invert to
+    // all zeros.
+    pub fn inverse(&self) -> SimdMat4 {
+        let m = &self.cols;
+        let mut cofactors = SimdMat4::ZERO;
+        for c in 0..4 {
+            for r in 0..4 {
+                // Entries of the 3x3 minor that skips column c and row r.
+                let skip = |i: usize, k: usize| if i < k { i } else { i + 1 };
+                let e = |i: usize, j: usize| m[skip(i, c)][skip(j, r)];
+                let minor = e(0, 0) * (e(1, 1) * e(2, 2) - e(2, 1) * e(1, 2))
+                    - e(1, 0) * (e(0, 1) * e(2, 2) - e(2, 1) * e(0, 2))
+                    + e(2, 0) * (e(0, 1) * e(1, 2) - e(1, 1) * e(0, 2));
+                let sign = if (c + r) % 2 == 0 { 1.0 } else { -1.0 };
+                cofactors.cols[c][r] = sign * minor;
+            }
+        }
+        let det: f32 = (0..4).map(|c| m[c][0] * cofactors.cols[c][0]).sum();
+        if det == 0.0 {
+            return SimdMat4::ZERO;
+        }
+        // The inverse is the transposed cofactor matrix over the determinant.
+        let mut out = SimdMat4::ZERO;
+        for c in 0..4 {
+            for r in 0..4 {
+                out.cols[c][r] = cofactors.cols[r][c] / det;
+            }
+        }
+        out
+    }
+
+    pub fn mul(&self, other: &SimdMat4) -> SimdMat4 {
+        #[cfg(all(target_arch = "x86_64", target_feature = "avx"))]
+        return unsafe { mul_avx(self, other) };
+        #[cfg(all(target_arch = "x86_64", not(target_feature = "avx")))]
+        return unsafe { mul_sse(self, other) };
+        #[cfg(not(target_arch = "x86_64"))]
+        return mul_scalar(self, other);
+    }
+}
+
+impl std::ops::Mul for SimdMat4 {
+    type Output = SimdMat4;
+
+    fn mul(self, other: SimdMat4) -> SimdMat4 {
+        SimdMat4::mul(&self, &other)
+    }
+}
+
+impl std::ops::Index<usize> for SimdMat4 {
+    type Output = [f32; 4];
+
+    fn index(&self, i: usize) -> &[f32; 4] {
+        &self.cols[i]
+    }
+}
+
+impl std::ops::IndexMut<usize> for SimdMat4 {
+    fn index_mut(&mut self, i: usize) -> &mut [f32; 4] {
+        &mut self.cols[i]
+    }
+}
+
+// Computes out[i] = parent * models[i]. AVX is detected at runtime, since the
+// batch amortizes the check.
+pub fn mul_batch(parent: &SimdMat4, models: &[SimdMat4], out: &mut [SimdMat4]) {
+    assert!(models.len() == out.len());
+    #[cfg(target_arch = "x86_64")]
+    if is_x86_feature_detected!("avx") {
+        for (model, out) in models.iter().zip(out.iter_mut()) {
+            *out = unsafe { mul_avx(parent, model) };
+        }
+        return;
+    }
+    for (model, out) in models.iter().zip(out.iter_mut()) {
+        *out = parent.mul(model);
+    }
+}
+
+fn mul_scalar(a: &SimdMat4, b: &SimdMat4) -> SimdMat4 {
+    let mut out = SimdMat4::ZERO;
+    for c in 0..4 {
+        for r in 0..4 {
+            out.cols[c][r] = a.cols[0][r] * b.cols[c][0]
+                + a.cols[1][r] * b.cols[c][1]
+                + a.cols[2][r] * b.cols[c][2]
+                + a.cols[3][r] * b.cols[c][3];
+        }
+    }
+    out
+}
+
+// Each output column is a linear combination of the columns of a, weighted by
+// the entries of the matching column of b.
+#[cfg(target_arch = "x86_64")]
+#[target_feature(enable = "sse")]
+unsafe fn mul_sse(a: &SimdMat4, b: &SimdMat4) -> SimdMat4 {
+    let a0 = _mm_load_ps(a.cols[0].as_ptr());
+    let a1 = _mm_load_ps(a.cols[1].as_ptr());
+    let a2 = _mm_load_ps(a.cols[2].as_ptr());
+    let a3 = _mm_load_ps(a.cols[3].as_ptr());
+    let mut out = SimdMat4::ZERO;
+    for c in 0..4 {
+        let col = &b.cols[c];
+        let lo = _mm_add_ps(
+            _mm_mul_ps(a0, _mm_set1_ps(col[0])),
+            _mm_mul_ps(a1, _mm_set1_ps(col[1])),
+        );
+        let hi = _mm_add_ps(
+            _mm_mul_ps(a2, _mm_set1_ps(col[2])),
+            _mm_mul_ps(a3, _mm_set1_ps(col[3])),
+        );
+        _mm_store_ps(out.cols[c].as_mut_ptr(), _mm_add_ps(lo, hi));
+    }
+    out
+}
+
+// Same as mul_sse, but computes two output columns per instruction, with the
+// columns of a duplicated into both halves of each register. Pairs of columns
+// are only 16 byte aligned, so the stores are unaligned. A store covers two
+// columns, so its pointer is derived from the whole matrix rather than from a
+// single column.
+#[cfg(target_arch = "x86_64")]
+#[target_feature(enable = "avx")]
+unsafe fn mul_avx(a: &SimdMat4, b: &SimdMat4) -> SimdMat4 {
+    let a0 = _mm256_broadcast_ps(&*(a.cols[0].as_ptr() as *const __m128));
+    let a1 = _mm256_broadcast_ps(&*(a.cols[1].as_ptr() as *const __m128));
+    let a2 = _mm256_broadcast_ps(&*(a.cols[2].as_ptr() as *const __m128));
+    let a3 = _mm256_broadcast_ps(&*(a.cols[3].as_ptr() as *const __m128));
+    let mut out = SimdMat4::ZERO;
+    let out_ptr = out.cols.as_mut_ptr() as *mut f32;
+    for c in (0..4).step_by(2) {
+        let (x, y) = (&b.cols[c], &b.cols[c + 1]);
+        let weight = |r: usize| _mm256_setr_ps(x[r], x[r], x[r], x[r], y[r], y[r], y[r], y[r]);
+        let lo = _mm256_add_ps(_mm256_mul_ps(a0, weight(0)), _mm256_mul_ps(a1, weight(1)));
+        let hi = _mm256_add_ps(_mm256_mul_ps(a2, weight(2)), _mm256_mul_ps(a3, weight(3)));
+        _mm256_storeu_ps(out_ptr.add(c * 4), _mm256_add_ps(lo, hi));
+    }
+    out
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::hint::black_box;
+    use std::time::Instant;
+
+    const BENCH_ITERATIONS: usize = 1 << 20;
+
+    fn test_matrix(seed: f32) -> SimdMat4 {
+        let mut m = SimdMat4::ZERO;
+        for c in 0..4 {
+            for r in 0..4 {
+                m.cols[c][r] = seed + (c * 4 + r) as f32 * 0.25;
+            }
+        }
+        m
+    }
+
+    #[test]
+    fn mul_matches_scalar() {
+        let (a, b) = (test_matrix(1.0), test_matrix(-3.0));
+        let expected = mul_scalar(&a, &b);
+        assert_eq!(a.mul(&b), expected);
+
+        let models = [b, a, SimdMat4::IDENTITY];
+        let mut out = [SimdMat4::ZERO; 3];
+        mul_batch(&a, &models, &mut out);
+        assert_eq!(out[0], expected);
+        assert_eq!(out[1], mul_scalar(&a, &a));
+        assert_eq!(out[2], a);
+    }
+
+    #[test]
+    fn inverses_multiply_to_identity() {
+        let mut model = SimdMat4::translate_scale([3.0, -2.0, 5.0], [2.0, 4.0, 0.5]);
+        model.cols[0][1] = 1.0;
+        let perspective = SimdMat4 {
+            cols: [
+                [1.5, 0.0, 0.0, 0.0],
+                [0.0, 1.5, 0.0, 0.0],
+                [0.0, 0.0, -1.0, -1.0],
+                [0.0, 0.0, -0.02, 0.0],
+            ],
+        };
+        for (m, inverse) in [
+            (model, model.affine_inverse()),
+            (model, model.inverse()),
+            (perspective, perspective.inverse()),
+        ] {
+            let product = m.mul(&inverse);
+            for c in 0..4 {
+                for r in 0..4 {
+                    assert!((product.cols[c][r] - SimdMat4::IDENTITY.cols[c][r]).abs() < 1.0e-5);
+                }
+            }
+        }
+        assert_eq!(SimdMat4::ZERO.affine_inverse(), SimdMat4::ZERO);
+    }
+
+    #[test]
+    fn translate_scale_matches_glm() {
+        let identity = SimdMat4::IDENTITY.to_glm();
+        let translate = ext::translate(&identity, vec3(1.0, 2.0, 3.0));
+        let model = ext::scale(&translate, vec3(4.0, 4.0, 4.0));
+        assert_eq!(
+            SimdMat4::from_glm(&model),
+            SimdMat4::translate_scale([1.0, 2.0, 3.0], [4.0, 4.0, 4.0])
+        );
+    }
+
+    // Micro-benchmarks against glm. Run with:
+    // cargo test --release -- --ignored --nocapture
+    #[test]
+    #[ignore]
+    fn bench_mul() {
+        let (a, b) = (test_matrix(1.0), test_matrix(-3.0));
+        let (glm_a, glm_b) = (a.to_glm(), b.to_glm());
+
+        let start = Instant::now();
+        for _ in 0..BENCH_ITERATIONS {
+            black_box(black_box(glm_a) * black_box(glm_b));
+        }
+        let glm_time = start.elapsed();
+
+        let start = Instant::now();
+        for _ in 0..BENCH_ITERATIONS {
+            black_box(black_box(&a).mul(black_box(&b)));
+        }
+        let simd_time = start.elapsed();
+
+        println!(
+            "mul: glm {:?}/op, simd {:?}/op",
+            glm_time / BENCH_ITERATIONS as u32,
+            simd_time / BENCH_ITERATIONS as u32
+        );
+    }
+
+    #[test]
+    #[ignore]
+    fn bench_mul_batch() {
+        let parent = test_matrix(1.0);
+        let models: Vec<SimdMat4> = (0..4096).map(|i| test_matrix(i as f32)).collect();
+        let glm_parent = parent.to_glm();
+        let glm_models: Vec<Matrix4<f32>> = models.iter().map(|m| m.to_glm()).collect();
+        let mut out = vec![SimdMat4::ZERO; models.len()];
+        let mut glm_out = glm_models.clone();
+        let rounds = BENCH_ITERATIONS / models.len();
+
+        let start = Instant::now();
+        for _ in 0..rounds {
+            for (model, out) in glm_models.iter().zip(glm_out.iter_mut()) {
+                *out = glm_parent * *model;
+            }
+            black_box(&mut glm_out);
+        }
+        let glm_time = start.elapsed();
+
+        let start = Instant::now();
+        for _ in 0..rounds {
+            mul_batch(&parent, &models, &mut out);
+            black_box(&mut out);
+        }
+        let simd_time = start.elapsed();
+
+        println!(
+            "mul_batch: glm {:?}/op, simd {:?}/op",
+            glm_time / (rounds * models.len()) as u32,
+            simd_time / (rounds * models.len()) as u32
+        );
+    }
+
+    #[test]
+    #[ignore]
+    fn bench_translate_scale() {
+        let identity = SimdMat4::IDENTITY.to_glm();
+
+        let start = Instant::now();
+        for i in 0..BENCH_ITERATIONS {
+            let translate = ext::translate(&identity, vec3(i as f32, 0.0, 1.0));
+            black_box(ext::scale(&translate, vec3(16.0, 16.0, 16.0)));
+        }
+        let glm_time = start.elapsed();
+
+        let start = Instant::now();
+        for i in 0..BENCH_ITERATIONS {
+            black_box(SimdMat4::translate_scale(
+                [i as f32, 0.0, 1.0],
+                [16.0, 16.0, 16.0],
+            ));
+        }
+        let simd_time = start.elapsed();
+
+        println!(
+            "translate_scale: glm {:?}/op, simd {:?}/op",
+            glm_time / BENCH_ITERATIONS as u32,
+            simd_time / BENCH_ITERATIONS as u32
+        );
+    }
+}
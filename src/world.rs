@@ -19,14 +19,20 @@ use std::collections::HashMap;
 use std::sync::*;
 
 use crate::gen::*;
+use crate::profile::profile_zone;
 use crate::render::*;
 use crate::scene::*;
+use crate::simd::*;
 use crate::voxel::*;
 
 const MOVE_SPEED: f32 = 5.0;
 const SENSITIVITY: f32 = 0.02;
 const PI: f32 = 3.14159265358979323846;
 
+// Terrain chunks are grouped into cubic regions of this many chunks per side,
+// so culling can reject a whole region at once.
+const TERRAIN_REGION_CHUNKS: i32 = 4;
+
 pub struct WorldState {
     pub camera_position: Vec3,
     pub camera_theta: f32,
@@ -36,10 +42,14 @@ pub struct WorldState {
     pub frame_num: i32,
     entity_texture_registry: HashMap<&'static str, TextureHandle>,
     world_pager: WorldPager,
+    pub scene: FlatScene,
+    scene_terrain: u32,
+    terrain_regions: HashMap<(i32, i32, i32), u32>,
+    terrain_instances: HashMap<(i32, i32, i32), u32>,
 }
 
 impl WorldState {
-    pub fn new(texture_upload_queue: Arc<Mutex<TextureUploadQueue>>) -> WorldState {
+    pub fn new(texture_upload_queue: Arc<Mutex<TextureUploadQueue>>, seed: u32) -> WorldState {
         let mut world = WorldState {
             camera_position: vec3(0.0, 0.0, 0.0),
             camera_theta: 0.0,
@@ -48,12 +58,36 @@ impl WorldState {
             accum_time_whole: 0,
             frame_num: 0,
             entity_texture_registry: HashMap::new(),
-            world_pager: WorldPager::new(),
+            world_pager: WorldPager::new(seed),
+            scene: FlatScene::new(),
+            scene_terrain: 0,
+            terrain_regions: HashMap::new(),
+            terrain_instances: HashMap::new(),
         };
 
         world.load_texture_from_file(texture_upload_queue.clone(), "AncientTemple");
         world.load_texture_from_file(texture_upload_queue.clone(), "Treasure");
 
+        let scene_entities = world.scene.add_group(SCENE_ROOT, SimdMat4::IDENTITY);
+        world.scene_terrain = world.scene.add_group(SCENE_ROOT, SimdMat4::IDENTITY);
+
+        let handle1 = *world.entity_texture_registry.get("Treasure").unwrap();
+        let handle2 = *world.entity_texture_registry.get("AncientTemple").unwrap();
+        for x in -5..=5 {
+            for z in -5..=5 {
+                let model = SimdMat4::translation([x as f32 * 1.5, -5.0, z as f32 * 1.5]);
+                world.scene.add_instance(
+                    scene_entities,
+                    model,
+                    if (x + z + 10) as u32 % 2 == 0 {
+                        handle1
+                    } else {
+                        handle2
+                    },
+                );
+            }
+        }
+
         world
     }
 
@@ -67,11 +101,15 @@ impl WorldState {
         let handle = texture_upload_queue
             .lock()
             .unwrap()
-            .add_texture(Box::new(texture.remove(0)));
+            .add_texture(Arc::new(texture.remove(0)));
 
         self.entity_texture_registry.insert(texture_name, handle);
     }
 
+    pub fn num_chunks_generated(&self) -> usize {
+        self.world_pager.num_chunks_generated()
+    }
+
     pub fn get_camera_direction(&self) -> Vec3 {
         vec3(
             cos(self.camera_theta) * sin(self.camera_phi),
@@ -89,7 +127,8 @@ impl WorldState {
         dt: f32,
         user_input: UserInput,
         texture_upload_queue: Arc<Mutex<TextureUploadQueue>>,
-    ) -> SceneGraph {
+    ) {
+        profile_zone!("WorldState::update");
         self.accum_time_frac += dt;
         if self.accum_time_frac > 1.0 {
             self.accum_time_frac -= 1.0;
@@ -134,74 +173,71 @@ impl WorldState {
             self.camera_phi = PI - 0.1;
         }
 
-        let mut scene = SceneGraph::new();
-        let mut scene_entities = SceneGraph::new();
-        let mut scene_terrain = SceneGraph::new();
-
-        let handle1 = *self.entity_texture_registry.get("Treasure").unwrap();
-        let handle2 = *self.entity_texture_registry.get("AncientTemple").unwrap();
-        for x in -5..=5 {
-            for z in -5..=5 {
-                let identity = Matrix4::new(
-                    Vec4::new(1.0, 0.0, 0.0, 0.0),
-                    Vec4::new(0.0, 1.0, 0.0, 0.0),
-                    Vec4::new(0.0, 0.0, 1.0, 0.0),
-                    Vec4::new(0.0, 0.0, 0.0, 1.0),
-                );
-                let model = ext::translate(&identity, vec3(x as f32 * 1.5, -5.0, z as f32 * 1.5));
-                scene_entities.add_child(SceneGraph::new_child(
-                    model,
-                    if (x + z + 10) as u32 % 2 == 0 {
-                        handle1
-                    } else {
-                        handle2
-                    },
-                ));
+        // Terrain instances stay in the scene while their chunk is in range,
+        // so static terrain doesn't need to be re-uploaded every frame.
+        let chunk_pos = get_chunk_pos(self.camera_position);
+        let scene = &mut self.scene;
+        self.terrain_instances.retain(|pos, instance| {
+            let in_range = (pos.0 - chunk_pos.0).abs() <= CHUNK_LOAD_DIST
+                && (pos.1 - chunk_pos.1).abs() <= CHUNK_LOAD_DIST
+                && (pos.2 - chunk_pos.2).abs() <= CHUNK_LOAD_DIST;
+            if !in_range {
+                scene.remove_instance(*instance);
             }
-        }
+            in_range
+        });
+
+        // Regions are only created for chunks in range, so a region left with
+        // no chunks has moved out of range.
+        self.terrain_regions.retain(|_, group| {
+            let occupied = scene.num_group_instances(*group) > 0;
+            if !occupied {
+                scene.remove_group(*group);
+            }
+            occupied
+        });
 
-        let chunk_pos = get_chunk_pos(self.camera_position);
         for x in -CHUNK_LOAD_DIST..=CHUNK_LOAD_DIST {
             for y in -CHUNK_LOAD_DIST..=CHUNK_LOAD_DIST {
                 for z in -CHUNK_LOAD_DIST..=CHUNK_LOAD_DIST {
-                    let chunk_handle = self.world_pager.page(
-                        chunk_pos.0 + x,
-                        chunk_pos.1 + y,
-                        chunk_pos.2 + z,
-                        texture_upload_queue.clone(),
-                    );
+                    let pos = (chunk_pos.0 + x, chunk_pos.1 + y, chunk_pos.2 + z);
+                    if self.terrain_instances.contains_key(&pos) {
+                        continue;
+                    }
+
+                    let chunk_handle =
+                        self.world_pager
+                            .page(pos.0, pos.1, pos.2, texture_upload_queue.clone());
 
                     if let Some(concrete_chunk_handle) = chunk_handle {
-                        let identity = Matrix4::new(
-                            Vec4::new(1.0, 0.0, 0.0, 0.0),
-                            Vec4::new(0.0, 1.0, 0.0, 0.0),
-                            Vec4::new(0.0, 0.0, 1.0, 0.0),
-                            Vec4::new(0.0, 0.0, 0.0, 1.0),
+                        let model = SimdMat4::translate_scale(
+                            [
+                                pos.0 as f32 * CHUNK_WORLD_SIZE,
+                                pos.1 as f32 * CHUNK_WORLD_SIZE,
+                                pos.2 as f32 * CHUNK_WORLD_SIZE,
+                            ],
+                            [CHUNK_WORLD_SIZE, CHUNK_WORLD_SIZE, CHUNK_WORLD_SIZE],
                         );
-                        let translate = ext::translate(
-                            &identity,
-                            vec3(
-                                (chunk_pos.0 + x) as f32 * CHUNK_WORLD_SIZE,
-                                (chunk_pos.1 + y) as f32 * CHUNK_WORLD_SIZE,
-                                (chunk_pos.2 + z) as f32 * CHUNK_WORLD_SIZE,
-                            ),
+                        let region = (
+                            pos.0.div_euclid(TERRAIN_REGION_CHUNKS),
+                            pos.1.div_euclid(TERRAIN_REGION_CHUNKS),
+                            pos.2.div_euclid(TERRAIN_REGION_CHUNKS),
                         );
-                        let model = ext::scale(
-                            &translate,
-                            vec3(CHUNK_WORLD_SIZE, CHUNK_WORLD_SIZE, CHUNK_WORLD_SIZE),
-                        );
-                        scene_terrain
-                            .add_child(SceneGraph::new_child(model, concrete_chunk_handle));
+                        let scene_terrain = self.scene_terrain;
+                        let scene = &mut self.scene;
+                        let group = *self
+                            .terrain_regions
+                            .entry(region)
+                            .or_insert_with(|| scene.add_group(scene_terrain, SimdMat4::IDENTITY));
+                        let instance = self.scene.add_instance(group, model, concrete_chunk_handle);
+                        self.terrain_instances.insert(pos, instance);
                     }
                 }
             }
         }
 
-        scene.add_child(scene_entities);
-        scene.add_child(scene_terrain);
+        self.scene.propagate();
 
         self.frame_num += 1;
-
-        scene
     }
 }